@@ -1,8 +1,14 @@
 
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "KeyVal.h"
 
@@ -16,28 +22,184 @@ static const int KEYVAL_MAX_INTERP_DEPTH = 25;
 // setting 'errno' is usually automatic on malloc fails, but I do it explicitly
 
 static const char *ERRSTR = "%s: '%s' argument null\n";
+static const char *FROZENSTR = "%s: KeyVal is frozen\n";
 
 // this is an internal hack from which you should immediately avert
-// your tender eyes:
-static char *lsijr = 0;
-static char **laijr = 0;
+// your tender eyes.  (Per-thread, so that threads working on different
+// KeyVals don't free each other's results.)
+static __thread char *lsijr = 0;
+static __thread char **laijr = 0;
+
+
+//////////////////////////////////////// KeyValArena
+
+static const int KEYVAL_ARENA_NUM_CLASSES = 8;  // 16 .. 2048 bytes
+static const unsigned long KEYVAL_ARENA_MIN_CHUNK = 4096;
+static const unsigned long KEYVAL_ARENA_MAX_CHUNK = 1 << 20;
+static const unsigned long KEYVAL_ARENA_CHUNK_HEADER = 16;  // keeps blocks 16-aligned
+
+// Returns the size class for a block of 'size' bytes, or -1 if it's too big
+// for the arena.
+static int
+KeyValArena_class(unsigned long size) {
+  int cls = 0;
+  unsigned long cls_size = 16;
+  while (cls_size < size) {
+    cls_size <<= 1;
+    ++cls;
+  }
+  return (cls < KEYVAL_ARENA_NUM_CLASSES) ? cls : -1;
+}
+
+// Returns a block of at least 'size' bytes, or 0 if out of memory.
+static void *
+KeyValArena_alloc(struct KeyValArena *arena, unsigned long size) {
+  int cls = KeyValArena_class(size);
+  if (cls < 0) return malloc(size);  // (never happens with legal strings)
+
+  // recycle first:
+  void *res = arena->free_lists[cls];
+  if (res) {
+    arena->free_lists[cls] = *(void**)res;
+    return res;
+  }
+
+  // otherwise, bump.  Whatever's left in a chunk that's too small is wasted:
+  unsigned long cls_size = 16UL << cls;
+  if (arena->bump_left < cls_size) {
+    unsigned long chunk_size = arena->next_chunk_size;
+    char *chunk = malloc(chunk_size);
+    if (!chunk) return 0;
+    *(void**)chunk = arena->chunks;
+    arena->chunks = chunk;
+    arena->bump = chunk + KEYVAL_ARENA_CHUNK_HEADER;
+    arena->bump_left = chunk_size - KEYVAL_ARENA_CHUNK_HEADER;
+    ++arena->num_chunks;
+    if (arena->next_chunk_size < KEYVAL_ARENA_MAX_CHUNK) {
+      arena->next_chunk_size <<= 1;
+    }
+  }
+  res = arena->bump;
+  arena->bump += cls_size;
+  arena->bump_left -= cls_size;
+  return res;
+}
+
+// Gives back a block of 'size' bytes (the same size it was allocated with).
+static void
+KeyValArena_free(struct KeyValArena *arena, void *ptr, unsigned long size) {
+  int cls = KeyValArena_class(size);
+  if (cls < 0) {
+    free(ptr);
+    return;
+  }
+  *(void**)ptr = arena->free_lists[cls];
+  arena->free_lists[cls] = ptr;
+}
+
+// Frees all the chunks, and the arena itself.
+static void
+KeyValArena_delete(struct KeyValArena *arena) {
+  while (arena->chunks) {
+    void *next = *(void**)arena->chunks;
+    free(arena->chunks);
+    arena->chunks = next;
+  }
+  free(arena);
+}
+
+
+// These are strdup/free, except that they go through kv's arena if it has
+// one:
+static char *
+KeyVal_strdup(struct KeyVal *kv, const char *str) {
+  if (!kv->arena) return strdup(str);
+  unsigned long size = strlen(str) + 1;
+  char *res = KeyValArena_alloc(kv->arena, size);
+  if (res) memcpy(res, str, size);
+  return res;
+}
+
+static void
+KeyVal_strfree(struct KeyVal *kv, char *str) {
+  if (kv->arena) {
+    KeyValArena_free(kv->arena, str, strlen(str) + 1);
+  } else {
+    free(str);
+  }
+}
 
 
 //////////////////////////////////////// KeyValElement
 
-// Creates a new KeyValElement, and initializes data to a copy of the given
-// parameters.
+// Returns an abbreviation of 'key' that compares, as a plain number, the same
+// way KeyVal_strcmp compares the whole key, at least when the abbreviations
+// differ.  (When they're equal, the keys still need a real comparison.)  It's
+// the first 8 bytes of the key, re-encoded so that "::" sorts below every
+// other character:
+//   end-of-string => 0x00 (i.e. padding)
+//   "::"          => 0x01 0x01
+//   0x01          => 0x01 0x02
+//   anything else => itself
+//
+// This function is internal, so it is not declared in KeyVal.h.  However,
+// KeyVal_binary.c needs it, so it is not static.
+unsigned long long
+KeyVal_keyPrefix(const char *key) {
+  unsigned long long res = 0;
+  int shift = 56;
+  const unsigned char *ch = (const unsigned char*)key;
+  while (*ch && shift >= 0) {
+    unsigned char first = *ch;
+    unsigned char second = 0;  // (0 means no second byte)
+    if (ch[0] == ':' && ch[1] == ':') {
+      first = 1; second = 1;
+      ++ch;
+    }
+    else if (ch[0] == 1) {
+      second = 2;
+    }
+    ++ch;
+    res |= (unsigned long long)first << shift;
+    shift -= 8;
+    if (second && shift >= 0) {
+      res |= (unsigned long long)second << shift;
+      shift -= 8;
+    }
+  }
+  return res;
+}
+
+
+// 32-bit FNV-1a.  Also sets '*len' to strlen(str).
+static unsigned int
+KeyVal_hash(const char *str, unsigned int *len) {
+  unsigned int res = 2166136261u;
+  const unsigned char *ch = (const unsigned char*)str;
+  while (*ch) {
+    res ^= *ch++;
+    res *= 16777619u;
+  }
+  *len = ch - (const unsigned char*)str;
+  return res;
+}
+
+
+// Initializes the KeyValElement at 'res' to a copy of the given parameters.
+// A borrowed key or val is not copied; the element just points at it (it
+// lives in one of KeyVal's mappings).
 // Returns:
-//   0: everything okay.  '*res' now points to a valid KeyValElement object
+//   0: everything okay.  '*res' is now a valid KeyValElement.
 //   1: encountered errors. stderr spewed, errno is set.
 static unsigned char
-KeyValElement_new(struct KeyValElement **res, const char *key, const char *val) {
+KeyValElement_init(struct KeyVal *kv, struct KeyValElement *res,
+    const char *key, const char *val,
+    unsigned char key_borrowed, unsigned char val_borrowed) {
   if (!res) {
     fprintf(stderr, ERRSTR, __func__, "res");
     errno = EINVAL;
     return 1;
   }
-  *res = 0;  // just for safety
   if (!key) {
     fprintf(stderr, ERRSTR, __func__, "key");
     errno = EINVAL;
@@ -49,690 +211,2117 @@ KeyValElement_new(struct KeyValElement **res, const char *key, const char *val)
     return 1;
   }
 
-  struct KeyValElement *tmp = malloc(sizeof(struct KeyValElement));
-  if (!tmp) {
-    fprintf(stderr, "KeyValElement_new: out of memory\n");
-    errno = ENOMEM;
-    return 1;
-  }
-
-  tmp->key = strdup(key);
-  if (!tmp->key) {
-    fprintf(stderr, "KeyValElement_new: out of memory\n");
-    free(tmp);
+  res->key_borrowed = key_borrowed;
+  res->val_borrowed = val_borrowed;
+  res->key = key_borrowed ? (char*)key : KeyVal_strdup(kv, key);
+  if (!res->key) {
+    fprintf(stderr, "KeyValElement_init: out of memory\n");
     errno = ENOMEM;
     return 1;
   }
-  tmp->val = strdup(val);
-  if (!tmp->val) {
-    fprintf(stderr, "KeyValElement_new: out of memory\n");
-    free(tmp->key);
-    free(tmp);
+  res->val = val_borrowed ? (char*)val : KeyVal_strdup(kv, val);
+  if (!res->val) {
+    fprintf(stderr, "KeyValElement_init: out of memory\n");
+    if (!key_borrowed) KeyVal_strfree(kv, res->key);
+    res->key = 0;
     errno = ENOMEM;
     return 1;
   }
-  *res = tmp;
+  res->key_hash = KeyVal_hash(key, &res->key_len);
+  res->key_prefix = KeyVal_keyPrefix(key);
   return 0;
 }
 
-// Cleans up the given KeyValElement object by deleting its data and then itself.
+// Cleans up the given KeyValElement by deleting its data.  (The element itself
+// lives in KeyVal's array, so it isn't freed.)
 // Returns:
 //   0: everything okay
 //   1: encountered errors.  stderr spewed, errno is set.
 static unsigned char
-KeyValElement_delete(struct KeyValElement *element) {
+KeyValElement_clear(struct KeyVal *kv, struct KeyValElement *element) {
   if (!element) {
     fprintf(stderr, ERRSTR, __func__, "element");
     errno = EINVAL;
     return 1;
   }
-  free(element->key); element->key = 0;
-  free(element->val); element->val = 0;
-  free(element);
+  if (!element->key_borrowed) KeyVal_strfree(kv, element->key);
+  element->key = 0;
+  if (!element->val_borrowed) KeyVal_strfree(kv, element->val);
+  element->val = 0;
   return 0;
 }
 
+// Returns whether two elements have the same key.  The cached lengths and
+// hashes settle almost every mismatch without touching the strings.
+static int
+KeyValElement_sameKey(const struct KeyValElement *e1, const struct KeyValElement *e2) {
+  return e1->key_hash == e2->key_hash
+      && e1->key_len == e2->key_len
+      && !memcmp(e1->key, e2->key, e1->key_len);
+}
 
-//////////////////////////////////////// KeyVal
+int KeyVal_strcmp(const char *s1, const char *s2);  // (below)
 
-// KeyVal_strcmp
-// We need a custom strcmp because we need "::" to be handled differently.  With
-// regular strcmp on US ASCII strings, a direct sort would result in the following:
-//   key::1
-//   key::10
-//   key::1::bar
-// But we want all the keys at a single level grouped together, like so:
-//   key::1
-//   key::1::bar
-//   key::10
-// To do that, we handle "::" as a special case.
-// The return value is the same for regular strcmp:
-//   0  if s1==s2
-//   >0 if s1>s2
-//   <0 if s1<s2
-// Surprisingly, this custom strcmp is not as slow as you'd expect.
-//
-// This function is internal, so it is not declared in KeyVal.h.  However, it
-// is tested directly in test.c, so it is not static.
-//
+// KeyVal_strcmp(e->key, key), except that most of the time the abbreviated
+// keys settle it without following e->key.  'key_prefix' must be
+// KeyVal_keyPrefix(key).
+static int
+KeyValElement_cmp(const struct KeyValElement *e, const char *key,
+    unsigned long long key_prefix) {
+  if (e->key_prefix != key_prefix) {
+    return (e->key_prefix < key_prefix) ? -1 : 1;
+  }
+  return KeyVal_strcmp(e->key, key);
+}
+
+
+//////////////////////////////////////// hash index
+
+// The optional hash index (see KeyVal_setHashIndex) is an open-addressing
+// table, with linear probing, of positions in the sorted part of the array.
+// Each slot holds a position plus one, so that 0 can mean "empty".  It only
+// ever covers [0, last_sorted): the unsorted tail isn't indexed until
+// KeyVal_ensureSorted merges it in, at which point the whole table is rebuilt
+// (the merge moved everything anyway).
+
+static const unsigned long KEYVAL_MIN_HASH_INDEX_SIZE = 64;
+
+// Puts position 'idx' into the table.  There must be room for it.
+static void
+KeyVal_hashIndexPut(struct KeyVal *kv, unsigned long idx) {
+  unsigned long mask = kv->hash_index_size - 1;
+  unsigned long slot = kv->data[idx].key_hash & mask;
+  while (kv->hash_index[slot]) {
+    slot = (slot + 1) & mask;
+  }
+  kv->hash_index[slot] = idx + 1;
+}
+
+// Throws away the table and indexes the whole sorted part from scratch, at no
+// more than half full.
 // Returns:
-//   0: strings match exactly
-//   <0: s1 < s2
-//   >0: s1 > s2
-// (Note: this function does NOT return an error code, but will spew stderr and
-// set errno.)
-int KeyVal_strcmp(const char *s1, const char *s2) {
-  if (!s1) {
-    fprintf(stderr, ERRSTR, __func__, "s1");
-    errno = EINVAL;
+//   0: everything okay
+//   1: encountered errors.  stderr spewed, errno is set.
+static unsigned char
+KeyVal_hashIndexRebuild(struct KeyVal *kv) {
+  unsigned long new_size = KEYVAL_MIN_HASH_INDEX_SIZE;
+  while (new_size < kv->last_sorted * 2) {
+    new_size <<= 1;
+  }
+  unsigned long *new_index = calloc(new_size, sizeof(unsigned long));
+  if (!new_index) {
+    // the old table is stale by now, so it can't be kept.  Better slow than
+    // wrong:
+    free(kv->hash_index);
+    kv->hash_index = 0;
+    kv->hash_index_size = 0;
+    fprintf(stderr, "KeyVal_hashIndexRebuild: out of memory\n");
+    errno = ENOMEM;
+    return 1;
   }
-  if (!s2) {
-    fprintf(stderr, ERRSTR, __func__, "s2");
-    errno = EINVAL;
+  free(kv->hash_index);
+  kv->hash_index = new_index;
+  kv->hash_index_size = new_size;
+  for (unsigned long i = 0; i < kv->last_sorted; ++i) {
+    KeyVal_hashIndexPut(kv, i);
   }
+  return 0;
+}
 
-  const unsigned char *_s1 = (const unsigned char*)s1;
-  const unsigned char *_s2 = (const unsigned char*)s2;
+// Indexes the element just appended to the sorted part.  'last_sorted' must
+// already count it.  If the table can't grow, it's thrown away (stderr
+// spewed); the index is optional, so that's not an error for the caller.
+static void
+KeyVal_hashIndexAppend(struct KeyVal *kv) {
+  if (kv->last_sorted * 2 > kv->hash_index_size) {
+    KeyVal_hashIndexRebuild(kv);
+    return;
+  }
+  KeyVal_hashIndexPut(kv, kv->last_sorted - 1);
+}
 
-  while (1) {
-    if (!*_s1 && !*_s2) {
-      // s1 and s2 are same length, and all same chars:
+// Looks up 'key' in the table.
+// Returns:
+//   0: found; '*res' is its position in the array.
+//   2: not found.
+static unsigned char
+KeyVal_hashIndexFind(unsigned long *res, struct KeyVal *kv, const char *key) {
+  unsigned int key_len;
+  unsigned int key_hash = KeyVal_hash(key, &key_len);
+  unsigned long mask = kv->hash_index_size - 1;
+  unsigned long slot = key_hash & mask;
+  while (kv->hash_index[slot]) {
+    struct KeyValElement *e = &kv->data[kv->hash_index[slot] - 1];
+    if (e->key_hash == key_hash && e->key_len == key_len
+        && !memcmp(e->key, key, key_len)) {
+      *res = kv->hash_index[slot] - 1;
       return 0;
     }
-    else if (!*_s2) {
-      // s1 is longer than s2:
-      return 1;
+    slot = (slot + 1) & mask;
+  }
+  return 2;
+}
+
+// Unindexes position 'idx', which is about to be removed from the array, and
+// shifts every later position down by one to match.  The element at 'idx'
+// must still have its cached hash.
+static void
+KeyVal_hashIndexRemove(struct KeyVal *kv, unsigned long idx) {
+  unsigned long mask = kv->hash_index_size - 1;
+  unsigned long hole = kv->data[idx].key_hash & mask;
+  while (kv->hash_index[hole] != idx + 1) {
+    hole = (hole + 1) & mask;
+  }
+
+  // Linear probing can't just empty the slot, or it would cut off anything
+  // that probed past it.  Instead, pull later entries of the cluster back
+  // into the hole, as long as that doesn't move them in front of their home
+  // slot:
+  unsigned long next = hole;
+  while (1) {
+    next = (next + 1) & mask;
+    if (!kv->hash_index[next]) break;
+    unsigned long home = kv->data[kv->hash_index[next] - 1].key_hash & mask;
+    // (is 'home' cyclically outside of (hole, next]?)
+    unsigned char movable = (hole <= next)
+        ? (home <= hole || home > next)
+        : (home <= hole && home > next);
+    if (movable) {
+      kv->hash_index[hole] = kv->hash_index[next];
+      hole = next;
     }
-    else if (!*_s1) {
-      // s2 is longer than s1:
-      return -1;
+  }
+  kv->hash_index[hole] = 0;
+
+  for (unsigned long slot = 0; slot < kv->hash_index_size; ++slot) {
+    if (kv->hash_index[slot] > idx + 1) --kv->hash_index[slot];
+  }
+}
+
+
+//////////////////////////////////////// trie index
+
+// The optional trie index (see KeyVal_setTrieIndex) splits every key at its
+// "::"s, and stores the pieces ("segments") as a tree: "a::b::c" is the node
+// "c" under "b" under "a" under the root.  Each node knows how many keys are at
+// or below it, and its children are kept sorted, so KeyVal_getKeys can just
+// list a node's children instead of scanning every key below it.  Unlike the
+// hash index, it doesn't care where keys are in the array; it only needs to
+// hear about keys being added and removed.  KeyVal_ensureSorted adds the new
+// keys from the tail, since that's the first time anybody knows which of
+// them are new.
+//
+// A key is split left to right, the same way KeyVal_extract_subkey does it, so
+// "a:::b" is "a" then ":b", and "a::" is "a" then "".
+
+// Returns the length of the segment at the start of 'seg'.
+static unsigned int
+KeyVal_segmentLen(const char *seg) {
+  const char *ch = seg;
+  while (*ch && !(ch[0] == ':' && ch[1] == ':')) {
+    ++ch;
+  }
+  return ch - seg;
+}
+
+// Finds the child named by the first 'len' bytes of 'name'.  Returns it, or 0
+// if there isn't one; either way, '*pos' is set to where it is or would go.
+static struct KeyValTrieNode *
+KeyValTrieNode_find(struct KeyValTrieNode *node, const char *name,
+    unsigned int len, unsigned int *pos) {
+  unsigned int lo = 0;
+  unsigned int hi = node->num_children;
+  while (lo != hi) {
+    unsigned int mid = (lo + hi) >> 1;
+    struct KeyValTrieNode *child = node->children[mid];
+    unsigned int min_len = (child->name_len < len) ? child->name_len : len;
+    int cmp = memcmp(child->name, name, min_len);
+    if (!cmp) cmp = (child->name_len > len) - (child->name_len < len);
+    if (!cmp) {
+      *pos = mid;
+      return child;
     }
-    else {
-      // need to figure out which, if either, has double-colons:
-      unsigned char s1_dc = (*_s1 == ':' && *(_s1+1) == ':');
-      unsigned char s2_dc = (*_s2 == ':' && *(_s2+1) == ':');
-      if (s1_dc && s2_dc) {
-        // match so far, and we can increment two chars:
-        ++_s1; ++_s1;
-        ++_s2; ++_s2;
-      }
-      else if (s1_dc && !s2_dc) {
-        // artifically make s1 < s2
-        return -2;
-      }
-      else if (s2_dc && !s1_dc) {
-        // artificially make s2 < s1
-        return 2;
-      }
-      // no double-colons, so compare as usual:
-      else if (*_s1 < *_s2) {
-        return -3;
-      }
-      else if (*_s2 < *_s1) {
-        return 3;
+    if (cmp < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  *pos = lo;
+  return 0;
+}
+
+// Frees the given node and everything under it.
+static void
+KeyValTrieNode_delete(struct KeyValTrieNode *node) {
+  for (unsigned int i = 0; i < node->num_children; ++i) {
+    KeyValTrieNode_delete(node->children[i]);
+  }
+  free(node->children);
+  free(node->name);
+  free(node);
+}
+
+// Adds 'key' to the trie.  The key must not already be in it.
+// Returns:
+//   0: everything okay
+//   1: encountered errors.  stderr spewed, errno is set.  The counts may now
+//     be off, so the caller should throw the trie away.
+static unsigned char
+KeyVal_trieInsert(struct KeyVal *kv, const char *key) {
+  struct KeyValTrieNode *node = kv->trie;
+  ++node->count;
+  const char *seg = key;
+  while (1) {
+    unsigned int len = KeyVal_segmentLen(seg);
+    unsigned int pos;
+    struct KeyValTrieNode *child = KeyValTrieNode_find(node, seg, len, &pos);
+    if (!child) {
+      if (node->num_children == node->max_children) {
+        unsigned int new_max = node->max_children ? node->max_children * 2 : 4;
+        struct KeyValTrieNode **new_children = realloc(node->children,
+            new_max * sizeof(struct KeyValTrieNode*));
+        if (!new_children) {
+          fprintf(stderr, "KeyVal_trieInsert: out of memory\n");
+          errno = ENOMEM;
+          return 1;
+        }
+        node->children = new_children;
+        node->max_children = new_max;
       }
-      else {
-        // match so far.  Carry on!
-        ++_s1;
-        ++_s2;
+      child = calloc(1, sizeof(struct KeyValTrieNode));
+      if (child) child->name = malloc(len + 1);
+      if (!child || !child->name) {
+        free(child);
+        fprintf(stderr, "KeyVal_trieInsert: out of memory\n");
+        errno = ENOMEM;
+        return 1;
       }
+      memcpy(child->name, seg, len);
+      child->name[len] = 0;
+      child->name_len = len;
+      memmove(&node->children[pos + 1], &node->children[pos],
+          (node->num_children - pos) * sizeof(struct KeyValTrieNode*));
+      node->children[pos] = child;
+      ++node->num_children;
+    }
+    ++child->count;
+    if (!seg[len]) {
+      child->has_value = 1;
+      return 0;
     }
+    node = child;
+    seg += len + 2;
   }
-  // (will never get here)
-  // (famous last words!!)
 }
 
+// Takes the key starting at 'seg' out of the subtree under 'node', pruning any
+// nodes that end up empty.  The key must be in it.
+static void
+KeyValTrieNode_remove(struct KeyValTrieNode *node, const char *seg) {
+  --node->count;
+  unsigned int len = KeyVal_segmentLen(seg);
+  unsigned int pos;
+  struct KeyValTrieNode *child = KeyValTrieNode_find(node, seg, len, &pos);
+  if (!child) return;  // (can't happen)
+  if (seg[len]) {
+    KeyValTrieNode_remove(child, seg + len + 2);
+  } else {
+    --child->count;
+    child->has_value = 0;
+  }
+  if (!child->count) {
+    KeyValTrieNode_delete(child);
+    memmove(&node->children[pos], &node->children[pos + 1],
+        (node->num_children - pos - 1) * sizeof(struct KeyValTrieNode*));
+    --node->num_children;
+  }
+}
+
+// Returns the node for 'path', or 0 if no key has that path.
+static struct KeyValTrieNode *
+KeyVal_trieFind(struct KeyVal *kv, const char *path) {
+  struct KeyValTrieNode *node = kv->trie;
+  const char *seg = path;
+  while (node) {
+    unsigned int len = KeyVal_segmentLen(seg);
+    unsigned int pos;
+    node = KeyValTrieNode_find(node, seg, len, &pos);
+    if (!seg[len]) break;
+    seg += len + 2;
+  }
+  return node;
+}
+
+// Returns whether there are keys under 'node' that KeyVal_has_subkey would
+// count, i.e. that are longer than the node's path plus "::".  (Only the key
+// itself, and the key with a bare "::" on the end, don't count.)
+static int
+KeyValTrieNode_hasSubkeys(struct KeyValTrieNode *node) {
+  unsigned long below = node->count - node->has_value;
+  if (node->num_children && node->children[0]->name_len == 0) {
+    below -= node->children[0]->has_value;
+  }
+  return below > 0;
+}
+
+// Returns whether the trie can answer questions about 'path'.  A path that
+// ends with a ':' can't be split the same way as the keys under it (the
+// last ':' might pair up with the "::" after it), so it gets the sorted array
+// instead.
+static int
+KeyVal_trieCanAnswer(struct KeyVal *kv, const char *path) {
+  if (!kv->trie) return 0;
+  size_t len = strlen(path);
+  return !len || path[len - 1] != ':';
+}
+
+// Throws away the trie (if any), and builds it again from the sorted array.
 // Returns:
-//   0: everything okay.  '*res' is set to a valid result
-//   1: encountered errors.  stderr spewed, errno is set.
-// The real result is stored wherever 'res' points, so please give it a
-// valid pointer.
-// The real result is the index where the given key should exist in the array:
-//   - if the key exists, this is where it is;
-//   - if the key does not exist, this is where it should be inserted.
-//
-// This function is internal, so it is not declared in KeyVal.h.  However, it
-// is tested directly in test.c, so it is not static.
-unsigned char KeyVal_findIdealIndex(unsigned long *res,
-    struct KeyVal *kv, const char *key) {
-  if (!res) {
-    fprintf(stderr, ERRSTR, __func__, "res");
-    errno = EINVAL;
+//   0: everything okay
+//   1: encountered errors.  stderr spewed, errno is set.  There is no trie.
+static unsigned char
+KeyVal_trieRebuild(struct KeyVal *kv) {
+  if (kv->trie) KeyValTrieNode_delete(kv->trie);
+  kv->trie = calloc(1, sizeof(struct KeyValTrieNode));
+  if (!kv->trie) {
+    fprintf(stderr, "KeyVal_trieRebuild: out of memory\n");
+    errno = ENOMEM;
     return 1;
   }
+  for (unsigned long i = 0; i < kv->last_sorted; ++i) {
+    if (KeyVal_trieInsert(kv, kv->data[i].key)) {
+      KeyValTrieNode_delete(kv->trie);
+      kv->trie = 0;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Adds 'key' to the trie, or throws the trie away if that fails (stderr
+// spewed), so that it can't give wrong answers later.  The trie is optional,
+// so that's not an error for the caller.
+static void
+KeyVal_trieAdd(struct KeyVal *kv, const char *key) {
+  if (KeyVal_trieInsert(kv, key)) {
+    KeyValTrieNode_delete(kv->trie);
+    kv->trie = 0;
+  }
+}
+
+
+//////////////////////////////////////// interpolation cache
+
+// The optional interpolation cache (see KeyVal_setInterpCache) keeps a node
+// per key that has been interpolated or looked up during an interpolation.
+// Each cached value has an edge to every key it was built from, and each key
+// has the other end of those edges, so changing a key can find and throw out
+// exactly the values that used it.  Since a value's edges go to everything it
+// read at any depth (not just the variables that appear in it directly), one
+// step is always enough; nothing needs to be chased recursively.
+
+static const unsigned long KEYVAL_MIN_INTERP_BUCKETS = 64;
+
+// Returns the node for 'key', or 0 if there isn't one.
+static struct KeyValInterpNode *
+KeyValInterpCache_find(struct KeyValInterpCache *cache, const char *key) {
+  unsigned int len;
+  unsigned int hash = KeyVal_hash(key, &len);
+  struct KeyValInterpNode *node = cache->buckets[hash & (cache->num_buckets - 1)];
+  while (node && (node->key_hash != hash || strcmp(node->key, key))) {
+    node = node->next;
+  }
+  return node;
+}
+
+// Returns the node for 'key', making it if need be (or 0, if out of memory).
+static struct KeyValInterpNode *
+KeyValInterpCache_findOrAdd(struct KeyValInterpCache *cache, const char *key) {
+  struct KeyValInterpNode *node = KeyValInterpCache_find(cache, key);
+  if (node) return node;
+
+  // keep the chains short:
+  if (cache->num_nodes >= cache->num_buckets) {
+    unsigned long new_num = cache->num_buckets * 2;
+    struct KeyValInterpNode **new_buckets = calloc(new_num, sizeof(struct KeyValInterpNode*));
+    if (!new_buckets) return 0;
+    for (unsigned long b = 0; b < cache->num_buckets; ++b) {
+      while (cache->buckets[b]) {
+        struct KeyValInterpNode *moving = cache->buckets[b];
+        cache->buckets[b] = moving->next;
+        moving->next = new_buckets[moving->key_hash & (new_num - 1)];
+        new_buckets[moving->key_hash & (new_num - 1)] = moving;
+      }
+    }
+    free(cache->buckets);
+    cache->buckets = new_buckets;
+    cache->num_buckets = new_num;
+  }
+
+  node = calloc(1, sizeof(struct KeyValInterpNode));
+  if (!node) return 0;
+  node->key = strdup(key);
+  if (!node->key) {
+    free(node);
+    return 0;
+  }
+  unsigned int len;
+  node->key_hash = KeyVal_hash(key, &len);
+  unsigned long b = node->key_hash & (cache->num_buckets - 1);
+  node->next = cache->buckets[b];
+  cache->buckets[b] = node;
+  ++cache->num_nodes;
+  return node;
+}
+
+// Throws out 'node's cached value, and unlinks it from everything it was
+// built from.
+static void
+KeyValInterpNode_drop(struct KeyValInterpNode *node) {
+  for (unsigned int i = 0; i < node->num_deps; ++i) {
+    struct KeyValInterpNode *dep = node->deps[i].node;
+    unsigned int slot = node->deps[i].slot;
+    // move the dep's last user into this edge's slot:
+    struct KeyValInterpEdge last = dep->users[--dep->num_users];
+    if (slot != dep->num_users) {
+      dep->users[slot] = last;
+      last.node->deps[last.slot].slot = slot;
+    }
+  }
+  free(node->deps);
+  node->deps = 0;
+  node->num_deps = 0;
+  free(node->val);
+  node->val = 0;
+}
+
+// Throws out the cached value of 'key', and of everything built from it.
+static void
+KeyValInterpCache_invalidate(struct KeyValInterpCache *cache, const char *key) {
+  struct KeyValInterpNode *node = KeyValInterpCache_find(cache, key);
+  if (!node) return;
+  KeyValInterpNode_drop(node);
+  // (each drop takes its edge out of node->users)
+  while (node->num_users) {
+    KeyValInterpNode_drop(node->users[node->num_users - 1].node);
+  }
+}
+
+// Notes that the value being interpolated read 'key'.
+static void
+KeyValInterpCache_record(struct KeyValInterpCache *cache, const char *key) {
+  if (cache->is_recording != 1) return;
+  struct KeyValInterpNode *dep = KeyValInterpCache_findOrAdd(cache, key);
+  if (!dep) {
+    cache->is_recording = 2;
+    return;
+  }
+  if (dep->mark == cache->mark) return;  // (already got it)
+  dep->mark = cache->mark;
+  if (cache->num_recording == cache->max_recording) {
+    unsigned int new_max = cache->max_recording ? cache->max_recording * 2 : 16;
+    struct KeyValInterpNode **new_rec = realloc(cache->recording,
+        new_max * sizeof(struct KeyValInterpNode*));
+    if (!new_rec) {
+      cache->is_recording = 2;
+      return;
+    }
+    cache->recording = new_rec;
+    cache->max_recording = new_max;
+  }
+  cache->recording[cache->num_recording++] = dep;
+}
+
+// Caches 'val' as the interpolated value of 'node', built from everything
+// that was just recorded.
+// Returns:
+//   0: everything okay
+//   1: out of memory.  Nothing was cached, which is fine.
+static unsigned char
+KeyValInterpNode_set(struct KeyValInterpNode *node, const char *val,
+    struct KeyValInterpNode **deps, unsigned int num_deps) {
+  // room for everything first, so that nothing is half-linked:
+  node->deps = malloc((num_deps ? num_deps : 1) * sizeof(struct KeyValInterpEdge));
+  if (!node->deps) return 1;
+  for (unsigned int i = 0; i < num_deps; ++i) {
+    struct KeyValInterpNode *dep = deps[i];
+    if (dep->num_users == dep->max_users) {
+      unsigned int new_max = dep->max_users ? dep->max_users * 2 : 4;
+      struct KeyValInterpEdge *new_users = realloc(dep->users,
+          new_max * sizeof(struct KeyValInterpEdge));
+      if (!new_users) {
+        free(node->deps);
+        node->deps = 0;
+        return 1;
+      }
+      dep->users = new_users;
+      dep->max_users = new_max;
+    }
+  }
+  node->val = strdup(val);
+  if (!node->val) {
+    free(node->deps);
+    node->deps = 0;
+    return 1;
+  }
+  for (unsigned int i = 0; i < num_deps; ++i) {
+    struct KeyValInterpNode *dep = deps[i];
+    dep->users[dep->num_users].node = node;
+    dep->users[dep->num_users].slot = i;
+    node->deps[i].node = dep;
+    node->deps[i].slot = dep->num_users;
+    ++dep->num_users;
+  }
+  node->num_deps = num_deps;
+  return 0;
+}
+
+static void
+KeyValInterpCache_delete(struct KeyValInterpCache *cache) {
+  for (unsigned long b = 0; b < cache->num_buckets; ++b) {
+    while (cache->buckets[b]) {
+      struct KeyValInterpNode *node = cache->buckets[b];
+      cache->buckets[b] = node->next;
+      free(node->key);
+      free(node->val);
+      free(node->deps);
+      free(node->users);
+      free(node);
+    }
+  }
+  free(cache->buckets);
+  free(cache->recording);
+  free(cache);
+}
+
+
+//////////////////////////////////////// KeyValWriter
+
+// KeyVal_save escapes everything straight into one big buffer, which goes out
+// with a plain write() whenever it fills up.  A writer without a file
+// (fd < 0) just keeps growing its buffer instead, so that KeyVal_saveParallel
+// can format ranges of keys in memory, to be written out in order later.
+
+static const unsigned long KEYVAL_WRITER_BUF_SIZE = 1 << 18;
+
+struct KeyValWriter {
+  int fd;  // or -1 to stay in memory
+  char *buf;
+  unsigned long len;
+  unsigned long max;  // size of buf
+  unsigned char failed;  // a write (or, in memory, realloc) failed; errno says why
+};
+
+// write(), until it's all gone.
+// Returns:
+//   0: everything okay
+//   1: the write failed.  errno is set.
+static unsigned char
+KeyVal_writeAll(int fd, const char *buf, unsigned long len) {
+  while (len) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return 1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// Writes out everything in the buffer (or, in memory, makes it bigger).
+// Failures are remembered in w->failed, and everything after that is
+// dropped.
+static void
+KeyValWriter_flush(struct KeyValWriter *w) {
+  if (w->fd < 0 && !w->failed) {
+    char *new_buf = realloc(w->buf, w->max * 2);
+    if (new_buf) {
+      w->buf = new_buf;
+      w->max *= 2;
+      return;
+    }
+    errno = ENOMEM;
+    w->failed = 1;
+  }
+  if (!w->failed && KeyVal_writeAll(w->fd, w->buf, w->len)) w->failed = 1;
+  w->len = 0;
+}
+
+// Makes room for 'need' more bytes.  ('need' must be at most
+// KEYVAL_WRITER_BUF_SIZE.)
+static inline void
+KeyValWriter_room(struct KeyValWriter *w, unsigned long need) {
+  if (w->len + need > w->max) KeyValWriter_flush(w);
+}
+
+static void
+KeyValWriter_put(struct KeyValWriter *w, const char *str, unsigned long len) {
+  while (len) {
+    KeyValWriter_room(w, 1);
+    unsigned long n = w->max - w->len;
+    if (n > len) n = len;
+    memcpy(w->buf + w->len, str, n);
+    w->len += n;
+    str += n;
+    len -= n;
+  }
+}
+
+// Writes 'str' in backquotes, with backslashes in front of any backquotes
+// and backslashes in it, a run of ordinary characters at a time.  Returns how
+// many characters that took.
+static unsigned long
+KeyValWriter_putQuoted(struct KeyValWriter *w, const char *str) {
+  unsigned long res = 2;
+  KeyValWriter_put(w, "`", 1);
+  while (1) {
+    unsigned long n = strcspn(str, "`\\");
+    KeyValWriter_put(w, str, n);
+    res += n;
+    str += n;
+    if (!*str) break;
+    KeyValWriter_room(w, 2);
+    w->buf[w->len++] = '\\';
+    w->buf[w->len++] = *str++;
+    res += 2;
+  }
+  KeyValWriter_put(w, "`", 1);
+  return res;
+}
+
+static void
+KeyValWriter_pad(struct KeyValWriter *w, long num_spaces) {
+  static const char spaces[] = "                                ";
+  while (num_spaces > 0) {
+    long n = num_spaces < (long)sizeof(spaces) - 1 ? num_spaces : (long)sizeof(spaces) - 1;
+    KeyValWriter_put(w, spaces, n);
+    num_spaces -= n;
+  }
+}
+
+
+//////////////////////////////////////// KeyValJournal
+
+// Appends lines for 'num' changes to the journal: 'keys[i]' set to 'vals[i]',
+// or, if 'vals' is 0, removed.  The lines are formatted just like
+// KeyVal_save's, and go out in a single write(), so that the file never has
+// half a change in it unless the disk fills up.
+// Returns:
+//   0: everything okay
+//   1: encountered errors.  stderr spewed, errno is set.
+static unsigned char
+KeyValJournal_write(struct KeyValJournal *j, const char **keys, const char **vals,
+    unsigned long num) {
+  struct KeyValWriter w = {-1, j->buf, 0, j->buf_size, 0};
+  for (unsigned long i = 0;
+      i < num && !w.failed;
+      ++i) {
+    KeyValWriter_putQuoted(&w, keys[i]);
+    if (vals) {
+      KeyValWriter_put(&w, " = ", 3);
+      KeyValWriter_putQuoted(&w, vals[i]);
+      KeyValWriter_put(&w, "\n", 1);
+    } else {
+      KeyValWriter_put(&w, " remove\n", 8);
+    }
+  }
+  // (the buffer may have grown, and stays that way for next time)
+  j->buf = w.buf;
+  j->buf_size = w.max;
+  if (w.failed) {
+    fprintf(stderr, "KeyVal journal: out of memory\n");
+    errno = ENOMEM;
+    return 1;
+  }
+  if (KeyVal_writeAll(j->fd, w.buf, w.len)) {
+    fprintf(stderr, "[ERROR] KeyVal journal: cannot write to this file:\n  %s\n  because of:\n  ", j->filepath);
+    perror(0);
+    return 1;
+  }
+  j->num_lines += num;
+  return 0;
+}
+
+// Closes and frees a journal (but leaves the file alone).
+static void
+KeyValJournal_delete(struct KeyValJournal *j) {
+  if (j->fd >= 0) close(j->fd);
+  free(j->filepath);
+  free(j->buf);
+  free(j);
+}
+
+
+//////////////////////////////////////// KeyVal
+
+// Returns how many bytes s1 and s2 have in common before the first one that
+// differs, or the end of both.  When the two strings are equally aligned, it
+// compares a word at a time, using only aligned loads: an aligned word never
+// crosses into the next page (or past the end of a malloc block's last
+// word), so it never touches memory it shouldn't be able to, but it does look
+// at up to 7 bytes past the terminator (hence the sanitizer exemption).
+// Valgrind accepts such loads with --partial-loads-ok=yes; build with
+// -DKEYVAL_NO_WORD_CMP to compare a byte at a time instead.
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ && !defined(KEYVAL_NO_WORD_CMP)
+#define KEYVAL_WORD_CMP 1
+#endif
+#ifdef KEYVAL_WORD_CMP
+__attribute__((no_sanitize_address))
+#endif
+static inline unsigned long
+KeyVal_commonPrefixLen(const unsigned char *s1, const unsigned char *s2) {
+  unsigned long i = 0;
+#ifdef KEYVAL_WORD_CMP
+  if (((uintptr_t)s1 ^ (uintptr_t)s2) & 7) {
+    // can't both be aligned at once; take one byte at a time:
+    while (s1[i] == s2[i] && s1[i]) ++i;
+    return i;
+  }
+  // a byte at a time up to the first word boundary:
+  while ((uintptr_t)(s1 + i) & 7) {
+    if (s1[i] != s2[i] || !s1[i]) return i;
+    ++i;
+  }
+  while (1) {
+    uint64_t w1;
+    uint64_t w2;
+    memcpy(&w1, s1 + i, 8);  // (both aligned here, so these are plain loads)
+    memcpy(&w2, s2 + i, 8);
+    // bits set at (or, for zeros, after) the first difference or terminator:
+    uint64_t stop = (w1 ^ w2)
+        | ((w1 - 0x0101010101010101ULL) & ~w1 & 0x8080808080808080ULL);
+    if (stop) return i + __builtin_ctzll(stop) / 8;
+    i += 8;
+  }
+#else
+  while (s1[i] == s2[i] && s1[i]) ++i;
+  return i;
+#endif
+}
+
+// KeyVal_strcmp
+// We need a custom strcmp because we need "::" to be handled differently.  With
+// regular strcmp on US ASCII strings, a direct sort would result in the following:
+//   key::1
+//   key::10
+//   key::1::bar
+// But we want all the keys at a single level grouped together, like so:
+//   key::1
+//   key::1::bar
+//   key::10
+// To do that, we handle "::" as a special case.
+// The return value is the same for regular strcmp:
+//   0  if s1==s2
+//   >0 if s1>s2
+//   <0 if s1<s2
+// Surprisingly, this custom strcmp is not as slow as you'd expect.
+//
+// Most of the time, two keys share a long prefix and the "::" rule only
+// matters right where they first differ.  So the common prefix is skipped 8
+// bytes at a time, and the byte-by-byte walk picks up from the start of the
+// run of colons (if any) just before the difference.  (The walk always lands
+// on the first colon of a run, and steps through it two at a time, so it
+// comes out exactly the same as walking from the very beginning.)
+//
+// This function is internal, so it is not declared in KeyVal.h.  However, it
+// is tested directly in test.c, so it is not static.
+//
+// Returns:
+//   0: strings match exactly
+//   <0: s1 < s2
+//   >0: s1 > s2
+// (Note: this function does NOT return an error code, but will spew stderr and
+// set errno.)
+int KeyVal_strcmp(const char *s1, const char *s2) {
+  if (!s1) {
+    fprintf(stderr, ERRSTR, __func__, "s1");
+    errno = EINVAL;
+  }
+  if (!s2) {
+    fprintf(stderr, ERRSTR, __func__, "s2");
+    errno = EINVAL;
+  }
+
+  const unsigned char *_s1 = (const unsigned char*)s1;
+  const unsigned char *_s2 = (const unsigned char*)s2;
+
+  unsigned long same = KeyVal_commonPrefixLen(_s1, _s2);
+  while (same && _s1[same - 1] == ':') --same;
+  _s1 += same;
+  _s2 += same;
+
+  while (1) {
+    if (!*_s1 && !*_s2) {
+      // s1 and s2 are same length, and all same chars:
+      return 0;
+    }
+    else if (!*_s2) {
+      // s1 is longer than s2:
+      return 1;
+    }
+    else if (!*_s1) {
+      // s2 is longer than s1:
+      return -1;
+    }
+    else {
+      // need to figure out which, if either, has double-colons:
+      unsigned char s1_dc = (*_s1 == ':' && *(_s1+1) == ':');
+      unsigned char s2_dc = (*_s2 == ':' && *(_s2+1) == ':');
+      if (s1_dc && s2_dc) {
+        // match so far, and we can increment two chars:
+        ++_s1; ++_s1;
+        ++_s2; ++_s2;
+      }
+      else if (s1_dc && !s2_dc) {
+        // artifically make s1 < s2
+        return -2;
+      }
+      else if (s2_dc && !s1_dc) {
+        // artificially make s2 < s1
+        return 2;
+      }
+      // no double-colons, so compare as usual:
+      else if (*_s1 < *_s2) {
+        return -3;
+      }
+      else if (*_s2 < *_s1) {
+        return 3;
+      }
+      else {
+        // match so far.  Carry on!
+        ++_s1;
+        ++_s2;
+      }
+    }
+  }
+  // (will never get here)
+  // (famous last words!!)
+}
+
+// Returns:
+//   0: everything okay.  '*res' is set to a valid result
+//   1: encountered errors.  stderr spewed, errno is set.
+// The real result is stored wherever 'res' points, so please give it a
+// valid pointer.
+// The real result is the index where the given key should exist in the array:
+//   - if the key exists, this is where it is;
+//   - if the key does not exist, this is where it should be inserted.
+//
+// This function is internal, so it is not declared in KeyVal.h.  However, it
+// is tested directly in test.c, so it is not static.
+unsigned char KeyVal_findIdealIndex(unsigned long *res,
+    struct KeyVal *kv, const char *key) {
+  if (!res) {
+    fprintf(stderr, ERRSTR, __func__, "res");
+    errno = EINVAL;
+    return 1;
+  }
+  if (!kv) {
+    fprintf(stderr, ERRSTR, __func__, "kv");
+    errno = EINVAL;
+    return 1;
+  }
+  if (!key) {
+    fprintf(stderr, ERRSTR, __func__, "key");
+    errno = EINVAL;
+    return 1;
+  }
+
+  // Instead of a typical binary search, we're using something called
+  // "deferred detection", where we don't check for equality inside the loop.
+  // Instead, we check less-than vs greater-than-or-equal-to.  This not only
+  // gives us the 'ideal' location (whether or not it exists), but has
+  // fewer comparisons inside the loop!
+
+  // The general idea is to have curr_low and curr_hi converge on the ideal
+  // location.  At all times:
+  // - the element at curr_hi's spot is either the key or something above it (or off the end)
+  // - the element at curr_lo's spot is either the key or something below it
+
+  // most comparisons are settled by the cached prefixes alone:
+  unsigned long long key_prefix = KeyVal_keyPrefix(key);
+
+  unsigned long curr_low = 0;
+  unsigned long curr_hi = kv->used_size;  // can't be - 1; what if ideal is off the end?
+  unsigned long curr_mid = curr_low;  // in case array is empty
+  while (curr_low != curr_hi) {
+
+    // SHR is both a fast divide and a fast floor:
+    curr_mid = (curr_low + curr_hi) >> 1;
+//printf("lo: %lu, mid: %lu, hi: %lu\n", curr_low, curr_mid, curr_hi);
+//printf("strcmp(%s, %s)=%d\n", kv->data[curr_mid].key, key, KeyVal_strcmp(kv->data[curr_mid].key, key));
+
+    if (KeyValElement_cmp(&kv->data[curr_mid], key, key_prefix) < 0) {
+      curr_low = curr_mid + 1;
+    } else {
+      curr_hi = curr_mid;
+    }
+  }
+
+  *res = curr_low;
+  return 0;
+}
+
+
+// Returns:
+//   0: everything okay.  '*res' is set to where the given key should exist in
+//     the array:
+//     - if the key exists, this is where it is;
+//     - if the key does not exist, this is where it should be inserted.
+//   1: encountered errors.  stderr spewed, errno is set.
+//   2: key was not found.
+//
+// This function is internal, so it is not declared in KeyVal.h.  However, it
+// is tested directly in test.c, so it is not static.
+unsigned char KeyVal_findIndex(unsigned long *res,
+    struct KeyVal *kv, const char *key) {
+  if (!res) {
+    fprintf(stderr, ERRSTR, __func__, "res");
+    errno = EINVAL;
+    return 1;
+  }
+  if (!kv) {
+    fprintf(stderr, ERRSTR, __func__, "kv");
+    errno = EINVAL;
+    return 1;
+  }
+  if (!key) {
+    fprintf(stderr, ERRSTR, __func__, "key");
+    errno = EINVAL;
+    return 1;
+  }
+
+  // the hash index, if there is one, answers this directly.  (It only covers
+  // the sorted part, so it's no help while there's a tail.)
+  if (kv->hash_index && kv->last_sorted == kv->used_size) {
+    return KeyVal_hashIndexFind(res, kv, key);
+  }
+
+  // find where it 'should' be:
+  unsigned long idx;
+  if (KeyVal_findIdealIndex(&idx, kv, key)) return 1;
+
+//printf("** findIndex: used=%lu, idx=%lu\n", kv->used_size, idx);
+  if (kv->used_size == idx) return 2;  // ideal is off the end of the array, so it wasn't found
+  // check if the key at the ideal index happens to be it:
+//printf("** strcmp'ing %s and %s..\n", kv->data[idx].key, key);
+  // (the cached length rejects most near-misses without reading the key)
+  struct KeyValElement *e = &kv->data[idx];
+  if (e->key_len == strlen(key) && memcmp(e->key, key, e->key_len) == 0) {
+    *res = idx;
+    return 0;
+  }
+  // not found:
+  return 2;
+}
+
+
+
+//////////////////////////////////////// KeyVal
+
+unsigned char
+KeyVal_new(struct KeyVal **res) {
+  if (!res) {
+    fprintf(stderr, ERRSTR, __func__, "res");
+    errno = EINVAL;
+    return 1;
+  }
+
+  // alloc:
+  struct KeyVal *tmp_res = malloc(sizeof(struct KeyVal));
+  if (!tmp_res) {
+    fprintf(stderr, "KeyVal_new: out of memory\n");
+    errno = ENOMEM;
+    return 1;
+  }
+
+  // init:
+  tmp_res->max_size = KEYVAL_MIN_ARRAY_SIZE;
+  tmp_res->used_size = 0;
+  tmp_res->last_sorted = 0;
+  tmp_res->mappings = 0;
+  tmp_res->arena = 0;
+  tmp_res->hash_index = 0;
+  tmp_res->hash_index_size = 0;
+  tmp_res->trie = 0;
+  tmp_res->interp_cache = 0;
+  tmp_res->journal = 0;
+  tmp_res->layers = 0;
+  tmp_res->num_layers = 0;
+  tmp_res->frozen = 0;
+  tmp_res->data = calloc(KEYVAL_MIN_ARRAY_SIZE, sizeof(struct KeyValElement));
+  if (!tmp_res->data) {
+    fprintf(stderr, "KeyVal_new: out of memory\n");
+    free(tmp_res);
+    errno = ENOMEM;
+    return 1;
+  }
+
+  *res = tmp_res;
+  return 0;
+}
+
+
+unsigned char
+KeyVal_newWithArena(struct KeyVal **res) {
+  if (!res) {
+    fprintf(stderr, ERRSTR, __func__, "res");
+    errno = EINVAL;
+    return 1;
+  }
+
+  struct KeyValArena *arena = calloc(1, sizeof(struct KeyValArena));
+  if (!arena) {
+    fprintf(stderr, "KeyVal_newWithArena: out of memory\n");
+    errno = ENOMEM;
+    return 1;
+  }
+  arena->next_chunk_size = KEYVAL_ARENA_MIN_CHUNK;
+
+  if (KeyVal_new(res)) {
+    free(arena);
+    return 1;
+  }
+  (*res)->arena = arena;
+  return 0;
+}
+
+
+unsigned char
+KeyVal_delete(struct KeyVal *kv) {
+  if (!kv) {
+    fprintf(stderr, ERRSTR, __func__, "kv");
+    errno = EINVAL;
+    return 1;
+  }
+
+  // I have a habit of zero'ing out things after freeing them, so that if
+  // anything is still pointing to them, they segfault right away instead
+  // picking up essentially random data.  However, there's a good argument
+  // to be made that it's unnecessary computation.
+
+  // destroy components.  With an arena, they all go at once:
+  if (kv->arena) {
+    KeyValArena_delete(kv->arena);
+    kv->arena = 0;
+  }
+  else {
+    for (unsigned long i = 0; i < kv->used_size; ++i) {
+      if (KeyValElement_clear(kv, &kv->data[i])) return 1;
+    }
+  }
+  // destroy array:
+  free(kv->data);
+  kv->data = 0;
+
+  free(kv->hash_index);
+  kv->hash_index = 0;
+  if (kv->trie) KeyValTrieNode_delete(kv->trie);
+  kv->trie = 0;
+  if (kv->interp_cache) KeyValInterpCache_delete(kv->interp_cache);
+  kv->interp_cache = 0;
+  if (kv->journal) KeyValJournal_delete(kv->journal);
+  kv->journal = 0;
+  for (unsigned long l = 0; l < kv->num_layers; ++l) {
+    struct KeyValLayer *layer = &kv->layers[l];
+    free(layer->filepath);
+    if (KeyVal_delete(layer->sets)) return 1;
+    if (KeyVal_delete(layer->removes)) return 1;
+  }
+  free(kv->layers);
+  kv->layers = 0;
+
+  // nothing points into the mappings anymore, so they can go too:
+  while (kv->mappings) {
+    struct KeyValMapping *next = kv->mappings->next;
+    munmap(kv->mappings->addr, kv->mappings->len);
+    free(kv->mappings);
+    kv->mappings = next;
+  }
+
+  // destroy myself:
+  free(kv);
+  return 0;
+}
+
+
+// this is a custom function because we need to account for escapes
+static int
+KeyVal_strlen(const char *keystr) {
+  if (!keystr) {
+    fprintf(stderr, ERRSTR, __func__, "keystr");
+  }
+
+  int res = 0;
+  for (const char *ch = keystr;
+      *ch;
+      ch++) {
+    res += (*ch == '`' || *ch == '\\') ? 2 : 1;
+  }
+  return res;
+}
+
+
+// A string being built up by interpolation.  It starts out in whatever
+// buffer the caller has handy (if any), and moves to the heap if that fills
+// up.  There's always room for a terminator after 'len' bytes.
+struct KeyValStrBuf {
+  char *buf;
+  unsigned long len;
+  unsigned long max;
+  unsigned char on_heap;
+};
+
+// Makes room for 'extra' more bytes (plus the terminator).
+// Returns:
+//   0: everything okay
+//   1: out of memory.  stderr spewed, errno is set.
+static unsigned char
+KeyValStrBuf_reserve(struct KeyValStrBuf *sb, unsigned long extra) {
+  if (sb->len + extra < sb->max) return 0;
+  unsigned long new_max = sb->max ? sb->max * 2 : 64;
+  while (new_max <= sb->len + extra) new_max *= 2;
+  char *new_buf = sb->on_heap ? realloc(sb->buf, new_max) : malloc(new_max);
+  if (!new_buf) {
+    fprintf(stderr, "KeyVal_interp: out of memory\n");
+    errno = ENOMEM;
+    return 1;
+  }
+  if (!sb->on_heap && sb->len) memcpy(new_buf, sb->buf, sb->len);
+  sb->buf = new_buf;
+  sb->max = new_max;
+  sb->on_heap = 1;
+  return 0;
+}
+
+static inline unsigned char
+KeyValStrBuf_append(struct KeyValStrBuf *sb, const char *str, unsigned long len) {
+  if (KeyValStrBuf_reserve(sb, len)) return 1;
+  memcpy(sb->buf + sb->len, str, len);
+  sb->len += len;
+  return 0;
+}
+
+
+static unsigned char KeyVal_ensureSorted(struct KeyVal *kv);  // (below)
+
+// Appends 'str' to 'out', with its variables interpolated, in one pass.
+// Every "${" that goes by is copied out as-is, and its position is pushed on
+// a stack.  A "}" pops the latest one, and everything written out since then
+// is the variable's name (with any variables inside it already interpolated,
+// so "${a::${b}}" works).  If the variable exists, its name is replaced by its
+// own interpolated value; otherwise (and for "${}"), the text just stays.
+// Returns:
+//   0: everything okay
+//   1: encountered errors.  stderr spewed, errno is set.
+//   2: hit KEYVAL_MAX_INTERP_DEPTH levels of variables (probably recursive)
+static unsigned char
+KeyVal_interp_next(struct KeyValStrBuf *out, struct KeyVal *kv, const char *str,
+    unsigned int depth) {
+  // hit KEYVAL_MAX_INTERP_DEPTH number of recursive variables?
+  if (depth == KEYVAL_MAX_INTERP_DEPTH) {
+    return 2;
+  }
+  if (KeyVal_ensureSorted(kv)) return 1;  // propagate error
+
+  // where the open "${"s are in 'out'.  (Almost never more than a couple.)
+  unsigned long local_opens[16];
+  unsigned long *opens = local_opens;
+  unsigned long num_opens = 0;
+  unsigned long max_opens = 16;
+  unsigned char res = 0;
+
+  const char *run = str;  // start of the plain text not yet copied out
+  const char *ch = str;
+  while (1) {
+    // skip to the next interesting character:
+    while (*ch && *ch != '}' && !(*ch == '$' && ch[1] == '{')) ++ch;
+    if (!*ch) break;
+    if (*ch == '$' || !num_opens) {
+      // "${" (or a "}" that doesn't close anything), which just go out as-is:
+      if (*ch == '$') {
+        if (num_opens == max_opens) {
+          unsigned long *new_opens = malloc(2 * max_opens * sizeof(unsigned long));
+          if (!new_opens) {
+            fprintf(stderr, "KeyVal_interp: out of memory\n");
+            errno = ENOMEM;
+            res = 1;
+            break;
+          }
+          memcpy(new_opens, opens, num_opens * sizeof(unsigned long));
+          if (opens != local_opens) free(opens);
+          opens = new_opens;
+          max_opens *= 2;
+        }
+        if (KeyValStrBuf_append(out, run, ch - run)) { res = 1; break; }
+        opens[num_opens++] = out->len;
+        run = ch;
+        ch += 2;
+      } else {
+        ++ch;
+      }
+      if (KeyValStrBuf_append(out, run, ch - run)) { res = 1; break; }
+      run = ch;
+      continue;
+    }
+
+    // a "}" closing the latest "${":
+    if (KeyValStrBuf_append(out, run, ch - run)) { res = 1; break; }
+    run = ++ch;
+    unsigned long open = opens[--num_opens];
+    const char *name = out->buf + open + 2;
+    out->buf[out->len] = 0;
+    unsigned long idx;
+    unsigned char find_res = 2;
+    if (*name) {
+      if (kv->interp_cache) KeyValInterpCache_record(kv->interp_cache, name);
+      find_res = KeyVal_findIndex(&idx, kv, name);
+      if (find_res == 1) { res = 1; break; }  // propagate error
+    }
+    if (find_res == 2) {
+      // no such variable, so leave it be:
+      if (KeyValStrBuf_append(out, "}", 1)) { res = 1; break; }
+      continue;
+    }
+    // replace the name with the value:
+    out->len = open;
+    res = KeyVal_interp_next(out, kv, kv->data[idx].val, depth + 1);
+    if (res) break;  // propagate errors
+  }
+
+  if (!res) res = KeyValStrBuf_append(out, run, ch - run);
+  if (opens != local_opens) free(opens);
+  out->buf[out->len] = 0;
+  return res;
+}
+
+
+// Replaces whatever is in 'out' with 'str', interpolated.
+// Returns:
+//   0: everything okay
+//   1: encountered errors.  stderr spewed, errno is set.
+//   2: hit KEYVAL_MAX_INTERP_DEPTH levels of variables.  stderr spewed.
+static unsigned char
+KeyVal_interpInto(struct KeyValStrBuf *out, struct KeyVal *kv, const char *str) {
+  out->len = 0;
+  if (KeyValStrBuf_reserve(out, 0)) return 1;
+  unsigned char interp_res = KeyVal_interp_next(out, kv, str, 0);
+  if (interp_res == 2 && !KEYVAL_QUIET) {
+    fprintf(stderr,
+        "KeyVal_interp: encountered %d levels of variables; possible recursion\n"
+        "in key `%s`\n",
+        KEYVAL_MAX_INTERP_DEPTH, str);
+  }
+  return interp_res;
+}
+
+
+unsigned char
+KeyVal_interp(char **res, struct KeyVal *kv, const char *str) {
+  if (!res) {
+    fprintf(stderr, ERRSTR, __func__, "res");
+    errno = EINVAL;
+    return 1;
+  }
+  if (!kv) {
+    fprintf(stderr, ERRSTR, __func__, "kv");
+    errno = EINVAL;
+    return 1;
+  }
+  if (!str) {
+    fprintf(stderr, ERRSTR, __func__, "str");
+    errno = EINVAL;
+    return 1;
+  }
+
+  struct KeyValStrBuf out = {0, 0, 0, 0};
+  unsigned char interp_res = KeyValStrBuf_reserve(&out, strlen(str));
+  if (!interp_res) interp_res = KeyVal_interpInto(&out, kv, str);
+  if (interp_res) {
+    free(out.buf);
+    out.buf = 0;
+  }
+  *res = out.buf;
+  return interp_res;
+}
+
+
+// KeyVal_interp of element 'e', out of the interpolation cache if it's there,
+// and into it if it wasn't (unless 'kv' is frozen).
+static unsigned char
+KeyVal_interpCached(char **res, struct KeyVal *kv, const struct KeyValElement *e) {
+  struct KeyValInterpCache *cache = kv->interp_cache;
+  struct KeyValInterpNode *node = KeyValInterpCache_find(cache, e->key);
+  if (node && node->val) {
+    *res = strdup(node->val);
+    if (!*res) {
+      fprintf(stderr, "KeyVal_getValue: out of memory\n");
+      errno = ENOMEM;
+      return 1;
+    }
+    return 0;
+  }
+  if (kv->frozen) return KeyVal_interp(res, kv, e->val);
+
+  // interpolate it, keeping track of every key that gets read:
+  node = KeyValInterpCache_findOrAdd(cache, e->key);
+  cache->is_recording = node ? 1 : 0;
+  cache->num_recording = 0;
+  ++cache->mark;
+  unsigned char interp_res = KeyVal_interp(res, kv, e->val);
+  unsigned char recorded = cache->is_recording == 1;
+  cache->is_recording = 0;
+  if (interp_res == 0 && recorded) {
+    // (if this fails, it just doesn't get cached)
+    KeyValInterpNode_set(node, *res, cache->recording, cache->num_recording);
+  }
+  return interp_res;
+}
+
+
+// Stable merge sort of 'n' elements into KeyVal_strcmp order.  'tmp' is
+// scratch space, and must have room for at least n/2 elements.
+static void
+KeyVal_mergeSort(struct KeyValElement *arr, struct KeyValElement *tmp,
+    unsigned long n) {
+
+  // short runs are faster with a plain insertion sort:
+  if (n <= 16) {
+    for (unsigned long i = 1; i < n; ++i) {
+      struct KeyValElement e = arr[i];
+      unsigned long j = i;
+      // strictly-greater keeps equal keys in their original order:
+      while (j > 0 && KeyValElement_cmp(&arr[j-1], e.key, e.key_prefix) > 0) {
+        arr[j] = arr[j-1];
+        --j;
+      }
+      arr[j] = e;
+    }
+    return;
+  }
+
+  unsigned long half = n >> 1;
+  KeyVal_mergeSort(arr, tmp, half);
+  KeyVal_mergeSort(arr + half, tmp, n - half);
+
+  // if the two halves are already in order (the common case for mostly-sorted
+  // input), there's nothing to merge:
+  if (KeyValElement_cmp(&arr[half-1], arr[half].key, arr[half].key_prefix) <= 0) return;
+
+  // merge the left half (moved out to tmp) with the right half (still in
+  // place).  Ties go to the left so that the sort is stable:
+  memcpy(tmp, arr, half * sizeof(struct KeyValElement));
+  unsigned long l = 0;
+  unsigned long r = half;
+  unsigned long w = 0;
+  while (l < half && r < n) {
+    if (KeyValElement_cmp(&tmp[l], arr[r].key, arr[r].key_prefix) <= 0) {
+      arr[w++] = tmp[l++];
+    } else {
+      arr[w++] = arr[r++];
+    }
+  }
+  // leftovers from the right half are already where they belong:
+  while (l < half) {
+    arr[w++] = tmp[l++];
+  }
+}
+
+
+static unsigned char
+KeyVal_ensureSorted(struct KeyVal *kv) {
+  if (!kv) {
+    fprintf(stderr, ERRSTR, __func__, "kv");
+    errno = EINVAL;
+    return 1;
+  }
+
+  // make sure there's something to sort:
+  if (kv->used_size == 0) return 0;
+
+  // make sure we actually need to sort.  (A frozen KeyVal never does, which
+  // is what makes it safe to read from several threads.)
+  if (kv->last_sorted == kv->used_size) return 0;
+
+  // The elements in [0, last_sorted) are sorted and unique.  The tail in
+  // [last_sorted, used_size) is in insertion order, and may contain duplicates
+  // of itself or of the sorted part.  Sort the tail as one batch, squeeze out
+  // its duplicates, and then merge it into the sorted part in a single pass.
+  // Whenever two keys collide, the newer one (later in the tail, or in the
+  // tail instead of the sorted part) wins.
+  struct KeyValElement *tail = &kv->data[kv->last_sorted];
+  unsigned long tail_size = kv->used_size - kv->last_sorted;
+
+  struct KeyValElement *tmp = malloc(tail_size * sizeof(struct KeyValElement));
+  if (!tmp) {
+    fprintf(stderr, "KeyVal_ensureSorted: out of memory\n");
+    errno = ENOMEM;
+    return 1;
+  }
+
+  // the sort is stable, so within a run of equal keys the last one is the
+  // most recently set:
+  KeyVal_mergeSort(tail, tmp, tail_size);
+  unsigned long uniq_size = 0;
+  for (unsigned long i = 0; i < tail_size; ++i) {
+    if (i + 1 < tail_size && KeyValElement_sameKey(&tail[i], &tail[i+1])) {
+      if (KeyValElement_clear(kv, &tail[i])) { free(tmp); return 1; }
+      continue;
+    }
+    tail[uniq_size++] = tail[i];
+  }
+
+  // merge from the back, so that the sorted part doesn't need to be copied
+  // anywhere.  The tail moves out of the way first:
+  memcpy(tmp, tail, uniq_size * sizeof(struct KeyValElement));
+  long s = (long)kv->last_sorted - 1;  // next sorted element to place
+  long t = (long)uniq_size - 1;  // next tail element to place
+  unsigned long w = kv->last_sorted + uniq_size;  // one past the next write
+  while (t >= 0) {
+    int cmp = (s >= 0) ? KeyValElement_cmp(&kv->data[s], tmp[t].key, tmp[t].key_prefix) : -1;
+    if (cmp > 0) {
+      kv->data[--w] = kv->data[s--];
+    }
+    else {
+      kv->data[--w] = tmp[t];
+      if (cmp == 0) {
+        // overwritten, so the old one goes away:
+        if (KeyValElement_clear(kv, &kv->data[s])) { free(tmp); return 1; }
+        --s;
+        tmp[t].key = 0;  // (not a new key, as far as the trie is concerned)
+      }
+      --t;
+    }
+  }
+
+  // whatever didn't collide is a brand new key.  (Front to back, so that trie
+  // nodes mostly get their children appended.  If the trie runs out of
+  // memory, it's gone, but the merge still has to be finished.)
+  for (unsigned long i = 0; i < uniq_size && kv->trie; ++i) {
+    if (tmp[i].key) KeyVal_trieAdd(kv, tmp[i].key);
+  }
+  free(tmp);
+
+  // every collision with the sorted part leaves a gap at the front, which
+  // needs to be closed up:
+  unsigned long gap = w - (unsigned long)(s + 1);
+  if (gap) {
+    memmove(&kv->data[s + 1], &kv->data[w],
+        (kv->last_sorted + uniq_size - w) * sizeof(struct KeyValElement));
+  }
+  kv->used_size = kv->last_sorted + uniq_size - gap;
+
+  // and now we know it's sorted!
+  kv->last_sorted = kv->used_size;
+
+  // everything moved, so the hash index starts over.  (If that fails, the
+  // index is thrown away, which only makes lookups slower.)
+  if (kv->hash_index) KeyVal_hashIndexRebuild(kv);
+
+  return 0;
+}
+
+
+static unsigned char
+KeyVal_resize(struct KeyVal *kv, unsigned long new_size) {
+  if (!kv) {
+    fprintf(stderr, ERRSTR, __func__, "kv");
+    errno = EINVAL;
+    return 1;
+  }
+
+  // do not resize below KEYVAL_MIN_ARRAY_SIZE
+  if (new_size < KEYVAL_MIN_ARRAY_SIZE) {
+    new_size = KEYVAL_MIN_ARRAY_SIZE;
+  }
+
+  // don't resize to the same value:
+  if (new_size == kv->max_size) {
+    return 0;
+  }
+
+  kv->max_size = new_size;
+  
+  // create new array:
+  struct KeyValElement *new_data = calloc(kv->max_size, sizeof(struct KeyValElement));
+  if (!new_data) {
+    fprintf(stderr, "KeyVal_resize: out of memory\n");
+    errno = ENOMEM;
+    return 1;
+  }
+
+  // copy over existing things:
+  memcpy(new_data,
+      kv->data,
+      kv->used_size * sizeof(struct KeyValElement));
+
+  // free up old array:
+  free(kv->data);
+
+  // shuffle:
+  kv->data = new_data;
+
+  return 0;
+}
+
+
+unsigned char
+KeyVal_setHashIndex(struct KeyVal *kv, unsigned char enable) {
   if (!kv) {
     fprintf(stderr, ERRSTR, __func__, "kv");
     errno = EINVAL;
     return 1;
   }
-  if (!key) {
-    fprintf(stderr, ERRSTR, __func__, "key");
-    errno = EINVAL;
+  if (kv->frozen) {
+    fprintf(stderr, FROZENSTR, __func__);
+    errno = EPERM;
     return 1;
   }
 
-  // Instead of a typical binary search, we're using something called
-  // "deferred detection", where we don't check for equality inside the loop.
-  // Instead, we check less-than vs greater-than-or-equal-to.  This not only
-  // gives us the 'ideal' location (whether or not it exists), but has
-  // fewer comparisons inside the loop!
-
-  // The general idea is to have curr_low and curr_hi converge on the ideal
-  // location.  At all times:
-  // - the element at curr_hi's spot is either the key or something above it (or off the end)
-  // - the element at curr_lo's spot is either the key or something below it
-
-  unsigned long curr_low = 0;
-  unsigned long curr_hi = kv->used_size;  // can't be - 1; what if ideal is off the end?
-  unsigned long curr_mid = curr_low;  // in case array is empty
-  while (curr_low != curr_hi) {
-
-    // SHR is both a fast divide and a fast floor:
-    curr_mid = (curr_low + curr_hi) >> 1;
-//printf("lo: %lu, mid: %lu, hi: %lu\n", curr_low, curr_mid, curr_hi);
-//printf("strcmp(%s, %s)=%d\n", kv->data[curr_mid]->key, key, KeyVal_strcmp(kv->data[curr_mid]->key, key));
-
-    if (KeyVal_strcmp(kv->data[curr_mid]->key, key) < 0) {
-      curr_low = curr_mid + 1;
-    } else {
-      curr_hi = curr_mid;
-    }
+  if (!enable) {
+    free(kv->hash_index);
+    kv->hash_index = 0;
+    kv->hash_index_size = 0;
+    return 0;
   }
+  if (kv->hash_index) return 0;  // already on
 
-  *res = curr_low;
-  return 0;
+  // build it over everything, which means sorting everything first:
+  if (KeyVal_ensureSorted(kv)) return 1;
+  return KeyVal_hashIndexRebuild(kv);
 }
 
 
-// Returns:
-//   0: everything okay.  '*res' is set to where the given key should exist in
-//     the array:
-//     - if the key exists, this is where it is;
-//     - if the key does not exist, this is where it should be inserted.
-//   1: encountered errors.  stderr spewed, errno is set.
-//   2: key was not found.
-//
-// This function is internal, so it is not declared in KeyVal.h.  However, it
-// is tested directly in test.c, so it is not static.
-unsigned char KeyVal_findIndex(unsigned long *res,
-    struct KeyVal *kv, const char *key) {
-  if (!res) {
-    fprintf(stderr, ERRSTR, __func__, "res");
-    errno = EINVAL;
-    return 1;
-  }
+unsigned char
+KeyVal_setTrieIndex(struct KeyVal *kv, unsigned char enable) {
   if (!kv) {
     fprintf(stderr, ERRSTR, __func__, "kv");
     errno = EINVAL;
     return 1;
   }
-  if (!key) {
-    fprintf(stderr, ERRSTR, __func__, "key");
-    errno = EINVAL;
+  if (kv->frozen) {
+    fprintf(stderr, FROZENSTR, __func__);
+    errno = EPERM;
     return 1;
   }
 
-  // find where it 'should' be:
-  unsigned long idx;
-  if (KeyVal_findIdealIndex(&idx, kv, key)) return 1;
-
-//printf("** findIndex: used=%lu, idx=%lu\n", kv->used_size, idx);
-  if (kv->used_size == idx) return 2;  // ideal is off the end of the array, so it wasn't found
-  // check if the key at the ideal index happens to be it:
-//printf("** strcmp'ing %s and %s..\n", kv->data[idx]->key, key);
-  if (strcmp(kv->data[idx]->key, key) == 0) {
-    *res = idx;
+  if (!enable) {
+    if (kv->trie) KeyValTrieNode_delete(kv->trie);
+    kv->trie = 0;
     return 0;
   }
-  // not found:
-  return 2;
-}
-
+  if (kv->trie) return 0;  // already on
 
+  // the tail can have duplicates, so get rid of it first:
+  if (KeyVal_ensureSorted(kv)) return 1;
+  return KeyVal_trieRebuild(kv);
+}
 
-//////////////////////////////////////// KeyVal
 
 unsigned char
-KeyVal_new(struct KeyVal **res) {
-  if (!res) {
-    fprintf(stderr, ERRSTR, __func__, "res");
+KeyVal_setInterpCache(struct KeyVal *kv, unsigned char enable) {
+  if (!kv) {
+    fprintf(stderr, ERRSTR, __func__, "kv");
     errno = EINVAL;
     return 1;
   }
-
-  // alloc:
-  struct KeyVal *tmp_res = malloc(sizeof(struct KeyVal));
-  if (!tmp_res) {
-    fprintf(stderr, "KeyVal_new: out of memory\n");
-    errno = ENOMEM;
+  if (kv->frozen) {
+    fprintf(stderr, FROZENSTR, __func__);
+    errno = EPERM;
     return 1;
   }
 
-  // init:
-  tmp_res->max_size = KEYVAL_MIN_ARRAY_SIZE;
-  tmp_res->used_size = 0;
-  tmp_res->last_sorted = 0;
-  tmp_res->data = calloc(KEYVAL_MIN_ARRAY_SIZE, sizeof(struct KeyValElement*));
-  if (!tmp_res->data) {
-    fprintf(stderr, "KeyVal_new: out of memory\n");
-    free(tmp_res);
+  if (!enable) {
+    if (kv->interp_cache) KeyValInterpCache_delete(kv->interp_cache);
+    kv->interp_cache = 0;
+    return 0;
+  }
+  if (kv->interp_cache) return 0;  // already on
+
+  // (it fills up as values get asked for)
+  struct KeyValInterpCache *cache = calloc(1, sizeof(struct KeyValInterpCache));
+  if (cache) {
+    cache->buckets = calloc(KEYVAL_MIN_INTERP_BUCKETS, sizeof(struct KeyValInterpNode*));
+    cache->num_buckets = KEYVAL_MIN_INTERP_BUCKETS;
+  }
+  if (!cache || !cache->buckets) {
+    free(cache);
+    fprintf(stderr, "KeyVal_setInterpCache: out of memory\n");
     errno = ENOMEM;
     return 1;
   }
-
-  *res = tmp_res;
+  kv->interp_cache = cache;
   return 0;
 }
 
 
 unsigned char
-KeyVal_delete(struct KeyVal *kv) {
+KeyVal_freeze(struct KeyVal *kv) {
   if (!kv) {
     fprintf(stderr, ERRSTR, __func__, "kv");
     errno = EINVAL;
     return 1;
   }
 
-  // I have a habit of zero'ing out things after freeing them, so that if
-  // anything is still pointing to them, they segfault right away instead
-  // picking up essentially random data.  However, there's a good argument
-  // to be made that it's unnecessary computation.
-
-  // destroy components:
-  for (unsigned long i = 0; i < kv->used_size; ++i) {
-    if (KeyValElement_delete(kv->data[i])) return 1;
-    kv->data[i] = 0;
-  }
-  // destroy array:
-  free(kv->data);
-  kv->data = 0;
-
-  // destroy myself:
-  free(kv);
+  // every bit of lazy work has to happen now, because after this, nothing
+  // gets written:
+  if (KeyVal_ensureSorted(kv)) return 1;
+  kv->frozen = 1;
   return 0;
 }
 
 
-// this is a custom function because we need to account for escapes
-static int
-KeyVal_strlen(const char *keystr) {
-  if (!keystr) {
-    fprintf(stderr, ERRSTR, __func__, "keystr");
+unsigned char
+KeyVal_thaw(struct KeyVal *kv) {
+  if (!kv) {
+    fprintf(stderr, ERRSTR, __func__, "kv");
+    errno = EINVAL;
+    return 1;
   }
 
-  int res = 0;
-  for (const char *ch = keystr;
-      *ch;
-      ch++) {
-    res += (*ch == '`' || *ch == '\\') ? 2 : 1;
-  }
-  return res;
+  kv->frozen = 0;
+  return 0;
 }
 
 
-static void
-KeyVal_escape_and_quote(char *dest, const char *src) {
-  if (!dest) {
-    fprintf(stderr, ERRSTR, __func__, "dest");
-  }
-  if (!src) {
-    fprintf(stderr, ERRSTR, __func__, "src");
-  }
-
-  unsigned long dest_idx = 0;
-  dest[dest_idx++] = '`';
-  for (const char *ch = src;
-      *ch;
-      ++ch) {
-    if (*ch == '`' || *ch == '\\') {
-      dest[dest_idx++] = '\\';
+// Formats the lines for kv->data[from, to) into 'w', interpolating into
+// 'interped' as needed.  'key_width' is how wide to pad keys to, or 0 for no
+// alignment.  (Only reads 'kv', so any number of these can run at once.)
+// Returns:
+//   0: everything okay (as far as 'w' knows; check w->failed)
+//   1: interpolation problems.  stderr spewed, errno is set.
+static unsigned char
+KeyVal_saveRange(struct KeyValWriter *w, struct KeyValStrBuf *interped,
+    struct KeyVal *kv, unsigned long from, unsigned long to,
+    unsigned char interp, int key_width) {
+  for (unsigned long i = from;
+      i < to && !w->failed;
+      ++i) {
+    const char *key = kv->data[i].key;
+    const char *val = kv->data[i].val;
+    // may need to interpolate variables in val:
+    if (interp && strstr(val, "${")) {
+      if (KeyVal_interpInto(interped, kv, val)) return 1;
+      val = interped->buf;
     }
-    dest[dest_idx++] = *ch;
+    // good to go:
+    unsigned long key_len = KeyValWriter_putQuoted(w, key);
+    if (key_width) KeyValWriter_pad(w, key_width - (long)key_len);
+    KeyValWriter_put(w, " = ", 3);
+    KeyValWriter_putQuoted(w, val);
+    KeyValWriter_put(w, "\n", 1);
   }
-  dest[dest_idx++] = '`';
-  dest[dest_idx++] = 0;
-  return;
+  return 0;
 }
 
 
-static unsigned char
-KeyVal_interp_next(char **res, struct KeyVal *kv, const char *str, unsigned int depth) {
-  if (!res) {
-    fprintf(stderr, ERRSTR, __func__, "res");
-    errno = EINVAL;
-    return 1;
-  }
-  if (!kv) {
-    fprintf(stderr, ERRSTR, __func__, "kv");
-    errno = EINVAL;
-    return 1;
-  }
-  if (!str) {
-    fprintf(stderr, ERRSTR, __func__, "str");
-    errno = EINVAL;
-    return 1;
+// KeyVal_saveParallel works through the array a round at a time: each range
+// in the round is formatted into its own buffer, by whichever thread gets to
+// it first, and then the buffers are written out in order.  (Rounds keep the
+// memory use down to a few ranges' worth of output.)
+static const unsigned long KEYVAL_SAVE_RANGE = 1 << 14;  // keys per range
+
+struct KeyValSaveJob {
+  struct KeyValWriter w;  // in memory
+  struct KeyValStrBuf interped;
+  unsigned long from;
+  unsigned long to;
+  unsigned char retcode;
+};
+
+struct KeyValSaveState {
+  struct KeyVal *kv;
+  unsigned char interp;
+  int key_width;
+  struct KeyValSaveJob *jobs;
+  unsigned long num_jobs;  // in this round
+  unsigned long next_job;  // claimed with __sync_fetch_and_add
+};
+
+static void *
+KeyVal_saveWorker(void *arg) {
+  struct KeyValSaveState *state = arg;
+  unsigned long j;
+  while ((j = __sync_fetch_and_add(&state->next_job, 1)) < state->num_jobs) {
+    struct KeyValSaveJob *job = &state->jobs[j];
+    job->w.len = 0;
+    job->retcode = KeyVal_saveRange(&job->w, &job->interped, state->kv,
+        job->from, job->to, state->interp, state->key_width);
   }
+  return 0;
+}
 
-  // hit KEYVAL_MAX_INTERP_DEPTH number of recursive variables?
-  if (depth == KEYVAL_MAX_INTERP_DEPTH) {
-    return 2;
-  }
 
-  // various error cases return a copy of the original string.  If variables
-  // are found, we'll reconstruct the string:
-  *res = strdup(str);
-  if (!*res) {
-    fprintf(stderr, "KeyVal_interp: out of memory\n");
+// Does KeyVal_save (on 'num_threads' threads at once, if that's more than 1)
+// into the already-open file 'fd'.
+// Returns:
+//   0: everything okay
+//   1: problems with memory or interpolation.  stderr spewed, errno is set.
+//   2: problems writing.  errno is set, but stderr is left to the caller.
+static unsigned char
+KeyVal_saveTo(int fd, struct KeyVal *kv, unsigned char interp, int key_width,
+    unsigned int num_threads) {
+  unsigned long num_ranges = (kv->used_size + KEYVAL_SAVE_RANGE - 1) / KEYVAL_SAVE_RANGE;
+  if (num_threads > num_ranges) num_threads = num_ranges;
+
+  if (num_threads <= 1) {
+    // one thread just streams it all out:
+    struct KeyValWriter w = {fd, malloc(KEYVAL_WRITER_BUF_SIZE), 0, KEYVAL_WRITER_BUF_SIZE, 0};
+    struct KeyValStrBuf interped = {0, 0, 0, 0};
+    if (!w.buf) {
+      fprintf(stderr, "KeyVal_save: out of memory\n");
+      errno = ENOMEM;
+      return 1;
+    }
+    unsigned char res = KeyVal_saveRange(&w, &interped, kv, 0, kv->used_size, interp, key_width);
+    if (!res) KeyValWriter_flush(&w);
+    free(interped.buf);
+    free(w.buf);
+    if (!res && w.failed) res = 2;
+    return res;
+  }
+
+  // a couple of ranges per thread in each round, so that nobody waits long:
+  struct KeyValSaveState state = {kv, interp, key_width, 0, 0, 0};
+  unsigned long jobs_per_round = 2 * num_threads;
+  state.jobs = calloc(jobs_per_round, sizeof(struct KeyValSaveJob));
+  pthread_t *threads = malloc((num_threads - 1) * sizeof(pthread_t));
+  unsigned char res = 0;
+  for (unsigned long j = 0; j < jobs_per_round && state.jobs; ++j) {
+    struct KeyValSaveJob *job = &state.jobs[j];
+    job->w.fd = -1;
+    job->w.max = KEYVAL_WRITER_BUF_SIZE;
+    job->w.buf = malloc(job->w.max);
+    if (!job->w.buf) res = 1;
+  }
+  if (!state.jobs || !threads || res) {
+    fprintf(stderr, "KeyVal_save: out of memory\n");
     errno = ENOMEM;
-    return 1;
-  }
-
-  // find the first close-brace, if there is one:
-  char *close_brace = index(*res, '}');
-  while (close_brace) {
-
-    // trace back to the preceding "${", if there is one:
-    char *open_brace = 0;
-    char *t = close_brace - 2;
-    while (*res <= t) {
-      if (*t == '$' && *(t+1) == '{') {
-        open_brace = t;
-        break;
-      }
-      --t;
+    res = 1;
+  }
+
+  for (unsigned long from = 0; from < kv->used_size && !res; ) {
+    // set up the round:
+    state.num_jobs = 0;
+    state.next_job = 0;
+    while (state.num_jobs < jobs_per_round && from < kv->used_size) {
+      struct KeyValSaveJob *job = &state.jobs[state.num_jobs++];
+      job->from = from;
+      job->to = from + KEYVAL_SAVE_RANGE < kv->used_size ? from + KEYVAL_SAVE_RANGE : kv->used_size;
+      from = job->to;
     }
-    if (!open_brace) {
-      return 0;
+    // format it on every thread (this one included).  If threads can't be
+    // started, fewer of them do the work:
+    unsigned int num_started = 0;
+    while (num_started < num_threads - 1
+        && !pthread_create(&threads[num_started], 0, KeyVal_saveWorker, &state)) {
+      ++num_started;
     }
-
-    // extract variable path:
-    char tmpstr[KEYVAL_MAX_STR_LEN];
-    char *tptr = &tmpstr[0];
-    t = open_brace + 2;
-    while (t < close_brace) {
-      *tptr++ = *t++;
+    KeyVal_saveWorker(&state);
+    for (unsigned int t = 0; t < num_started; ++t) {
+      pthread_join(threads[t], 0);
     }
-    *tptr = 0;
-    if (!strcmp(tmpstr, "")) {  // just in case
-      return 0;
+    // and write it out in order:
+    for (unsigned long j = 0; j < state.num_jobs && !res; ++j) {
+      struct KeyValSaveJob *job = &state.jobs[j];
+      if (job->retcode) {
+        res = job->retcode;
+      } else if (job->w.failed) {
+        fprintf(stderr, "KeyVal_save: out of memory\n");
+        errno = ENOMEM;
+        res = 1;
+      } else if (KeyVal_writeAll(fd, job->w.buf, job->w.len)) {
+        res = 2;
+      }
     }
+  }
+
+  for (unsigned long j = 0; j < jobs_per_round && state.jobs; ++j) {
+    free(state.jobs[j].w.buf);
+    free(state.jobs[j].interped.buf);
+  }
+  free(state.jobs);
+  free(threads);
+  return res;
+}
 
-    // get its (uninterpolated) value:
-    char *subval;
-    if (KeyVal_getValue(&subval, kv, tmpstr, 0)) {
-      // propagate errors
+
+// Everything gets saved to a temporary file next to the real one, which is
+// then renamed over it, so that nobody ever sees a half-written file (and
+// anyone who has the old one open or mapped keeps the old one intact).
+// Symlinks are followed, so the file they point to gets replaced rather than
+// the link, and the temporary file gets the permissions (and, if we're
+// allowed, the owner) of the file it replaces.  (The pid and counter keep
+// threads and processes from sharing temporary files.)
+// These are internal, but KeyVal_binary.c saves the same way.
+//
+// KeyVal_tempOpen sets 'fd' to the open temporary file, and 'real_path' and
+// 'tmp_path' to malloc'ed paths that KeyVal_tempCommit frees.
+// Returns:
+//   0: everything okay
+//   1: problems with memory.  stderr spewed, errno is set.
+//   2: problems opening.  stderr spewed, errno is set.
+unsigned char
+KeyVal_tempOpen(int *fd, char **real_path, char **tmp_path,
+    const char *filepath, const char *func) {
+  *real_path = realpath(filepath, 0);
+  if (!*real_path) {
+    if (errno == ENOMEM) {
+      fprintf(stderr, "%s: out of memory\n", func);
       return 1;
     }
-    if (!*subval) {
-      // uninterpolatable variable, so just stop here with what we've got
-      return 0;
-    }
-
-    // interpolate variables in it:
-    char *substr;
-    unsigned char interp_res = KeyVal_interp_next(&substr, kv, subval, depth+1);
-    if (interp_res == 1) return 1;  // propagate error
-    if (interp_res == 2) return 2;  // propagate recursive variable error
-
-    // patch together the new string.
-    // copy the pre-variable part:
-    tptr = &tmpstr[0];
-    t = *res;
-    while (t < open_brace) {
-      *tptr++ = *t++;
-    }
-    // then the variable part:
-    t = &substr[0];
-    while (*t) {
-      *tptr++ = *t++;
-    }
-    // then the post-variable part:
-    t = close_brace + 1;
-    while (*t) {
-      *tptr++ = *t++;
-    }
-    *tptr = 0;
-    // Finally, move it back to res:
-    free(*res);
-    *res = strdup(tmpstr);
-    if (!*res) {
-      fprintf(stderr, "KeyVal_interp_next: out of memory\n");
+    *real_path = strdup(filepath);  // doesn't exist yet, presumably
+    if (!*real_path) {
+      fprintf(stderr, "%s: out of memory\n", func);
       errno = ENOMEM;
       return 1;
     }
-
-    // cleanup the sub-variable memory:
-    free(substr);
-
-    // next iteration:
-    close_brace = index(*res, '}');
   }
 
-  return 0;
-}
-
-
-unsigned char
-KeyVal_interp(char **res, struct KeyVal *kv, const char *str) {
-  if (!res) {
-    fprintf(stderr, ERRSTR, __func__, "res");
-    errno = EINVAL;
-    return 1;
-  }
-  if (!kv) {
-    fprintf(stderr, ERRSTR, __func__, "kv");
-    errno = EINVAL;
-    return 1;
-  }
-  if (!str) {
-    fprintf(stderr, ERRSTR, __func__, "str");
-    errno = EINVAL;
+  static unsigned long temp_counter = 0;
+  unsigned long this_temp = __sync_fetch_and_add(&temp_counter, 1);
+  *tmp_path = malloc(strlen(*real_path) + 64);
+  if (!*tmp_path) {
+    fprintf(stderr, "%s: out of memory\n", func);
+    free(*real_path);
+    errno = ENOMEM;
     return 1;
   }
+  sprintf(*tmp_path, "%s.tmp.%ld.%lu", *real_path, (long)getpid(), this_temp);
 
-  unsigned char interp_res = KeyVal_interp_next(res, kv, str, 0);
-  if (interp_res == 1) return 1;  // propagate error
-  if (interp_res == 2) {
-    if (!KEYVAL_QUIET) {
-      fprintf(stderr,
-          "%s: encountered %d levels of variables; possible recursion\n"
-          "in key `%s`\n",
-          __func__,
-          KEYVAL_MAX_INTERP_DEPTH, str);
+  struct stat st;
+  unsigned char replacing = !stat(*real_path, &st);
+  *fd = open(*tmp_path, O_WRONLY | O_CREAT | O_EXCL, replacing ? 0600 : 0666);
+  if (*fd >= 0 && replacing) {
+    if (fchown(*fd, st.st_uid, st.st_gid)) {
+      // only root gets to give files away, so keep ours
+    }
+    if (fchmod(*fd, st.st_mode & 07777)) {
+      close(*fd);
+      unlink(*tmp_path);
+      *fd = -1;
     }
+  }
+  if (*fd < 0) {
+    fprintf(stderr, "[ERROR] %s: cannot write to this file:\n  %s\n  because of:\n  ", func, *tmp_path);
+    perror(0);
+    free(*tmp_path);
+    free(*real_path);
     return 2;
   }
   return 0;
 }
 
 
-static unsigned char
-KeyVal_ensureSorted(struct KeyVal *kv) {
-  if (!kv) {
-    fprintf(stderr, ERRSTR, __func__, "kv");
-    errno = EINVAL;
-    return 1;
+// Renames the (already synced and closed) temporary file over the real one,
+// if 'res' is 0, and otherwise just removes it.  Frees both paths.
+// Returns 'res', or 2 if the rename fails (stderr spewed, errno set).
+unsigned char
+KeyVal_tempCommit(char *real_path, char *tmp_path, unsigned char res,
+    const char *func) {
+  if (!res && rename(tmp_path, real_path)) {
+    fprintf(stderr, "[ERROR] %s: cannot write to this file:\n  %s\n  because of:\n  ", func, real_path);
+    perror(0);
+    res = 2;
   }
+  if (res) unlink(tmp_path);
+  free(tmp_path);
+  free(real_path);
+  return res;
+}
 
-  // make sure there's something to sort:
-  if (kv->used_size == 0) return 0;
-
-  // make sure we actually need to sort:
-  if (kv->last_sorted == kv->used_size) return 0;
-
-  // this uses insertion sort!
-  unsigned long orig_size = kv->used_size;
-  kv->used_size = kv->last_sorted;  // so that findIdealIndex works right
-  for (unsigned long idx = kv->last_sorted;
-      idx < orig_size;
-      ++idx) {
-
-    const char *key = kv->data[idx]->key;
 
-    unsigned long ideal_idx;
-    if (KeyVal_findIdealIndex(&ideal_idx, kv, key)) return 1;
+// KeyVal_save and KeyVal_saveParallel, once their arguments have been
+// checked.  If 'append_fd' isn't null, the new file is kept open for
+// appending, and '*append_fd' is set to it once it's in place (so there's
+// no reopening it by name, which could fail after the old file is gone).
+static unsigned char
+KeyVal_saveWith(struct KeyVal *kv, const char *filepath, unsigned char interp,
+    unsigned char align, unsigned int num_threads, int *append_fd) {
+  // make sure the database is sane:
+  if (KeyVal_ensureSorted(kv)) return 1;
 
-    // if it goes at the end, we're already done!
-    if (ideal_idx == kv->used_size) {
-      ++kv->used_size;
+  // if we need to align, find the max size of all the keys:
+  int key_width = 0;
+  if (align) {
+    for (unsigned long i = 0;
+        i < kv->used_size;
+        ++i) {
+      int this_len = KeyVal_strlen(kv->data[i].key);
+      if (key_width < this_len) {
+        key_width = this_len;
+      }
     }
-    // if it's already there, just overwrite the value:
-    else if (!strcmp(kv->data[ideal_idx]->key, key)) {
-      // move the existing value from [idx] to [ideal_idx]:
-      free(kv->data[ideal_idx]->val);
-      kv->data[ideal_idx]->val = kv->data[idx]->val;
-      // destroy the key for [idx]:
-      // (don't use KeyValElement_delete because we don't want 'val' deleted)
-      free(kv->data[idx]->key);
-      kv->data[idx]->key = 0;
-      free(kv->data[idx]);
-      kv->data[idx] = 0;
-      // do not increase used_size!
-    }
-
-    // otherwise, we need to insert it to the ideal_idx spot:
-    else {
+    key_width += 2;  // for the surrounding quotes
+  }
 
-      // we're going to overwrite this spot, so remember what it points to:
-      struct KeyValElement *newb = kv->data[idx];
+  char *real_path, *tmp_path;
+  int fd;
+  unsigned char res = KeyVal_tempOpen(&fd, &real_path, &tmp_path, filepath, "KeyVal_save");
+  if (res) return res;
 
-      // move everything down one:
-      void *src = &kv->data[ideal_idx];
-      void *dest = &kv->data[ideal_idx+1];
-      unsigned long num_bytes = sizeof(struct KeyValElement*) * (kv->used_size - ideal_idx);
-      memmove(dest, src, num_bytes);
+  res = KeyVal_saveTo(fd, kv, interp, key_width, num_threads);
 
-      // set the ideal spot to idx's (original) data:
-      kv->data[ideal_idx] = newb;
-      ++kv->used_size;
+  // check everything for errors, because this is what fails when disks fill
+  // up, etc.  (fsync, so that the rename can't land before the data does.)
+  if (res == 2 || (!res && fsync(fd))) {
+    fprintf(stderr, "[ERROR] KeyVal_save: cannot finish writing this file:\n  %s\n  because of:\n  ", tmp_path);
+    perror(0);
+    res = 2;
+  }
+  if (append_fd && !res) {
+    if (fcntl(fd, F_SETFL, O_APPEND)) {
+      fprintf(stderr, "[ERROR] KeyVal_save: cannot append to this file:\n  %s\n  because of:\n  ", tmp_path);
+      perror(0);
+      res = 2;
     }
+    res = KeyVal_tempCommit(real_path, tmp_path, res, "KeyVal_save");
+    if (res) close(fd);
+    else *append_fd = fd;
+    return res;
   }
-
-  // and now we know it's sorted!
-  kv->last_sorted = kv->used_size;
-
-  return 0;
+  if (close(fd) && !res) {
+    fprintf(stderr, "[ERROR] KeyVal_save: cannot finish writing this file:\n  %s\n  because of:\n  ", tmp_path);
+    perror(0);
+    res = 2;
+  }
+  return KeyVal_tempCommit(real_path, tmp_path, res, "KeyVal_save");
 }
 
 
-static unsigned char
-KeyVal_resize(struct KeyVal *kv, unsigned long new_size) {
+unsigned char
+KeyVal_save(struct KeyVal *kv, const char *filepath, unsigned char interp, unsigned char align) {
   if (!kv) {
     fprintf(stderr, ERRSTR, __func__, "kv");
     errno = EINVAL;
     return 1;
   }
-
-  // do not resize below KEYVAL_MIN_ARRAY_SIZE
-  if (new_size < KEYVAL_MIN_ARRAY_SIZE) {
-    new_size = KEYVAL_MIN_ARRAY_SIZE;
+  if (!filepath) {
+    fprintf(stderr, ERRSTR, __func__, "filepath");
+    errno = EINVAL;
+    return 1;
   }
+  return KeyVal_saveWith(kv, filepath, interp, align, 1, 0);
+}
 
-  // don't resize to the same value:
-  if (new_size == kv->max_size) {
-    return 0;
-  }
 
-  kv->max_size = new_size;
-  
-  // create new array:
-  struct KeyValElement **new_data = calloc(kv->max_size, sizeof(struct KeyValElement *));
-  if (!new_data) {
-    fprintf(stderr, "KeyVal_resize: out of memory\n");
-    errno = ENOMEM;
+unsigned char
+KeyVal_saveParallel(struct KeyVal *kv, const char *filepath, unsigned char interp,
+    unsigned char align, unsigned int num_threads) {
+  if (!kv) {
+    fprintf(stderr, ERRSTR, __func__, "kv");
+    errno = EINVAL;
     return 1;
   }
+  if (!filepath) {
+    fprintf(stderr, ERRSTR, __func__, "filepath");
+    errno = EINVAL;
+    return 1;
+  }
+  return KeyVal_saveWith(kv, filepath, interp, align, num_threads, 0);
+}
 
-  // copy over existing things:
-  memcpy(new_data,
-      kv->data,
-      kv->used_size * sizeof(struct KeyValElement *));
-
-  // free up old array:
-  free(kv->data);
-
-  // shuffle:
-  kv->data = new_data;
 
+// Saves over the journal file, and goes on appending to the new one.  (If the
+// save fails, the old file is still there, so appending just goes on.)
+// Returns:
+//   0: everything okay
+//   1: problems with memory.  stderr spewed, errno is set.
+//   2: problems writing.  stderr spewed, errno is set.
+static unsigned char
+KeyVal_compactJournal(struct KeyVal *kv) {
+  struct KeyValJournal *j = kv->journal;
+  int fd;
+  unsigned char res = KeyVal_saveWith(kv, j->filepath, 0, 0, 1, &fd);
+  if (res) return res;
+  // (the old descriptor points at the file that just got replaced)
+  if (j->fd >= 0) close(j->fd);
+  j->fd = fd;
+  j->num_lines = 0;
   return 0;
 }
 
+// For the end of every change that went into the journal: compacts it, if
+// it's time.  The change itself is already safely in the journal, so a
+// failed compaction is only reported, and not tried again until another
+// 'compact_after' lines have gone by.
+static inline void
+KeyVal_journalDone(struct KeyVal *kv) {
+  struct KeyValJournal *j = kv->journal;
+  if (!j || !j->compact_after || j->num_lines < j->compact_after) return;
+  if (KeyVal_compactJournal(kv)) j->num_lines = 0;
+}
+
 
 unsigned char
-KeyVal_save(struct KeyVal *kv, const char *filepath, unsigned char interp, unsigned char align) {
+KeyVal_setJournal(struct KeyVal *kv, const char *filepath, unsigned long compact_after) {
   if (!kv) {
     fprintf(stderr, ERRSTR, __func__, "kv");
     errno = EINVAL;
     return 1;
   }
-  if (!filepath) {
-    fprintf(stderr, ERRSTR, __func__, "filepath");
-    errno = EINVAL;
+  if (kv->frozen) {
+    fprintf(stderr, FROZENSTR, __func__);
+    errno = EPERM;
     return 1;
   }
 
-  FILE *fh = fopen(filepath, "w");
-  if (!fh) {
-    fprintf(stderr, "[ERROR] KeyVal_save: cannot write to this file:\n  %s\n  because of:\n  ", filepath);
-    perror(0);
-    return 2;
-  }
-
-  // make sure the database is sane:
-  if (KeyVal_ensureSorted(kv)) return 1;
+  if (kv->journal) KeyValJournal_delete(kv->journal);
+  kv->journal = 0;
+  if (!filepath) return 0;
 
-  // if we need to align, find the max size of all the keys:
-  char fmt_str[16];
-  if (align) {
-    int max_size = 0;
-    for (unsigned long i = 0;
-        i < kv->used_size;
-        ++i) {
-      int this_len = KeyVal_strlen(kv->data[i]->key);
-      if (max_size < this_len) {
-        max_size = this_len;
-      }
-    }
-    sprintf(fmt_str, "%%-%ds = %%s\n", max_size+2);  // "-" is for left-align; "+2" is for the surrounding quotes
+  struct KeyValJournal *j = calloc(1, sizeof(struct KeyValJournal));
+  if (j) {
+    j->fd = -1;
+    j->filepath = strdup(filepath);
+    j->buf_size = 1024;
+    j->buf = malloc(j->buf_size);
+    j->compact_after = compact_after;
   }
-  else {
-    sprintf(fmt_str, "%%s = %%s\n");
+  if (!j || !j->filepath || !j->buf) {
+    if (j) KeyValJournal_delete(j);
+    fprintf(stderr, "KeyVal_setJournal: out of memory\n");
+    errno = ENOMEM;
+    return 1;
   }
+  // the file starts out as exactly what's in memory:
+  kv->journal = j;
+  unsigned char res = KeyVal_compactJournal(kv);
+  if (res) {
+    KeyValJournal_delete(j);
+    kv->journal = 0;
+  }
+  return res;
+}
 
-  // the +2 is for the surrounding quote characters:
-  char this_key[KEYVAL_MAX_STR_LEN+2];
-  char this_val[KEYVAL_MAX_STR_LEN+2];    
 
-  for (unsigned long i = 0;
-      i < kv->used_size;
-      ++i) {
-    KeyVal_escape_and_quote(this_key, kv->data[i]->key);
-    // may need to interpolate variables in this_val:
-    if (interp) {
-      char *interped_val;
-      if (KeyVal_interp(&interped_val, kv, kv->data[i]->val)) return 1;
-      KeyVal_escape_and_quote(this_val, interped_val);
-      free(interped_val);
-    }
-    else {
-      KeyVal_escape_and_quote(this_val, kv->data[i]->val);
-    }
-    // good to go:
-    fprintf(fh, fmt_str, this_key, this_val);
+unsigned char
+KeyVal_compact(struct KeyVal *kv) {
+  if (!kv) {
+    fprintf(stderr, ERRSTR, __func__, "kv");
+    errno = EINVAL;
+    return 1;
   }
-
-  // check close for errors, because this is what fails when disks fill up, etc:
-  if (fclose(fh)) {
-    fprintf(stderr, "[ERROR] KeyVal_save: cannot finish writing this file:\n  %s\n  because of:\n  ", filepath);
-    perror(0);
-    return 2;
+  if (!kv->journal) {
+    fprintf(stderr, "KeyVal_compact: journaling is off\n");
+    errno = EINVAL;
+    return 1;
   }
-  return 0;
+  return KeyVal_compactJournal(kv);
 }
 
 
+// This is KeyVal_setValue, except that 'key' and/or 'val' may be borrowed
+// pointers into one of kv's mappings, in which case they are not copied.
+//
+// This function is internal, so it is not declared in KeyVal.h.  However,
+// KeyVal_load.c needs it, so it is not static.
 unsigned char
-KeyVal_setValue(struct KeyVal *kv, const char *key, const char *val) {
+KeyVal_setValueBorrowed(struct KeyVal *kv, const char *key, const char *val,
+    unsigned char key_borrowed, unsigned char val_borrowed) {
   if (!kv) {
     fprintf(stderr, ERRSTR, __func__, "kv");
     errno = EINVAL;
@@ -748,6 +2337,11 @@ KeyVal_setValue(struct KeyVal *kv, const char *key, const char *val) {
     errno = EINVAL;
     return 1;
   }
+  if (kv->frozen) {
+    fprintf(stderr, FROZENSTR, "KeyVal_setValue");
+    errno = EPERM;
+    return 1;
+  }
   int _tmp_len = KeyVal_strlen(key); // use the KeyVal version to account for escapes
   if (KEYVAL_MAX_STR_LEN < _tmp_len) {
     fprintf(stderr, "KeyVal_setValue: 'key' argument too long (%d > %d): '%s'\n", _tmp_len, KEYVAL_MAX_STR_LEN, key);
@@ -761,14 +2355,27 @@ KeyVal_setValue(struct KeyVal *kv, const char *key, const char *val) {
     return 1;
   }
 
+  // the journal goes first, so that what's in memory is never ahead of it:
+  if (kv->journal) {
+    if (KeyValJournal_write(kv->journal, &key, &val, 1)) return 1;
+  }
+
+  if (kv->interp_cache) {
+    KeyValInterpCache_invalidate(kv->interp_cache, key);
+  }
+
   int _need_to_add = 1;
 
   // base case: nothing in the array at all.
   if (kv->used_size == 0) {
-    if (KeyValElement_new(&kv->data[0], key, val)) return 1;
+    if (KeyValElement_init(kv, &kv->data[0], key, val, key_borrowed, val_borrowed)) return 1;
     kv->used_size = 1;
     kv->last_sorted = 1;
     _need_to_add = 0;
+    // (the indexes drop themselves if they can't keep up, but the value is
+    // set either way)
+    if (kv->hash_index) KeyVal_hashIndexAppend(kv);
+    if (kv->trie) KeyVal_trieAdd(kv, kv->data[0].key);
   }
 
   // next two cases only apply if it's currently sorted:
@@ -779,27 +2386,32 @@ KeyVal_setValue(struct KeyVal *kv, const char *key, const char *val) {
     // end of the array.  However, findIdealIndex does log(n) strcmps, and we
     // want loading already-sorted files to be extremely fast, so we'll spend
     // one (possibly extra) strcmp to get that speedup.)
-    if (KeyVal_strcmp(kv->data[kv->used_size - 1]->key, key) < 0) {
+    if (KeyValElement_cmp(&kv->data[kv->used_size - 1], key, KeyVal_keyPrefix(key)) < 0) {
       _need_to_add = 0;
       // may need to resize:
       if (kv->used_size == kv->max_size) {
         if (KeyVal_resize(kv, kv->max_size*2)) return 1;
       }
       // add to end:
-      if (KeyValElement_new(&kv->data[kv->used_size], key, val)) return 1;
+      if (KeyValElement_init(kv, &kv->data[kv->used_size], key, val, key_borrowed, val_borrowed)) return 1;
       ++kv->used_size;
       ++kv->last_sorted;
+      if (kv->hash_index) KeyVal_hashIndexAppend(kv);
+      if (kv->trie) KeyVal_trieAdd(kv, kv->data[kv->used_size - 1].key);
     }
 
     // next case: overwrites an existing setting:
     else {
-      unsigned long ideal_idx;
-      if (KeyVal_findIdealIndex(&ideal_idx, kv, key)) return 1;
-      if (!strcmp(kv->data[ideal_idx]->key, key)) {
+      unsigned long idx;
+      unsigned char find_res = KeyVal_findIndex(&idx, kv, key);
+      if (find_res == 1) return 1;  // propagate error
+      if (find_res == 0) {
         _need_to_add = 0;
-        free(kv->data[ideal_idx]->val);
-        kv->data[ideal_idx]->val = strdup(val);
-        if (!kv->data[ideal_idx]->val) {
+        struct KeyValElement *e = &kv->data[idx];
+        if (!e->val_borrowed) KeyVal_strfree(kv, e->val);
+        e->val_borrowed = val_borrowed;
+        e->val = val_borrowed ? (char*)val : KeyVal_strdup(kv, val);
+        if (!e->val) {
           fprintf(stderr, "KeyVal_setValue: out of memory\n");
           errno = ENOMEM;
           return 1;
@@ -812,37 +2424,449 @@ KeyVal_setValue(struct KeyVal *kv, const char *key, const char *val) {
       }
     }
   }
-  // last case: currently unsorted, so just add to the end, and sort later:
-  else {
-    _need_to_add = 1;
+  // last case: currently unsorted, so just add to the end, and sort later:
+  else {
+    _need_to_add = 1;
+  }
+
+
+  // still need to add it?
+  if (_need_to_add == 1) {
+
+    // may need to resize:
+    if (kv->used_size == kv->max_size) {
+      if (KeyVal_resize(kv, kv->max_size*2)) return 1;
+    }
+    // add to end:
+    if (KeyValElement_init(kv, &kv->data[kv->used_size], key, val, key_borrowed, val_borrowed)) return 1;
+    ++kv->used_size;
+
+    // this does not preserve sorting, so do not increment last_sorted
+  }
+
+  KeyVal_journalDone(kv);
+  return 0;
+}
+
+
+unsigned char
+KeyVal_setValue(struct KeyVal *kv, const char *key, const char *val) {
+  return KeyVal_setValueBorrowed(kv, key, val, 0, 0);
+}
+
+
+// One of the keys handed to KeyVal_getValues or KeyVal_setValues,
+// remembering where it came from.
+struct KeyValBatchKey {
+  const char *key;
+  unsigned long long key_prefix;
+  unsigned long pos;  // index into the caller's arrays
+};
+
+// Sorts by key, and then by position, so that the last of any repeated keys
+// is also the last of its run.
+static int
+KeyValBatchKey_cmp(const void *a, const void *b) {
+  const struct KeyValBatchKey *k1 = a;
+  const struct KeyValBatchKey *k2 = b;
+  if (k1->key_prefix != k2->key_prefix) {
+    return (k1->key_prefix < k2->key_prefix) ? -1 : 1;
+  }
+  int cmp = KeyVal_strcmp(k1->key, k2->key);
+  if (cmp) return cmp;
+  return (k1->pos < k2->pos) ? -1 : (k1->pos > k2->pos);
+}
+
+// Sorts the caller's array of keys into a new array of KeyValBatchKeys.
+// Returns 0 if out of memory (stderr spewed, errno is set).
+static struct KeyValBatchKey *
+KeyValBatchKey_sort(const char **keys, unsigned long num_keys, const char *func) {
+  struct KeyValBatchKey *sorted = malloc((num_keys ? num_keys : 1) * sizeof(struct KeyValBatchKey));
+  if (!sorted) {
+    fprintf(stderr, "%s: out of memory\n", func);
+    errno = ENOMEM;
+    return 0;
+  }
+  for (unsigned long i = 0; i < num_keys; ++i) {
+    sorted[i].key = keys[i];
+    sorted[i].key_prefix = KeyVal_keyPrefix(keys[i]);
+    sorted[i].pos = i;
+  }
+  qsort(sorted, num_keys, sizeof(struct KeyValBatchKey), KeyValBatchKey_cmp);
+  return sorted;
+}
+
+// Where 'key' belongs in the sorted kv->data[low, end), for a batch of keys
+// coming through in sorted order.  Everything before 'low' must be below
+// 'key'.  From there, this gallops forward (1, 2, 4, ..) until passing the
+// key, and then binary searches only the last step.  Keys that are close
+// together take only a few comparisons to find, and a whole batch never takes
+// more than one plain binary search per key.
+static unsigned long
+KeyVal_gallop(struct KeyVal *kv, unsigned long low, unsigned long end,
+    const char *key, unsigned long long key_prefix) {
+  unsigned long hi = low;
+  unsigned long step = 1;
+  while (hi < end && KeyValElement_cmp(&kv->data[hi], key, key_prefix) < 0) {
+    low = hi + 1;
+    hi = low + step;
+    step <<= 1;
+  }
+  if (hi > end) hi = end;
+  while (low != hi) {
+    unsigned long mid = (low + hi) >> 1;
+    if (KeyValElement_cmp(&kv->data[mid], key, key_prefix) < 0) {
+      low = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return low;
+}
+
+
+unsigned char
+KeyVal_setValues(struct KeyVal *kv, const char **keys, const char **vals,
+    unsigned long num_keys) {
+  if (!kv) {
+    fprintf(stderr, ERRSTR, __func__, "kv");
+    errno = EINVAL;
+    return 1;
+  }
+  if (!keys && num_keys) {
+    fprintf(stderr, ERRSTR, __func__, "keys");
+    errno = EINVAL;
+    return 1;
+  }
+  if (!vals && num_keys) {
+    fprintf(stderr, ERRSTR, __func__, "vals");
+    errno = EINVAL;
+    return 1;
+  }
+  if (kv->frozen) {
+    fprintf(stderr, FROZENSTR, __func__);
+    errno = EPERM;
+    return 1;
+  }
+  // check everything first, so that bad arguments don't leave half of them
+  // set:
+  for (unsigned long i = 0; i < num_keys; ++i) {
+    if (!keys[i]) {
+      fprintf(stderr, ERRSTR, __func__, "keys[i]");
+      errno = EINVAL;
+      return 1;
+    }
+    if (!vals[i]) {
+      fprintf(stderr, ERRSTR, __func__, "vals[i]");
+      errno = EINVAL;
+      return 1;
+    }
+    int _tmp_len = KeyVal_strlen(keys[i]); // use the KeyVal version to account for escapes
+    if (KEYVAL_MAX_STR_LEN < _tmp_len) {
+      fprintf(stderr, "KeyVal_setValues: 'key' argument too long (%d > %d): '%s'\n", _tmp_len, KEYVAL_MAX_STR_LEN, keys[i]);
+      errno = EINVAL;
+      return 1;
+    }
+    _tmp_len = KeyVal_strlen(vals[i]);
+    if (KEYVAL_MAX_STR_LEN < _tmp_len) {
+      fprintf(stderr, "KeyVal_setValues: 'val' argument too long (%d > %d): '%s'\n", _tmp_len, KEYVAL_MAX_STR_LEN, vals[i]);
+      errno = EINVAL;
+      return 1;
+    }
+  }
+  if (!num_keys) return 0;
+  if (kv->journal) {
+    if (KeyValJournal_write(kv->journal, keys, vals, num_keys)) return 1;
+  }
+
+  // Anything already on the unsorted tail is newer than the sorted part, so
+  // it has to be merged in first, or it would win over this batch:
+  if (KeyVal_ensureSorted(kv)) return 1;  // propagate error
+
+  // A batch that's big next to what's already there just goes on the tail,
+  // without looking for duplicates: one KeyVal_ensureSorted at the end sorts
+  // it all, keeps the last of any repeated keys, and merges it in (which also
+  // takes care of the trie and the hash index).
+  if (num_keys >= kv->used_size / 8) {
+    if (kv->used_size + num_keys > kv->max_size) {
+      unsigned long new_size = kv->max_size;
+      while (new_size < kv->used_size + num_keys) new_size *= 2;
+      if (KeyVal_resize(kv, new_size)) return 1;
+    }
+    for (unsigned long i = 0; i < num_keys; ++i) {
+      if (kv->interp_cache) {
+        KeyValInterpCache_invalidate(kv->interp_cache, keys[i]);
+      }
+      if (KeyValElement_init(kv, &kv->data[kv->used_size], keys[i], vals[i], 0, 0)) return 1;
+      ++kv->used_size;
+    }
+    if (KeyVal_ensureSorted(kv)) return 1;
+    KeyVal_journalDone(kv);
+    return 0;
+  }
+
+  // A small batch would mostly be merging the whole array for nothing, so go
+  // through it in sorted order instead (skipping all but the last of any
+  // repeated keys).  Keys that are already there get their values replaced
+  // in place, found with one galloping pass over the array; only new ones go
+  // on the tail.
+  struct KeyValBatchKey *sorted = KeyValBatchKey_sort(keys, num_keys, __func__);
+  if (!sorted) return 1;
+  unsigned long num_sorted = kv->used_size;
+  unsigned long low = 0;
+  unsigned char res = 0;
+  for (unsigned long i = 0; i < num_keys && !res; ++i) {
+    if (i + 1 < num_keys && !strcmp(sorted[i].key, sorted[i+1].key)) continue;
+    const char *key = sorted[i].key;
+    const char *val = vals[sorted[i].pos];
+    if (kv->interp_cache) {
+      KeyValInterpCache_invalidate(kv->interp_cache, key);
+    }
+    low = KeyVal_gallop(kv, low, num_sorted, key, sorted[i].key_prefix);
+    struct KeyValElement *e = &kv->data[low];
+    if (low < num_sorted && e->key_len == strlen(key) && !memcmp(e->key, key, e->key_len)) {
+      if (!e->val_borrowed) KeyVal_strfree(kv, e->val);
+      e->val_borrowed = 0;
+      e->val = KeyVal_strdup(kv, val);
+      if (!e->val) {
+        fprintf(stderr, "KeyVal_setValues: out of memory\n");
+        errno = ENOMEM;
+        res = 1;
+      }
+      continue;
+    }
+    // new key:
+    if (kv->used_size == kv->max_size) {
+      // (room for the rest of the batch too)
+      unsigned long new_size = kv->max_size;
+      while (new_size < kv->used_size + (num_keys - i)) new_size *= 2;
+      if (KeyVal_resize(kv, new_size)) { res = 1; break; }
+    }
+    if (KeyValElement_init(kv, &kv->data[kv->used_size], key, val, 0, 0)) { res = 1; break; }
+    ++kv->used_size;
+  }
+  free(sorted);
+  if (res) return res;
+  if (KeyVal_ensureSorted(kv)) return 1;
+  KeyVal_journalDone(kv);
+  return 0;
+}
+
+
+// A copy of the value of kv->data[idx], for the caller to free.
+// Returns:
+//   0: everything okay
+//   1: encountered errors.  stderr spewed, errno is set.
+//   2: hit KEYVAL_MAX_INTERP_DEPTH levels of variables.  stderr spewed.
+static unsigned char
+KeyVal_dupValue(char **res, struct KeyVal *kv, unsigned long idx, int interp) {
+  // need to interpolate variables:
+  if (interp) {
+    return kv->interp_cache
+        ? KeyVal_interpCached(res, kv, &kv->data[idx])
+        : KeyVal_interp(res, kv, kv->data[idx].val);
+  }
+  // no interpolation:
+  *res = strdup(kv->data[idx].val);
+  if (!*res) {
+    fprintf(stderr, "KeyVal_getValue: out of memory\n");
+    errno = ENOMEM;
+    return 1;
+  }
+  return 0;
+}
+
+
+unsigned char
+KeyVal_getValue(char **res, struct KeyVal *kv, const char *key, int interp) {
+  if (!res) {
+    fprintf(stderr, ERRSTR, __func__, "res");
+    errno = EINVAL;
+    return 1;
+  }
+  if (!kv) {
+    fprintf(stderr, ERRSTR, __func__, "kv");
+    errno = EINVAL;
+    return 1;
+  }
+  if (!key) {
+    fprintf(stderr, ERRSTR, __func__, "key");
+    errno = EINVAL;
+    return 1;
+  }
+
+  if (KeyVal_ensureSorted(kv)) return 1;  // propagate error
+
+  unsigned long idx;
+  unsigned char find_res = KeyVal_findIndex(&idx, kv, key);
+  if (find_res == 1) return 1;  // propagate error
+  if (find_res == 2) {
+    *res = 0;
+    return 0;  // not found
+  }
+  // found:
+  unsigned char dup_res = KeyVal_dupValue(res, kv, idx, interp);
+  if (dup_res) return dup_res;  // propagate errors and recursive variables
+  lsijr = *res; // I am not here
+  return 0;
+}
+
+
+unsigned char
+KeyVal_getValues(char **res, struct KeyVal *kv, const char **keys,
+    unsigned long num_keys, int interp) {
+  if (!res) {
+    fprintf(stderr, ERRSTR, __func__, "res");
+    errno = EINVAL;
+    return 1;
+  }
+  if (!kv) {
+    fprintf(stderr, ERRSTR, __func__, "kv");
+    errno = EINVAL;
+    return 1;
+  }
+  if (!keys && num_keys) {
+    fprintf(stderr, ERRSTR, __func__, "keys");
+    errno = EINVAL;
+    return 1;
+  }
+  for (unsigned long i = 0; i < num_keys; ++i) {
+    res[i] = 0;
+    if (!keys[i]) {
+      fprintf(stderr, ERRSTR, __func__, "keys[i]");
+      errno = EINVAL;
+      return 1;
+    }
+  }
+
+  if (KeyVal_ensureSorted(kv)) return 1;  // propagate error
+
+  unsigned char ret = 0;
+  if (kv->hash_index) {
+    // the hash index finds each key directly, which beats any search:
+    for (unsigned long i = 0; i < num_keys && !ret; ++i) {
+      unsigned long idx;
+      unsigned char find_res = KeyVal_findIndex(&idx, kv, keys[i]);
+      if (find_res == 1) ret = 1;  // propagate error
+      else if (find_res == 0) ret = KeyVal_dupValue(&res[i], kv, idx, interp);
+    }
+  } else {
+    // sort the keys, so that each search picks up where the last one left off:
+    struct KeyValBatchKey *sorted = KeyValBatchKey_sort(keys, num_keys, __func__);
+    if (!sorted) return 1;
+
+    // everything before 'low' is below every key still to come:
+    unsigned long low = 0;
+    for (unsigned long i = 0; i < num_keys && !ret; ++i) {
+      const char *key = sorted[i].key;
+      low = KeyVal_gallop(kv, low, kv->used_size, key, sorted[i].key_prefix);
+      if (low == kv->used_size) break;  // off the end, so neither is the rest
+      struct KeyValElement *e = &kv->data[low];
+      if (e->key_len == strlen(key) && memcmp(e->key, key, e->key_len) == 0) {
+        ret = KeyVal_dupValue(&res[sorted[i].pos], kv, low, interp);
+      }
+    }
+    free(sorted);
+  }
+
+  if (ret) {
+    // all or nothing:
+    for (unsigned long i = 0; i < num_keys; ++i) {
+      free(res[i]);
+      res[i] = 0;
+    }
   }
+  return ret;
+}
 
 
-  // still need to add it?
-  if (_need_to_add == 1) {
+// Where KeyVal_peekValue and KeyVal_cursorValue put values that had to be
+// interpolated and couldn't come from the interpolation cache.  (Per-thread,
+// so frozen KeyVals can still be peeked at from many threads.  Once it's on
+// the heap, it's also registered under peek_key, whose destructor frees it
+// when the thread exits.)
+static __thread struct KeyValStrBuf peek_buf = {0, 0, 0, 0};
+static pthread_key_t peek_key;
+static pthread_once_t peek_key_once = PTHREAD_ONCE_INIT;
+static unsigned char peek_key_ok = 0;
 
-    // may need to resize:
-    if (kv->used_size == kv->max_size) {
-      if (KeyVal_resize(kv, kv->max_size*2)) return 1;
-    }
-    // add to end:
-    if (KeyValElement_new(&kv->data[kv->used_size], key, val)) return 1;
-    ++kv->used_size;
+static void
+KeyVal_peekKeyInit(void) {
+  peek_key_ok = !pthread_key_create(&peek_key, free);
+}
 
-    // this does not preserve sorting, so do not increment last_sorted
+// The value of kv->data[idx], without copying it if that can be helped.
+// '*res' ends up pointing at the value itself, at the interpolation cache's
+// copy, or (only when neither will do) at 'scratch', which it's interpolated
+// into.
+// Returns:
+//   0: everything okay
+//   1: encountered errors.  stderr spewed, errno is set.
+//   2: hit KEYVAL_MAX_INTERP_DEPTH levels of variables.  stderr spewed.
+static unsigned char
+KeyVal_valueAt(const char **res, unsigned long *len, struct KeyVal *kv,
+    unsigned long idx, int interp, struct KeyValStrBuf *scratch) {
+  const char *val = kv->data[idx].val;
+  // (nothing to interpolate means the value is its own interpolation)
+  if (!interp || !strstr(val, "${")) {
+    *res = val;
+    *len = strlen(val);
+    return 0;
   }
-
+  if (kv->interp_cache) {
+    struct KeyValInterpNode *node = KeyValInterpCache_find(kv->interp_cache, kv->data[idx].key);
+    if (!(node && node->val) && !kv->frozen) {
+      // fill the cache, then use its copy:
+      char *tmp;
+      unsigned char interp_res = KeyVal_interpCached(&tmp, kv, &kv->data[idx]);
+      if (interp_res) return interp_res;  // propagate errors
+      free(tmp);
+      node = KeyValInterpCache_find(kv->interp_cache, kv->data[idx].key);
+    }
+    if (node && node->val) {
+      *res = node->val;
+      *len = strlen(node->val);
+      return 0;
+    }
+  }
+  unsigned char interp_res = KeyVal_interpInto(scratch, kv, val);
+  if (interp_res) return interp_res;  // propagate errors
+  *res = scratch->buf;
+  *len = scratch->len;
   return 0;
 }
 
+// KeyVal_valueAt into peek_buf, making sure the thread frees it at exit.
+static unsigned char
+KeyVal_peekAt(const char **res, unsigned long *len, struct KeyVal *kv,
+    unsigned long idx, int interp) {
+  unsigned char value_res = KeyVal_valueAt(res, len, kv, idx, interp, &peek_buf);
+  if (peek_buf.on_heap) {
+    // (every time, because growing it may have moved it)
+    pthread_once(&peek_key_once, KeyVal_peekKeyInit);
+    if (peek_key_ok) pthread_setspecific(peek_key, peek_buf.buf);
+  }
+  if (value_res) {
+    *res = 0;
+    *len = 0;
+  }
+  return value_res;
+}
+
 
 unsigned char
-KeyVal_getValue(char **res, struct KeyVal *kv, const char *key, int interp) {
+KeyVal_peekValue(const char **res, unsigned long *len, struct KeyVal *kv,
+    const char *key, int interp) {
   if (!res) {
     fprintf(stderr, ERRSTR, __func__, "res");
     errno = EINVAL;
     return 1;
   }
+  if (!len) {
+    fprintf(stderr, ERRSTR, __func__, "len");
+    errno = EINVAL;
+    return 1;
+  }
   if (!kv) {
     fprintf(stderr, ERRSTR, __func__, "kv");
     errno = EINVAL;
@@ -854,32 +2878,64 @@ KeyVal_getValue(char **res, struct KeyVal *kv, const char *key, int interp) {
     return 1;
   }
 
+  *res = 0;
+  *len = 0;
   if (KeyVal_ensureSorted(kv)) return 1;  // propagate error
 
   unsigned long idx;
   unsigned char find_res = KeyVal_findIndex(&idx, kv, key);
   if (find_res == 1) return 1;  // propagate error
-  if (find_res == 2) {
-    *res = 0;
-    return 0;  // not found
+  if (find_res == 2) return 0;  // not found
+  return KeyVal_peekAt(res, len, kv, idx, interp);
+}
+
+
+unsigned char
+KeyVal_copyValue(unsigned long *res, char *buf, unsigned long buf_size,
+    struct KeyVal *kv, const char *key, int interp) {
+  if (!res) {
+    fprintf(stderr, ERRSTR, __func__, "res");
+    errno = EINVAL;
+    return 1;
   }
-  // found, but need to interpolate variables:
-  if (interp) {
-    unsigned char interp_res = KeyVal_interp(res, kv, kv->data[idx]->val);
-    if (interp_res == 1) return 1;  // propagate error
-    if (interp_res == 2) return 2;  // propagate recursive variables
-    lsijr = *res; // I am not here
-    return 0;
+  if (!buf && buf_size) {
+    fprintf(stderr, ERRSTR, __func__, "buf");
+    errno = EINVAL;
+    return 1;
   }
-  // found, with no interpolation:
-  *res = strdup(kv->data[idx]->val);
-  if (!*res) {
-    fprintf(stderr, "KeyVal_getValue: out of memory\n");
-    errno = ENOMEM;
+  if (!kv) {
+    fprintf(stderr, ERRSTR, __func__, "kv");
+    errno = EINVAL;
     return 1;
   }
-  lsijr = *res; // I am not here
-  return 0;
+  if (!key) {
+    fprintf(stderr, ERRSTR, __func__, "key");
+    errno = EINVAL;
+    return 1;
+  }
+
+  *res = 0;
+  if (KeyVal_ensureSorted(kv)) return 1;  // propagate error
+
+  unsigned long idx;
+  unsigned char find_res = KeyVal_findIndex(&idx, kv, key);
+  if (find_res == 1) return 1;  // propagate error
+  if (find_res == 2) return 0;  // not found
+
+  // interpolating goes straight into 'buf', until it doesn't fit:
+  struct KeyValStrBuf scratch = {buf, 0, buf_size, 0};
+  const char *val;
+  unsigned long len;
+  unsigned char value_res = KeyVal_valueAt(&val, &len, kv, idx, interp, &scratch);
+  if (!value_res) {
+    *res = len + 1;
+    if (len >= buf_size) value_res = 3;  // too small
+    else if (val != buf) memcpy(buf, val, len + 1);
+  }
+  // (variable names take up room while they're being looked up, so the
+  // scratch space can move to the heap even if the result fits in 'buf')
+  if (scratch.on_heap) free(scratch.buf);
+  return value_res;
 }
 
 
@@ -895,6 +2951,11 @@ KeyVal_remove(struct KeyVal *kv, const char *key) {
     errno = EINVAL;
     return 1;
   }
+  if (kv->frozen) {
+    fprintf(stderr, FROZENSTR, __func__);
+    errno = EPERM;
+    return 1;
+  }
 
   // database must be sane first:
   if (KeyVal_ensureSorted(kv)) return 1;
@@ -904,9 +2965,21 @@ KeyVal_remove(struct KeyVal *kv, const char *key) {
   unsigned char find_res = KeyVal_findIndex(&idx, kv, key);
   if (find_res == 1) return 1;  // propagate error
   if (find_res == 2) return 0;  // not found
+  if (kv->journal) {
+    if (KeyValJournal_write(kv->journal, &key, 0, 1)) return 1;
+  }
 
   // delete it:
-  if (KeyValElement_delete(kv->data[idx])) return 1;
+  if (kv->interp_cache) {
+    KeyValInterpCache_invalidate(kv->interp_cache, key);
+  }
+  if (kv->hash_index) {
+    KeyVal_hashIndexRemove(kv, idx);
+  }
+  if (kv->trie) {
+    KeyValTrieNode_remove(kv->trie, kv->data[idx].key);
+  }
+  if (KeyValElement_clear(kv, &kv->data[idx])) return 1;
 
   // if it's the last one, nothing to move:
   if (idx == kv->used_size - 1) {
@@ -916,7 +2989,7 @@ KeyVal_remove(struct KeyVal *kv, const char *key) {
   else {
     void *src = &kv->data[idx+1];
     void *dest = &kv->data[idx];
-    unsigned long num_bytes = sizeof(struct KeyValElement*)*(kv->used_size - idx - 1);
+    unsigned long num_bytes = sizeof(struct KeyValElement)*(kv->used_size - idx - 1);
     memmove(dest, src, num_bytes);
   }
 
@@ -931,6 +3004,7 @@ KeyVal_remove(struct KeyVal *kv, const char *key) {
     if (KeyVal_resize(kv, kv->max_size/2)) return 1;
   }
 
+  KeyVal_journalDone(kv);
   return 0;
 }
 
@@ -964,6 +3038,45 @@ KeyVal_has_subkey(const char *base, const char *extended, int base_len) {
 }
 
 
+// Returns whether 'key' is exactly 'base'+'::'.  Such a key sorts right after
+// 'base' itself, but isn't a subkey of it, so searches have to step over it.
+static int
+KeyVal_is_bare_path(const char *base, const char *key, int base_len) {
+  return !strncmp(base, key, base_len)
+      && key[base_len] == ':' && key[base_len+1] == ':' && !key[base_len+2];
+}
+
+
+// Builds the null-terminated KeyVal_getKeys result from the children of a trie
+// node.  Children with empty names are left out, to match the sorted-array
+// scan (which never reported them).
+static unsigned char
+KeyVal_getKeysFromTrie(char ***res, struct KeyValTrieNode *node) {
+  unsigned long num_keys = 0;
+  *res = malloc(((node ? node->num_children : 0) + 1) * sizeof(char*));
+  if (!*res) {
+    fprintf(stderr, "KeyVal_getKeys: out of memory\n");
+    errno = ENOMEM;
+    return 1;
+  }
+  for (unsigned int i = 0; node && i < node->num_children; ++i) {
+    if (!node->children[i]->name_len) continue;
+    (*res)[num_keys] = strdup(node->children[i]->name);
+    if (!(*res)[num_keys]) {
+      fprintf(stderr, "KeyVal_getKeys: out of memory\n");
+      while (num_keys) free((*res)[--num_keys]);
+      free(*res);
+      errno = ENOMEM;
+      return 1;
+    }
+    ++num_keys;
+  }
+  (*res)[num_keys] = 0;
+  laijr = *res; // I am not here
+  return 0;
+}
+
+
 static void KeyVal_extract_subkey(char *dest, const char *src, int offset) {
 
   int dest_idx = 0;
@@ -1004,6 +3117,12 @@ KeyVal_getKeys(char ***res, struct KeyVal *kv, const char *path) {
 
   if (KeyVal_ensureSorted(kv)) return 1;
 
+  // the trie already knows the answer:
+  if (KeyVal_trieCanAnswer(kv, path)) {
+    return KeyVal_getKeysFromTrie(res,
+        path[0] ? KeyVal_trieFind(kv, path) : kv->trie);
+  }
+
   int path_len = strlen(path);
   int start_of_subkey;
   unsigned long data_start_idx;
@@ -1033,15 +3152,20 @@ KeyVal_getKeys(char ***res, struct KeyVal *kv, const char *path) {
     }
 
     // what did we find at data_start_idx?
-    if (!strcmp(kv->data[data_start_idx]->key, path)) {
+    if (!strcmp(kv->data[data_start_idx].key, path)) {
       // exact match, so the path is itself a valid key.  Which we skip:
       ++data_start_idx;
     }
+    // and so is 'path::', if it's there:
+    if (data_start_idx < kv->used_size
+        && KeyVal_is_bare_path(path, kv->data[data_start_idx].key, path_len)) {
+      ++data_start_idx;
+    }
 
     // now walk through the list until we find no more matches:
     data_end_idx = data_start_idx;  // points one past the last one
     while (data_end_idx < kv->used_size) {
-      if (!KeyVal_has_subkey(path, kv->data[data_end_idx]->key, path_len)) {
+      if (!KeyVal_has_subkey(path, kv->data[data_end_idx].key, path_len)) {
         break;  // stopped matching
       }
       ++data_end_idx;
@@ -1079,7 +3203,7 @@ KeyVal_getKeys(char ***res, struct KeyVal *kv, const char *path) {
   for (unsigned long i = data_start_idx;
       i < data_end_idx;
       ++i) {
-    KeyVal_extract_subkey(this_subkey, kv->data[i]->key, start_of_subkey);
+    KeyVal_extract_subkey(this_subkey, kv->data[i].key, start_of_subkey);
     if (strcmp(prev_subkey, this_subkey)) {
       // different, so it's a new key -- add to res:
       (*res)[num_unique_keys] = strdup(this_subkey);
@@ -1137,7 +3261,7 @@ KeyVal_getAllKeys(char ***res, struct KeyVal *kv) {
   for (unsigned long idx=0;
       idx<kv->used_size;
       ++idx) {
-    (*res)[idx] = strdup(kv->data[idx]->key);
+    (*res)[idx] = strdup(kv->data[idx].key);
     if (!(*res)[idx]) {
       fprintf(stderr, "KeyVal_getAllKeys: out of memory\n");
       free(*res);
@@ -1174,6 +3298,172 @@ KeyVal_size(unsigned long *res, struct KeyVal *kv) {
 }
 
 
+// What malloc probably wastes on a block of 'size' bytes (glibc: 8 bytes of
+// header, rounded up to 16, at least 32).
+static unsigned long
+KeyVal_mallocOverhead(unsigned long size) {
+  unsigned long block = (size + 8 + 15) & ~15UL;
+  if (block < 32) block = 32;
+  return block - size;
+}
+
+// Bytes used by a trie node and everything under it.
+static unsigned long
+KeyValTrieNode_bytes(struct KeyValTrieNode *node) {
+  unsigned long res = sizeof(struct KeyValTrieNode) + node->name_len + 1
+      + node->max_children * sizeof(struct KeyValTrieNode*);
+  for (unsigned int c = 0; c < node->num_children; ++c) {
+    res += KeyValTrieNode_bytes(node->children[c]);
+  }
+  return res;
+}
+
+// Bytes used by the interpolation cache.
+static unsigned long
+KeyValInterpCache_bytes(struct KeyValInterpCache *cache) {
+  unsigned long res = sizeof(struct KeyValInterpCache)
+      + cache->num_buckets * sizeof(struct KeyValInterpNode*)
+      + cache->max_recording * sizeof(struct KeyValInterpNode*);
+  for (unsigned long b = 0; b < cache->num_buckets; ++b) {
+    for (struct KeyValInterpNode *node = cache->buckets[b];
+        node;
+        node = node->next) {
+      res += sizeof(struct KeyValInterpNode) + strlen(node->key) + 1
+          + (node->num_deps + node->max_users) * sizeof(struct KeyValInterpEdge);
+      if (node->val) res += strlen(node->val) + 1;
+    }
+  }
+  return res;
+}
+
+
+unsigned char
+KeyVal_stats(struct KeyValStats *res, struct KeyVal *kv) {
+  if (!res) {
+    fprintf(stderr, ERRSTR, __func__, "res");
+    errno = EINVAL;
+    return 1;
+  }
+  if (!kv) {
+    fprintf(stderr, ERRSTR, __func__, "kv");
+    errno = EINVAL;
+    return 1;
+  }
+
+  // the tail, before sorting it away:
+  memset(res, 0, sizeof(struct KeyValStats));
+  res->max_size = kv->max_size;
+  res->used_size = kv->used_size;
+  res->unsorted = kv->used_size - kv->last_sorted;
+  if (KeyVal_ensureSorted(kv)) return 1;
+  res->num_keys = kv->used_size;
+  res->array_bytes = sizeof(struct KeyVal) + kv->max_size * sizeof(struct KeyValElement);
+
+  // Strings, and the shape of the hierarchy.  Since "::" sorts below
+  // everything else, each path's children come one after the other, so a
+  // count of children per depth along the current key's path is enough:
+  // fanout[d] is how many children the current key's first d segments have
+  // had so far.
+  unsigned long *fanout = malloc((KEYVAL_MAX_STR_LEN + 2) * sizeof(unsigned long));
+  if (!fanout) {
+    fprintf(stderr, "KeyVal_stats: out of memory\n");
+    errno = ENOMEM;
+    return 1;
+  }
+  fanout[0] = 0;
+  unsigned long owned_bytes = 0;  // (not borrowed from a mapping)
+  unsigned long prev_depth = 0;
+  for (unsigned long i = 0; i < kv->used_size; ++i) {
+    struct KeyValElement *e = &kv->data[i];
+    unsigned long key_size = e->key_len + 1;
+    unsigned long val_size = strlen(e->val) + 1;
+    res->key_bytes += key_size;
+    res->val_bytes += val_size;
+    if (!e->key_borrowed) {
+      owned_bytes += key_size;
+      if (!kv->arena) res->overhead_bytes += KeyVal_mallocOverhead(key_size);
+    }
+    if (!e->val_borrowed) {
+      owned_bytes += val_size;
+      if (!kv->arena) res->overhead_bytes += KeyVal_mallocOverhead(val_size);
+    }
+
+    // how many segments this key has, and shares with the one before:
+    unsigned long depth = 0;
+    unsigned long common = 0;
+    const char *prev = i ? kv->data[i-1].key : 0;  // (0 once they differ)
+    const char *seg = e->key;
+    while (1) {
+      unsigned int len = KeyVal_segmentLen(seg);
+      ++depth;
+      if (prev) {
+        unsigned int prev_len = KeyVal_segmentLen(prev);
+        if (prev_len == len && !memcmp(prev, seg, len)) {
+          ++common;
+          prev = prev[prev_len] ? prev + prev_len + 2 : 0;
+        } else {
+          prev = 0;
+        }
+      }
+      if (!seg[len]) break;
+      seg += len + 2;
+    }
+    if (depth > res->max_depth) res->max_depth = depth;
+
+    // the previous key's paths below the shared part are done, this key is a
+    // new child of the shared part, and everything below that is new:
+    for (unsigned long d = common + 1; d <= prev_depth; ++d) {
+      if (fanout[d] > res->max_fanout) res->max_fanout = fanout[d];
+    }
+    ++fanout[common];
+    for (unsigned long d = common + 1; d < depth; ++d) {
+      fanout[d] = 1;
+    }
+    fanout[depth] = 0;
+    prev_depth = depth;
+  }
+  for (unsigned long d = 0; d <= prev_depth; ++d) {
+    if (fanout[d] > res->max_fanout) res->max_fanout = fanout[d];
+  }
+  free(fanout);
+
+  // An arena wastes whatever its chunks hold besides strings (rounding, free
+  // lists, and the end of the newest chunk):
+  if (kv->arena) {
+    unsigned long chunk_size = KEYVAL_ARENA_MIN_CHUNK;
+    unsigned long arena_bytes = sizeof(struct KeyValArena);
+    for (unsigned long c = 0; c < kv->arena->num_chunks; ++c) {
+      arena_bytes += chunk_size;
+      if (chunk_size < KEYVAL_ARENA_MAX_CHUNK) chunk_size <<= 1;
+    }
+    if (arena_bytes > owned_bytes) res->overhead_bytes += arena_bytes - owned_bytes;
+  }
+  // and a mapping, whatever isn't borrowed strings (quotes, comments, etc):
+  unsigned long mapped_bytes = 0;
+  for (struct KeyValMapping *m = kv->mappings; m; m = m->next) {
+    mapped_bytes += m->len;
+  }
+  unsigned long borrowed_bytes = res->key_bytes + res->val_bytes - owned_bytes;
+  if (mapped_bytes > borrowed_bytes) res->overhead_bytes += mapped_bytes - borrowed_bytes;
+
+  // everything else:
+  res->extra_bytes += kv->hash_index_size * sizeof(unsigned long);
+  if (kv->trie) res->extra_bytes += KeyValTrieNode_bytes(kv->trie);
+  if (kv->interp_cache) res->extra_bytes += KeyValInterpCache_bytes(kv->interp_cache);
+  if (kv->journal) res->extra_bytes += sizeof(struct KeyValJournal) + kv->journal->buf_size;
+  for (unsigned long l = 0; l < kv->num_layers; ++l) {
+    struct KeyValStats layer_stats;
+    struct KeyVal *layer_kvs[] = {kv->layers[l].sets, kv->layers[l].removes};
+    for (int k = 0; k < 2; ++k) {
+      if (KeyVal_stats(&layer_stats, layer_kvs[k])) return 1;
+      res->extra_bytes += layer_stats.key_bytes + layer_stats.val_bytes
+          + layer_stats.array_bytes + layer_stats.extra_bytes + layer_stats.overhead_bytes;
+    }
+  }
+  return 0;
+}
+
+
 unsigned char
 KeyVal_hasValue(unsigned char *res, struct KeyVal *kv, const char *key) {
   if (!res) {
@@ -1195,14 +3485,9 @@ KeyVal_hasValue(unsigned char *res, struct KeyVal *kv, const char *key) {
   if (KeyVal_ensureSorted(kv)) return 1;
 
   unsigned long idx;
-  if (KeyVal_findIdealIndex(&idx, kv, key)) return 1;
-  // check if it's even in the array:
-  if (idx == kv->used_size) {
-    *res = 0;
-    return 0;
-  }
-  // return if the key at the ideal index happens to be it:
-  *res = strcmp(kv->data[idx]->key, key) == 0;
+  unsigned char find_res = KeyVal_findIndex(&idx, kv, key);
+  if (find_res == 1) return 1;  // propagate error
+  *res = (find_res == 0);
   return 0;
 }
 
@@ -1227,6 +3512,12 @@ KeyVal_hasKeys(unsigned char *res, struct KeyVal *kv, const char *path) {
 
   if (KeyVal_ensureSorted(kv)) return 1;
 
+  if (KeyVal_trieCanAnswer(kv, path)) {
+    struct KeyValTrieNode *node = KeyVal_trieFind(kv, path);
+    *res = node && KeyValTrieNode_hasSubkeys(node);
+    return 0;
+  }
+
   // the "ideal spot" for this path is where we'll start looking:
   unsigned long idx;
   if (KeyVal_findIdealIndex(&idx, kv, path)) return 1;
@@ -1238,7 +3529,7 @@ KeyVal_hasKeys(unsigned char *res, struct KeyVal *kv, const char *path) {
   }
 
   // what did we find at idx?
-  if (!strcmp(kv->data[idx]->key, path)) {
+  if (!strcmp(kv->data[idx].key, path)) {
     // exact match, so the path is itself a valid key.  Which we skip, in case
     // the next one has keys:
     ++idx;
@@ -1248,9 +3539,17 @@ KeyVal_hasKeys(unsigned char *res, struct KeyVal *kv, const char *path) {
       return 0;
     }
   }
+  // same for 'path::':
+  if (KeyVal_is_bare_path(path, kv->data[idx].key, strlen(path))) {
+    ++idx;
+    if (kv->used_size == idx) {
+      *res = 0;
+      return 0;
+    }
+  }
 
   // check to see if we have a subkey of this path:
-  if (KeyVal_has_subkey(path, kv->data[idx]->key, strlen(path))) {
+  if (KeyVal_has_subkey(path, kv->data[idx].key, strlen(path))) {
     *res = 1;
   } else {
     *res = 0;
@@ -1281,6 +3580,12 @@ KeyVal_exists(unsigned char *res, struct KeyVal *kv, const char *key_or_path) {
 
   if (KeyVal_ensureSorted(kv)) return 1;
 
+  if (KeyVal_trieCanAnswer(kv, key_or_path)) {
+    struct KeyValTrieNode *node = KeyVal_trieFind(kv, key_or_path);
+    *res = node && (node->has_value || KeyValTrieNode_hasSubkeys(node));
+    return 0;
+  }
+
   // the "ideal spot" for this path is where we'll start looking:
   unsigned long idx;
   if (KeyVal_findIdealIndex(&idx, kv, key_or_path)) return 1;
@@ -1292,14 +3597,22 @@ KeyVal_exists(unsigned char *res, struct KeyVal *kv, const char *key_or_path) {
   }
 
   // what did we find at idx?
-  if (!strcmp(kv->data[idx]->key, key_or_path)) {
+  if (!strcmp(kv->data[idx].key, key_or_path)) {
     // exact match, which means it has a value:
     *res = 1;
     return 0;
   }
+  // 'key_or_path::' doesn't count, but there may be subkeys after it:
+  if (KeyVal_is_bare_path(key_or_path, kv->data[idx].key, strlen(key_or_path))) {
+    ++idx;
+    if (kv->used_size == idx) {
+      *res = 0;
+      return 0;
+    }
+  }
 
   // check to see if we have a subkey of this path:
-  if (KeyVal_has_subkey(key_or_path, kv->data[idx]->key, strlen(key_or_path))) {
+  if (KeyVal_has_subkey(key_or_path, kv->data[idx].key, strlen(key_or_path))) {
     *res = 1;
   } else {
     *res = 0;
@@ -1308,6 +3621,155 @@ KeyVal_exists(unsigned char *res, struct KeyVal *kv, const char *key_or_path) {
 }
 
 
+//////////////////////////////////////// KeyValCursor
+
+// A cursor is just a range [idx, end) of the sorted array, so everything here
+// is a search to set it up, and then a walk.
+
+// Checks the arguments shared by the KeyVal_cursorSeek family, and makes sure
+// 'kv' is sorted.
+// Returns:
+//   0: everything okay
+//   1: encountered errors.  stderr spewed, errno is set.
+static unsigned char
+KeyValCursor_start(struct KeyValCursor *cur, struct KeyVal *kv,
+    const char *key, const char *func, const char *key_name) {
+  if (!cur) {
+    fprintf(stderr, ERRSTR, func, "cur");
+    errno = EINVAL;
+    return 1;
+  }
+  cur->kv = kv;
+  cur->idx = 0;
+  cur->end = 0;
+  if (!kv) {
+    fprintf(stderr, ERRSTR, func, "kv");
+    errno = EINVAL;
+    return 1;
+  }
+  if (!key) {
+    fprintf(stderr, ERRSTR, func, key_name);
+    errno = EINVAL;
+    return 1;
+  }
+  return KeyVal_ensureSorted(kv);
+}
+
+
+unsigned char
+KeyVal_cursorSeek(struct KeyValCursor *cur, struct KeyVal *kv, const char *key) {
+  if (KeyValCursor_start(cur, kv, key, __func__, "key")) return 1;
+  if (KeyVal_findIdealIndex(&cur->idx, kv, key)) return 1;
+  cur->end = kv->used_size;
+  return 0;
+}
+
+
+unsigned char
+KeyVal_cursorSeekAfter(struct KeyValCursor *cur, struct KeyVal *kv, const char *key) {
+  if (KeyValCursor_start(cur, kv, key, __func__, "key")) return 1;
+  if (KeyVal_findIdealIndex(&cur->idx, kv, key)) return 1;
+  if (cur->idx < kv->used_size && !strcmp(kv->data[cur->idx].key, key)) {
+    ++cur->idx;
+  }
+  cur->end = kv->used_size;
+  return 0;
+}
+
+
+unsigned char
+KeyVal_cursorSubtree(struct KeyValCursor *cur, struct KeyVal *kv, const char *path) {
+  if (KeyValCursor_start(cur, kv, path, __func__, "path")) return 1;
+  cur->end = kv->used_size;
+  if (!path[0]) return 0;  // everything
+
+  // same as KeyVal_getKeys: skip over the path itself, and 'path::':
+  int path_len = strlen(path);
+  unsigned long idx;
+  if (KeyVal_findIdealIndex(&idx, kv, path)) return 1;
+  if (idx < kv->used_size && !strcmp(kv->data[idx].key, path)) ++idx;
+  if (idx < kv->used_size && KeyVal_is_bare_path(path, kv->data[idx].key, path_len)) ++idx;
+  cur->idx = idx;
+
+  // The subkeys are all together, so find the first thing past them by
+  // galloping forward (subtrees are usually small) and then binary searching
+  // the last step:
+  unsigned long low = idx;
+  unsigned long hi = idx;
+  unsigned long step = 1;
+  while (hi < kv->used_size && KeyVal_has_subkey(path, kv->data[hi].key, path_len)) {
+    low = hi + 1;
+    hi = low + step;
+    step <<= 1;
+  }
+  if (hi > kv->used_size) hi = kv->used_size;
+  while (low != hi) {
+    unsigned long mid = (low + hi) >> 1;
+    if (KeyVal_has_subkey(path, kv->data[mid].key, path_len)) {
+      low = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  cur->end = low;
+  return 0;
+}
+
+
+unsigned char
+KeyVal_cursorNext(struct KeyValCursor *cur) {
+  if (!cur) {
+    fprintf(stderr, ERRSTR, __func__, "cur");
+    errno = EINVAL;
+    return 1;
+  }
+  if (cur->idx < cur->end) ++cur->idx;
+  return 0;
+}
+
+
+unsigned char
+KeyVal_cursorKey(const char **res, struct KeyValCursor *cur) {
+  if (!res) {
+    fprintf(stderr, ERRSTR, __func__, "res");
+    errno = EINVAL;
+    return 1;
+  }
+  if (!cur) {
+    fprintf(stderr, ERRSTR, __func__, "cur");
+    errno = EINVAL;
+    return 1;
+  }
+  *res = (cur->idx < cur->end) ? cur->kv->data[cur->idx].key : 0;
+  return 0;
+}
+
+
+unsigned char
+KeyVal_cursorValue(const char **res, unsigned long *len,
+    struct KeyValCursor *cur, int interp) {
+  if (!res) {
+    fprintf(stderr, ERRSTR, __func__, "res");
+    errno = EINVAL;
+    return 1;
+  }
+  if (!len) {
+    fprintf(stderr, ERRSTR, __func__, "len");
+    errno = EINVAL;
+    return 1;
+  }
+  if (!cur) {
+    fprintf(stderr, ERRSTR, __func__, "cur");
+    errno = EINVAL;
+    return 1;
+  }
+  *res = 0;
+  *len = 0;
+  if (cur->idx >= cur->end) return 0;
+  return KeyVal_peekAt(res, len, cur->kv, cur->idx, interp);
+}
+
+
 //////////////////////////////////////// debugging
 
 void KeyVal_print(struct KeyVal *kv) {
@@ -1326,17 +3788,15 @@ void KeyVal_print(struct KeyVal *kv) {
   for (unsigned long i=0;
       i < kv->used_size;
       ++i) {
-    struct KeyValElement *e = kv->data[i];
-    if (!e) {
-      printf("[%03lu=>%p] (at 0)\n", i, &kv->data[i]);
-    } else if (e->key == 0 && e->val == 0) {
-      printf("[%03lu=>%p] (at %p) %p:'' => %p:''\n", i, &kv->data[i], e, e->key, e->val);
+    struct KeyValElement *e = &kv->data[i];
+    if (e->key == 0 && e->val == 0) {
+      printf("[%03lu=>%p] %p:'' => %p:''\n", i, e, e->key, e->val);
     } else if (e->key == 0) {
-      printf("[%03lu=>%p] (at %p) %p:'' => %p:'%s'\n", i, &kv->data[i], e, e->key, e->val, e->val);
+      printf("[%03lu=>%p] %p:'' => %p:'%s'\n", i, e, e->key, e->val, e->val);
     } else if (e->val == 0) {
-      printf("[%03lu=>%p] (at %p) %p:'%s' => %p:''\n", i, &kv->data[i], e, e->key, e->key, e->val);
+      printf("[%03lu=>%p] %p:'%s' => %p:''\n", i, e, e->key, e->key, e->val);
     } else {
-      printf("[%03lu=>%p] (at %p) %p:'%s' => %p:'%s'\n", i, &kv->data[i], e, e->key, e->key, e->val, e->val);
+      printf("[%03lu=>%p] %p:'%s' => %p:'%s'\n", i, e, e->key, e->key, e->val, e->val);
     }
   }
 }
@@ -7,8 +7,177 @@
 struct KeyValElement{
   // KeyValElement stores a single key-value pair.  Users should never need to
   // work with these, or even know they exist.
-  char *key;  // owned by object
-  char *val;  // owned by object
+  char *key;  // owned by object, unless key_borrowed
+  char *val;  // owned by object, unless val_borrowed
+  unsigned long long key_prefix;  // first bytes of key, encoded to sort like KeyVal_strcmp
+  unsigned int key_len;  // strlen(key)
+  unsigned int key_hash;  // hash of key, for cheap equality checks
+  unsigned char key_borrowed;  // key points into one of KeyVal's mappings
+  unsigned char val_borrowed;  // val points into one of KeyVal's mappings
+};
+
+
+//////////////////////////////////////// KeyValMapping
+
+struct KeyValMapping {
+  // KeyValMapping is a file that KeyVal_loadMapped left mapped into memory,
+  // because elements still point into it.  Also not for users.
+  void *addr;
+  unsigned long len;
+  struct KeyValMapping *next;
+};
+
+
+//////////////////////////////////////// KeyValArena
+
+struct KeyValArena {
+  // KeyValArena is an optional allocator that owns all of a KeyVal's string
+  // storage (see KeyVal_newWithArena).  Blocks are bumped out of
+  // big chunks, and freed blocks go onto a free list for their size class, to
+  // be handed out again.  Nothing is returned to malloc until KeyVal_delete,
+  // which frees whole chunks at once.  Also not for users.
+  void *chunks;  // linked through the first word of each chunk
+  char *bump;  // next unused byte in the newest chunk
+  unsigned long bump_left;  // unused bytes after 'bump'
+  unsigned long next_chunk_size;  // chunks double in size, up to a limit
+  unsigned long num_chunks;
+  void *free_lists[8];  // size classes of 16, 32, .. 2048 bytes
+};
+
+
+//////////////////////////////////////// KeyValTrieNode
+
+struct KeyValTrieNode {
+  // KeyValTrieNode is one "::"-separated segment of one or more keys, in the
+  // optional trie index (see KeyVal_setTrieIndex).  Also not for users.
+  char *name;  // this segment, null-terminated
+  unsigned int name_len;
+  unsigned char has_value;  // whether the path down to here is itself a key
+  unsigned long count;  // number of keys at or below this node
+  struct KeyValTrieNode **children;  // sorted by name
+  unsigned int num_children;
+  unsigned int max_children;
+};
+
+
+//////////////////////////////////////// KeyValInterpCache
+
+struct KeyValInterpEdge {
+  // KeyValInterpEdge is one end of a "this value was built from that key" link
+  // in the interpolation cache.  'slot' is where the other end's copy of the
+  // link is, so that either end can unlink both in constant time.  Also not
+  // for users.
+  struct KeyValInterpNode *node;
+  unsigned int slot;
+};
+
+struct KeyValInterpNode {
+  // KeyValInterpNode is one key in the optional interpolation cache (see
+  // KeyVal_setInterpCache): its interpolated value, if that's cached, and
+  // whose cached values were built from it.  Keys that don't exist get nodes
+  // too, so that setting one later throws out whatever tried to use it.  Also
+  // not for users.
+  char *key;
+  unsigned int key_hash;
+  struct KeyValInterpNode *next;  // next in the same hash bucket
+  char *val;  // interpolated value, or 0 if not cached
+  struct KeyValInterpEdge *deps;  // every key 'val' was built from, at any depth
+  unsigned int num_deps;
+  struct KeyValInterpEdge *users;  // every node whose val was built from this key
+  unsigned int num_users;
+  unsigned int max_users;
+  unsigned long mark;  // (for spotting repeats while recording deps)
+};
+
+struct KeyValInterpCache {
+  // KeyValInterpCache is a hash table of KeyValInterpNodes.  Also not for
+  // users.
+  struct KeyValInterpNode **buckets;
+  unsigned long num_buckets;  // a power of 2
+  unsigned long num_nodes;
+  unsigned long mark;  // bumped for every value that gets recorded
+  struct KeyValInterpNode **recording;  // deps of the value being interpolated
+  unsigned int num_recording;
+  unsigned int max_recording;
+  unsigned char is_recording;  // 0: no, 1: yes, 2: yes, but ran out of memory
+};
+
+
+//////////////////////////////////////// KeyValBinary
+
+struct KeyValBinary {
+  // KeyValBinary is a read-only KeyVal image, written by KeyVal_saveBinary and
+  // mapped back in by KeyVal_openBinary.  Also not for users.
+  void *addr;  // the whole mapped file
+  unsigned long len;
+  unsigned long num_keys;
+  const void *table;  // sorted entries pointing into the heap
+  const char *heap;  // all the keys and values
+  unsigned long heap_size;
+  unsigned char interpolated;  // whether values were interpolated when saved
+};
+
+
+//////////////////////////////////////// KeyValLayer
+
+struct KeyValLayer {
+  // KeyValLayer is one file loaded by KeyVal_loadLayer, boiled down to what it
+  // does to each key it mentions, plus enough about the file for
+  // KeyVal_refresh to tell whether it has changed.  Also not for users.
+  char *filepath;
+  unsigned long inode;
+  long size;
+  long mtime_sec;
+  long mtime_nsec;
+  long ctime_sec;  // (the change time catches mtimes that were set back)
+  long ctime_nsec;
+  struct KeyVal *sets;  // the keys whose last line sets them, to that value
+  struct KeyVal *removes;  // the keys whose last line removes them
+};
+
+
+//////////////////////////////////////// KeyValJournal
+
+struct KeyValJournal {
+  // KeyValJournal is the file that KeyVal_setJournal appends changes to.  Also
+  // not for users.
+  int fd;  // opened for appending
+  char *filepath;
+  unsigned long num_lines;  // appended since the file was last compacted
+  unsigned long compact_after;  // 0 means only KeyVal_compact compacts
+  char *buf;  // lines on their way to the file
+  unsigned long buf_size;
+};
+
+
+//////////////////////////////////////// KeyValCursor
+
+struct KeyValCursor {
+  // KeyValCursor walks part of a KeyVal's sorted array (see
+  // KeyVal_cursorSeek).  It's small enough to live on the stack, and it
+  // doesn't need to be cleaned up.
+  struct KeyVal *kv;
+  unsigned long idx;  // current position
+  unsigned long end;  // one past the last position
+};
+
+
+//////////////////////////////////////// KeyValStats
+
+struct KeyValStats {
+  // KeyValStats is what KeyVal_stats fills in.  Unlike most of the structs in
+  // here, this one is for users.  All sizes are in bytes.
+  unsigned long num_keys;  // distinct keys (as KeyVal_size)
+  unsigned long max_size;  // slots in the array
+  unsigned long used_size;  // slots in use, including repeats in the unsorted tail
+  unsigned long unsorted;  // slots in the unsorted tail (used_size - last_sorted)
+  unsigned long key_bytes;  // all the keys, with their terminators
+  unsigned long val_bytes;  // all the values, with their terminators
+  unsigned long array_bytes;  // the array itself, including unused slots
+  unsigned long extra_bytes;  // indexes, the interpolation cache, and layers
+  unsigned long overhead_bytes;  // (estimated) malloc, arena, and mapping waste
+  unsigned long max_depth;  // most "::"-separated segments in any key
+  unsigned long max_fanout;  // most children of any one path (or the root)
 };
 
 
@@ -17,11 +186,22 @@ struct KeyValElement{
 struct KeyVal {
   // KeyVal is implemented as a doubling array of KeyValElements, which is then
   // searched using binary search.  The elements of the doubling array are
-  // lazy-sorted on demand.
-  struct KeyValElement **data;  // array of pointers
+  // lazy-sorted on demand.  The elements are stored inline, so a search only
+  // follows a key pointer when the cached prefixes can't settle a comparison.
+  struct KeyValElement *data;  // array of elements
   unsigned long max_size;  // total number of slots available in data.  0 <= MIN_SIZE <= max_size
   unsigned long used_size; // total number of slots used.  0 <= used_size <= max_size
   unsigned long last_sorted;  // number of sorted elements.  1 <= last_sorted <= used_size
+  struct KeyValMapping *mappings;  // files that borrowed keys/vals point into
+  struct KeyValArena *arena;  // 0 unless made by KeyVal_newWithArena
+  unsigned long *hash_index;  // 0 unless turned on by KeyVal_setHashIndex
+  unsigned long hash_index_size;  // slots in hash_index; a power of 2
+  struct KeyValTrieNode *trie;  // 0 unless turned on by KeyVal_setTrieIndex
+  struct KeyValInterpCache *interp_cache;  // 0 unless turned on by KeyVal_setInterpCache
+  struct KeyValJournal *journal;  // 0 unless turned on by KeyVal_setJournal
+  struct KeyValLayer *layers;  // files loaded by KeyVal_loadLayer, oldest first
+  unsigned long num_layers;
+  unsigned char frozen;  // set by KeyVal_freeze
 };
 
 
@@ -40,6 +220,121 @@ unsigned char
   KeyVal_new(struct KeyVal **res);
 
 
+// Creates a new KeyVal object, just like KeyVal_new, except that all of its
+// keys and values are allocated out of a private arena.  This is much
+// cheaper than one malloc per key and per value, and KeyVal_delete frees the
+// arena in whole chunks instead of string by string.  The catch is that the
+// arena never shrinks: storage freed by KeyVal_setValue or KeyVal_remove is
+// only reused by this same KeyVal.
+// Parameters:
+//   <res>: where to put the result (see KeyVal_new).
+// Returns:
+//   0: everything okay.  '*res' points to a new KeyVal object.
+//   1: encountered errors.  stderr spewed, errno is set.
+// Example:
+//   struct KeyVal *kv;
+//   if (KeyVal_newWithArena(&kv)) abort();
+unsigned char
+  KeyVal_newWithArena(struct KeyVal **res);
+
+
+// Turns the hash index on or off.  With it on, KeyVal_getValue,
+// KeyVal_hasValue, and overwriting KeyVal_setValue find keys by hash instead of
+// by binary search, which is much faster for big KeyVals.  Everything else
+// (KeyVal_getKeys and friends) still uses the sorted array.  The index costs
+// two words per key, and it is rebuilt whenever out-of-order keys get sorted
+// in, so it's best turned on once the KeyVal is mostly loaded.
+// Parameters:
+//   <kv>: a KeyVal object.
+//   <enable>: 1 to build the index, 0 to throw it away.
+// Returns:
+//   0: everything okay.
+//   1: encountered errors.  stderr spewed, errno is set.
+// Example:
+//   struct KeyVal *kv;
+//   if (KeyVal_new(&kv)) abort();
+//   if (KeyVal_load(kv, "config.kv")) abort();
+//   if (KeyVal_setHashIndex(kv, 1)) abort();
+unsigned char
+  KeyVal_setHashIndex(struct KeyVal *kv, unsigned char enable);
+
+
+// Turns the trie index on or off.  With it on, KeyVal_getKeys, KeyVal_hasKeys,
+// and KeyVal_exists look paths up in a tree of "::"-separated key segments, so
+// they take time proportional to the answer instead of to the number of keys
+// under the path.  (KeyVal_getKeys on a path with a million grandchildren but
+// ten children only looks at the ten.)  The trie costs a node per distinct
+// path, and is kept up to date as keys come and go.
+// Parameters:
+//   <kv>: a KeyVal object.
+//   <enable>: 1 to build the trie, 0 to throw it away.
+// Returns:
+//   0: everything okay.
+//   1: encountered errors.  stderr spewed, errno is set.
+// Example:
+//   struct KeyVal *kv;
+//   if (KeyVal_new(&kv)) abort();
+//   if (KeyVal_setTrieIndex(kv, 1)) abort();
+//   if (KeyVal_load(kv, "config.kv")) abort();
+unsigned char
+  KeyVal_setTrieIndex(struct KeyVal *kv, unsigned char enable);
+
+
+// Turns the interpolation cache on or off.  With it on, KeyVal_getValue with
+// <interp> remembers each interpolated value, along with every key that went
+// into it (at any depth, and including keys that didn't exist), so that
+// asking again is just a copy.  KeyVal_setValue and KeyVal_remove (and so
+// KeyVal_load and friends) throw out only the values that were built from the
+// key they change.  A frozen KeyVal still answers from the cache, but doesn't
+// add to it, so warm it up before KeyVal_freeze if that matters.
+// Parameters:
+//   <kv>: a KeyVal object.
+//   <enable>: 1 to start caching, 0 to throw the cache away.
+// Returns:
+//   0: everything okay.
+//   1: encountered errors.  stderr spewed, errno is set.
+// Example:
+//   struct KeyVal *kv;
+//   if (KeyVal_new(&kv)) abort();
+//   if (KeyVal_setInterpCache(kv, 1)) abort();
+//   if (KeyVal_load(kv, "config.kv")) abort();
+unsigned char
+  KeyVal_setInterpCache(struct KeyVal *kv, unsigned char enable);
+
+
+// Freezes the given KeyVal, so that it can be read from any number of threads
+// at once without locking.  Normally even a "read" like KeyVal_getValue may
+// finish sorting recently-added keys first, which is a write; KeyVal_freeze
+// does all of that up front, and after it, every query is a pure read.  In
+// exchange, anything that would change the KeyVal (KeyVal_setValue,
+// KeyVal_remove, KeyVal_load, turning indexes on or off) fails with errno set
+// to EPERM until KeyVal_thaw.
+// Parameters:
+//   <kv>: a KeyVal object.
+// Returns:
+//   0: everything okay.
+//   1: encountered errors.  stderr spewed, errno is set.
+// Example:
+//   struct KeyVal *kv;
+//   if (KeyVal_new(&kv)) abort();
+//   if (KeyVal_load(kv, "config.kv")) abort();
+//   if (KeyVal_freeze(kv)) abort();
+//   .. start reader threads ..
+unsigned char
+  KeyVal_freeze(struct KeyVal *kv);
+
+
+// Undoes KeyVal_freeze, so that the KeyVal can be changed again.  No other
+// threads may be using it while this happens.
+// Parameters:
+//   <kv>: a KeyVal object.
+// Returns:
+//   0: everything okay.
+//   1: encountered errors.  stderr spewed, errno is set.
+unsigned char
+  KeyVal_thaw(struct KeyVal *kv);
+
+
 // Cleans up the given KeyVal object by deleting all data and then itself.
 // Parameters:
 //   <kv>: a KeyVal object.
@@ -62,7 +357,8 @@ unsigned char
 //   <filepath>: the path to the keyval file to load.
 // Returns:
 //   0: everything okay.
-//   1: parsing problem with the keyval file (stderr spewed, errno is set).
+//   1: parsing problem with the keyval file, or the KeyVal is frozen (stderr
+//     spewed, errno is set).
 //   2: problem opening the keyval file (stderr spewed, errno is set).
 // Example:
 //   struct KeyVal *kv;
@@ -72,7 +368,135 @@ unsigned char
   KeyVal_load(struct KeyVal *kv, const char *filepath);
 
 
-// Writes the contents to disk.
+// Loads in a keyval file just like KeyVal_load, but instead of copying each
+// key and value, leaves the file mapped into memory and points straight into
+// it.  Only strings with escape sequences in them get copied, and a value is
+// copied anyway when KeyVal_setValue overwrites it.  The mapping is private,
+// so the file on disk is never modified, and it stays around until
+// KeyVal_delete.  Replacing the file (e.g. by rename) is safe while it is
+// mapped, but truncating it in place is not.  Anything that can't be mapped
+// (pipes, special files, empty files) is loaded the usual way.
+// Parameters:
+//   <kv>: a KeyVal object.
+//   <filepath>: the path to the keyval file to load.
+// Returns:
+//   0: everything okay.
+//   1: parsing problem with the keyval file, or the KeyVal is frozen (stderr
+//     spewed, errno is set).
+//   2: problem opening the keyval file (stderr spewed, errno is set).
+// Example:
+//   struct KeyVal *kv;
+//   if (KeyVal_new(&kv)) abort();
+//   if (KeyVal_loadMapped(kv, "/path/to/somewhere.kv")) abort();
+unsigned char
+  KeyVal_loadMapped(struct KeyVal *kv, const char *filepath);
+
+
+// Loads several keyval files, exactly as if KeyVal_load had been called on
+// each of them in turn: later files override earlier ones, and a 'remove' in
+// a later file removes what an earlier file set.  The difference is that the
+// parsing happens on up to <num_threads> threads at once; only the final
+// merge, in argument order, is done one file at a time.  Every file is read
+// even if an earlier one has problems.
+// Parameters:
+//   <kv>: a KeyVal object.
+//   <filepaths>: the paths to the keyval files to load, in order.
+//   <num_files>: how many paths are in <filepaths>.
+//   <num_threads>: the most threads to parse with (0 or 1 means no threads).
+// Returns:
+//   0: everything okay.
+//   1: problems with arguments or memory, a parsing problem with one of the
+//     keyval files, or the KeyVal is frozen (stderr spewed, errno is set).
+//   2: problem opening one of the keyval files (stderr spewed, errno is set).
+// Example:
+//   const char *layers[] = {"/etc/app/defaults.kv", "/etc/app/site.kv"};
+//   struct KeyVal *kv;
+//   if (KeyVal_new(&kv)) abort();
+//   if (KeyVal_loadMany(kv, layers, 2, 4)) abort();
+unsigned char
+  KeyVal_loadMany(struct KeyVal *kv, const char **filepaths,
+      unsigned long num_files, unsigned int num_threads);
+
+
+// Loads one big keyval file, exactly as KeyVal_load would, but parses it on
+// up to <num_threads> threads at once.  The file is split into chunks at line
+// boundaries, each chunk is parsed on its own, and the results are applied in
+// file order, so later lines still win.  If anything in the file is wrong, it
+// gets loaded again the usual way, which reports the problems (with the right
+// line numbers) and loads exactly what KeyVal_load would.  Small files, and
+// anything that isn't a regular file, are always loaded the usual way.
+// Parameters:
+//   <kv>: a KeyVal object.
+//   <filepath>: the path to the keyval file to load.
+//   <num_threads>: the most threads to parse with (0 or 1 means no threads).
+// Returns:
+//   0: everything okay.
+//   1: problems with arguments, a parsing problem with the keyval file, or
+//     the KeyVal is frozen (stderr spewed, errno is set).
+//   2: problem opening the keyval file (stderr spewed, errno is set).
+// Example:
+//   struct KeyVal *kv;
+//   if (KeyVal_new(&kv)) abort();
+//   if (KeyVal_loadParallel(kv, "/path/to/huge.kv", 8)) abort();
+unsigned char
+  KeyVal_loadParallel(struct KeyVal *kv, const char *filepath,
+      unsigned int num_threads);
+
+
+// Loads a keyval file as the next layer of a stack of them: exactly as
+// KeyVal_load would (later layers win over earlier ones), except that the
+// KeyVal also remembers the file (its inode, size, and modification time)
+// and what it did to each key, so that KeyVal_refresh can pick up changes to
+// it later.  The layers own every key they mention, so KeyVal_refresh may
+// change those keys back, even if they've been set some other way since.
+// Parameters:
+//   <kv>: a KeyVal object.
+//   <filepath>: the path to the keyval file to load.
+// Returns:
+//   0: everything okay.
+//   1: problems with arguments or memory, a parsing problem with the keyval
+//     file, or the KeyVal is frozen (stderr spewed, errno is set).
+//   2: problem opening the keyval file (stderr spewed, errno is set).
+// Example:
+//   struct KeyVal *kv;
+//   if (KeyVal_new(&kv)) abort();
+//   if (KeyVal_loadLayer(kv, "/etc/app/defaults.kv")) abort();
+//   if (KeyVal_loadLayer(kv, "/etc/app/site.kv")) abort();
+unsigned char
+  KeyVal_loadLayer(struct KeyVal *kv, const char *filepath);
+
+
+// Reloads whichever of the files loaded by KeyVal_loadLayer have changed
+// (going by their inode, size, and modification and change times, to the
+// nanosecond), and recomputes only the keys those files mention, now or
+// before.  Afterwards, every key any
+// layer mentions is just what loading all the layers again, in order, would
+// have made it, and keys that no layer mentions anymore are gone.  A file
+// that can't be opened or parsed is reported, and its old contents stay in
+// effect until it can be.
+// Parameters:
+//   <res>: where to put how many files were reloaded.
+//   <kv>: a KeyVal object.
+// Returns:
+//   0: everything okay.
+//   1: problems with arguments or memory, a parsing problem with one of the
+//     keyval files, or the KeyVal is frozen (stderr spewed, errno is set).
+//   2: problem opening one of the keyval files (stderr spewed, errno is set).
+// Example:
+//   struct KeyVal *kv;
+//   ..
+//   unsigned long num_reloaded;
+//   if (KeyVal_refresh(&num_reloaded, kv)) abort();
+unsigned char
+  KeyVal_refresh(unsigned long *res, struct KeyVal *kv);
+
+
+// Writes the contents to disk.  The file is written under a temporary name
+// next to <filepath> and then renamed over it, so readers only ever see the
+// old file or the new one.  If <filepath> is a symlink, the file it points to
+// is the one replaced, and an existing file keeps its permissions (and its
+// owner, when the process is allowed to set that).  KeyVal_saveParallel,
+// KeyVal_compact, and KeyVal_setJournal's rewrites save the same way.
 // Parameters:
 //   <kv>: a KeyVal object.
 //   <filepath>: the path to the file to write.
@@ -90,6 +514,81 @@ unsigned char
   KeyVal_save(struct KeyVal *kv, const char *filepath, unsigned char interp, unsigned char align);
 
 
+// Writes the contents to disk, exactly as KeyVal_save would (the file is
+// byte-for-byte the same), but interpolates and escapes on up to
+// <num_threads> threads at once.  The keys are split into ranges, each range
+// is formatted into its own buffer, and the buffers are written out in
+// order.  Small KeyVals are always saved the usual way.
+// Parameters:
+//   <kv>: a KeyVal object.
+//   <filepath>: the path to the file to write.
+//   <interp>: whether to interpolate variables.
+//   <align>: whether to inject whitespace so all the values align.
+//   <num_threads>: the most threads to format with (0 or 1 means no threads).
+// Returns:
+//   0: everything okay.
+//   1: problems with arguments or memory (stderr spewed, errno is set).
+//   2: problems writing the file (stderr spewed, errno is set).
+// Example:
+//   struct KeyVal *kv;
+//   ..
+//   if (KeyVal_saveParallel(kv, "/path/to/huge.kv", 1, 0, 8)) abort();
+unsigned char
+  KeyVal_saveParallel(struct KeyVal *kv, const char *filepath, unsigned char interp,
+      unsigned char align, unsigned int num_threads);
+
+
+// Turns journaling on or off.  With it on, the KeyVal is first saved to
+// <filepath> (as KeyVal_save would, without interpolating or aligning), and
+// from then on every KeyVal_setValue, KeyVal_setValues, and KeyVal_remove
+// (including the ones that loading files does) is appended to the end of
+// that file as an ordinary keyval line, before it's made in memory.  So each
+// change costs one small write instead of a whole KeyVal_save, and the file
+// is always one that KeyVal_load reads back into the same contents.  Since
+// the file only ever grows, it gets compacted (saved over, sorted, with only
+// the latest value of each key) by KeyVal_compact, or automatically once
+// <compact_after> lines have been appended.  Only KeyVal_compact returns
+// compaction errors: an automatic compaction that fails is reported on
+// stderr, but the change that set it off still succeeds (it's already in the
+// journal), and the next try waits another <compact_after> lines.
+// Parameters:
+//   <kv>: a KeyVal object.
+//   <filepath>: the file to journal to, or null to stop journaling.
+//   <compact_after>: how many appended lines to compact after, or 0 to leave
+//     it to KeyVal_compact.
+// Returns:
+//   0: everything okay.
+//   1: problems with arguments or memory, or the KeyVal is frozen (stderr
+//     spewed, errno is set).
+//   2: problems writing the file (stderr spewed, errno is set).
+// Example:
+//   struct KeyVal *kv;
+//   if (KeyVal_new(&kv)) abort();
+//   if (KeyVal_load(kv, "/path/to/somewhere.kv") == 1) abort();
+//   if (KeyVal_setJournal(kv, "/path/to/somewhere.kv", 100000)) abort();
+//   if (KeyVal_setValue(kv, "visits", "12")) abort();  // one line appended
+unsigned char
+  KeyVal_setJournal(struct KeyVal *kv, const char *filepath, unsigned long compact_after);
+
+
+// Compacts the journal file started by KeyVal_setJournal: saves over it with
+// just the current contents, sorted, and goes on appending to the new file.
+// Parameters:
+//   <kv>: a KeyVal object with journaling on.
+// Returns:
+//   0: everything okay.
+//   1: problems with arguments or memory, or journaling is off (stderr
+//     spewed, errno is set).
+//   2: problems writing the file (stderr spewed, errno is set).  The old
+//     file is still there, and still being appended to.
+// Example:
+//   struct KeyVal *kv;
+//   ..
+//   if (KeyVal_compact(kv)) abort();
+unsigned char
+  KeyVal_compact(struct KeyVal *kv);
+
+
 // Sets the given key to the given value.  KeyVal makes its own copies of
 // both the key and the value, so pointer ownership stays with the caller.
 // Parameters:
@@ -107,6 +606,31 @@ unsigned char
   KeyVal_setValue(struct KeyVal *kv, const char *key, const char *val);
 
 
+// Sets lots of keys at once, as if by KeyVal_setValue on each in turn (so if
+// a key shows up more than once, the last one wins).  This is faster than a
+// loop of KeyVal_setValue: the batch is sorted first, so that keys that are
+// already there can all be found in one pass, and the new ones are merged in
+// all at once at the end.
+// Parameters:
+//   <kv>: a KeyVal object.
+//   <keys>: an array of <num_keys> key path strings.
+//   <vals>: an array of <num_keys> value strings, to go with <keys>.
+//   <num_keys>: how many there are.
+// Returns:
+//   0: everything okay.
+//   1: encountered errors.  stderr spewed, errno is set.  If the arguments
+//     were bad, nothing was set; otherwise, some of them may have been.
+// Example:
+//   struct KeyVal *kv;
+//   ..
+//   const char *keys[] = {"db::port", "db::host"};
+//   const char *vals[] = {"5432", "localhost"};
+//   if (KeyVal_setValues(kv, keys, vals, 2)) abort();
+unsigned char
+  KeyVal_setValues(struct KeyVal *kv, const char **keys, const char **vals,
+      unsigned long num_keys);
+
+
 // Returns the value for the given key.  Ownership of the returned string
 // belongs with the caller, so you need to free it.
 // Parameters:
@@ -130,6 +654,97 @@ unsigned char
   KeyVal_getValue(char **res, struct KeyVal *kv, const char *key, int interp);
 
 
+// Like KeyVal_getValue, but without making a copy: the string still belongs
+// to the KeyVal.  It stays valid until the KeyVal next changes (setValue,
+// remove, load, etc).  If it had to be interpolated and wasn't in the
+// interpolation cache, it's in a per-thread buffer instead, and the next
+// interpolating KeyVal_peekValue or KeyVal_cursorValue in the same thread
+// reuses that buffer.  (The buffer is freed when the thread exits.)
+// Parameters:
+//   <res>: pointer to where to put the string.
+//   <len>: pointer to where to put the string's length.
+//   <kv>: a KeyVal object.
+//   <key>: the key path to retrieve.
+//   <interp>: whether to interpolate variables.
+// Returns:
+//   0: everything okay.  '*res' is either null (if the key does not exist) or
+//     else it points to a string that you must not free or change.  '*len'
+//     is its length.
+//   1: encountered errors.  stderr spewed, errno is set.
+//   2: too many levels of variables (probably recursive).  stderr spewed.
+// Example:
+//   struct KeyVal *kv;
+//   ..
+//   const char *value;
+//   unsigned long len;
+//   if (KeyVal_peekValue(&value, &len, kv, "some::random::path", 1)) abort();
+//   if (value) fwrite(value, 1, len, stdout);
+unsigned char
+  KeyVal_peekValue(const char **res, unsigned long *len, struct KeyVal *kv,
+      const char *key, int interp);
+
+
+// Like KeyVal_getValue, but copies the value into a buffer of yours.
+// Parameters:
+//   <res>: pointer to where to put the size of the value, including its
+//     terminator.  This is 0 if the key does not exist.
+//   <buf>: where to copy the value.  This can only be null if <buf_size> is 0.
+//   <buf_size>: how many bytes 'buf' has room for.
+//   <kv>: a KeyVal object.
+//   <key>: the key path to retrieve.
+//   <interp>: whether to interpolate variables.
+// Returns:
+//   0: everything okay.  If the key exists, 'buf' holds its value.
+//   1: encountered errors.  stderr spewed, errno is set.
+//   2: too many levels of variables (probably recursive).  stderr spewed.
+//   3: 'buf' is too small.  '*res' is how big it needs to be, and what's in
+//     'buf' is garbage.
+// Example:
+//   struct KeyVal *kv;
+//   ..
+//   char value[256];
+//   unsigned long size;
+//   unsigned char res = KeyVal_copyValue(&size, value, sizeof(value), kv,
+//       "some::random::path", 1);
+//   if (res == 1 || res == 2) abort();
+//   if (res == 3) { .. try again with 'size' bytes .. }
+unsigned char
+  KeyVal_copyValue(unsigned long *res, char *buf, unsigned long buf_size,
+      struct KeyVal *kv, const char *key, int interp);
+
+
+// Like KeyVal_getValue, for lots of keys at once.  This is faster than
+// looking them up one by one, especially when they're near each other (say,
+// several keys under the same path): they're looked up in sorted order, and
+// each search starts where the last one stopped.
+// Parameters:
+//   <res>: an array of <num_keys> string pointers to fill in.  'res[i]' gets
+//     the value of 'keys[i]', just like from KeyVal_getValue.
+//   <kv>: a KeyVal object.
+//   <keys>: an array of <num_keys> key paths to retrieve.  They can be in any
+//     order, and can repeat.
+//   <num_keys>: how many keys there are.
+//   <interp>: whether to interpolate variables.
+// Returns:
+//   0: everything okay.  Each 'res[i]' is either null (if that key does not
+//     exist) or else it points to a string that you own and must free.
+//   1: encountered errors.  stderr spewed, errno is set.  Every 'res[i]' is
+//     null.
+//   2: too many levels of variables (probably recursive).  stderr spewed.
+//     Every 'res[i]' is null.
+// Example:
+//   struct KeyVal *kv;
+//   ..
+//   const char *keys[] = {"db::host", "db::port", "db::user"};
+//   char *values[3];
+//   if (KeyVal_getValues(values, kv, keys, 3, 1)) abort();
+//   ..
+//   for (int i = 0; i < 3; ++i) free(values[i]);
+unsigned char
+  KeyVal_getValues(char **res, struct KeyVal *kv, const char **keys,
+      unsigned long num_keys, int interp);
+
+
 // Removes the specified key from the database.  It is okay if the key is
 // already not in the database.
 // Parameters:
@@ -221,6 +836,30 @@ unsigned char
   KeyVal_size(unsigned long *res, struct KeyVal *kv);
 
 
+// Fills in statistics about a KeyVal's memory and shape (see struct
+// KeyValStats), for keeping an eye on big ones.  'max_size', 'used_size', and
+// 'unsorted' are what they were when this was called; everything else is
+// counted after sorting the tail, as any query would.  The byte counts for the
+// allocators are estimates, assuming glibc-like malloc (16-byte blocks with an
+// 8-byte header).  This walks every key, so it's not for tight loops.
+// Parameters:
+//   <res>: where to put the results.
+//   <kv>: a KeyVal object.
+// Returns:
+//   0: everything okay.
+//   1: encountered errors.  stderr is spewed, errno is set.
+// Example:
+//   struct KeyVal *kv;
+//   ..
+//   struct KeyValStats stats;
+//   if (KeyVal_stats(&stats, kv)) abort();
+//   printf("%lu keys in %lu bytes\n", stats.num_keys,
+//       stats.key_bytes + stats.val_bytes + stats.array_bytes
+//       + stats.extra_bytes + stats.overhead_bytes);
+unsigned char
+  KeyVal_stats(struct KeyValStats *res, struct KeyVal *kv);
+
+
 // Returns whether the given key path exists and is a leaf (as opposed to 
 // being only part of a deeper hierarchy).
 // Parameters:
@@ -284,6 +923,153 @@ unsigned char
   KeyVal_exists(unsigned char *res, struct KeyVal *kv, const char *key_or_path);
 
 
+// Points a cursor at the first key that is at or after 'key' (in sorted key
+// order, where "a::b" comes right after "a"), to walk from there to the end.
+// Walking costs nothing but the initial search: the keys and values come
+// straight out of the KeyVal, without being copied.  A cursor is only good
+// until the KeyVal next changes (setValue, remove, load, etc).
+// Parameters:
+//   <cur>: the cursor to set up.
+//   <kv>: a KeyVal object.
+//   <key>: where to start.  It doesn't have to exist.
+// Returns:
+//   0: everything okay.
+//   1: encountered errors.  stderr spewed, errno is set.
+// Example:
+//   struct KeyVal *kv;
+//   ..
+//   struct KeyValCursor cur;
+//   const char *key;
+//   const char *value;
+//   unsigned long len;
+//   if (KeyVal_cursorSeek(&cur, kv, "m")) abort();
+//   for (;;) {
+//     if (KeyVal_cursorKey(&key, &cur)) abort();
+//     if (!key) break;
+//     if (KeyVal_cursorValue(&value, &len, &cur, 1)) abort();
+//     ..
+//     if (KeyVal_cursorNext(&cur)) abort();
+//   }
+unsigned char
+  KeyVal_cursorSeek(struct KeyValCursor *cur, struct KeyVal *kv, const char *key);
+
+
+// Like KeyVal_cursorSeek, but starts after 'key', if it exists.
+unsigned char
+  KeyVal_cursorSeekAfter(struct KeyValCursor *cur, struct KeyVal *kv, const char *key);
+
+
+// Like KeyVal_cursorSeek, but walks only the keys under the given path, at any
+// depth.  (Under "a" are "a::b" and "a::b::c", but not "a" itself.)  An
+// empty path ("") means every key.
+unsigned char
+  KeyVal_cursorSubtree(struct KeyValCursor *cur, struct KeyVal *kv, const char *path);
+
+
+// Moves a cursor on to the next key.  At the end, it stays there.
+// Returns:
+//   0: everything okay.
+//   1: encountered errors.  stderr spewed, errno is set.
+unsigned char
+  KeyVal_cursorNext(struct KeyValCursor *cur);
+
+
+// The key a cursor is at, or null if it's at the end.  The string belongs to
+// the KeyVal, so don't free it.
+// Returns:
+//   0: everything okay.
+//   1: encountered errors.  stderr spewed, errno is set.
+unsigned char
+  KeyVal_cursorKey(const char **res, struct KeyValCursor *cur);
+
+
+// The value a cursor is at (and its length), or null if it's at the end.  This
+// is just like KeyVal_peekValue (and shares its per-thread buffer), and the
+// string is only good for as long.
+// Returns:
+//   0: everything okay.
+//   1: encountered errors.  stderr spewed, errno is set.
+//   2: too many levels of variables (probably recursive).  stderr spewed.
+unsigned char
+  KeyVal_cursorValue(const char **res, unsigned long *len,
+      struct KeyValCursor *cur, int interp);
+
+
+// Writes the contents to disk as a binary image, which KeyVal_openBinary can
+// later map straight back into memory, with no parsing at all.  The image is a
+// header (with a format version and a checksum), a table of keys in sorted
+// order, and the keys and values themselves.  It is only meant as a fast cache
+// of a text file; it's specific to the machine's byte order, and is never read
+// by KeyVal_load.  The file is replaced the same way KeyVal_save replaces
+// one, so anyone who already has the old image open keeps reading it.
+// Parameters:
+//   <kv>: a KeyVal object.
+//   <filepath>: the path to the file to write.
+//   <interp>: whether to interpolate variables first.  (Binary images can't
+//     interpolate when they're read, so this is the only chance.)
+// Returns:
+//   0: everything okay.
+//   1: problems with arguments, memory, or interpolation (stderr spewed,
+//     errno is set).
+//   2: problems writing the file (stderr spewed, errno is set).
+// Example:
+//   struct KeyVal *kv;
+//   ..
+//   if (KeyVal_saveBinary(kv, "/path/to/somewhere.kvb", 1)) abort();
+unsigned char
+  KeyVal_saveBinary(struct KeyVal *kv, const char *filepath, unsigned char interp);
+
+
+// Maps in a binary image written by KeyVal_saveBinary.  This takes the same
+// (short) time no matter how many keys there are, and no memory per key:
+// lookups search the mapped file where it lies.  The header is always
+// checked; the checksum is only checked on request, since that means reading
+// the whole file.  (Even without it, a corrupted file can only give wrong
+// answers, never crash.)
+// Parameters:
+//   <res>: where to put the result.  This must be the address of a valid
+//     pointer, though the pointer itself doesn't have to be valid.
+//   <filepath>: the path to the binary image.
+//   <verify>: whether to check the checksum.
+// Returns:
+//   0: everything okay.  '*res' points to a new KeyValBinary object.
+//   1: not a usable binary image (wrong format, version, or byte order,
+//     truncated, or failed the checksum), or problems with arguments or
+//     memory (stderr spewed, errno is set).
+//   2: problem opening the file (stderr spewed, errno is set).
+// Example:
+//   struct KeyValBinary *kvb;
+//   if (KeyVal_openBinary(&kvb, "/path/to/somewhere.kvb", 0)) {
+//     .. fall back to KeyVal_load on the text file ..
+//   }
+unsigned char
+  KeyVal_openBinary(struct KeyValBinary **res, const char *filepath, unsigned char verify);
+
+
+// Unmaps the given binary image and deletes the object.
+// Parameters:
+//   <kvb>: a KeyValBinary object.
+// Returns:
+//   0: everything okay.
+//   1: encountered errors.  stderr spewed, errno is set.
+unsigned char
+  KeyVal_closeBinary(struct KeyValBinary *kvb);
+
+
+// These are KeyVal_getValue, KeyVal_hasValue, KeyVal_getKeys, and
+// KeyVal_size, for binary images.  They behave the same way (including who
+// owns the results), except that values come back exactly as they were saved,
+// since there's no interpolation.
+unsigned char
+  KeyVal_binaryGetValue(char **res, struct KeyValBinary *kvb, const char *key);
+unsigned char
+  KeyVal_binaryHasValue(unsigned char *res, struct KeyValBinary *kvb, const char *key);
+unsigned char
+  KeyVal_binaryGetKeys(char ***res, struct KeyValBinary *kvb, const char *path);
+unsigned char
+  KeyVal_binarySize(unsigned long *res, struct KeyValBinary *kvb);
+
+
 // This is just for debugging, though if you need it, go for it.
 void
   KeyVal_print(struct KeyVal *kv);
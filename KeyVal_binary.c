@@ -0,0 +1,525 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "KeyVal.h"
+
+/*
+A binary image (conventionally a .kvb file) is a KeyVal that has already been
+parsed and sorted, laid out so that it can be mapped straight into memory and
+searched where it lies:
+
+  header:  one struct KeyValBinaryHeader (64 bytes)
+  table:   one struct KeyValBinaryEntry per key, in KeyVal_strcmp order
+  heap:    every key and value, each null-terminated
+
+The text format is still the canonical one; an image is only ever derived from
+a KeyVal, by KeyVal_saveBinary.  Numbers are in the writer's byte order, and
+the header says which one that was, so a reader on a different machine
+rejects the file instead of misreading it.
+*/
+
+extern unsigned char KEYVAL_QUIET;
+
+// internal functions from KeyVal.c:
+int KeyVal_strcmp(const char *s1, const char *s2);
+unsigned long long KeyVal_keyPrefix(const char *key);
+unsigned char KeyVal_interp(char **res, struct KeyVal *kv, const char *str);
+unsigned char KeyVal_tempOpen(int *fd, char **real_path, char **tmp_path,
+    const char *filepath, const char *func);
+unsigned char KeyVal_tempCommit(char *real_path, char *tmp_path, unsigned char res,
+    const char *func);
+
+static const char *ERRSTR = "%s: '%s' argument null\n";
+
+static const char KEYVAL_BINARY_MAGIC[8] = "KeyValB";
+static const uint32_t KEYVAL_BINARY_VERSION = 1;
+static const uint32_t KEYVAL_BINARY_BYTE_ORDER = 0x01020304;
+static const uint32_t KEYVAL_BINARY_INTERPOLATED = 1;  // (flag)
+
+struct KeyValBinaryHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t flags;
+  uint32_t checksum;  // KeyVal_binaryChecksum of the table and heap
+  uint64_t num_keys;
+  uint64_t heap_size;
+  uint64_t file_size;
+  char reserved[16];
+};
+
+struct KeyValBinaryEntry {
+  uint64_t key_prefix;  // same as KeyValElement's, to speed up the search
+  uint64_t key_off;  // offsets into the heap
+  uint64_t val_off;
+  uint32_t key_len;
+  uint32_t val_len;
+};
+
+
+// 32-bit FNV-1a, continued from 'hash' (start with 2166136261).
+static uint32_t
+KeyVal_binaryChecksum(uint32_t hash, const void *data, unsigned long len) {
+  const unsigned char *ch = data;
+  const unsigned char *end = ch + len;
+  while (ch != end) {
+    hash ^= *ch++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+
+// fwrite that also adds what it wrote to '*checksum'.  Returns 0 on success.
+static int
+KeyVal_binaryWrite(FILE *fh, uint32_t *checksum, const void *data, unsigned long len) {
+  *checksum = KeyVal_binaryChecksum(*checksum, data, len);
+  return fwrite(data, 1, len, fh) != len;
+}
+
+
+unsigned char
+KeyVal_saveBinary(struct KeyVal *kv, const char *filepath, unsigned char interp) {
+  if (!kv) {
+    fprintf(stderr, ERRSTR, __func__, "kv");
+    errno = EINVAL;
+    return 1;
+  }
+  if (!filepath) {
+    fprintf(stderr, ERRSTR, __func__, "filepath");
+    errno = EINVAL;
+    return 1;
+  }
+
+  // (this also sorts it)
+  unsigned long num_keys;
+  if (KeyVal_size(&num_keys, kv)) return 1;
+
+  // the values are needed twice (once to lay out the heap, once to write it),
+  // so interpolate them all up front:
+  char **vals = malloc((num_keys ? num_keys : 1) * sizeof(char*));
+  if (!vals) {
+    fprintf(stderr, "KeyVal_saveBinary: out of memory\n");
+    errno = ENOMEM;
+    return 1;
+  }
+  unsigned char res = 0;
+  unsigned long num_vals = 0;
+  for (; num_vals < num_keys; ++num_vals) {
+    if (interp) {
+      if (KeyVal_interp(&vals[num_vals], kv, kv->data[num_vals].val)) {
+        res = 1;
+        break;
+      }
+    } else {
+      vals[num_vals] = kv->data[num_vals].val;
+    }
+  }
+
+  // written to a temporary file and renamed into place (as KeyVal_save does),
+  // because truncating an image that somebody has mapped would crash them:
+  char *real_path = 0, *tmp_path = 0;
+  FILE *fh = 0;
+  if (!res) {
+    int fd;
+    res = KeyVal_tempOpen(&fd, &real_path, &tmp_path, filepath, "KeyVal_saveBinary");
+    if (!res) {
+      fh = fdopen(fd, "w");
+      if (!fh) {
+        fprintf(stderr, "[ERROR] KeyVal_saveBinary: cannot write to this file:\n  %s\n  because of:\n  ", tmp_path);
+        perror(0);
+        close(fd);
+        res = KeyVal_tempCommit(real_path, tmp_path, 2, "KeyVal_saveBinary");
+      }
+    }
+  }
+
+  if (!res) {
+    struct KeyValBinaryHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, KEYVAL_BINARY_MAGIC, sizeof(header.magic));
+    header.version = KEYVAL_BINARY_VERSION;
+    header.byte_order = KEYVAL_BINARY_BYTE_ORDER;
+    header.flags = interp ? KEYVAL_BINARY_INTERPOLATED : 0;
+    header.num_keys = num_keys;
+
+    // the header goes out now as a placeholder, and again at the end once the
+    // checksum is known:
+    uint32_t checksum = 2166136261u;
+    int write_err = fwrite(&header, sizeof(header), 1, fh) != 1;
+
+    uint64_t heap_off = 0;
+    for (unsigned long i = 0; i < num_keys && !write_err; ++i) {
+      struct KeyValBinaryEntry entry;
+      memset(&entry, 0, sizeof(entry));
+      entry.key_prefix = kv->data[i].key_prefix;
+      entry.key_len = kv->data[i].key_len;
+      entry.val_len = strlen(vals[i]);
+      entry.key_off = heap_off;
+      heap_off += entry.key_len + 1;
+      entry.val_off = heap_off;
+      heap_off += entry.val_len + 1;
+      write_err = KeyVal_binaryWrite(fh, &checksum, &entry, sizeof(entry));
+    }
+    for (unsigned long i = 0; i < num_keys && !write_err; ++i) {
+      write_err = KeyVal_binaryWrite(fh, &checksum, kv->data[i].key, kv->data[i].key_len + 1)
+          || KeyVal_binaryWrite(fh, &checksum, vals[i], strlen(vals[i]) + 1);
+    }
+
+    header.checksum = checksum;
+    header.heap_size = heap_off;
+    header.file_size = sizeof(header) + num_keys * sizeof(struct KeyValBinaryEntry) + heap_off;
+    if (!write_err) {
+      write_err = fseek(fh, 0, SEEK_SET) || fwrite(&header, sizeof(header), 1, fh) != 1;
+    }
+
+    // check everything for errors, because this is what fails when disks fill
+    // up, etc.  (fsync, so that the rename can't land before the data does.)
+    if (!write_err) {
+      write_err = fflush(fh) || fsync(fileno(fh));
+    }
+    if (fclose(fh) || write_err) {
+      fprintf(stderr, "[ERROR] KeyVal_saveBinary: cannot finish writing this file:\n  %s\n  because of:\n  ", tmp_path);
+      perror(0);
+      res = 2;
+    }
+    res = KeyVal_tempCommit(real_path, tmp_path, res, "KeyVal_saveBinary");
+  }
+
+  if (interp) {
+    for (unsigned long i = 0; i < num_vals; ++i) {
+      free(vals[i]);
+    }
+  }
+  free(vals);
+  return res;
+}
+
+
+// Complains about a file that isn't a usable image.
+static unsigned char
+KeyVal_binaryReject(const char *filepath, const char *why) {
+  if (!KEYVAL_QUIET) {
+    fprintf(stderr, "[ERROR] KeyVal_openBinary: '%s' %s\n", filepath, why);
+  }
+  errno = EINVAL;
+  return 1;
+}
+
+
+unsigned char
+KeyVal_openBinary(struct KeyValBinary **res, const char *filepath, unsigned char verify) {
+  if (!res) {
+    fprintf(stderr, ERRSTR, __func__, "res");
+    errno = EINVAL;
+    return 1;
+  }
+  if (!filepath) {
+    fprintf(stderr, ERRSTR, __func__, "filepath");
+    errno = EINVAL;
+    return 1;
+  }
+
+  FILE *fh = fopen(filepath, "r");
+  if (!fh) {
+    if (!KEYVAL_QUIET) {
+      fprintf(stderr, "[ERROR] KeyVal_openBinary: cannot open file '%s'\n", filepath);
+    }
+    return 2;
+  }
+  struct stat st;
+  if (fstat(fileno(fh), &st) || !S_ISREG(st.st_mode)) {
+    fclose(fh);
+    return KeyVal_binaryReject(filepath, "is not a regular file");
+  }
+  if (st.st_size < (off_t)sizeof(struct KeyValBinaryHeader)) {
+    fclose(fh);
+    return KeyVal_binaryReject(filepath, "is too short to be a binary KeyVal");
+  }
+  void *addr = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fh), 0);
+  fclose(fh);  // (the mapping stays)
+  if (addr == MAP_FAILED) {
+    if (!KEYVAL_QUIET) {
+      fprintf(stderr, "[ERROR] KeyVal_openBinary: cannot map file '%s'\n", filepath);
+    }
+    return 2;
+  }
+
+  // everything in the header has to agree with itself and with the file, so
+  // that no lookup can ever wander outside of the mapping:
+  const struct KeyValBinaryHeader *header = addr;
+  const char *why = 0;
+  uint64_t max_keys = (st.st_size - sizeof(*header)) / sizeof(struct KeyValBinaryEntry);
+  if (memcmp(header->magic, KEYVAL_BINARY_MAGIC, sizeof(header->magic))) {
+    why = "is not a binary KeyVal";
+  } else if (header->version != KEYVAL_BINARY_VERSION) {
+    why = "is an unsupported binary KeyVal version";
+  } else if (header->byte_order != KEYVAL_BINARY_BYTE_ORDER) {
+    why = "was written on a machine with a different byte order";
+  } else if (header->file_size != (uint64_t)st.st_size
+      || header->num_keys > max_keys
+      || header->heap_size != st.st_size - sizeof(*header)
+          - header->num_keys * sizeof(struct KeyValBinaryEntry)) {
+    why = "is truncated or corrupted";
+  } else if (header->num_keys && !header->heap_size) {
+    why = "is truncated or corrupted";
+  } else if (header->heap_size && ((const char*)addr)[st.st_size - 1]) {
+    // (this is what keeps every string null-terminated inside the mapping)
+    why = "is truncated or corrupted";
+  } else if (verify) {
+    uint32_t checksum = KeyVal_binaryChecksum(2166136261u,
+        (const char*)addr + sizeof(*header), st.st_size - sizeof(*header));
+    if (checksum != header->checksum) why = "fails its checksum";
+  }
+  if (why) {
+    munmap(addr, st.st_size);
+    return KeyVal_binaryReject(filepath, why);
+  }
+
+  struct KeyValBinary *kvb = malloc(sizeof(struct KeyValBinary));
+  if (!kvb) {
+    munmap(addr, st.st_size);
+    fprintf(stderr, "KeyVal_openBinary: out of memory\n");
+    errno = ENOMEM;
+    return 1;
+  }
+  kvb->addr = addr;
+  kvb->len = st.st_size;
+  kvb->num_keys = header->num_keys;
+  kvb->table = (const char*)addr + sizeof(*header);
+  kvb->heap = (const char*)kvb->table + header->num_keys * sizeof(struct KeyValBinaryEntry);
+  kvb->heap_size = header->heap_size;
+  kvb->interpolated = (header->flags & KEYVAL_BINARY_INTERPOLATED) != 0;
+  *res = kvb;
+  return 0;
+}
+
+
+unsigned char
+KeyVal_closeBinary(struct KeyValBinary *kvb) {
+  if (!kvb) {
+    fprintf(stderr, ERRSTR, __func__, "kvb");
+    errno = EINVAL;
+    return 1;
+  }
+  munmap(kvb->addr, kvb->len);
+  kvb->addr = 0;
+  free(kvb);
+  return 0;
+}
+
+
+// Returns the heap string at 'off'.  A bad offset (which only a corrupted
+// file that skipped verification could have) reads as the heap's last byte,
+// which is always a terminator, i.e. "".
+static const char *
+KeyVal_binaryString(const struct KeyValBinary *kvb, uint64_t off) {
+  return kvb->heap + (off < kvb->heap_size ? off : kvb->heap_size - 1);
+}
+
+
+static const char *
+KeyVal_binaryKey(const struct KeyValBinary *kvb, unsigned long idx) {
+  const struct KeyValBinaryEntry *table = kvb->table;
+  return KeyVal_binaryString(kvb, table[idx].key_off);
+}
+
+
+// Same as KeyVal_findIdealIndex: the first entry whose key is not below
+// 'key', or num_keys.
+static unsigned long
+KeyVal_binaryFindIdealIndex(const struct KeyValBinary *kvb, const char *key) {
+  const struct KeyValBinaryEntry *table = kvb->table;
+  unsigned long long key_prefix = KeyVal_keyPrefix(key);
+  unsigned long lo = 0;
+  unsigned long hi = kvb->num_keys;
+  while (lo != hi) {
+    unsigned long mid = (lo + hi) >> 1;
+    int cmp;
+    if (table[mid].key_prefix != key_prefix) {
+      cmp = (table[mid].key_prefix < key_prefix) ? -1 : 1;
+    } else {
+      cmp = KeyVal_strcmp(KeyVal_binaryKey(kvb, mid), key);
+    }
+    if (cmp < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+
+// Returns:
+//   0: found; '*res' is its index.
+//   2: not found.
+static unsigned char
+KeyVal_binaryFindIndex(unsigned long *res, const struct KeyValBinary *kvb, const char *key) {
+  unsigned long idx = KeyVal_binaryFindIdealIndex(kvb, key);
+  if (idx == kvb->num_keys || strcmp(KeyVal_binaryKey(kvb, idx), key)) return 2;
+  *res = idx;
+  return 0;
+}
+
+
+unsigned char
+KeyVal_binaryGetValue(char **res, struct KeyValBinary *kvb, const char *key) {
+  if (!res) {
+    fprintf(stderr, ERRSTR, __func__, "res");
+    errno = EINVAL;
+    return 1;
+  }
+  if (!kvb) {
+    fprintf(stderr, ERRSTR, __func__, "kvb");
+    errno = EINVAL;
+    return 1;
+  }
+  if (!key) {
+    fprintf(stderr, ERRSTR, __func__, "key");
+    errno = EINVAL;
+    return 1;
+  }
+
+  unsigned long idx;
+  if (KeyVal_binaryFindIndex(&idx, kvb, key)) {
+    *res = 0;
+    return 0;  // not found
+  }
+  const struct KeyValBinaryEntry *table = kvb->table;
+  *res = strdup(KeyVal_binaryString(kvb, table[idx].val_off));
+  if (!*res) {
+    fprintf(stderr, "KeyVal_binaryGetValue: out of memory\n");
+    errno = ENOMEM;
+    return 1;
+  }
+  return 0;
+}
+
+
+unsigned char
+KeyVal_binaryHasValue(unsigned char *res, struct KeyValBinary *kvb, const char *key) {
+  if (!res) {
+    fprintf(stderr, ERRSTR, __func__, "res");
+    errno = EINVAL;
+    return 1;
+  }
+  if (!kvb) {
+    fprintf(stderr, ERRSTR, __func__, "kvb");
+    errno = EINVAL;
+    return 1;
+  }
+  if (!key) {
+    fprintf(stderr, ERRSTR, __func__, "key");
+    errno = EINVAL;
+    return 1;
+  }
+
+  unsigned long idx;
+  *res = KeyVal_binaryFindIndex(&idx, kvb, key) == 0;
+  return 0;
+}
+
+
+unsigned char
+KeyVal_binaryGetKeys(char ***res, struct KeyValBinary *kvb, const char *path) {
+  if (!res) {
+    fprintf(stderr, ERRSTR, __func__, "res");
+    errno = EINVAL;
+    return 1;
+  }
+  if (!kvb) {
+    fprintf(stderr, ERRSTR, __func__, "kvb");
+    errno = EINVAL;
+    return 1;
+  }
+  if (!path) {
+    fprintf(stderr, ERRSTR, __func__, "path");
+    errno = EINVAL;
+    return 1;
+  }
+
+  // this is KeyVal_getKeys' scan, over the table instead of the array:
+  size_t path_len = strlen(path);
+  size_t start_of_subkey = 0;
+  unsigned long start_idx = 0;
+  unsigned long end_idx = kvb->num_keys;
+  if (path_len) {
+    start_idx = KeyVal_binaryFindIdealIndex(kvb, path);
+    // skip 'path' itself, and 'path::':
+    if (start_idx < kvb->num_keys && !strcmp(KeyVal_binaryKey(kvb, start_idx), path)) {
+      ++start_idx;
+    }
+    if (start_idx < kvb->num_keys) {
+      const char *key = KeyVal_binaryKey(kvb, start_idx);
+      if (!strncmp(key, path, path_len) && !strcmp(key + path_len, "::")) ++start_idx;
+    }
+    // everything after that which starts with 'path::' and something more:
+    end_idx = start_idx;
+    while (end_idx < kvb->num_keys) {
+      const char *key = KeyVal_binaryKey(kvb, end_idx);
+      if (strncmp(key, path, path_len) || strncmp(key + path_len, "::", 2)
+          || !key[path_len + 2]) {
+        break;
+      }
+      ++end_idx;
+    }
+    start_of_subkey = path_len + 2;
+  }
+
+  // an upper bound on the number of keys:
+  *res = malloc((end_idx - start_idx + 1) * sizeof(char*));
+  if (!*res) {
+    fprintf(stderr, "KeyVal_binaryGetKeys: out of memory\n");
+    errno = ENOMEM;
+    return 1;
+  }
+  unsigned long num_keys = 0;
+  const char *prev = "";
+  size_t prev_len = 0;
+  for (unsigned long i = start_idx; i < end_idx; ++i) {
+    const char *subkey = KeyVal_binaryKey(kvb, i) + start_of_subkey;
+    size_t len = 0;
+    while (subkey[len] && !(subkey[len] == ':' && subkey[len + 1] == ':')) {
+      ++len;
+    }
+    if (len == prev_len && !strncmp(subkey, prev, len)) continue;
+    (*res)[num_keys] = strndup(subkey, len);
+    if (!(*res)[num_keys]) {
+      fprintf(stderr, "KeyVal_binaryGetKeys: out of memory\n");
+      while (num_keys) free((*res)[--num_keys]);
+      free(*res);
+      errno = ENOMEM;
+      return 1;
+    }
+    ++num_keys;
+    prev = subkey;
+    prev_len = len;
+  }
+  (*res)[num_keys] = 0;
+  return 0;
+}
+
+
+unsigned char
+KeyVal_binarySize(unsigned long *res, struct KeyValBinary *kvb) {
+  if (!res) {
+    fprintf(stderr, ERRSTR, __func__, "res");
+    errno = EINVAL;
+    return 1;
+  }
+  if (!kvb) {
+    fprintf(stderr, ERRSTR, __func__, "kvb");
+    errno = EINVAL;
+    return 1;
+  }
+
+  *res = kvb->num_keys;
+  return 0;
+}
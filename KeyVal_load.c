@@ -1,13 +1,41 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "KeyVal.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define KEYVAL_X86_SCAN 1
+#endif
+
 extern unsigned char KEYVAL_QUIET;
 
-static void die(const char *file, int line, const char *expected, char got) {
-  if (KEYVAL_QUIET) return;  // hopefully only for regressions
+// internal functions from KeyVal.c:
+unsigned char KeyVal_setValueBorrowed(struct KeyVal *kv, const char *key,
+    const char *val, unsigned char key_borrowed, unsigned char val_borrowed);
+
+// Everything get_input_char needs to know about one input file.  Each call to
+// load_file has its own, so that any number of loads can run at once (as long
+// as they're loading into different KeyVals).
+struct input_state {
+  FILE *fh;
+  char *buf;
+  long ptr;
+  long eof_location;
+  char *map;  // the whole file, if it could be mmap'ed
+  const char *filename;
+  unsigned char quiet;  // (no error messages, even without KEYVAL_QUIET)
+};
+
+
+static void die(const struct input_state *in, int line, const char *expected, char got) {
+  if (KEYVAL_QUIET || in->quiet) return;  // hopefully only for regressions
 
   char got_fmt[16];
   if (got == -1)
@@ -23,26 +51,30 @@ static void die(const char *file, int line, const char *expected, char got) {
 
   fprintf(stderr,
       "[ERROR] expecting %s, but got '%s'\n  at line %d of %s\n",
-      expected, got_fmt, line, file);
+      expected, got_fmt, line, in->filename);
   return;
 }
 
-
-static char *get_input_char__buf;
-static int get_input_char__ptr;
-static int get_input_char__eof_location;
 // Returns:
 //   -1  at EOF
 //   -2  on error
 //   or whatever the next character of input is
-static short get_input_char(FILE *fh) {
+static short get_input_char(struct input_state *in) {
+
+  // a mapped file is already entirely in memory:
+  if (in->map) {
+    if (in->ptr == in->eof_location) {
+      return -1;
+    }
+    return in->map[in->ptr++];
+  }
 
   // do I need to read in the next page:
-  if (get_input_char__ptr == 4096) {
-    int num_read = fread(get_input_char__buf, 1, 4096, fh);
+  if (in->ptr == 4096) {
+    int num_read = fread(in->buf, 1, 4096, in->fh);
     if (!num_read) {
       // could be EOF or an error.  Error => return -2:
-      if (ferror(fh)) {
+      if (ferror(in->fh)) {
         if (!KEYVAL_QUIET) {
           fprintf(stderr,
               "[ERROR] problem reading input file.  (Did it vanish?)\n");
@@ -50,58 +82,277 @@ static short get_input_char(FILE *fh) {
         return -2;
       }
     }
-    get_input_char__eof_location = num_read;
-    get_input_char__ptr = 0;
+    in->eof_location = num_read;
+    in->ptr = 0;
   }
 
   // EOF => return -1:
-  if (get_input_char__ptr == get_input_char__eof_location) {
+  if (in->ptr == in->eof_location) {
     return -1;
   }
 
   // ok, next byte's ready to go:
-//printf("** returning '%c'\n", get_input_char__buf[get_input_char__ptr]);
-  return get_input_char__buf[get_input_char__ptr++];
+//printf("** returning '%c'\n", in->buf[in->ptr]);
+  return in->buf[in->ptr++];
 }
 
 
-unsigned char KeyVal_load(struct KeyVal *keyval, const char *filename) {
+// An op log is a parsed file that hasn't been applied to a KeyVal yet: every
+// set and remove, in file order, with the strings copied into one growing
+// buffer.  (Offsets rather than pointers, since the buffer moves as it grows.)
+// KeyVal_loadMany and KeyVal_loadParallel parse files (or pieces of one)
+// into these on worker threads, and then replay them into the KeyVal in order.
+struct load_op {
+  unsigned long key_off;
+  unsigned long val_off;  // (or LOAD_OP_REMOVE)
+};
 
-  FILE *fh = fopen(filename, "r");
-  if (!fh) {
-    if (!KEYVAL_QUIET) {
-      fprintf(stderr,
-          "[ERROR] cannot open file '%s'\n",
-          filename);
+struct load_ops {
+  char *buf;
+  unsigned long buf_len;
+  unsigned long buf_max;
+  struct load_op *ops;
+  unsigned long num_ops;
+  unsigned long max_ops;
+};
+
+static const unsigned long LOAD_OP_REMOVE = (unsigned long)-1;
+
+// Copies 'str' onto the end of the op log's buffer, and returns its offset
+// (or LOAD_OP_REMOVE, if out of memory).
+static unsigned long
+load_ops_add_str(struct load_ops *ops, const char *str) {
+  unsigned long len = strlen(str) + 1;
+  if (ops->buf_len + len > ops->buf_max) {
+    unsigned long new_max = ops->buf_max ? ops->buf_max * 2 : 65536;
+    while (new_max < ops->buf_len + len) new_max *= 2;
+    char *new_buf = realloc(ops->buf, new_max);
+    if (!new_buf) return LOAD_OP_REMOVE;
+    ops->buf = new_buf;
+    ops->buf_max = new_max;
+  }
+  memcpy(ops->buf + ops->buf_len, str, len);
+  ops->buf_len += len;
+  return ops->buf_len - len;
+}
+
+// Records a set (or, with 'val' 0, a remove) in the op log.
+// Returns:
+//   0: everything okay
+//   1: out of memory.  stderr spewed, errno is set.
+static unsigned char
+load_ops_add(struct load_ops *ops, const char *key, const char *val) {
+  if (ops->num_ops == ops->max_ops) {
+    unsigned long new_max = ops->max_ops ? ops->max_ops * 2 : 1024;
+    struct load_op *new_ops = realloc(ops->ops, new_max * sizeof(struct load_op));
+    if (!new_ops) goto oom;
+    ops->ops = new_ops;
+    ops->max_ops = new_max;
+  }
+  struct load_op *op = &ops->ops[ops->num_ops];
+  op->key_off = load_ops_add_str(ops, key);
+  if (op->key_off == LOAD_OP_REMOVE) goto oom;
+  op->val_off = LOAD_OP_REMOVE;
+  if (val) {
+    op->val_off = load_ops_add_str(ops, val);
+    if (op->val_off == LOAD_OP_REMOVE) goto oom;
+  }
+  ++ops->num_ops;
+  return 0;
+
+oom:
+  fprintf(stderr, "KeyVal_load: out of memory\n");
+  errno = ENOMEM;
+  return 1;
+}
+
+
+// Applies one parsed line: either straight to 'keyval', or (if 'ops' isn't 0)
+// to the end of an op log.  A 'val' of 0 means the line was a remove.
+// Returns:
+//   0: everything okay
+//   1: encountered errors.  stderr spewed, errno is set.
+static unsigned char
+load_apply(struct KeyVal *keyval, struct load_ops *ops,
+    const char *key, const char *val,
+    unsigned char key_borrowed, unsigned char val_borrowed) {
+  if (ops) return load_ops_add(ops, key, val);
+  if (!val) return KeyVal_remove(keyval, key);
+  return KeyVal_setValueBorrowed(keyval, key, val, key_borrowed, val_borrowed);
+}
+
+
+//////////////////////////////////////// scanning
+
+// Almost every byte inside a quoted string is an ordinary character, so
+// instead of taking them through the state machine one at a time, the parser
+// looks ahead for the next byte that matters (a close-quote, a backslash, or
+// a newline) and copies the whole run in front of it at once.  There are
+// three ways of looking, from slowest to fastest:
+//   0: a word (8 bytes) at a time, which works anywhere
+//   1: SSE2, 16 bytes at a time
+//   2: AVX2, 32 bytes at a time
+// Each returns the first special byte in [p, end), or 'end' if there isn't
+// one.
+
+static inline int
+is_quoted_special(char ch) {
+  return ch == '`' || ch == '\\' || ch == '\n';
+}
+
+// (nonzero iff some byte of 'w' is zero)
+#define HAS_ZERO_BYTE(w) (((w) - 0x0101010101010101ULL) & ~(w) & 0x8080808080808080ULL)
+
+static const char *
+scan_quoted_word(const char *p, const char *end) {
+  while (p + 8 <= end) {
+    uint64_t w;
+    memcpy(&w, p, 8);
+    if (HAS_ZERO_BYTE(w ^ 0x6060606060606060ULL)  // '`'
+        || HAS_ZERO_BYTE(w ^ 0x5c5c5c5c5c5c5c5cULL)  // '\\'
+        || HAS_ZERO_BYTE(w ^ 0x0a0a0a0a0a0a0a0aULL)) {  // '\n'
+      break;
     }
-    return 2;
+    p += 8;
+  }
+  while (p < end && !is_quoted_special(*p)) ++p;
+  return p;
+}
+
+#ifdef KEYVAL_X86_SCAN
+__attribute__((target("sse2")))
+static const char *
+scan_quoted_sse2(const char *p, const char *end) {
+  const __m128i quote = _mm_set1_epi8('`');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i newline = _mm_set1_epi8('\n');
+  while (p + 16 <= end) {
+    __m128i v = _mm_loadu_si128((const __m128i*)p);
+    __m128i hits = _mm_or_si128(_mm_or_si128(
+        _mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+        _mm_cmpeq_epi8(v, newline));
+    int mask = _mm_movemask_epi8(hits);
+    if (mask) return p + __builtin_ctz(mask);
+    p += 16;
+  }
+  return scan_quoted_word(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char *
+scan_quoted_avx2(const char *p, const char *end) {
+  const __m256i quote = _mm256_set1_epi8('`');
+  const __m256i backslash = _mm256_set1_epi8('\\');
+  const __m256i newline = _mm256_set1_epi8('\n');
+  while (p + 32 <= end) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)p);
+    __m256i hits = _mm256_or_si256(_mm256_or_si256(
+        _mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, backslash)),
+        _mm256_cmpeq_epi8(v, newline));
+    unsigned int mask = _mm256_movemask_epi8(hits);
+    if (mask) return p + __builtin_ctz(mask);
+    p += 32;
+  }
+  return scan_quoted_sse2(p, end);
+}
+#endif
+
+// Returns the fastest way of scanning this CPU supports.
+static int
+best_scan_level() {
+#ifdef KEYVAL_X86_SCAN
+  if (__builtin_cpu_supports("avx2")) return 2;
+  if (__builtin_cpu_supports("sse2")) return 1;
+#endif
+  return 0;
+}
+
+// Returns the first '`', '\\', or '\n' in [p, end), or 'end' if there isn't
+// one, scanning the 'level' way (or the fastest way the CPU supports, if it
+// doesn't support that one).
+//
+// This function is internal, so it is not declared in KeyVal.h.  However,
+// test.c needs it, so it is not static.
+const char *
+KeyVal_scanQuoted(const char *p, const char *end, int level) {
+  int best = best_scan_level();
+  if (level > best) level = best;
+#ifdef KEYVAL_X86_SCAN
+  if (level == 2) return scan_quoted_avx2(p, end);
+  if (level == 1) return scan_quoted_sse2(p, end);
+#endif
+  return scan_quoted_word(p, end);
+}
+
+
+// Makes sure the string in '*buf' (currently '*max' bytes) has room for
+// 'need' bytes, and returns it (or 0, if out of memory).
+static inline char *
+room_for(char **buf, int *max, int need) {
+  if (need > *max) {
+    int new_max = *max * 2;
+    while (new_max < need) new_max *= 2;
+    char *new_buf = realloc(*buf, new_max);
+    if (!new_buf) return 0;
+    *buf = new_buf;
+    *max = new_max;
   }
+  return *buf;
+}
+
 
-  typedef enum {
-      S_WAITING_FOR_KEY,
-      S_COMMENT,
-      S_QUOTEDSTRING,
-      S_WAITING_FOR_EQ_OR_DELETE,
-      S_WAITING_FOR_VALUE,
-      S_WAITING_FOR_EOL,
-      S_ESCAPE,
-    } statelist;
+//////////////////////////////////////// parsing
+
+typedef enum {
+  S_WAITING_FOR_KEY,
+  S_COMMENT,
+  S_QUOTEDSTRING,
+  S_WAITING_FOR_EQ_OR_DELETE,
+  S_WAITING_FOR_VALUE,
+  S_WAITING_FOR_EOL,
+  S_ESCAPE,
+} statelist;
+
+// Runs the parsing state machine over 'in', from wherever it is up to its
+// EOF, starting out at the beginning of a line.  If 'end_state' isn't 0, it
+// gets the state the machine was left in.  (Anything but
+// S_WAITING_FOR_KEY means the input stopped partway through a line.)
+// Returns:
+//   0: everything okay
+//   1: parsing problems.  stderr spewed (unless in->quiet).
+static unsigned char
+parse_input(struct KeyVal *keyval, struct load_ops *ops,
+    struct input_state *in, int zero_copy,
+    statelist *end_state) {
 
   // (re)initialize all the state variables:
   statelist curr_state = S_WAITING_FOR_KEY;
   statelist stack_state = -1;  // where to pop back from certain states
-  get_input_char__buf = malloc(4096);
-  get_input_char__ptr = 4096;
-  get_input_char__eof_location = -1;
-
   int line_num = 1;
 
   // we use the same code for filling both the key and the value, so as an
-  // abstraction we point 'curr_str' to whichever one we're filling at the time:
-  char *curr_key = malloc(1024);
-  char *curr_val = malloc(1024);
+  // abstraction we point 'curr_str' to whichever one we're filling at the time.
+  // (They grow as needed; 'curr_buf' and 'curr_max' are where to grow it.)
+  int key_max = 1024;
+  int val_max = 1024;
+  char *curr_key = malloc(key_max);
+  char *curr_val = malloc(val_max);
   char *curr_str;
+  char **curr_buf = &curr_key;
+  int *curr_max = &key_max;
   int curr_str_len;
+  int scan_level = best_scan_level();
+
+  // In zero-copy mode, a string is first tracked as a span of the mapping.
+  // If it gets all the way to its close-quote without an escape, the
+  // close-quote becomes its terminator and nothing is copied.  Otherwise it
+  // falls back to being copied into curr_str.  'key_span' and 'val_span' are
+  // the results (or 0 if they were copied), and 'curr_span' points at
+  // whichever one is being filled.
+  char *key_span = 0;
+  char *val_span = 0;
+  char **curr_span = &key_span;
+  unsigned char removing = 0;  // whether the current line is a remove
 
   int retcode = 0;
   int burn_to_eol = 0;  // for error listing
@@ -111,7 +362,29 @@ unsigned char KeyVal_load(struct KeyVal *keyval, const char *filename) {
 
   do {  // this is a do-while because the EOF needs to go through the machine
 
-    input_char = get_input_char(fh);
+    // Fast paths for the long runs of ordinary bytes inside quoted strings
+    // and comments.  Each stops just short of the byte that ends its run, and
+    // leaves that one for the state machine.
+    if (in->ptr < in->eof_location
+        && (curr_state == S_QUOTEDSTRING || curr_state == S_COMMENT)) {
+      char *data = in->map ? in->map : in->buf;
+      const char *run = data + in->ptr;
+      const char *stop;
+      if (curr_state == S_QUOTEDSTRING) {
+        stop = KeyVal_scanQuoted(run, data + in->eof_location, scan_level);
+        if (stop > run && !*curr_span) {
+          if (!(curr_str = room_for(curr_buf, curr_max, curr_str_len + (stop - run) + 1))) goto oom;
+          memcpy(curr_str + curr_str_len, run, stop - run);
+          curr_str_len += stop - run;
+        }
+      } else {
+        stop = memchr(run, '\n', in->eof_location - in->ptr);
+        if (!stop) stop = data + in->eof_location;
+      }
+      in->ptr += stop - run;
+    }
+
+    input_char = get_input_char(in);
 //printf("* state=%d, input=%c (%d)\n", curr_state, input_char, input_char);
 
     if (input_char == -2) break;  // in case of error
@@ -128,7 +401,11 @@ unsigned char KeyVal_load(struct KeyVal *keyval, const char *filename) {
         stack_state = S_WAITING_FOR_EQ_OR_DELETE;
         curr_state = S_QUOTEDSTRING;
         curr_str = curr_key;
+        curr_buf = &curr_key;
+        curr_max = &key_max;
         curr_str_len = 0;
+        curr_span = &key_span;
+        *curr_span = zero_copy ? in->map + in->ptr : 0;
         break;
       // skip whitespace:
       case ' ':
@@ -142,7 +419,7 @@ unsigned char KeyVal_load(struct KeyVal *keyval, const char *filename) {
         break;
       // anything else is unexpected:
       default:
-        die(filename, line_num, "comment or key", input_char);
+        die(in, line_num, "comment or key", input_char);
         burn_to_eol = 1;
         break;
       }
@@ -168,23 +445,40 @@ unsigned char KeyVal_load(struct KeyVal *keyval, const char *filename) {
       switch(input_char) {
       // close-quote:
       case '`':
-        curr_str[curr_str_len] = 0;
+        if (*curr_span) {
+          // terminate the span in place, on top of the close-quote:
+          in->map[in->ptr - 1] = 0;
+        } else {
+          curr_str[curr_str_len] = 0;
+        }
         curr_state = stack_state;
         stack_state = -1;
         break;
       // escape sequence:
       case '\\':
+        if (*curr_span) {
+          // escapes need rewriting, so switch over to copying:
+          curr_str_len = in->map + in->ptr - 1 - *curr_span;
+          if (!(curr_str = room_for(curr_buf, curr_max, curr_str_len + 3))) goto oom;
+          memcpy(curr_str, *curr_span, curr_str_len);
+          *curr_span = 0;
+        }
         curr_state = S_ESCAPE;
         break;
       // carriage returns and EOF are about the only thing we don't want to see:
       case '\n':
       case -1:
         ++line_num;
-        die(filename, line_num, "anything but \\n or EOF", input_char);
+        die(in, line_num, "anything but \\n or EOF", input_char);
         burn_to_eol = 1;
         break;
       // any other character just gets added to the string:
-      default: curr_str[curr_str_len++] = input_char; break;
+      default:
+        if (!*curr_span) {
+          if (!(curr_str = room_for(curr_buf, curr_max, curr_str_len + 2))) goto oom;
+          curr_str[curr_str_len++] = input_char;
+        }
+        break;
       }
       break;
 
@@ -201,23 +495,24 @@ unsigned char KeyVal_load(struct KeyVal *keyval, const char *filename) {
       // a "d" means it's a key-delete (maybe)
       case 'r':
         // manually scan the next several bytes for "remove"
-        if (get_input_char(fh) != 'e'
-            || get_input_char(fh) != 'm'
-            || get_input_char(fh) != 'o'
-            || get_input_char(fh) != 'v'
-            || get_input_char(fh) != 'e') {
+        if (get_input_char(in) != 'e'
+            || get_input_char(in) != 'm'
+            || get_input_char(in) != 'o'
+            || get_input_char(in) != 'v'
+            || get_input_char(in) != 'e') {
           // this is perhaps not the clearest error message, but hey:
-          die(filename, line_num, "remove", '?');
+          die(in, line_num, "remove", '?');
           burn_to_eol = 1;
           break;
         }
-        KeyVal_remove(keyval, curr_key);
+        // (the remove happens at the end of the line, like a set would)
+        removing = 1;
         curr_state = S_WAITING_FOR_EOL;
         break;
       case '\n':
         ++line_num;
       default:
-        die(filename, line_num, "= or delete", input_char);
+        die(in, line_num, "= or delete", input_char);
         burn_to_eol = 1;
         break;
       }
@@ -230,7 +525,11 @@ unsigned char KeyVal_load(struct KeyVal *keyval, const char *filename) {
         stack_state = S_WAITING_FOR_EOL;
         curr_state = S_QUOTEDSTRING;
         curr_str = curr_val;
+        curr_buf = &curr_val;
+        curr_max = &val_max;
         curr_str_len = 0;
+        curr_span = &val_span;
+        *curr_span = zero_copy ? in->map + in->ptr : 0;
         break;
       // skip whitespace:
       case ' ':
@@ -240,7 +539,7 @@ unsigned char KeyVal_load(struct KeyVal *keyval, const char *filename) {
       case '\n':
         ++line_num;
       default:
-        die(filename, line_num, "comment or value", input_char);
+        die(in, line_num, "comment or value", input_char);
         burn_to_eol = 1;
         break;
       }
@@ -251,15 +550,23 @@ unsigned char KeyVal_load(struct KeyVal *keyval, const char *filename) {
       // escapes are removed from backslashes and quotes:
       case '\\':
       case '`':
+        if (!(curr_str = room_for(curr_buf, curr_max, curr_str_len + 2))) goto oom;
         curr_str[curr_str_len++] = input_char;
         curr_state = S_QUOTEDSTRING;
         break;
+      // EOF is still a problem:
+      case -1:
+        die(in, line_num, "anything but EOF", input_char);
+        burn_to_eol = 1;
+        break;
       // any other escapes are actually just preserved:
       case '\n':
         ++line_num;
       default:
+        if (!(curr_str = room_for(curr_buf, curr_max, curr_str_len + 3))) goto oom;
         curr_str[curr_str_len++] = '\\';
         curr_str[curr_str_len++] = input_char;
+        curr_state = S_QUOTEDSTRING;
         break;
       }
       break;
@@ -276,13 +583,19 @@ unsigned char KeyVal_load(struct KeyVal *keyval, const char *filename) {
         curr_state = S_WAITING_FOR_KEY;
       case -1: // (EOF)
 //printf("[debug] '%s' => '%s'\n", curr_key, curr_val);
-        // add it to the database:
-        KeyVal_setValue(keyval, curr_key, curr_val);
+        // add it to (or remove it from) the database:
+        if (load_apply(keyval, ops,
+            key_span ? key_span : curr_key,
+            removing ? 0 : (val_span ? val_span : curr_val),
+            key_span != 0, val_span != 0)) {
+          retcode = 1;
+        }
+        removing = 0;
 //printf("b\n");
         break;
       // anything else is unrecognized:
       default:
-        die(filename, line_num, "carriage return", input_char);
+        die(in, line_num, "carriage return", input_char);
         burn_to_eol = 1;
         break;
       }
@@ -298,11 +611,14 @@ unsigned char KeyVal_load(struct KeyVal *keyval, const char *filename) {
       retcode = 1;
       // pretend we're starting back at the beginning:
       curr_state = S_WAITING_FOR_KEY;
+      removing = 0;
       curr_str = curr_key;
+      curr_buf = &curr_key;
+      curr_max = &key_max;
       curr_str_len = 0;
       // burn input until we hit \n (or EOF) (or an actual error):
       while (input_char != '\n' && input_char != -1 && input_char != -2) {
-        input_char = get_input_char(fh);
+        input_char = get_input_char(in);
       }
       ++line_num;
       if (input_char == -2) break; // in case of error reading input
@@ -310,7 +626,7 @@ unsigned char KeyVal_load(struct KeyVal *keyval, const char *filename) {
       // count the number of errors we see, and stop before flooding the screen:
       ++error_count;
       if (error_count == 13) {
-        if (!KEYVAL_QUIET) fprintf(stderr, "^^ too many errors, halting\n");
+        if (!KEYVAL_QUIET && !in->quiet) fprintf(stderr, "^^ too many errors, halting\n");
         break;
       }
 
@@ -319,13 +635,649 @@ unsigned char KeyVal_load(struct KeyVal *keyval, const char *filename) {
     }
 //printf("d\n");
   } while (input_char != -1);
-//printf("e\n");
-  // cleanup:
-  fclose(fh);
+  goto done;
+
+oom:
+  fprintf(stderr, "KeyVal_load: out of memory\n");
+  errno = ENOMEM;
+  retcode = 1;
+
+done:
+  if (end_state) *end_state = curr_state;
   free(curr_key); curr_key = 0;
   free(curr_val); curr_val = 0;
-  free(get_input_char__buf); get_input_char__buf = 0;
+  return retcode;
+}
+
+
+// This is the guts of KeyVal_load and KeyVal_loadMapped.  With 'zero_copy',
+// the mapping is writable (but private), each unescaped string is terminated
+// in place, and the mapping is handed over to 'keyval' at the end.  With
+// 'ops', 'keyval' isn't touched at all; everything goes into the op log.
+static unsigned char
+load_file(struct KeyVal *keyval, struct load_ops *ops, const char *filename, int zero_copy) {
+
+  // (checked up front, so that a frozen KeyVal doesn't get a parse error for
+  // every line of the file)
+  if (!ops && keyval->frozen) {
+    if (!KEYVAL_QUIET) {
+      fprintf(stderr, "[ERROR] cannot load '%s' into a frozen KeyVal\n", filename);
+    }
+    errno = EPERM;
+    return 1;
+  }
+
+  FILE *fh = fopen(filename, "r");
+  if (!fh) {
+    if (!KEYVAL_QUIET) {
+      fprintf(stderr,
+          "[ERROR] cannot open file '%s'\n",
+          filename);
+    }
+    return 2;
+  }
+
+  struct input_state in;
+  in.fh = fh;
+  in.buf = malloc(4096);
+  in.ptr = 4096;
+  in.eof_location = -1;
+  in.map = 0;
+  in.filename = filename;
+  in.quiet = 0;
+
+  // Regular files get mapped in whole, which saves a copy and a refill check
+  // on every byte.  Pipes, special files, empty files, and anything that
+  // refuses to map go through the 4 KiB fread buffer instead.
+  struct stat st;
+  if (fstat(fileno(fh), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    int prot = zero_copy ? PROT_READ | PROT_WRITE : PROT_READ;
+    void *map = mmap(0, st.st_size, prot, MAP_PRIVATE, fileno(fh), 0);
+    if (map != MAP_FAILED) {
+      madvise(map, st.st_size, MADV_SEQUENTIAL);
+      in.map = map;
+      in.ptr = 0;
+      in.eof_location = st.st_size;
+    }
+  }
+
+  zero_copy = zero_copy && in.map && !ops;
+  int retcode = parse_input(keyval, ops, &in, zero_copy, 0);
+
+  // cleanup:
+  if (in.map) {
+    struct KeyValMapping *mapping = zero_copy ? malloc(sizeof(struct KeyValMapping)) : 0;
+    if (mapping) {
+      // elements may be pointing into it, so the KeyVal owns it now:
+      mapping->addr = in.map;
+      mapping->len = in.eof_location;
+      mapping->next = keyval->mappings;
+      keyval->mappings = mapping;
+    }
+    else if (zero_copy) {
+      // Can't hand it over, and can't unmap it while elements point into it.
+      // Leaking it is the lesser evil:
+      fprintf(stderr, "KeyVal_loadMapped: out of memory\n");
+      retcode = 1;
+    }
+    else {
+      munmap(in.map, in.eof_location);
+    }
+    in.map = 0;
+  }
+  fclose(fh);
+  free(in.buf); in.buf = 0;
 //printf("f\n");
 
   return retcode;
 }
+
+
+unsigned char KeyVal_load(struct KeyVal *keyval, const char *filename) {
+  return load_file(keyval, 0, filename, 0);
+}
+
+
+unsigned char KeyVal_loadMapped(struct KeyVal *keyval, const char *filename) {
+  return load_file(keyval, 0, filename, 1);
+}
+
+
+// Runs 'worker' on 'num_threads' threads at once (this one included), and
+// waits for them all.  The workers are expected to share out the work among
+// themselves.  If threads can't be started, fewer of them do the work.
+static void
+run_workers(void *(*worker)(void*), void *arg, unsigned int num_threads) {
+  pthread_t *threads = malloc((num_threads - 1) * sizeof(pthread_t));
+  unsigned int num_started = 0;
+  while (threads && num_started < num_threads - 1
+      && !pthread_create(&threads[num_started], 0, worker, arg)) {
+    ++num_started;
+  }
+  worker(arg);
+  for (unsigned int t = 0; t < num_started; ++t) {
+    pthread_join(threads[t], 0);
+  }
+  free(threads);
+}
+
+
+// Applies everything in an op log to 'keyval', in order, and frees it.
+// Returns:
+//   0: everything okay
+//   1: encountered errors.  stderr spewed, errno is set.
+static unsigned char
+load_ops_replay(struct KeyVal *keyval, struct load_ops *ops) {
+  unsigned char retcode = 0;
+  for (unsigned long o = 0; o < ops->num_ops; ++o) {
+    struct load_op *op = &ops->ops[o];
+    const char *key = ops->buf + op->key_off;
+    unsigned char res = (op->val_off == LOAD_OP_REMOVE)
+        ? KeyVal_remove(keyval, key)
+        : KeyVal_setValue(keyval, key, ops->buf + op->val_off);
+    if (res) retcode = 1;
+  }
+  free(ops->buf);
+  free(ops->ops);
+  return retcode;
+}
+
+
+// One of KeyVal_loadMany's files, and what became of it.
+struct load_many_job {
+  const char *filename;
+  struct load_ops ops;
+  unsigned char retcode;
+};
+
+struct load_many_state {
+  struct load_many_job *jobs;
+  unsigned long num_jobs;
+  unsigned long next_job;  // (shared by the workers; atomic)
+};
+
+static void *
+load_many_worker(void *arg) {
+  struct load_many_state *state = arg;
+  while (1) {
+    unsigned long j = __sync_fetch_and_add(&state->next_job, 1);
+    if (j >= state->num_jobs) break;
+    struct load_many_job *job = &state->jobs[j];
+    job->retcode = load_file(0, &job->ops, job->filename, 0);
+  }
+  return 0;
+}
+
+unsigned char KeyVal_loadMany(struct KeyVal *keyval, const char **filenames,
+    unsigned long num_files, unsigned int num_threads) {
+  if (!keyval) {
+    fprintf(stderr, "KeyVal_loadMany: 'keyval' argument null\n");
+    errno = EINVAL;
+    return 1;
+  }
+  if (!filenames && num_files) {
+    fprintf(stderr, "KeyVal_loadMany: 'filenames' argument null\n");
+    errno = EINVAL;
+    return 1;
+  }
+  if (keyval->frozen) {
+    if (!KEYVAL_QUIET) {
+      fprintf(stderr, "[ERROR] cannot load into a frozen KeyVal\n");
+    }
+    errno = EPERM;
+    return 1;
+  }
+
+  // one thread doesn't need any of the machinery:
+  if (num_threads > num_files) num_threads = num_files;
+  if (num_threads <= 1) {
+    unsigned char retcode = 0;
+    for (unsigned long i = 0; i < num_files; ++i) {
+      unsigned char res = load_file(keyval, 0, filenames[i], 0);
+      if (res > retcode) retcode = res;
+    }
+    return retcode;
+  }
+
+  struct load_many_state state;
+  state.jobs = calloc(num_files, sizeof(struct load_many_job));
+  if (!state.jobs) {
+    fprintf(stderr, "KeyVal_loadMany: out of memory\n");
+    errno = ENOMEM;
+    return 1;
+  }
+  state.num_jobs = num_files;
+  state.next_job = 0;
+  for (unsigned long i = 0; i < num_files; ++i) {
+    state.jobs[i].filename = filenames[i];
+  }
+
+  // parse everything in parallel:
+  run_workers(load_many_worker, &state, num_threads);
+
+  // and replay it all in order, exactly as if the files had been loaded one
+  // after the other:
+  unsigned char retcode = 0;
+  for (unsigned long i = 0; i < num_files; ++i) {
+    struct load_many_job *job = &state.jobs[i];
+    if (job->retcode > retcode) retcode = job->retcode;
+    if (load_ops_replay(keyval, &job->ops) && !retcode) retcode = 1;
+  }
+  free(state.jobs);
+  return retcode;
+}
+
+
+// KeyVal_loadParallel won't bother splitting anything smaller than this:
+static const long LOAD_PARALLEL_MIN_CHUNK = 1 << 20;
+
+// One piece of the file KeyVal_loadParallel is splitting up, and what became
+// of it.
+struct load_chunk {
+  long start;
+  long end;
+  struct load_ops ops;
+  unsigned char retcode;
+  statelist end_state;
+};
+
+struct load_parallel_state {
+  const char *filename;
+  char *map;
+  struct load_chunk *chunks;
+  unsigned long num_chunks;
+  unsigned long next_chunk;  // (shared by the workers; atomic)
+};
+
+static void *
+load_parallel_worker(void *arg) {
+  struct load_parallel_state *state = arg;
+  while (1) {
+    unsigned long c = __sync_fetch_and_add(&state->next_chunk, 1);
+    if (c >= state->num_chunks) break;
+    struct load_chunk *chunk = &state->chunks[c];
+    struct input_state in;
+    in.fh = 0;
+    in.buf = 0;
+    in.ptr = chunk->start;
+    in.eof_location = chunk->end;
+    in.map = state->map;
+    in.filename = state->filename;
+    // (its line numbers would be wrong anyway; see below)
+    in.quiet = 1;
+    chunk->retcode = parse_input(0, &chunk->ops, &in, 0, &chunk->end_state);
+  }
+  return 0;
+}
+
+unsigned char KeyVal_loadParallel(struct KeyVal *keyval, const char *filename,
+    unsigned int num_threads) {
+  if (!keyval) {
+    fprintf(stderr, "KeyVal_loadParallel: 'keyval' argument null\n");
+    errno = EINVAL;
+    return 1;
+  }
+  if (!filename) {
+    fprintf(stderr, "KeyVal_loadParallel: 'filename' argument null\n");
+    errno = EINVAL;
+    return 1;
+  }
+  if (num_threads <= 1 || keyval->frozen) {
+    return load_file(keyval, 0, filename, 0);
+  }
+
+  // Only regular files can be split up.  Everything else (including files
+  // that can't be opened at all) goes through the usual path, which knows
+  // how to complain about them.
+  FILE *fh = fopen(filename, "r");
+  if (!fh) return load_file(keyval, 0, filename, 0);
+  struct stat st;
+  char *map = 0;
+  if (fstat(fileno(fh), &st) == 0 && S_ISREG(st.st_mode)
+      && st.st_size >= 2 * LOAD_PARALLEL_MIN_CHUNK) {
+    map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fh), 0);
+    if (map == MAP_FAILED) map = 0;
+  }
+  fclose(fh);
+  if (!map) return load_file(keyval, 0, filename, 0);
+  madvise(map, st.st_size, MADV_WILLNEED);
+
+  // A few chunks per thread, so that a slow one doesn't hold everyone up:
+  unsigned long max_chunks = num_threads * 4;
+  if (max_chunks > (unsigned long)(st.st_size / LOAD_PARALLEL_MIN_CHUNK)) {
+    max_chunks = (unsigned long)(st.st_size / LOAD_PARALLEL_MIN_CHUNK);
+  }
+  struct load_parallel_state state;
+  state.filename = filename;
+  state.map = map;
+  state.chunks = calloc(max_chunks, sizeof(struct load_chunk));
+  state.num_chunks = 0;
+  state.next_chunk = 0;
+  if (!state.chunks) {
+    munmap(map, st.st_size);
+    return load_file(keyval, 0, filename, 0);
+  }
+
+  // Each chunk starts just after a newline, which is where a new line starts,
+  // unless the newline was escaped inside a quoted string.  Skipping past
+  // newlines with a backslash in front of them dodges the obvious cases.
+  // Whether the guess was right gets checked after the parse: the chunk in
+  // front has to have ended up between lines.
+  long start = 0;
+  for (unsigned long c = 1; c <= max_chunks; ++c) {
+    long end = st.st_size;
+    if (c < max_chunks) {
+      end = (long)(st.st_size * (double)c / max_chunks);
+      if (end <= start) continue;
+      char *nl;
+      while ((nl = memchr(map + end, '\n', st.st_size - end))
+          && nl > map && nl[-1] == '\\') {
+        end = nl + 1 - map;
+      }
+      if (!nl) continue;
+      end = nl + 1 - map;
+    }
+    struct load_chunk *chunk = &state.chunks[state.num_chunks++];
+    chunk->start = start;
+    chunk->end = end;
+    start = end;
+    if (start == st.st_size) break;
+  }
+
+  run_workers(load_parallel_worker, &state, num_threads);
+
+  // Any parsing problems, and the whole file gets loaded again, the usual
+  // way.  That's what reports them, with the right line numbers, and it
+  // takes care of anything split in the wrong place, too.
+  int ok = 1;
+  for (unsigned long c = 0; c < state.num_chunks; ++c) {
+    struct load_chunk *chunk = &state.chunks[c];
+    if (chunk->retcode
+        || (c + 1 < state.num_chunks && chunk->end_state != S_WAITING_FOR_KEY)) {
+      ok = 0;
+    }
+  }
+
+  unsigned char retcode = 0;
+  for (unsigned long c = 0; c < state.num_chunks; ++c) {
+    struct load_chunk *chunk = &state.chunks[c];
+    if (!ok) {
+      free(chunk->ops.buf);
+      free(chunk->ops.ops);
+    }
+    else if (load_ops_replay(keyval, &chunk->ops)) {
+      retcode = 1;
+    }
+  }
+  free(state.chunks);
+  munmap(map, st.st_size);
+  if (!ok) return load_file(keyval, 0, filename, 0);
+  return retcode;
+}
+
+
+//////////////////////////////////////// layers
+
+// A file loaded by KeyVal_loadLayer is kept as two KeyVals: the keys it
+// leaves set, and the keys it leaves removed.  Only the last line for each
+// key counts, so the lines are sorted by key (and then by where they were) to
+// find it.
+struct layer_line {
+  const char *key;
+  unsigned long pos;  // index into the op log
+};
+
+static int
+layer_line_cmp(const void *a, const void *b) {
+  const struct layer_line *l1 = a;
+  const struct layer_line *l2 = b;
+  int cmp = strcmp(l1->key, l2->key);
+  if (cmp) return cmp;
+  return (l1->pos < l2->pos) ? -1 : (l1->pos > l2->pos);
+}
+
+// Parses 'filename' into new 'layer->sets' and 'layer->removes'.  With
+// parsing problems, they still get whatever could be parsed (like
+// KeyVal_load).
+// Returns:
+//   0: everything okay
+//   1: parsing or memory problems.  stderr spewed, errno is set.
+//   2: problem opening the file.  stderr spewed.  Nothing is allocated.
+static unsigned char
+layer_parse(struct KeyValLayer *layer, const char *filename) {
+  struct load_ops ops = {0, 0, 0, 0, 0, 0};
+  layer->sets = 0;
+  layer->removes = 0;
+  unsigned char retcode = load_file(0, &ops, filename, 0);
+  if (retcode == 2) return 2;
+
+  // (the keys and values that win, 'n' slots each for sets and removes)
+  unsigned long n = ops.num_ops;
+  struct layer_line *lines = malloc((n ? n : 1) * sizeof(struct layer_line));
+  const char **strs = malloc((n ? n : 1) * 4 * sizeof(char*));
+  if (!lines || !strs) {
+    fprintf(stderr, "KeyVal_loadLayer: out of memory\n");
+    errno = ENOMEM;
+    retcode = 1;
+    goto done;
+  }
+  for (unsigned long i = 0; i < n; ++i) {
+    lines[i].key = ops.buf + ops.ops[i].key_off;
+    lines[i].pos = i;
+  }
+  qsort(lines, n, sizeof(struct layer_line), layer_line_cmp);
+
+  const char **set_keys = strs;
+  const char **set_vals = strs + n;
+  const char **remove_keys = strs + 2 * n;
+  const char **remove_vals = strs + 3 * n;
+  unsigned long num_sets = 0;
+  unsigned long num_removes = 0;
+  for (unsigned long i = 0; i < n; ++i) {
+    if (i + 1 < n && !strcmp(lines[i].key, lines[i+1].key)) continue;
+    struct load_op *op = &ops.ops[lines[i].pos];
+    if (op->val_off == LOAD_OP_REMOVE) {
+      remove_keys[num_removes] = lines[i].key;
+      remove_vals[num_removes++] = "";
+    } else {
+      set_keys[num_sets] = lines[i].key;
+      set_vals[num_sets++] = ops.buf + op->val_off;
+    }
+  }
+  if (KeyVal_newWithArena(&layer->sets)
+      || KeyVal_newWithArena(&layer->removes)
+      || KeyVal_setValues(layer->sets, set_keys, set_vals, num_sets)
+      || KeyVal_setValues(layer->removes, remove_keys, remove_vals, num_removes)) {
+    retcode = 1;
+  }
+
+done:
+  if (retcode == 1 && (!layer->sets || !layer->removes)) {
+    if (layer->sets) KeyVal_delete(layer->sets);
+    if (layer->removes) KeyVal_delete(layer->removes);
+    layer->sets = 0;
+    layer->removes = 0;
+  }
+  free(lines);
+  free(strs);
+  free(ops.buf);
+  free(ops.ops);
+  return retcode;
+}
+
+// Sets (or removes) 'key' in 'keyval' the way its layers say to: the last
+// layer that mentions it wins, and if none of them do, it goes.
+// Returns:
+//   0: everything okay
+//   1: encountered errors.  stderr spewed, errno is set.
+static unsigned char
+layer_recompute(struct KeyVal *keyval, const char *key) {
+  const char *val = 0;
+  unsigned long len;
+  for (unsigned long l = keyval->num_layers; l-- > 0; ) {
+    struct KeyValLayer *layer = &keyval->layers[l];
+    if (KeyVal_peekValue(&val, &len, layer->sets, key, 0)) return 1;
+    if (val) break;
+    unsigned char removed;
+    if (KeyVal_hasValue(&removed, layer->removes, key)) return 1;
+    if (removed) break;
+  }
+
+  // (no change, no setValue, so that the interpolation cache and the journal
+  // only hear about real changes)
+  const char *curr;
+  if (KeyVal_peekValue(&curr, &len, keyval, key, 0)) return 1;
+  if (!val) return curr ? KeyVal_remove(keyval, key) : 0;
+  if (curr && !strcmp(curr, val)) return 0;
+  return KeyVal_setValue(keyval, key, val);
+}
+
+// Recomputes every key in 'mentions' (one of a layer's KeyVals).
+static unsigned char
+layer_recompute_all(struct KeyVal *keyval, struct KeyVal *mentions) {
+  struct KeyValCursor cur;
+  const char *key;
+  if (KeyVal_cursorSubtree(&cur, mentions, "")) return 1;
+  while (1) {
+    if (KeyVal_cursorKey(&key, &cur)) return 1;
+    if (!key) return 0;
+    if (layer_recompute(keyval, key)) return 1;
+    if (KeyVal_cursorNext(&cur)) return 1;
+  }
+}
+
+// (Nanoseconds, because a file rewritten within the same second as it was
+// loaded would otherwise look unchanged, and the change time too, because
+// the modification time can be set back by hand.)
+static void
+layer_stat(struct KeyValLayer *layer, const struct stat *st) {
+  layer->inode = st->st_ino;
+  layer->size = st->st_size;
+  layer->mtime_sec = st->st_mtim.tv_sec;
+  layer->mtime_nsec = st->st_mtim.tv_nsec;
+  layer->ctime_sec = st->st_ctim.tv_sec;
+  layer->ctime_nsec = st->st_ctim.tv_nsec;
+}
+
+static unsigned char
+layer_unchanged(const struct KeyValLayer *layer, const struct stat *st) {
+  return (unsigned long)st->st_ino == layer->inode && st->st_size == layer->size
+      && st->st_mtim.tv_sec == layer->mtime_sec && st->st_mtim.tv_nsec == layer->mtime_nsec
+      && st->st_ctim.tv_sec == layer->ctime_sec && st->st_ctim.tv_nsec == layer->ctime_nsec;
+}
+
+static unsigned char
+layer_checks(struct KeyVal *keyval, const char *func) {
+  if (!keyval) {
+    fprintf(stderr, "%s: 'keyval' argument null\n", func);
+    errno = EINVAL;
+    return 1;
+  }
+  if (keyval->frozen) {
+    if (!KEYVAL_QUIET) {
+      fprintf(stderr, "[ERROR] cannot load into a frozen KeyVal\n");
+    }
+    errno = EPERM;
+    return 1;
+  }
+  return 0;
+}
+
+unsigned char KeyVal_loadLayer(struct KeyVal *keyval, const char *filename) {
+  if (layer_checks(keyval, "KeyVal_loadLayer")) return 1;
+  if (!filename) {
+    fprintf(stderr, "KeyVal_loadLayer: 'filename' argument null\n");
+    errno = EINVAL;
+    return 1;
+  }
+
+  // (stat first: if the file changes after this, the next refresh sees it)
+  struct stat st;
+  if (stat(filename, &st)) {
+    if (!KEYVAL_QUIET) {
+      fprintf(stderr, "[ERROR] cannot open file '%s'\n", filename);
+    }
+    return 2;
+  }
+  struct KeyValLayer *layers = realloc(keyval->layers,
+      (keyval->num_layers + 1) * sizeof(struct KeyValLayer));
+  if (!layers) {
+    fprintf(stderr, "KeyVal_loadLayer: out of memory\n");
+    errno = ENOMEM;
+    return 1;
+  }
+  keyval->layers = layers;
+  struct KeyValLayer *layer = &layers[keyval->num_layers];
+  unsigned char retcode = layer_parse(layer, filename);
+  if (retcode == 2) return 2;
+  if (!layer->sets) return 1;
+  layer->filepath = strdup(filename);
+  if (!layer->filepath) {
+    fprintf(stderr, "KeyVal_loadLayer: out of memory\n");
+    KeyVal_delete(layer->sets);
+    KeyVal_delete(layer->removes);
+    errno = ENOMEM;
+    return 1;
+  }
+  layer_stat(layer, &st);
+  ++keyval->num_layers;
+
+  // it's on top, so everything it mentions goes its way:
+  if (layer_recompute_all(keyval, layer->sets)
+      || layer_recompute_all(keyval, layer->removes)) {
+    retcode = 1;
+  }
+  return retcode;
+}
+
+unsigned char KeyVal_refresh(unsigned long *res, struct KeyVal *keyval) {
+  if (!res) {
+    fprintf(stderr, "KeyVal_refresh: 'res' argument null\n");
+    errno = EINVAL;
+    return 1;
+  }
+  if (layer_checks(keyval, "KeyVal_refresh")) return 1;
+
+  *res = 0;
+  unsigned char retcode = 0;
+  for (unsigned long l = 0; l < keyval->num_layers; ++l) {
+    struct KeyValLayer *layer = &keyval->layers[l];
+    struct stat st;
+    if (stat(layer->filepath, &st)) {
+      if (!KEYVAL_QUIET) {
+        fprintf(stderr, "[ERROR] cannot open file '%s'\n", layer->filepath);
+      }
+      retcode = 2;
+      continue;
+    }
+    if (layer_unchanged(layer, &st)) continue;
+
+    // A file that doesn't parse is left the way it was, rather than applying
+    // half of it.  (Its stats stay old too, so it gets another try next time.)
+    struct KeyValLayer fresh;
+    unsigned char parse_res = layer_parse(&fresh, layer->filepath);
+    if (parse_res) {
+      if (fresh.sets) KeyVal_delete(fresh.sets);
+      if (fresh.removes) KeyVal_delete(fresh.removes);
+      if (parse_res > retcode) retcode = parse_res;
+      continue;
+    }
+    struct KeyVal *old_sets = layer->sets;
+    struct KeyVal *old_removes = layer->removes;
+    layer->sets = fresh.sets;
+    layer->removes = fresh.removes;
+    layer_stat(layer, &st);
+    ++*res;
+
+    // everything it mentioned before or mentions now might be different:
+    if (layer_recompute_all(keyval, old_sets)
+        || layer_recompute_all(keyval, old_removes)
+        || layer_recompute_all(keyval, layer->sets)
+        || layer_recompute_all(keyval, layer->removes)) {
+      retcode = 1;
+    }
+    KeyVal_delete(old_sets);
+    KeyVal_delete(old_removes);
+  }
+  return retcode;
+}
@@ -0,0 +1,816 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "KeyVal.h"
+
+/*
+bench.c is just to keep an eye on how KeyVal scales.  It is not part of
+'make check'; run it by hand.
+*/
+
+
+static const char *BENCH_FILE = "/tmp/c.bench.kv";
+
+
+static double
+now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+// Writes 'n' keys to BENCH_FILE in a shuffled (but repeatable) order.
+static void
+write_shuffled(unsigned long n) {
+  unsigned long *order = malloc(n * sizeof(unsigned long));
+  if (!order) abort();
+  for (unsigned long i = 0; i < n; ++i) {
+    order[i] = i;
+  }
+  // Fisher-Yates with a fixed LCG, so every run sees the same file:
+  unsigned long long seed = 42;
+  for (unsigned long i = n - 1; i > 0; --i) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    unsigned long j = (seed >> 33) % (i + 1);
+    unsigned long t = order[i]; order[i] = order[j]; order[j] = t;
+  }
+
+  FILE *fh = fopen(BENCH_FILE, "w");
+  if (!fh) abort();
+  for (unsigned long i = 0; i < n; ++i) {
+    fprintf(fh, "`svc%lu::host%lu::key%lu` = `value %lu`\n",
+        order[i] % 97, order[i] % 1013, order[i], order[i]);
+  }
+  if (fclose(fh)) abort();
+  free(order);
+}
+
+
+// Loading a shuffled file puts every key in the unsorted tail, so the first
+// query after the load pays for the whole sort.
+static void
+bench_shuffled_load() {
+  printf("shuffled load (load, then first query sorts the tail):\n");
+  printf("  %10s %10s %10s %12s\n", "keys", "load s", "sort s", "sort ns/key");
+  for (unsigned long n = 62500; n <= 2000000; n *= 2) {
+    write_shuffled(n);
+
+    struct KeyVal *kv;
+    if (KeyVal_new(&kv)) abort();
+    double t0 = now();
+    if (KeyVal_load(kv, BENCH_FILE)) abort();
+    double t1 = now();
+    unsigned long size;
+    if (KeyVal_size(&size, kv)) abort();  // forces the sort
+    double t2 = now();
+    if (size != n) abort();
+    if (KeyVal_delete(kv)) abort();
+
+    printf("  %10lu %10.3f %10.3f %12.1f\n",
+        n, t1 - t0, t2 - t1, (t2 - t1) * 1e9 / n);
+  }
+  printf("\n");
+}
+
+
+// KeyVal_load copies every key and value; KeyVal_loadMapped mostly doesn't,
+// and an arena makes the copies cheaper.
+static void
+bench_load_modes() {
+  const unsigned long n = 1000000;
+  write_shuffled(n);
+  printf("load modes, %lu keys:\n", n);
+  const char *names[] = {"KeyVal_load", "KeyVal_loadMapped", "load with arena"};
+  for (int mode = 0; mode < 3; ++mode) {
+    struct KeyVal *kv;
+    if (mode == 2) {
+      if (KeyVal_newWithArena(&kv)) abort();
+    } else {
+      if (KeyVal_new(&kv)) abort();
+    }
+    double t0 = now();
+    if (mode == 1) {
+      if (KeyVal_loadMapped(kv, BENCH_FILE)) abort();
+    } else {
+      if (KeyVal_load(kv, BENCH_FILE)) abort();
+    }
+    double t1 = now();
+    if (KeyVal_delete(kv)) abort();
+    double t2 = now();
+    printf("  %-18s load %.3f s, delete %.3f s\n", names[mode], t1 - t0, t2 - t1);
+  }
+  printf("\n");
+}
+
+
+// Point lookups against a big, already-sorted KeyVal, in the same shuffled
+// order the keys were written in.
+static void
+bench_lookups() {
+  const unsigned long n = 1000000;
+  write_shuffled(n);
+  struct KeyVal *kv;
+  if (KeyVal_new(&kv)) abort();
+  if (KeyVal_load(kv, BENCH_FILE)) abort();
+  unsigned long size;
+  if (KeyVal_size(&size, kv)) abort();
+
+  FILE *fh = fopen(BENCH_FILE, "r");
+  if (!fh) abort();
+  char line[256];
+  char **keys = malloc(n * sizeof(char*));
+  if (!keys) abort();
+  for (unsigned long i = 0; i < n; ++i) {
+    if (!fgets(line, sizeof(line), fh)) abort();
+    *strchr(line + 1, '`') = 0;
+    keys[i] = strdup(line + 1);
+  }
+  fclose(fh);
+
+  double t0 = now();
+  unsigned long found = 0;
+  for (unsigned long i = 0; i < n; ++i) {
+    unsigned char has;
+    if (KeyVal_hasValue(&has, kv, keys[i])) abort();
+    found += has;
+  }
+  double t1 = now();
+  if (found != n) abort();
+  if (KeyVal_setHashIndex(kv, 1)) abort();
+  double t2 = now();
+  for (unsigned long i = 0; i < n; ++i) {
+    unsigned char has;
+    if (KeyVal_hasValue(&has, kv, keys[i])) abort();
+    found += has;
+  }
+  double t3 = now();
+  if (found != 2 * n) abort();
+  printf("lookups, %lu keys:\n", n);
+  printf("  binary search      %.1f ns/lookup\n", (t1 - t0) * 1e9 / n);
+  printf("  hash index         %.1f ns/lookup\n", (t3 - t2) * 1e9 / n);
+
+  // fetching the values too, for a hot set of keys (with the hash index still
+  // on), where the malloc/free of getValue shows:
+  double t[4];
+  unsigned long total = 0;
+  for (int r = 0; r < 3; ++r) {
+    t[r] = now();
+    for (unsigned long i = 0; i < n; ++i) {
+      if (r == 0) {
+        char *v;
+        if (KeyVal_getValue(&v, kv, keys[i % 1024], 0)) abort();
+        total += strlen(v);
+        free(v);
+      } else if (r == 1) {
+        const char *v;
+        unsigned long len;
+        if (KeyVal_peekValue(&v, &len, kv, keys[i % 1024], 0)) abort();
+        total += len;
+      } else {
+        unsigned long len;
+        if (KeyVal_copyValue(&len, line, sizeof(line), kv, keys[i % 1024], 0)) abort();
+        total += len - 1;
+      }
+    }
+  }
+  t[3] = now();
+  if (!total) abort();
+  printf("  hot getValue       %.1f ns/lookup\n", (t[1] - t[0]) * 1e9 / n);
+  printf("  hot peekValue      %.1f ns/lookup\n", (t[2] - t[1]) * 1e9 / n);
+  printf("  hot copyValue      %.1f ns/lookup\n\n", (t[3] - t[2]) * 1e9 / n);
+
+  for (unsigned long i = 0; i < n; ++i) {
+    free(keys[i]);
+  }
+  free(keys);
+  if (KeyVal_delete(kv)) abort();
+}
+
+
+// Batches of keys under the same few parents, one by one vs KeyVal_getValues.
+static void
+bench_get_values() {
+  const int num_users = 100000;
+  const int batch = 100;
+  const int num_batches = 20000;
+  struct KeyVal *kv;
+  if (KeyVal_new(&kv)) abort();
+  char key[64];
+  for (int i = 0; i < num_users; ++i) {
+    for (int f = 0; f < 10; ++f) {
+      sprintf(key, "users::%d::field%d", i, f);
+      if (KeyVal_setValue(kv, key, "some value")) abort();
+    }
+  }
+  unsigned long size;
+  if (KeyVal_size(&size, kv)) abort();
+
+  // each batch is every field of 10 users that are near each other:
+  char **keys = malloc(batch * sizeof(char*));
+  char **vals = malloc(batch * sizeof(char*));
+  if (!keys || !vals) abort();
+  for (int i = 0; i < batch; ++i) keys[i] = malloc(64);
+  unsigned long long seed = 1;
+  double t[2] = {0, 0};
+  for (int b = 0; b < num_batches; ++b) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    int first = (seed >> 33) % (num_users - 10);
+    for (int i = 0; i < batch; ++i) {
+      sprintf(keys[i], "users::%d::field%d", first + i % 10, (i / 10 + i * 7) % 10);
+    }
+    double t0 = now();
+    for (int i = 0; i < batch; ++i) {
+      if (KeyVal_getValue(&vals[i], kv, keys[i], 0)) abort();
+    }
+    for (int i = 0; i < batch; ++i) free(vals[i]);
+    double t1 = now();
+    if (KeyVal_getValues(vals, kv, (const char **)keys, batch, 0)) abort();
+    for (int i = 0; i < batch; ++i) free(vals[i]);
+    double t2 = now();
+    t[0] += t1 - t0;
+    t[1] += t2 - t1;
+  }
+  printf("getValues, batches of %d nearby keys out of %lu:\n", batch, size);
+  printf("  getValue each      %.1f ns/key\n", t[0] * 1e9 / (num_batches * batch));
+  printf("  getValues          %.1f ns/key\n\n", t[1] * 1e9 / (num_batches * batch));
+
+  for (int i = 0; i < batch; ++i) free(keys[i]);
+  free(keys);
+  free(vals);
+  if (KeyVal_delete(kv)) abort();
+}
+
+
+// A million shuffled keys, set one at a time vs all at once.
+static void
+bench_set_values() {
+  const unsigned long n = 1000000;
+  char **keys = malloc(n * sizeof(char*));
+  if (!keys) abort();
+  unsigned long long seed = 1;
+  char key[64];
+  for (unsigned long i = 0; i < n; ++i) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    sprintf(key, "k::%lu::%lu", (unsigned long)(seed >> 40) % 1000, i);
+    keys[i] = strdup(key);
+  }
+  printf("setting %lu shuffled keys:\n", n);
+  for (int bulk = 0; bulk < 2; ++bulk) {
+    struct KeyVal *kv;
+    if (KeyVal_new(&kv)) abort();
+    double t0 = now();
+    if (bulk) {
+      if (KeyVal_setValues(kv, (const char **)keys, (const char **)keys, n)) abort();
+    } else {
+      for (unsigned long i = 0; i < n; ++i) {
+        if (KeyVal_setValue(kv, keys[i], keys[i])) abort();
+      }
+    }
+    unsigned long size;
+    if (KeyVal_size(&size, kv)) abort();  // (sorts)
+    double t1 = now();
+    if (size != n) abort();
+    printf("  %-18s %.0f ns/key\n", bulk ? "setValues" : "setValue each",
+        (t1 - t0) * 1e9 / n);
+
+    // then updates, a subtree at a time, with a read after each:
+    const char **batch_keys = malloc(n * sizeof(char*));
+    const char **vals = malloc(n * sizeof(char*));
+    if (!batch_keys || !vals) abort();
+    unsigned long num_updates = 0;
+    t0 = 0;
+    for (unsigned long g = 0; g < 100; ++g) {
+      sprintf(key, "k::%lu::", g * 7);
+      unsigned long batch = 0;
+      for (unsigned long i = 0; i < n; ++i) {
+        if (!strncmp(keys[i], key, strlen(key))) {
+          batch_keys[batch] = keys[i];
+          vals[batch++] = "updated";
+        }
+      }
+      double t2 = now();
+      if (bulk) {
+        if (KeyVal_setValues(kv, batch_keys, vals, batch)) abort();
+      } else {
+        for (unsigned long i = 0; i < batch; ++i) {
+          if (KeyVal_setValue(kv, batch_keys[i], vals[i])) abort();
+        }
+      }
+      unsigned char has;
+      if (KeyVal_hasValue(&has, kv, batch_keys[0])) abort();
+      t0 += now() - t2;
+      num_updates += batch;
+    }
+    printf("  %-18s %.0f ns/key\n", "  then updates", t0 * 1e9 / num_updates);
+    free(batch_keys);
+    free(vals);
+    if (KeyVal_delete(kv)) abort();
+  }
+  printf("\n");
+  for (unsigned long i = 0; i < n; ++i) free(keys[i]);
+  free(keys);
+}
+
+
+// Walking small subtrees: getKeys plus getValue on each, vs a cursor.
+static void
+bench_cursor() {
+  const int num_users = 100000;
+  const int num_walks = 100000;
+  struct KeyVal *kv;
+  if (KeyVal_new(&kv)) abort();
+  char key[64];
+  for (int i = 0; i < num_users; ++i) {
+    for (int f = 0; f < 10; ++f) {
+      sprintf(key, "users::%d::field%d", i, f);
+      if (KeyVal_setValue(kv, key, "some value")) abort();
+    }
+  }
+  unsigned long size;
+  if (KeyVal_size(&size, kv)) abort();
+
+  printf("walking %d subtrees of 10 keys out of %lu:\n", num_walks, size);
+  unsigned long long seed = 1;
+  unsigned long total = 0;
+  double t0 = now();
+  for (int w = 0; w < num_walks; ++w) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    char path[32];
+    sprintf(path, "users::%d", (int)((seed >> 33) % num_users));
+    char **children;
+    if (KeyVal_getKeys(&children, kv, path)) abort();
+    for (char **c = children; *c; ++c) {
+      sprintf(key, "%s::%s", path, *c);
+      char *v;
+      if (KeyVal_getValue(&v, kv, key, 0)) abort();
+      total += strlen(v);
+      free(v);
+      free(*c);
+    }
+    free(children);
+  }
+  double t1 = now();
+  seed = 1;
+  for (int w = 0; w < num_walks; ++w) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    char path[32];
+    sprintf(path, "users::%d", (int)((seed >> 33) % num_users));
+    struct KeyValCursor cur;
+    const char *k;
+    if (KeyVal_cursorSubtree(&cur, kv, path)) abort();
+    while (!KeyVal_cursorKey(&k, &cur) && k) {
+      const char *v;
+      unsigned long len;
+      if (KeyVal_cursorValue(&v, &len, &cur, 0)) abort();
+      total -= len;
+      if (KeyVal_cursorNext(&cur)) abort();
+    }
+  }
+  double t2 = now();
+  if (total) abort();
+  printf("  getKeys+getValue   %.0f ns/subtree\n", (t1 - t0) * 1e9 / num_walks);
+  printf("  cursor             %.0f ns/subtree\n\n", (t2 - t1) * 1e9 / num_walks);
+  if (KeyVal_delete(kv)) abort();
+}
+
+
+// KeyVal_getKeys on a node with a few children and lots of grandchildren.
+static void
+bench_get_keys() {
+  const int num_children = 10;
+  const int num_grandchildren = 50000;
+  printf("getKeys, %d children with %d grandchildren each:\n",
+      num_children, num_grandchildren);
+  for (int use_trie = 0; use_trie < 2; ++use_trie) {
+    struct KeyVal *kv;
+    if (KeyVal_new(&kv)) abort();
+    if (use_trie && KeyVal_setTrieIndex(kv, 1)) abort();
+    char key[64];
+    for (int c = 0; c < num_children; ++c) {
+      for (int g = 0; g < num_grandchildren; ++g) {
+        sprintf(key, "top::child%d::grandchild%06d", c, g);
+        if (KeyVal_setValue(kv, key, "x")) abort();
+      }
+    }
+    unsigned long size;
+    if (KeyVal_size(&size, kv)) abort();
+
+    const int reps = 20;
+    double t0 = now();
+    for (int r = 0; r < reps; ++r) {
+      char **keys;
+      if (KeyVal_getKeys(&keys, kv, "top")) abort();
+      int n = 0;
+      for (; keys[n]; ++n) free(keys[n]);
+      free(keys);
+      if (n != num_children) abort();
+    }
+    double t1 = now();
+    printf("  %-18s %.1f us/call\n", use_trie ? "trie index" : "sorted array",
+        (t1 - t0) * 1e6 / reps);
+    if (KeyVal_delete(kv)) abort();
+  }
+  printf("\n");
+}
+
+
+// Startup: parsing the text file vs. mapping in a binary image of it, plus
+// enough lookups to touch a few pages.
+static void
+bench_binary_startup() {
+  const unsigned long n = 1000000;
+  const char *BIN = "/tmp/c.bench.kvb";
+  write_shuffled(n);
+  struct KeyVal *kv;
+  if (KeyVal_new(&kv)) abort();
+  if (KeyVal_load(kv, BENCH_FILE)) abort();
+  if (KeyVal_saveBinary(kv, BIN, 0)) abort();
+  if (KeyVal_delete(kv)) abort();
+
+  printf("startup, %lu keys:\n", n);
+  double t0 = now();
+  if (KeyVal_new(&kv)) abort();
+  if (KeyVal_load(kv, BENCH_FILE)) abort();
+  unsigned char has;
+  if (KeyVal_hasValue(&has, kv, "svc0::host0::key0") || !has) abort();
+  double t1 = now();
+  if (KeyVal_delete(kv)) abort();
+  printf("  %-18s %.3f s\n", "text", t1 - t0);
+
+  for (int verify = 0; verify < 2; ++verify) {
+    struct KeyValBinary *kvb;
+    t0 = now();
+    if (KeyVal_openBinary(&kvb, BIN, verify)) abort();
+    if (KeyVal_binaryHasValue(&has, kvb, "svc0::host0::key0") || !has) abort();
+    t1 = now();
+    if (KeyVal_closeBinary(kvb)) abort();
+    printf("  %-18s %.6f s\n", verify ? "binary, verified" : "binary", t1 - t0);
+  }
+  unlink(BIN);
+  printf("\n");
+}
+
+
+// Several layer files: one KeyVal_load after another vs. KeyVal_loadMany.
+static void
+bench_load_many() {
+  const int num_files = 8;
+  const unsigned long per_file = 250000;
+  char paths[8][64];
+  const char *path_ptrs[8];
+  for (int f = 0; f < num_files; ++f) {
+    write_shuffled(per_file);
+    sprintf(paths[f], "/tmp/c.bench.layer%d.kv", f);
+    if (rename(BENCH_FILE, paths[f])) abort();
+    path_ptrs[f] = paths[f];
+  }
+  printf("load %d files of %lu keys:\n", num_files, per_file);
+  const unsigned int thread_counts[] = {1, 2, 4, 8};
+  for (int t = 0; t < 4; ++t) {
+    struct KeyVal *kv;
+    if (KeyVal_new(&kv)) abort();
+    double t0 = now();
+    if (KeyVal_loadMany(kv, path_ptrs, num_files, thread_counts[t])) abort();
+    double t1 = now();
+    if (KeyVal_delete(kv)) abort();
+    printf("  %u thread%-10s %.3f s\n", thread_counts[t],
+        thread_counts[t] == 1 ? "" : "s", t1 - t0);
+  }
+  for (int f = 0; f < num_files; ++f) {
+    unlink(paths[f]);
+  }
+  printf("\n");
+}
+
+
+// One big file: KeyVal_load vs. KeyVal_loadParallel.
+static void
+bench_load_parallel() {
+  const unsigned long n = 2000000;
+  write_shuffled(n);
+  printf("load one file of %lu keys:\n", n);
+  const unsigned int thread_counts[] = {1, 2, 4, 8};
+  for (int t = 0; t < 4; ++t) {
+    struct KeyVal *kv;
+    if (KeyVal_new(&kv)) abort();
+    double t0 = now();
+    if (KeyVal_loadParallel(kv, BENCH_FILE, thread_counts[t])) abort();
+    double t1 = now();
+    if (KeyVal_delete(kv)) abort();
+    printf("  %u thread%-10s %.3f s\n", thread_counts[t],
+        thread_counts[t] == 1 ? "" : "s", t1 - t0);
+  }
+  printf("\n");
+}
+
+
+// Raw quoted-string scanning at each level, and end-to-end load throughput.
+static void
+bench_scan() {
+  const char *KeyVal_scanQuoted(const char *p, const char *end, int level);
+  const unsigned long len = 64 << 20;
+  char *buf = malloc(len);
+  if (!buf) abort();
+  for (unsigned long i = 0; i < len; ++i) {
+    buf[i] = i % 97 == 96 ? '`' : 'a' + i % 26;
+  }
+  printf("scanning quoted strings (runs of 96 bytes):\n");
+  const char *names[] = {"word at a time", "SSE2", "AVX2"};
+  for (int level = 0; level < 3; ++level) {
+    double t0 = now();
+    unsigned long stops = 0;
+    for (const char *p = buf; p < buf + len; ++p) {
+      p = KeyVal_scanQuoted(p, buf + len, level);
+      ++stops;
+    }
+    double t1 = now();
+    if (stops < len / 97) abort();
+    printf("  %-18s %.2f GB/s\n", names[level], len / (t1 - t0) / 1e9);
+  }
+  free(buf);
+
+  write_shuffled(1000000);
+  struct stat st;
+  if (stat(BENCH_FILE, &st)) abort();
+  struct KeyVal *kv;
+  if (KeyVal_new(&kv)) abort();
+  double t0 = now();
+  if (KeyVal_load(kv, BENCH_FILE)) abort();
+  double t1 = now();
+  if (KeyVal_delete(kv)) abort();
+  printf("  %-18s %.0f MB/s (including inserts)\n\n", "KeyVal_load",
+      st.st_size / (t1 - t0) / 1e6);
+}
+
+
+// KeyVal_strcmp on short keys, and on long keys that only differ at the end.
+static void
+bench_strcmp() {
+  int KeyVal_strcmp(const char *s1, const char *s2);
+  const int num_keys = 1024;
+  char **shorts = malloc(num_keys * sizeof(char*));
+  char **longs = malloc(num_keys * sizeof(char*));
+  if (!shorts || !longs) abort();
+  for (int i = 0; i < num_keys; ++i) {
+    char key[256];
+    sprintf(key, "k%d::v%d", i % 37, i);
+    shorts[i] = strdup(key);
+    sprintf(key, "datacenter::us-east-1::cluster::frontend::host%d::service::nginx::setting%d",
+        i % 3, i);
+    longs[i] = strdup(key);
+  }
+  printf("KeyVal_strcmp:\n");
+  const char *names[] = {"short keys", "long shared prefix"};
+  for (int w = 0; w < 2; ++w) {
+    char **keys = w ? longs : shorts;
+    const int reps = 20000000;
+    long sum = 0;
+    double t0 = now();
+    for (int r = 0; r < reps; ++r) {
+      sum += KeyVal_strcmp(keys[r % num_keys], keys[(r * 7 + 1) % num_keys]);
+    }
+    double t1 = now();
+    printf("  %-18s %.1f ns/compare (%ld)\n", names[w], (t1 - t0) * 1e9 / reps,
+        sum % 2);
+  }
+  for (int i = 0; i < num_keys; ++i) {
+    free(shorts[i]);
+    free(longs[i]);
+  }
+  free(shorts);
+  free(longs);
+  printf("\n");
+}
+
+
+// Interpolated reads of values that each use a handful of other keys, with
+// and without the interpolation cache.
+static void
+bench_interp() {
+  const int n = 100000;
+  printf("interpolated getValue, %d keys using 4 others each:\n", n);
+  for (int use_cache = 0; use_cache < 2; ++use_cache) {
+    struct KeyVal *kv;
+    if (KeyVal_new(&kv)) abort();
+    if (use_cache && KeyVal_setInterpCache(kv, 1)) abort();
+    char key[64];
+    char val[256];
+    for (int i = 0; i < 100; ++i) {
+      sprintf(key, "base::%d", i);
+      sprintf(val, "/srv/%d", i);
+      if (KeyVal_setValue(kv, key, val)) abort();
+    }
+    for (int i = 0; i < n; ++i) {
+      sprintf(key, "app::%d::path", i);
+      sprintf(val, "${base::%d}/${base::%d}/x/${base::%d}/${base::%d}",
+          i % 100, (i / 7) % 100, (i / 11) % 100, (i / 13) % 100);
+      if (KeyVal_setValue(kv, key, val)) abort();
+    }
+    unsigned long size;
+    if (KeyVal_size(&size, kv)) abort();
+
+    // (the first pass fills the cache, and the rest use it)
+    double t[4];
+    for (int r = 0; r < 4; ++r) {
+      t[r] = now();
+      if (r == 3) break;
+      for (int i = 0; i < n; ++i) {
+        sprintf(key, "app::%d::path", i);
+        char *v;
+        if (KeyVal_getValue(&v, kv, key, 1)) abort();
+        free(v);
+      }
+    }
+    printf("  %-18s first %.0f ns/read, then %.0f ns/read\n",
+        use_cache ? "cache" : "no cache",
+        (t[1] - t[0]) * 1e9 / n, (t[3] - t[1]) * 1e9 / (2 * n));
+    if (KeyVal_delete(kv)) abort();
+  }
+
+  // one long value made of lots of variables:
+  struct KeyVal *kv;
+  if (KeyVal_new(&kv)) abort();
+  if (KeyVal_setValue(kv, "dir", "/srv/app")) abort();
+  char val[1024] = "";
+  for (int i = 0; i < 100; ++i) strcat(val, "${dir}:");
+  if (KeyVal_setValue(kv, "path", val)) abort();
+  const int m = 20000;
+  double t0 = now();
+  for (int i = 0; i < m; ++i) {
+    char *v;
+    if (KeyVal_getValue(&v, kv, "path", 1)) abort();
+    free(v);
+  }
+  printf("  %-18s %.0f ns/read\n", "100 vars in 1 key", (now() - t0) * 1e9 / m);
+  if (KeyVal_delete(kv)) abort();
+  printf("\n");
+}
+
+
+// KeyVal_save of a big KeyVal, a tenth of whose values use a variable.
+static void
+bench_save() {
+  const unsigned long n = 1000000;
+  write_shuffled(n);
+  struct KeyVal *kv;
+  if (KeyVal_new(&kv)) abort();
+  if (KeyVal_load(kv, BENCH_FILE)) abort();
+  char key[64];
+  for (unsigned long i = 1; i < n; i += 10) {
+    sprintf(key, "svc%lu::host%lu::key%lu", i % 97, i % 1013, i);
+    if (KeyVal_setValue(kv, key, "${svc0::host0::key0} and `more`")) abort();
+  }
+  unsigned long size;
+  if (KeyVal_size(&size, kv)) abort();
+  printf("save, %lu keys:\n", size);
+  for (int mode = 0; mode < 3; ++mode) {
+    // (best of 3, since the disk gets a say)
+    double best = 1e9;
+    for (int r = 0; r < 3; ++r) {
+      double t0 = now();
+      if (KeyVal_save(kv, BENCH_FILE, mode == 2, mode == 1)) abort();
+      double t1 = now();
+      if (t1 - t0 < best) best = t1 - t0;
+    }
+    printf("  %-18s %.3f s\n",
+        mode == 0 ? "plain" : mode == 1 ? "aligned" : "interpolated", best);
+  }
+  for (unsigned int threads = 2; threads <= 4; threads *= 2) {
+    double best = 1e9;
+    for (int r = 0; r < 3; ++r) {
+      double t0 = now();
+      if (KeyVal_saveParallel(kv, BENCH_FILE, 1, 0, threads)) abort();
+      double t1 = now();
+      if (t1 - t0 < best) best = t1 - t0;
+    }
+    char label[32];
+    sprintf(label, "interp, %u threads", threads);
+    printf("  %-18s %.3f s\n", label, best);
+  }
+  printf("\n");
+  if (KeyVal_delete(kv)) abort();
+}
+
+
+// One change at a time, saved either way: KeyVal_save after every change, or
+// one appended line in journal mode.
+static void
+bench_journal() {
+  const unsigned long n = 1000000;
+  write_shuffled(n);
+  struct KeyVal *kv;
+  if (KeyVal_new(&kv)) abort();
+  if (KeyVal_load(kv, BENCH_FILE)) abort();
+  printf("one change, then save, %lu keys:\n", n);
+
+  const int num_saves = 5;
+  double t0 = now();
+  for (int i = 0; i < num_saves; ++i) {
+    if (KeyVal_setValue(kv, "svc0::host0::key0", i % 2 ? "odd" : "even")) abort();
+    if (KeyVal_save(kv, BENCH_FILE, 0, 0)) abort();
+  }
+  double t1 = now();
+  printf("  %-18s %.1f us/change\n", "KeyVal_save", (t1 - t0) / num_saves * 1e6);
+
+  if (KeyVal_setJournal(kv, BENCH_FILE, 0)) abort();
+  const int num_changes = 100000;
+  char key[64];
+  t0 = now();
+  for (int i = 0; i < num_changes; ++i) {
+    sprintf(key, "svc%d::host%d::key%d", i % 97, i % 1013, i);
+    if (KeyVal_setValue(kv, key, i % 2 ? "odd" : "even")) abort();
+  }
+  t1 = now();
+  printf("  %-18s %.1f us/change\n", "journaled", (t1 - t0) / num_changes * 1e6);
+  t0 = now();
+  if (KeyVal_compact(kv)) abort();
+  t1 = now();
+  printf("  %-18s %.3f s\n", "compact", t1 - t0);
+  printf("\n");
+  if (KeyVal_delete(kv)) abort();
+}
+
+
+// A big base layer and a small one on top, and a change to the small one:
+// loading everything again vs. KeyVal_refresh.
+static void
+bench_refresh() {
+  const unsigned long n = 1000000;
+  write_shuffled(n);
+  const char *base = "/tmp/c.bench.base.kv";
+  const char *site = "/tmp/c.bench.site.kv";
+  if (rename(BENCH_FILE, base)) abort();
+  const char *paths[] = {base, site};
+  printf("reload after changing a 100-key layer over %lu keys:\n", n);
+
+  double best_load = 1e9;
+  double best_refresh = 1e9;
+  struct KeyVal *kv;
+  if (KeyVal_new(&kv)) abort();
+  for (int r = 0; r < 4; ++r) {
+    // (a new file each time, the way deployments do it)
+    FILE *fh = fopen(BENCH_FILE, "w");
+    if (!fh) abort();
+    for (int i = 0; i < 100; ++i) {
+      fprintf(fh, "`svc%d::host%d::key%d` = `override %d`\n", i % 97, i % 1013, i, r);
+    }
+    if (fclose(fh)) abort();
+    if (rename(BENCH_FILE, site)) abort();
+    if (r == 0) {
+      if (KeyVal_loadLayer(kv, base) || KeyVal_loadLayer(kv, site)) abort();
+      continue;
+    }
+
+    unsigned long num_reloaded;
+    double t0 = now();
+    if (KeyVal_refresh(&num_reloaded, kv) || num_reloaded != 1) abort();
+    double t1 = now();
+    if (t1 - t0 < best_refresh) best_refresh = t1 - t0;
+
+    // (and after that, since freeing a million strings leaves malloc with a
+    // lot of tidying up to do on the next big allocation)
+    struct KeyVal *fresh;
+    if (KeyVal_new(&fresh)) abort();
+    t0 = now();
+    if (KeyVal_loadMany(fresh, paths, 2, 1)) abort();
+    t1 = now();
+    if (KeyVal_delete(fresh)) abort();
+    if (t1 - t0 < best_load) best_load = t1 - t0;
+  }
+  printf("  %-18s %.3f s\n", "load everything", best_load);
+  printf("  %-18s %.1f us\n", "KeyVal_refresh", best_refresh * 1e6);
+  printf("\n");
+  if (KeyVal_delete(kv)) abort();
+  unlink(base);
+  unlink(site);
+}
+
+
+int main(int argc, char **argv) {
+  bench_shuffled_load();
+  bench_load_modes();
+  bench_lookups();
+  bench_get_values();
+  bench_set_values();
+  bench_get_keys();
+  bench_cursor();
+  bench_binary_startup();
+  bench_load_many();
+  bench_load_parallel();
+  bench_refresh();
+  bench_scan();
+  bench_strcmp();
+  bench_interp();
+  bench_save();
+  bench_journal();
+
+  // cleanup:
+  unlink(BENCH_FILE);
+  printf("[done]\n");
+  return 0;
+}
@@ -1,11 +1,14 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "KeyVal.h"
 
 /*
-oom.c is just to look for memory leaks in KeyVal.
+oom.c is just to look for memory leaks in KeyVal.  Run it as "oom --arena" to
+use KeyVal_newWithArena instead of KeyVal_new.
 */
 
 
@@ -26,17 +29,27 @@ const char *big_str =
 
 int main(int argc, char **argv) {
 
+  int use_arena = (argc > 1 && !strcmp(argv[1], "--arena"));
+
   // create dummy file with one key:
   FILE *fh = fopen("/tmp/c.oom.kv", "w");
   if (!fh) abort();
   fprintf(fh, "`%s` = `%s`\n", small_str, small_str);
   if (fclose(fh)) abort();
 
+  const int iterations = 100000;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
   for (int i=0;
-      i < 100000;
+      i < iterations;
       ++i) {
     struct KeyVal *kv;
-    if (KeyVal_new(&kv)) abort();
+    if (use_arena) {
+      if (KeyVal_newWithArena(&kv)) abort();
+    } else {
+      if (KeyVal_new(&kv)) abort();
+    }
     if (KeyVal_load(kv, "/tmp/c.oom.kv")) abort();
     if (KeyVal_setValue(kv, big_str, big_str)) abort();
     char *v;
@@ -60,10 +73,15 @@ int main(int argc, char **argv) {
     if (KeyVal_delete(kv)) abort();
   }
 
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
   // cleanup:
   unlink("/tmp/c.oom.kv");
   unlink("/tmp/c.oom.kv-out");
-  printf("[done]\n");
+  printf("[done] %s: %.2f us per iteration\n",
+      use_arena ? "arena" : "malloc", elapsed * 1e6 / iterations);
   return 0;
 }
 
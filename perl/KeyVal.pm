@@ -137,6 +137,18 @@ sub size {
   return $res;
 }
 
+# returns a hashref of everything in struct KeyValStats:
+sub stats {
+  my ($self) = @_;
+  my $stats = KeyVal_C_API::KeyValStats->new();
+  my $errcode = KeyVal_C_API::KeyVal_stats($stats, $self->{kv});
+  if ($errcode != 0) { croak "[ERROR] KeyVal::stats"; }
+  my %res = map { $_ => $stats->{$_} } qw(num_keys max_size used_size
+      unsorted key_bytes val_bytes array_bytes extra_bytes overhead_bytes
+      max_depth max_fanout);
+  return \%res;
+}
+
 sub hasValue {
   my ($self, $key) = @_;
   my $res_p = KeyVal_C_API::new_bool_ptr();
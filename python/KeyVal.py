@@ -5,6 +5,10 @@
 
 import KeyVal_C_API
 
+# the fields of struct KeyValStats, for KeyVal.stats:
+STATS_FIELDS = ("num_keys", "max_size", "used_size", "unsorted", "key_bytes",
+    "val_bytes", "array_bytes", "extra_bytes", "overhead_bytes", "max_depth",
+    "max_fanout")
 
 class KeyVal:
   def __init__(self):
@@ -102,6 +106,14 @@ class KeyVal:
     KeyVal_C_API.delete_long_ptr(res_p)
     return res
 
+  def stats(self):
+    # returns a dict of everything in struct KeyValStats:
+    stats = KeyVal_C_API.KeyValStats()
+    errcode = KeyVal_C_API.KeyVal_stats(stats, self.kv)
+    if errcode:
+      raise Exception("[ERROR] KeyVal.stats")
+    return {name: getattr(stats, name) for name in STATS_FIELDS}
+
   def hasValue(self, key):
     res_p = KeyVal_C_API.new_bool_ptr()
     errcode = KeyVal_C_API.KeyVal_hasValue(res_p, self.kv, key)
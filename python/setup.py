@@ -2,8 +2,9 @@
 import distutils.core
 
 mod = distutils.core.Extension('_KeyVal_C_API',
-    sources=['python/KeyVal_wrap.c', 'KeyVal.c', 'KeyVal_load.c'],
+    sources=['python/KeyVal_wrap.c', 'KeyVal.c', 'KeyVal_load.c', 'KeyVal_binary.c'],
     include_dirs=['.'],
+    libraries=['pthread'],
     )
 
 distutils.core.setup(
@@ -7,7 +7,7 @@ load tcl/KeyVal_C_API.dylib
 
 namespace eval KeyVal {
   namespace export new delete load save setValue getValue remove getKeys\
-      getAllKeys size hasValue hasKeys exists print
+      getAllKeys size stats hasValue hasKeys exists print
 }
 
 proc ::KeyVal::new {} {
@@ -113,6 +113,23 @@ proc ::KeyVal::size { kv } {
   return $res
 }
 
+# returns a dict of everything in struct KeyValStats:
+proc ::KeyVal::stats { kv } {
+  set stats [new_KeyValStats]
+  set errcode [KeyVal_stats $stats $kv]
+  if { $errcode != 0 } {
+    delete_KeyValStats $stats
+    error "ERROR: KeyVal::stats"
+  }
+  set res [dict create]
+  foreach name { num_keys max_size used_size unsorted key_bytes val_bytes\
+      array_bytes extra_bytes overhead_bytes max_depth max_fanout } {
+    dict set res $name [KeyValStats_${name}_get $stats]
+  }
+  delete_KeyValStats $stats
+  return $res
+}
+
 proc ::KeyVal::hasValue { kv key } {
   set res_p [new_bool_ptr]
   set errcode [KeyVal_hasValue $res_p $kv $key]
@@ -1,6 +1,14 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "KeyVal.h"
 
@@ -769,8 +777,2116 @@ static void test10() {
 }
 
 
+static void test11() {
+  struct KeyVal *kv;
+  _check_err(KeyVal_new(&kv), "KeyVal_new");
+
+  // sorted part, which the unsorted tail will collide with:
+  _check_err(KeyVal_setValue(kv, "b", "old-b"), "KeyVal_setValue");
+  _check_err(KeyVal_setValue(kv, "d", "old-d"), "KeyVal_setValue");
+  _check_err(KeyVal_setValue(kv, "f", "old-f"), "KeyVal_setValue");
+  // unsorted tail, with duplicates of itself and of the sorted part:
+  _check_err(KeyVal_setValue(kv, "e", "e1"), "KeyVal_setValue");
+  _check_err(KeyVal_setValue(kv, "a", "a1"), "KeyVal_setValue");
+  _check_err(KeyVal_setValue(kv, "e", "e2"), "KeyVal_setValue");
+  _check_err(KeyVal_setValue(kv, "b", "new-b"), "KeyVal_setValue");
+  _check_err(KeyVal_setValue(kv, "a", "a2"), "KeyVal_setValue");
+  _check_err(KeyVal_setValue(kv, "c::1", "c1"), "KeyVal_setValue");
+  _check_err(KeyVal_setValue(kv, "c", "c"), "KeyVal_setValue");
+  _check_err(KeyVal_setValue(kv, "a", "a3"), "KeyVal_setValue");
+
+  // 11a: duplicates collapse:
+  unsigned long size;
+  _check_err(KeyVal_size(&size, kv), "KeyVal_size");
+  if (!ok(size == 7, "11a. duplicates in unsorted tail are collapsed")) {
+    printf("  -> thinks it has %lu settings\n", size);
+  }
+
+  // 11b-11d: last write wins, both within the tail and against the sorted part:
+  char *value;
+  _check_err(KeyVal_getValue(&value, kv, "a", 0), "KeyVal_getValue");
+  ok(value && !strcmp(value, "a3"), "11b. last of three tail duplicates wins");
+  free(value);
+  _check_err(KeyVal_getValue(&value, kv, "e", 0), "KeyVal_getValue");
+  ok(value && !strcmp(value, "e2"), "11c. last of two tail duplicates wins");
+  free(value);
+  _check_err(KeyVal_getValue(&value, kv, "b", 0), "KeyVal_getValue");
+  ok(value && !strcmp(value, "new-b"), "11d. tail overwrites sorted part");
+  free(value);
+
+  // 11e: everything ends up in order:
+  _check_err(KeyVal_save(kv, OUT, 0, 0), "KeyVal_save");
+  ok(_check_output("`a` = `a3`\n`b` = `new-b`\n`c` = `c`\n`c::1` = `c1`\n"
+        "`d` = `old-d`\n`e` = `e2`\n`f` = `old-f`\n") == 0,
+      "11e. merged output is sorted");
+
+  // 11f: a tail long enough to take the merge path (not just insertion sort),
+  // in descending order so that every run needs merging:
+  char key[32];
+  for (int i = 999; i >= 0; --i) {
+    sprintf(key, "n::%d", i % 500);
+    _check_err(KeyVal_setValue(kv, key, i < 500 ? "low" : "high"), "KeyVal_setValue");
+  }
+  _check_err(KeyVal_size(&size, kv), "KeyVal_size");
+  ok(size == 507, "11f. long tail with duplicates collapses");
+  _check_err(KeyVal_getValue(&value, kv, "n::42", 0), "KeyVal_getValue");
+  ok(value && !strcmp(value, "low"), "11g. long tail keeps last write");
+  free(value);
+
+  _check_err(KeyVal_delete(kv), "KeyVal_delete");
+}
+
+
+// Loads 'contents' through a fifo, so that KeyVal_load can't mmap it.
+static unsigned char
+_load_through_fifo(struct KeyVal *kv, const char *contents) {
+  remove(IN);
+  if (mkfifo(IN, 0600)) return 99;
+  pid_t pid = fork();
+  if (pid == 0) {
+    FILE *fh = fopen(IN, "w");
+    if (fh) {
+      fprintf(fh, "%s", contents);
+      fclose(fh);
+    }
+    _exit(0);
+  }
+  unsigned char res = KeyVal_load(kv, IN);
+  waitpid(pid, 0, 0);
+  remove(IN);
+  return res;
+}
+
+static void test12() {
+  // the mmap'ed and the fread'ed paths must behave identically:
+  const char *TEXT =
+      "# comment\n"
+      "`b` = `2`\n"
+      "  `a::x` = `\\`one\\``\n"
+      "`c` = `3`\n";
+  const char *EXPECTED = "`a::x` = `\\`one\\``\n`b` = `2`\n`c` = `3`\n";
+
+  struct KeyVal *kv;
+  _check_err(KeyVal_new(&kv), "KeyVal_new");
+  _set_input(TEXT);
+  ok(KeyVal_load(kv, IN) == 0, "12a. loads a regular (mapped) file");
+  _check_err(KeyVal_save(kv, OUT, 0, 0), "KeyVal_save");
+  ok(_check_output(EXPECTED) == 0, "12b. mapped file has the right contents");
+  _check_err(KeyVal_delete(kv), "KeyVal_delete");
+
+  _check_err(KeyVal_new(&kv), "KeyVal_new");
+  ok(_load_through_fifo(kv, TEXT) == 0, "12c. loads a fifo");
+  _check_err(KeyVal_save(kv, OUT, 0, 0), "KeyVal_save");
+  ok(_check_output(EXPECTED) == 0, "12d. fifo has the right contents");
+  ok(_load_through_fifo(kv, "`key` = `val") == 1, "12e. fifo reports parse errors");
+  _check_err(KeyVal_delete(kv), "KeyVal_delete");
+
+  // a special file that can't be mapped:
+  _check_err(KeyVal_new(&kv), "KeyVal_new");
+  ok(KeyVal_load(kv, "/dev/null") == 0, "12f. loads /dev/null");
+  _check_err(KeyVal_delete(kv), "KeyVal_delete");
+}
+
+
+static void test13() {
+  struct KeyVal *kv;
+  _check_err(KeyVal_new(&kv), "KeyVal_new");
+
+  _set_input(
+      "`plain` = `value`\n"
+      "`esc\\`aped` = `also plain`\n"
+      "`other` = `esc\\\\aped`\n");
+  ok(KeyVal_loadMapped(kv, IN) == 0, "13a. loadMapped reads the file");
+  // the file shouldn't be needed anymore:
+  remove(IN);
+
+  // 13b-13d: unescaped strings are borrowed, escaped ones are copied:
+  unsigned long size;
+  _check_err(KeyVal_size(&size, kv), "KeyVal_size");  // (sorts, for findIndex)
+  unsigned long idx;
+  _check_err(KeyVal_findIndex(&idx, kv, "plain"), "KeyVal_findIndex");
+  ok(kv->data[idx].key_borrowed && kv->data[idx].val_borrowed,
+      "13b. unescaped key and value are borrowed");
+  _check_err(KeyVal_findIndex(&idx, kv, "esc`aped"), "KeyVal_findIndex");
+  ok(!kv->data[idx].key_borrowed && kv->data[idx].val_borrowed,
+      "13c. escaped key is copied");
+  _check_err(KeyVal_findIndex(&idx, kv, "other"), "KeyVal_findIndex");
+  ok(kv->data[idx].key_borrowed && !kv->data[idx].val_borrowed,
+      "13d. escaped value is copied");
+
+  // 13e: contents are the same as a regular load would give:
+  _check_err(KeyVal_save(kv, OUT, 0, 0), "KeyVal_save");
+  ok(_check_output(
+        "`esc\\`aped` = `also plain`\n"
+        "`other` = `esc\\\\aped`\n"
+        "`plain` = `value`\n") == 0,
+      "13e. loadMapped gives the same contents as load");
+
+  // 13f: overwriting a borrowed value copies the new one:
+  _check_err(KeyVal_setValue(kv, "plain", "changed"), "KeyVal_setValue");
+  _check_err(KeyVal_findIndex(&idx, kv, "plain"), "KeyVal_findIndex");
+  ok(kv->data[idx].key_borrowed && !kv->data[idx].val_borrowed
+      && !strcmp(kv->data[idx].val, "changed"), "13f. setValue copies over a borrowed value");
+
+  // 13g: borrowed elements can be removed:
+  _check_err(KeyVal_remove(kv, "other"), "KeyVal_remove");
+  _check_err(KeyVal_size(&size, kv), "KeyVal_size");
+  ok(size == 2, "13g. borrowed elements can be removed");
+
+  // 13h: a missing file is still reported:
+  ok(KeyVal_loadMapped(kv, IN) == 2, "13h. loadMapped detects missing input file");
+
+  _check_err(KeyVal_delete(kv), "KeyVal_delete");
+}
+
+
+// 15: elements cache each key's length, hash, and an abbreviation that is
+// supposed to sort exactly like KeyVal_strcmp.  Keys built from a tiny
+// alphabet hit all the awkward cases ("::" vs ':' vs 0x01, keys longer than
+// the abbreviation, keys that are prefixes of each other).
+static void test15() {
+  const char alphabet[] = {'a', 'b', ':', 1};
+  struct KeyVal *kv;
+  _check_err(KeyVal_new(&kv), "KeyVal_new");
+
+  char key[16];
+  unsigned long long seed = 15;
+  for (int i = 0; i < 4000; ++i) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    int len = 1 + (seed >> 60) % 12;
+    for (int c = 0; c < len; ++c) {
+      seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+      key[c] = alphabet[(seed >> 40) & 3];
+    }
+    key[len] = 0;
+    _check_err(KeyVal_setValue(kv, key, "x"), "KeyVal_setValue");
+  }
+  unsigned long size;
+  _check_err(KeyVal_size(&size, kv), "KeyVal_size");
+
+  int in_order = 1;
+  int prefixes_agree = 1;
+  int lens_agree = 1;
+  for (unsigned long i = 0; i < size; ++i) {
+    struct KeyValElement *e = &kv->data[i];
+    if (e->key_len != strlen(e->key)) lens_agree = 0;
+    if (i + 1 < size) {
+      struct KeyValElement *next = &kv->data[i+1];
+      if (KeyVal_strcmp(e->key, next->key) >= 0) in_order = 0;
+      if (e->key_prefix > next->key_prefix) prefixes_agree = 0;
+    }
+  }
+  ok(in_order, "15a. elements are in KeyVal_strcmp order with no duplicates");
+  ok(prefixes_agree, "15b. cached prefixes never contradict KeyVal_strcmp");
+  ok(lens_agree, "15c. cached key lengths are right");
+
+  int all_found = 1;
+  for (unsigned long i = 0; i < size; ++i) {
+    unsigned long idx;
+    if (KeyVal_findIndex(&idx, kv, kv->data[i].key) || idx != i) all_found = 0;
+  }
+  ok(all_found, "15d. every key is found where it is");
+
+  // 15e: removing from the middle keeps the cached fields with their keys:
+  for (unsigned long i = 0; i < size; i += 2) {
+    strcpy(key, kv->data[i / 2].key);
+    _check_err(KeyVal_remove(kv, key), "KeyVal_remove");
+  }
+  _check_err(KeyVal_size(&size, kv), "KeyVal_size");
+  int still_agree = 1;
+  for (unsigned long i = 0; i < size; ++i) {
+    unsigned long idx;
+    if (kv->data[i].key_len != strlen(kv->data[i].key)) still_agree = 0;
+    if (KeyVal_findIndex(&idx, kv, kv->data[i].key) || idx != i) still_agree = 0;
+  }
+  ok(still_agree, "15e. cached fields survive removals");
+
+  _check_err(KeyVal_delete(kv), "KeyVal_delete");
+}
+
+
+static void test14() {
+  struct KeyVal *kv;
+  _check_err(KeyVal_newWithArena(&kv), "KeyVal_newWithArena");
+  ok(kv->arena != 0, "14a. newWithArena has an arena");
+
+  // 14b: overwrites recycle the old value's slot:
+  _check_err(KeyVal_setValue(kv, "k", "a fairly long value, to be overwritten"), "KeyVal_setValue");
+  char *old_val = kv->data[0].val;
+  _check_err(KeyVal_setValue(kv, "k", "a different value of a similar length"), "KeyVal_setValue");
+  ok(kv->data[0].val == old_val, "14b. overwritten value's storage is reused");
+
+  // 14c-14e: lots of elements, all from a handful of chunks:
+  char key[32];
+  char val[32];
+  for (int i = 0; i < 10000; ++i) {
+    sprintf(key, "k::%d", (i * 7919) % 10000);  // (out of order)
+    sprintf(val, "%d", i);
+    _check_err(KeyVal_setValue(kv, key, val), "KeyVal_setValue");
+  }
+  unsigned long size;
+  _check_err(KeyVal_size(&size, kv), "KeyVal_size");
+  ok(size == 10001, "14c. arena-backed KeyVal holds everything");
+  ok(kv->arena->num_chunks < 16, "14d. arena uses few chunks");
+  char *value;
+  _check_err(KeyVal_getValue(&value, kv, "k::7919", 0), "KeyVal_getValue");
+  ok(value && !strcmp(value, "1"), "14e. arena-backed values are intact");
+  free(value);
+
+  // 14f: removing and re-adding doesn't need more chunks:
+  unsigned long num_chunks = kv->arena->num_chunks;
+  for (int i = 0; i < 10000; ++i) {
+    sprintf(key, "k::%d", i);
+    _check_err(KeyVal_remove(kv, key), "KeyVal_remove");
+  }
+  for (int i = 0; i < 10000; ++i) {
+    sprintf(key, "k::%d", i);
+    _check_err(KeyVal_setValue(kv, key, "again"), "KeyVal_setValue");
+  }
+  ok(kv->arena->num_chunks == num_chunks, "14f. removed elements are recycled");
+
+  // 14g: loading into an arena:
+  _set_input("`loaded` = `from a file`\n`k` = `reloaded`\n");
+  ok(KeyVal_load(kv, IN) == 0, "14g. loads into an arena-backed KeyVal");
+  _check_err(KeyVal_getValue(&value, kv, "k", 0), "KeyVal_getValue");
+  ok(value && !strcmp(value, "reloaded"), "14h. loaded values land in the arena");
+  free(value);
+
+  _check_err(KeyVal_delete(kv), "KeyVal_delete");
+}
+
+
 ////////////////////////////////////////
 
+// 16: the hash index has to agree with the sorted array through every kind of
+// change.  Run the same random sets and removes against a KeyVal with the
+// index and one without, and compare answers for every key.
+static void test16() {
+  struct KeyVal *plain;
+  struct KeyVal *hashed;
+  _check_err(KeyVal_new(&plain), "KeyVal_new");
+  _check_err(KeyVal_new(&hashed), "KeyVal_new");
+  _check_err(KeyVal_setHashIndex(hashed, 1), "KeyVal_setHashIndex");
+  ok(hashed->hash_index != 0, "16a. setHashIndex builds an index");
+
+  char key[32];
+  char val[32];
+  unsigned long long seed = 16;
+  int agree = 1;
+  for (int round = 0; round < 40; ++round) {
+    for (int op = 0; op < 500; ++op) {
+      seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+      unsigned int r = seed >> 33;
+      // every few rounds, add keys in order, to exercise the sorted append:
+      if (round % 4 == 0) {
+        sprintf(key, "z::%04d::%04d", round, op);
+      } else {
+        sprintf(key, "k::%u", r % 700);
+      }
+      if (r % 5 == 0) {
+        _check_err(KeyVal_remove(plain, key), "KeyVal_remove");
+        _check_err(KeyVal_remove(hashed, key), "KeyVal_remove");
+      } else {
+        sprintf(val, "%d.%d", round, op);
+        _check_err(KeyVal_setValue(plain, key, val), "KeyVal_setValue");
+        _check_err(KeyVal_setValue(hashed, key, val), "KeyVal_setValue");
+      }
+    }
+    for (int i = 0; i < 700; ++i) {
+      sprintf(key, "k::%d", i);
+      char *v1;
+      char *v2;
+      _check_err(KeyVal_getValue(&v1, plain, key, 0), "KeyVal_getValue");
+      _check_err(KeyVal_getValue(&v2, hashed, key, 0), "KeyVal_getValue");
+      if ((!v1) != (!v2) || (v1 && strcmp(v1, v2))) agree = 0;
+      free(v1);
+      free(v2);
+      unsigned char has;
+      _check_err(KeyVal_hasValue(&has, hashed, key), "KeyVal_hasValue");
+      if (has != (v1 != 0)) agree = 0;
+    }
+  }
+  ok(agree, "16b. indexed and unindexed KeyVals agree");
+
+  unsigned long size;
+  _check_err(KeyVal_size(&size, hashed), "KeyVal_size");
+  int all_found = 1;
+  for (unsigned long i = 0; i < size; ++i) {
+    unsigned long idx;
+    if (KeyVal_findIndex(&idx, hashed, hashed->data[i].key) || idx != i) all_found = 0;
+  }
+  ok(all_found, "16c. index points at the right slots");
+  ok(hashed->hash_index_size >= 2 * size, "16d. index is at most half full");
+
+  // 16e: turning it off goes back to binary search:
+  _check_err(KeyVal_setHashIndex(hashed, 0), "KeyVal_setHashIndex");
+  unsigned char has;
+  _check_err(KeyVal_hasValue(&has, hashed, hashed->data[size / 2].key), "KeyVal_hasValue");
+  ok(hashed->hash_index == 0 && has, "16e. index can be turned off");
+
+  // 16f: loading into an indexed KeyVal:
+  _check_err(KeyVal_setHashIndex(hashed, 1), "KeyVal_setHashIndex");
+  _set_input("`z::loaded` = `1`\n`a::loaded` = `2`\n");
+  _check_err(KeyVal_load(hashed, IN), "KeyVal_load");
+  _check_err(KeyVal_hasValue(&has, hashed, "a::loaded"), "KeyVal_hasValue");
+  ok(has, "16f. loaded keys are indexed");
+
+  _check_err(KeyVal_delete(plain), "KeyVal_delete");
+  _check_err(KeyVal_delete(hashed), "KeyVal_delete");
+}
+
+
+// Returns whether two null-terminated key arrays match, and frees both.
+static int
+_same_keys(char **k1, char **k2) {
+  int same = 1;
+  unsigned long i = 0;
+  for (; k1[i] && k2[i]; ++i) {
+    if (strcmp(k1[i], k2[i])) same = 0;
+  }
+  if (k1[i] || k2[i]) same = 0;
+  for (i = 0; k1[i]; ++i) free(k1[i]);
+  for (i = 0; k2[i]; ++i) free(k2[i]);
+  free(k1);
+  free(k2);
+  return same;
+}
+
+
+// 17: the trie index has to give the same answers as scanning the sorted
+// array.  Keys made of 'a', 'b', and ':' hit the awkward cases (empty
+// segments, ":::", trailing "::").
+static void test17() {
+  // 17a-17c: a key of just 'path::' used to hide the subkeys after it:
+  struct KeyVal *kv;
+  _check_err(KeyVal_new(&kv), "KeyVal_new");
+  _check_err(KeyVal_setValue(kv, "a", "1"), "KeyVal_setValue");
+  _check_err(KeyVal_setValue(kv, "a::", "2"), "KeyVal_setValue");
+  _check_err(KeyVal_setValue(kv, "a::b", "3"), "KeyVal_setValue");
+  char **keys;
+  _check_err(KeyVal_getKeys(&keys, kv, "a"), "KeyVal_getKeys");
+  ok(keys[0] && !strcmp(keys[0], "b") && !keys[1], "17a. getKeys steps over 'path::'");
+  free(keys[0]);
+  free(keys);
+  unsigned char res;
+  _check_err(KeyVal_remove(kv, "a"), "KeyVal_remove");
+  _check_err(KeyVal_hasKeys(&res, kv, "a"), "KeyVal_hasKeys");
+  ok(res, "17b. hasKeys steps over 'path::'");
+  _check_err(KeyVal_exists(&res, kv, "a"), "KeyVal_exists");
+  ok(res, "17c. exists steps over 'path::'");
+  _check_err(KeyVal_delete(kv), "KeyVal_delete");
+
+  struct KeyVal *plain;
+  struct KeyVal *trie;
+  _check_err(KeyVal_new(&plain), "KeyVal_new");
+  _check_err(KeyVal_new(&trie), "KeyVal_new");
+  _check_err(KeyVal_setTrieIndex(trie, 1), "KeyVal_setTrieIndex");
+  ok(trie->trie != 0, "17d. setTrieIndex builds a trie");
+
+  const char alphabet[] = {'a', 'b', ':'};
+  char key[16];
+  unsigned long long seed = 17;
+  int same_keys = 1;
+  int same_has = 1;
+  int same_exists = 1;
+  for (int round = 0; round < 30; ++round) {
+    for (int op = 0; op < 300; ++op) {
+      seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+      int len = (seed >> 60) % 9;
+      for (int c = 0; c < len; ++c) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        key[c] = alphabet[(seed >> 40) % 3];
+      }
+      key[len] = 0;
+      if ((seed >> 20) % 4 == 0) {
+        _check_err(KeyVal_remove(plain, key), "KeyVal_remove");
+        _check_err(KeyVal_remove(trie, key), "KeyVal_remove");
+      } else {
+        _check_err(KeyVal_setValue(plain, key, "x"), "KeyVal_setValue");
+        _check_err(KeyVal_setValue(trie, key, "x"), "KeyVal_setValue");
+      }
+    }
+    for (int q = 0; q < 200; ++q) {
+      seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+      int len = (seed >> 60) % 7;
+      for (int c = 0; c < len; ++c) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        key[c] = alphabet[(seed >> 40) % 3];
+      }
+      key[len] = 0;
+      char **k1;
+      char **k2;
+      _check_err(KeyVal_getKeys(&k1, plain, key), "KeyVal_getKeys");
+      _check_err(KeyVal_getKeys(&k2, trie, key), "KeyVal_getKeys");
+      if (!_same_keys(k1, k2)) same_keys = 0;
+      unsigned char r1;
+      unsigned char r2;
+      _check_err(KeyVal_hasKeys(&r1, plain, key), "KeyVal_hasKeys");
+      _check_err(KeyVal_hasKeys(&r2, trie, key), "KeyVal_hasKeys");
+      if (r1 != r2) same_has = 0;
+      _check_err(KeyVal_exists(&r1, plain, key), "KeyVal_exists");
+      _check_err(KeyVal_exists(&r2, trie, key), "KeyVal_exists");
+      if (r1 != r2) same_exists = 0;
+    }
+  }
+  ok(same_keys, "17e. trie and array agree on getKeys");
+  ok(same_has, "17f. trie and array agree on hasKeys");
+  ok(same_exists, "17g. trie and array agree on exists");
+
+  unsigned long size;
+  _check_err(KeyVal_size(&size, trie), "KeyVal_size");
+  ok(trie->trie->count == size, "17h. trie counts every key");
+
+  // 17i: a rebuilt trie matches the one that was kept up to date:
+  _check_err(KeyVal_setTrieIndex(trie, 0), "KeyVal_setTrieIndex");
+  ok(trie->trie == 0, "17i. trie can be turned off");
+  _check_err(KeyVal_setTrieIndex(trie, 1), "KeyVal_setTrieIndex");
+  ok(trie->trie->count == size, "17j. rebuilt trie counts every key");
+
+  _check_err(KeyVal_delete(plain), "KeyVal_delete");
+  _check_err(KeyVal_delete(trie), "KeyVal_delete");
+}
+
+
+// 18: loads on separate threads, into separate KeyVals, mustn't interfere.
+// Each thread loads its own file over and over, through the mapped path, the
+// zero-copy path, and a fifo (which goes through the read buffer), and checks
+// what it got.
+#define TEST18_THREADS 8
+#define TEST18_KEYS 2000
+
+struct test18_job {
+  int id;
+  char path[64];
+  char fifo_path[64];
+  char *contents;
+  int failures;
+};
+
+static void *
+_test18_write_fifo(void *arg) {
+  struct test18_job *job = arg;
+  FILE *fh = fopen(job->fifo_path, "w");
+  if (fh) {
+    fputs(job->contents, fh);
+    fclose(fh);
+  }
+  return 0;
+}
+
+static int
+_test18_check(struct test18_job *job, struct KeyVal *kv) {
+  unsigned long size;
+  if (KeyVal_size(&size, kv) || size != TEST18_KEYS + 1) return 0;
+  char key[64];
+  char expected[64];
+  for (int k = 0; k < TEST18_KEYS; k += 97) {
+    sprintf(key, "t%d::k%d", job->id, k);
+    sprintf(expected, "`%d.%d` of t%d", job->id, k, job->id);
+    char *val;
+    if (KeyVal_getValue(&val, kv, key, 1)) return 0;
+    int same = val && !strcmp(val, expected);
+    free(val);
+    if (!same) return 0;
+  }
+  return 1;
+}
+
+static void *
+_test18_load(void *arg) {
+  struct test18_job *job = arg;
+  for (int rep = 0; rep < 30; ++rep) {
+    struct KeyVal *kv;
+    if (KeyVal_new(&kv)) { ++job->failures; continue; }
+    unsigned char res;
+    if (rep % 3 == 0) {
+      res = KeyVal_load(kv, job->path);
+    } else if (rep % 3 == 1) {
+      res = KeyVal_loadMapped(kv, job->path);
+    } else {
+      pthread_t writer;
+      remove(job->fifo_path);
+      if (mkfifo(job->fifo_path, 0600)
+          || pthread_create(&writer, 0, _test18_write_fifo, job)) {
+        ++job->failures;
+        KeyVal_delete(kv);
+        continue;
+      }
+      res = KeyVal_load(kv, job->fifo_path);
+      pthread_join(writer, 0);
+      remove(job->fifo_path);
+    }
+    if (res || !_test18_check(job, kv)) ++job->failures;
+    KeyVal_delete(kv);
+  }
+  return 0;
+}
+
+static void test18() {
+  struct test18_job jobs[TEST18_THREADS];
+  pthread_t threads[TEST18_THREADS];
+  for (int t = 0; t < TEST18_THREADS; ++t) {
+    struct test18_job *job = &jobs[t];
+    job->id = t;
+    job->failures = 0;
+    sprintf(job->path, "/tmp/keyval.test.thread%d.in", t);
+    sprintf(job->fifo_path, "/tmp/keyval.test.thread%d.fifo", t);
+
+    // (in reverse, so every load has to sort, and with escapes and
+    // interpolation so that every part of the parser gets used)
+    job->contents = malloc(TEST18_KEYS * 64 + 64);
+    char *ptr = job->contents;
+    ptr += sprintf(ptr, "`t%d::name` = `t%d`\n", t, t);
+    for (int k = TEST18_KEYS - 1; k >= 0; --k) {
+      ptr += sprintf(ptr, "`t%d::k%d` = `\\`%d.%d\\` of ${t%d::name}`\n", t, k, t, k, t);
+    }
+    FILE *fh = fopen(job->path, "w");
+    fputs(job->contents, fh);
+    fclose(fh);
+  }
+
+  int started = 1;
+  for (int t = 0; t < TEST18_THREADS; ++t) {
+    if (pthread_create(&threads[t], 0, _test18_load, &jobs[t])) started = 0;
+  }
+  ok(started, "18a. started all the loader threads");
+  int failures = 0;
+  for (int t = 0; t < TEST18_THREADS; ++t) {
+    pthread_join(threads[t], 0);
+    failures += jobs[t].failures;
+    remove(jobs[t].path);
+    free(jobs[t].contents);
+  }
+  ok(failures == 0, "18b. concurrent loads all got the right contents");
+}
+
+
+// 19: a frozen KeyVal can be read from lots of threads with no locking, and
+// refuses to change.  (The readers start before anything has been queried, so
+// an unfrozen KeyVal would still have its whole tail to sort.)
+#define TEST19_THREADS 8
+
+struct test19_job {
+  struct KeyVal *kv;
+  int failures;
+};
+
+static void *
+_test19_read(void *arg) {
+  struct test19_job *job = arg;
+  char key[64];
+  char expected[64];
+  for (int rep = 0; rep < 5; ++rep) {
+    for (int k = 0; k < 3000; ++k) {
+      sprintf(key, "g%d::k%d", k % 10, k);
+      sprintf(expected, "%d in g%d", k, k % 10);
+      char *val;
+      if (KeyVal_getValue(&val, job->kv, key, 1)) { ++job->failures; continue; }
+      if (!val || strcmp(val, expected)) ++job->failures;
+      free(val);
+      // (this goes through the thread's own buffer, freed when it exits)
+      const char *peeked;
+      unsigned long len;
+      if (KeyVal_peekValue(&peeked, &len, job->kv, key, 1)) { ++job->failures; continue; }
+      if (!peeked || strcmp(peeked, expected)) ++job->failures;
+    }
+    char **keys;
+    if (KeyVal_getKeys(&keys, job->kv, "")) { ++job->failures; continue; }
+    int n = 0;
+    for (; keys[n]; ++n) free(keys[n]);
+    free(keys);
+    if (n != 10) ++job->failures;
+    unsigned char has;
+    if (KeyVal_hasKeys(&has, job->kv, "g3") || !has) ++job->failures;
+    if (KeyVal_exists(&has, job->kv, "g3::nope") || has) ++job->failures;
+  }
+  return 0;
+}
+
+static void test19() {
+  struct KeyVal *kv;
+  _check_err(KeyVal_new(&kv), "KeyVal_new");
+  char key[64];
+  char val[64];
+  for (int k = 2999; k >= 0; --k) {
+    sprintf(key, "g%d::k%d", k % 10, k);
+    sprintf(val, "%d in ${g%d::name}", k, k % 10);
+    _check_err(KeyVal_setValue(kv, key, val), "KeyVal_setValue");
+  }
+  for (int g = 0; g < 10; ++g) {
+    sprintf(key, "g%d::name", g);
+    sprintf(val, "g%d", g);
+    _check_err(KeyVal_setValue(kv, key, val), "KeyVal_setValue");
+  }
+  ok(kv->last_sorted < kv->used_size, "19a. KeyVal starts out unsorted");
+  ok(KeyVal_freeze(kv) == 0, "19b. freeze works");
+  ok(kv->last_sorted == kv->used_size, "19c. freeze sorts everything");
+
+  struct test19_job jobs[TEST19_THREADS];
+  pthread_t threads[TEST19_THREADS];
+  for (int t = 0; t < TEST19_THREADS; ++t) {
+    jobs[t].kv = kv;
+    jobs[t].failures = 0;
+    pthread_create(&threads[t], 0, _test19_read, &jobs[t]);
+  }
+  int failures = 0;
+  for (int t = 0; t < TEST19_THREADS; ++t) {
+    pthread_join(threads[t], 0);
+    failures += jobs[t].failures;
+  }
+  ok(failures == 0, "19d. concurrent readers all got the right answers");
+
+  errno = 0;
+  ok(KeyVal_setValue(kv, "new", "value") == 1 && errno == EPERM, "19e. frozen KeyVal refuses setValue");
+  errno = 0;
+  ok(KeyVal_remove(kv, "g0::k0") == 1 && errno == EPERM, "19f. frozen KeyVal refuses remove");
+  _set_input("`new` = `value`\n");
+  errno = 0;
+  ok(KeyVal_load(kv, IN) == 1 && errno == EPERM, "19g. frozen KeyVal refuses load");
+  unsigned char has;
+  _check_err(KeyVal_hasValue(&has, kv, "new"), "KeyVal_hasValue");
+  ok(!has, "19h. frozen KeyVal is unchanged");
+
+  ok(KeyVal_thaw(kv) == 0, "19i. thaw works");
+  ok(KeyVal_setValue(kv, "new", "value") == 0, "19j. thawed KeyVal can change again");
+
+  _check_err(KeyVal_delete(kv), "KeyVal_delete");
+}
+
+
+// 20: binary images have to answer exactly like the KeyVal they came from.
+static void test20() {
+  const char *BIN = "/tmp/keyval.test.kvb";
+  struct KeyVal *kv;
+  _check_err(KeyVal_new(&kv), "KeyVal_new");
+  char key[64];
+  char val[64];
+  for (int i = 499; i >= 0; --i) {
+    sprintf(key, "g%d::s%d::k%d", i % 7, i % 3, i);
+    sprintf(val, "%d of ${g%d::name}", i, i % 7);
+    _check_err(KeyVal_setValue(kv, key, val), "KeyVal_setValue");
+  }
+  for (int g = 0; g < 7; ++g) {
+    sprintf(key, "g%d::name", g);
+    sprintf(val, "group `%d`", g);
+    _check_err(KeyVal_setValue(kv, key, val), "KeyVal_setValue");
+  }
+  _check_err(KeyVal_setValue(kv, "g1::", "bare"), "KeyVal_setValue");
+  _check_err(KeyVal_setValue(kv, "g1", "top"), "KeyVal_setValue");
+
+  ok(KeyVal_saveBinary(kv, BIN, 1) == 0, "20a. saveBinary works");
+  struct KeyValBinary *kvb;
+  ok(KeyVal_openBinary(&kvb, BIN, 1) == 0, "20b. openBinary works, with verification");
+  unsigned long size1;
+  unsigned long size2;
+  _check_err(KeyVal_size(&size1, kv), "KeyVal_size");
+  _check_err(KeyVal_binarySize(&size2, kvb), "KeyVal_binarySize");
+  ok(size1 == size2 && kvb->interpolated, "20c. binary image has every key");
+
+  int same_vals = 1;
+  for (unsigned long i = 0; i < size1; ++i) {
+    char *v1;
+    char *v2;
+    _check_err(KeyVal_getValue(&v1, kv, kv->data[i].key, 1), "KeyVal_getValue");
+    _check_err(KeyVal_binaryGetValue(&v2, kvb, kv->data[i].key), "KeyVal_binaryGetValue");
+    if (!v1 || !v2 || strcmp(v1, v2)) same_vals = 0;
+    free(v1);
+    free(v2);
+  }
+  ok(same_vals, "20d. binary image has interpolated values");
+
+  const char *paths[] = {"", "g1", "g1::s2", "g6::s0::k6", "g", "nope", "g1::name", 0};
+  int same_keys = 1;
+  for (int p = 0; paths[p]; ++p) {
+    char **k1;
+    char **k2;
+    _check_err(KeyVal_getKeys(&k1, kv, paths[p]), "KeyVal_getKeys");
+    _check_err(KeyVal_binaryGetKeys(&k2, kvb, paths[p]), "KeyVal_binaryGetKeys");
+    if (!_same_keys(k1, k2)) same_keys = 0;
+  }
+  ok(same_keys, "20e. binary getKeys matches");
+  unsigned char has;
+  _check_err(KeyVal_binaryHasValue(&has, kvb, "g1::"), "KeyVal_binaryHasValue");
+  ok(has, "20f. binary hasValue finds keys");
+  _check_err(KeyVal_binaryHasValue(&has, kvb, "g1::nope"), "KeyVal_binaryHasValue");
+  ok(!has, "20g. binary hasValue misses missing keys");
+  char *v;
+  _check_err(KeyVal_binaryGetValue(&v, kvb, "g1::nope"), "KeyVal_binaryGetValue");
+  ok(v == 0, "20h. binary getValue misses missing keys");
+  _check_err(KeyVal_closeBinary(kvb), "KeyVal_closeBinary");
+
+  // 20i: uninterpolated images keep the variables:
+  _check_err(KeyVal_saveBinary(kv, BIN, 0), "KeyVal_saveBinary");
+  _check_err(KeyVal_openBinary(&kvb, BIN, 0), "KeyVal_openBinary");
+  _check_err(KeyVal_binaryGetValue(&v, kvb, "g0::s0::k0"), "KeyVal_binaryGetValue");
+  ok(v && !strcmp(v, "0 of ${g0::name}") && !kvb->interpolated, "20i. uninterpolated image keeps variables");
+  free(v);
+
+  // 20q-20r: saving over an image that's open leaves the open one alone
+  // (writing it in place would truncate it out from under the mapping):
+  struct KeyVal *empty;
+  _check_err(KeyVal_new(&empty), "KeyVal_new");
+  ok(KeyVal_saveBinary(empty, BIN, 1) == 0, "20q. saveBinary over an open image works");
+  _check_err(KeyVal_delete(empty), "KeyVal_delete");
+  _check_err(KeyVal_binaryGetValue(&v, kvb, "g6::s0::k6"), "KeyVal_binaryGetValue");
+  ok(v && !strcmp(v, "6 of ${g6::name}"), "20r. the open image still reads the old contents");
+  free(v);
+  _check_err(KeyVal_closeBinary(kvb), "KeyVal_closeBinary");
+  _check_err(KeyVal_saveBinary(kv, BIN, 0), "KeyVal_saveBinary");
+
+  // 20j-20m: damaged images are refused:
+  struct stat st;
+  stat(BIN, &st);
+  FILE *fh = fopen(BIN, "r+");
+  fseek(fh, st.st_size - 10, SEEK_SET);
+  fputc('#', fh);
+  fclose(fh);
+  ok(KeyVal_openBinary(&kvb, BIN, 1) == 1, "20j. verification catches a damaged heap");
+  ok(KeyVal_openBinary(&kvb, BIN, 0) == 0, "20k. damage goes unnoticed without verification");
+  _check_err(KeyVal_closeBinary(kvb), "KeyVal_closeBinary");
+  truncate(BIN, st.st_size - 1);
+  ok(KeyVal_openBinary(&kvb, BIN, 0) == 1, "20l. truncated image is refused");
+  ok(KeyVal_openBinary(&kvb, IN, 0) == 1, "20m. text file is refused");
+  remove(BIN);
+  ok(KeyVal_openBinary(&kvb, BIN, 0) == 2, "20n. missing image can't be opened");
+  _check_err(KeyVal_delete(kv), "KeyVal_delete");
+
+  // 20o: an empty KeyVal makes an empty image:
+  _check_err(KeyVal_new(&kv), "KeyVal_new");
+  _check_err(KeyVal_saveBinary(kv, BIN, 1), "KeyVal_saveBinary");
+  ok(KeyVal_openBinary(&kvb, BIN, 1) == 0, "20o. empty image works");
+  char **keys;
+  _check_err(KeyVal_binaryGetKeys(&keys, kvb, ""), "KeyVal_binaryGetKeys");
+  ok(keys[0] == 0, "20p. empty image has no keys");
+  free(keys);
+  _check_err(KeyVal_closeBinary(kvb), "KeyVal_closeBinary");
+  _check_err(KeyVal_delete(kv), "KeyVal_delete");
+  remove(BIN);
+}
+
+
+// Compares everything in two KeyVals, uninterpolated.
+static int
+_same_contents(struct KeyVal *kv1, struct KeyVal *kv2) {
+  unsigned long size1;
+  unsigned long size2;
+  _check_err(KeyVal_size(&size1, kv1), "KeyVal_size");
+  _check_err(KeyVal_size(&size2, kv2), "KeyVal_size");
+  if (size1 != size2) return 0;
+  int same = 1;
+  for (unsigned long i = 0; same && i < size1; ++i) {
+    char *v1;
+    char *v2;
+    _check_err(KeyVal_getValue(&v1, kv1, kv2->data[i].key, 0), "KeyVal_getValue");
+    _check_err(KeyVal_getValue(&v2, kv2, kv2->data[i].key, 0), "KeyVal_getValue");
+    if (!v1 || !v2 || strcmp(v1, v2)) same = 0;
+    free(v1);
+    free(v2);
+  }
+  return same;
+}
+
+
+// 21: loading several files at once has to end up exactly where loading them
+// one after the other does.
+static void test21() {
+  const int num_files = 6;
+  char paths[6][64];
+  const char *path_ptrs[7];
+  for (int f = 0; f < num_files; ++f) {
+    sprintf(paths[f], "/tmp/keyval.test.layer%d.in", f);
+    path_ptrs[f] = paths[f];
+    FILE *fh = fopen(paths[f], "w");
+    for (int i = 0; i < 300; ++i) {
+      // each layer overrides some of the earlier layers' keys, and removes
+      // some others:
+      if (f && i % 5 == f) {
+        fprintf(fh, "`k%d` remove\n", i);
+      } else if (i % (f + 1) == 0) {
+        fprintf(fh, "`k%d` = `layer %d`\n", i, f);
+      }
+    }
+    fprintf(fh, "`only%d` = `${k0} from %d`\n", f, f);
+    fclose(fh);
+  }
+
+  // 21a: a remove line removes the key:
+  _set_input("`a` = `1`\n`b` = `2`\n`a` remove\n");
+  struct KeyVal *kv;
+  _check_err(KeyVal_new(&kv), "KeyVal_new");
+  _check_err(KeyVal_load(kv, IN), "KeyVal_load");
+  unsigned char has;
+  _check_err(KeyVal_hasValue(&has, kv, "a"), "KeyVal_hasValue");
+  ok(!has, "21a. remove lines remove the key");
+  _check_err(KeyVal_delete(kv), "KeyVal_delete");
+
+  struct KeyVal *expected;
+  _check_err(KeyVal_new(&expected), "KeyVal_new");
+  for (int f = 0; f < num_files; ++f) {
+    _check_err(KeyVal_load(expected, paths[f]), "KeyVal_load");
+  }
+
+  const unsigned int thread_counts[] = {0, 1, 2, 3, 16};
+  int same = 1;
+  for (int t = 0; t < 5; ++t) {
+    _check_err(KeyVal_new(&kv), "KeyVal_new");
+    // (something already there, for the first layer to override)
+    _check_err(KeyVal_setValue(kv, "k0", "before"), "KeyVal_setValue");
+    if (KeyVal_loadMany(kv, path_ptrs, num_files, thread_counts[t])) same = 0;
+    if (!_same_contents(kv, expected)) same = 0;
+    _check_err(KeyVal_delete(kv), "KeyVal_delete");
+  }
+  ok(same, "21b. loadMany matches sequential loads, for any number of threads");
+  _check_err(KeyVal_delete(expected), "KeyVal_delete");
+
+  // 21c-21e: problems with one file don't stop the others:
+  _set_input("`bad` line\n");
+  path_ptrs[1] = IN;
+  path_ptrs[6] = "/tmp/keyval.test.nonexistent";
+  _check_err(KeyVal_new(&kv), "KeyVal_new");
+  ok(KeyVal_loadMany(kv, path_ptrs, 2, 2) == 1, "21c. parse errors are reported");
+  ok(KeyVal_loadMany(kv, path_ptrs + 1, 6, 4) == 2, "21d. missing files are reported");
+  _check_err(KeyVal_hasValue(&has, kv, "only5"), "KeyVal_hasValue");
+  ok(has, "21e. the other files still get loaded");
+  ok(KeyVal_loadMany(kv, path_ptrs, 0, 4) == 0, "21f. no files is fine");
+  _check_err(KeyVal_freeze(kv), "KeyVal_freeze");
+  ok(KeyVal_loadMany(kv, path_ptrs, 1, 4) == 1 && errno == EPERM, "21g. frozen KeyVals are refused");
+  _check_err(KeyVal_delete(kv), "KeyVal_delete");
+
+  for (int f = 0; f < num_files; ++f) {
+    remove(paths[f]);
+  }
+}
+
+
+// 22: splitting one big file up has to end up exactly where loading it the
+// usual way does.
+static void test22() {
+  // a few MB, with comments, escapes, overrides, and removes all over:
+  FILE *fh = fopen(IN, "w");
+  for (int i = 0; i < 60000; ++i) {
+    int k = i % 20011;
+    if (i % 97 == 0) {
+      fprintf(fh, "# comment %d with a `quote` in it\n", i);
+    }
+    if (i % 13 == 5) {
+      fprintf(fh, "  `key::%d` remove\n", k);
+    } else {
+      fprintf(fh, "`key::%d`\t= `value \\`%d\\` with some padding to make it longer`\n", k, i);
+    }
+  }
+  fprintf(fh, "`last` = `no newline`");
+  fclose(fh);
+
+  struct KeyVal *expected;
+  _check_err(KeyVal_new(&expected), "KeyVal_new");
+  _check_err(KeyVal_load(expected, IN), "KeyVal_load");
+
+  struct KeyVal *kv;
+  int same = 1;
+  for (unsigned int threads = 1; threads <= 8; threads *= 2) {
+    _check_err(KeyVal_new(&kv), "KeyVal_new");
+    if (KeyVal_loadParallel(kv, IN, threads)) same = 0;
+    if (!_same_contents(kv, expected)) same = 0;
+    _check_err(KeyVal_delete(kv), "KeyVal_delete");
+  }
+  ok(same, "22a. loadParallel matches load");
+  _check_err(KeyVal_delete(expected), "KeyVal_delete");
+
+  // 22b: a mistake near the end gets the file loaded again the usual way:
+  fh = fopen(IN, "a");
+  fprintf(fh, "\n`broken` = value\n`after` = `the mistake`\n");
+  fclose(fh);
+  _check_err(KeyVal_new(&expected), "KeyVal_new");
+  ok(KeyVal_load(expected, IN) == 1, "22b. (sequential load sees the mistake)");
+  _check_err(KeyVal_new(&kv), "KeyVal_new");
+  ok(KeyVal_loadParallel(kv, IN, 4) == 1, "22c. loadParallel sees the mistake");
+  ok(_same_contents(kv, expected), "22d. and still loads the same things");
+  _check_err(KeyVal_delete(kv), "KeyVal_delete");
+  _check_err(KeyVal_delete(expected), "KeyVal_delete");
+
+  // 22e-22f: everything else goes the usual way:
+  _check_err(KeyVal_new(&kv), "KeyVal_new");
+  _set_input("`small` = `file`\n");
+  ok(KeyVal_loadParallel(kv, IN, 4) == 0, "22e. small files load");
+  ok(KeyVal_loadParallel(kv, "/tmp/keyval.test.nonexistent", 4) == 2, "22f. missing files are reported");
+  char *v;
+  _check_err(KeyVal_getValue(&v, kv, "small", 0), "KeyVal_getValue");
+  ok(v && !strcmp(v, "file"), "22g. small files load correctly");
+  free(v);
+  _check_err(KeyVal_delete(kv), "KeyVal_delete");
+}
+
+
+// 23: the quoted-string fast path.
+static void test23() {
+  const char *KeyVal_scanQuoted(const char *p, const char *end, int level);
+
+  // 23a: every way of scanning finds the same byte, wherever it is:
+  char buf[256];
+  unsigned long long seed = 23;
+  int same = 1;
+  for (int trial = 0; trial < 5000; ++trial) {
+    int len = trial % 200;
+    for (int i = 0; i < len; ++i) {
+      seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+      int r = (seed >> 33) % 300;
+      buf[i] = r == 0 ? '`' : r == 1 ? '\\' : r == 2 ? '\n' : 'a' + r % 26;
+    }
+    int start = len ? trial % len : 0;
+    const char *expected = buf + start;
+    while (expected < buf + len && *expected != '`' && *expected != '\\' && *expected != '\n') {
+      ++expected;
+    }
+    for (int level = 0; level <= 2; ++level) {
+      if (KeyVal_scanQuoted(buf + start, buf + len, level) != expected) same = 0;
+    }
+  }
+  ok(same, "23a. every scan level agrees");
+
+  // 23b-23e: long strings (across several of the pipe's reads), and escapes
+  // that aren't '`' or '\\', whether the input is mapped or read through a
+  // pipe:
+  const int num_long = 20;
+  const int len = 1000;
+  char *text = malloc(num_long * (2 * len + 20) + 100);
+  char *p = text;
+  for (int k = 0; k < num_long; ++k) {
+    p += sprintf(p, "`long::%02d::", k);
+    for (int i = 0; i < len - 10; ++i) *p++ = 'a' + (i + k) % 26;
+    p += sprintf(p, "` = `");
+    for (int i = 0; i < len - 4; ++i) *p++ = 'A' + (i * k) % 26;
+    p += sprintf(p, "\\`end`\n");
+  }
+  p += sprintf(p, "`esc` = `a\\tb\\\nc`\n  # `comment\n`after` = `x`\n");
+  *p = 0;
+  for (int fifo = 0; fifo < 2; ++fifo) {
+    struct KeyVal *kv;
+    _check_err(KeyVal_new(&kv), "KeyVal_new");
+    _set_input(text);
+    unsigned char res = fifo ? _load_through_fifo(kv, text) : KeyVal_load(kv, IN);
+    ok(res == 0, fifo ? "23b. (fifo) loads long strings" : "23b. loads long strings");
+    char **keys;
+    _check_err(KeyVal_getAllKeys(&keys, kv), "KeyVal_getAllKeys");
+    int right = 1;
+    int num_keys = 0;
+    for (; keys[num_keys]; ++num_keys) {
+      char *v;
+      _check_err(KeyVal_getValue(&v, kv, keys[num_keys], 0), "KeyVal_getValue");
+      if (!strncmp(keys[num_keys], "long::", 6)
+          && (strlen(keys[num_keys]) != len || !v || strlen(v) != len
+            || strcmp(v + len - 4, "`end"))) {
+        right = 0;
+      }
+      free(v);
+      free(keys[num_keys]);
+    }
+    free(keys);
+    ok(right && num_keys == num_long + 2, fifo ? "23c. (fifo) long strings are intact" : "23c. long strings are intact");
+    char *v;
+    _check_err(KeyVal_getValue(&v, kv, "esc", 0), "KeyVal_getValue");
+    ok(v && !strcmp(v, "a\\tb\\\nc"), fifo ? "23d. (fifo) other escapes are preserved" : "23d. other escapes are preserved");
+    free(v);
+    _check_err(KeyVal_getValue(&v, kv, "after", 0), "KeyVal_getValue");
+    ok(v && !strcmp(v, "x"), fifo ? "23e. (fifo) parsing carries on after them" : "23e. parsing carries on after them");
+    free(v);
+    _check_err(KeyVal_delete(kv), "KeyVal_delete");
+  }
+  free(text);
+}
+
+
+// The byte-at-a-time KeyVal_strcmp, as a reference for test 24.
+static int
+_reference_strcmp(const char *s1, const char *s2) {
+  const unsigned char *_s1 = (const unsigned char*)s1;
+  const unsigned char *_s2 = (const unsigned char*)s2;
+  while (1) {
+    if (!*_s1 && !*_s2) return 0;
+    if (!*_s2) return 1;
+    if (!*_s1) return -1;
+    unsigned char s1_dc = (_s1[0] == ':' && _s1[1] == ':');
+    unsigned char s2_dc = (_s2[0] == ':' && _s2[1] == ':');
+    if (s1_dc && s2_dc) {
+      _s1 += 2;
+      _s2 += 2;
+    }
+    else if (s1_dc) return -2;
+    else if (s2_dc) return 2;
+    else if (*_s1 != *_s2) return (*_s1 < *_s2) ? -3 : 3;
+    else {
+      ++_s1;
+      ++_s2;
+    }
+  }
+}
+
+static int
+_sign(int x) {
+  return (x > 0) - (x < 0);
+}
+
+// 24: the word-at-a-time KeyVal_strcmp has to order everything exactly like
+// the byte-at-a-time one.
+static void test24() {
+  // 24a: random keys made mostly of colons and a few letters (so that "::"
+  // turns up everywhere, including right at word boundaries), with long
+  // shared prefixes, at every alignment:
+  char buf1[128];
+  char buf2[128];
+  unsigned long long seed = 24;
+  int same = 1;
+  for (int trial = 0; trial < 200000 && same; ++trial) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    int off1 = (seed >> 20) % 8;
+    int off2 = (seed >> 23) % 8;
+    int len1 = (seed >> 26) % 40;
+    int len2 = (seed >> 32) % 40;
+    char *s1 = buf1 + off1;
+    char *s2 = buf2 + off2;
+    for (int i = 0; i < len1; ++i) {
+      seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+      s1[i] = ":::ab0"[(seed >> 33) % 6];
+    }
+    s1[len1] = 0;
+    // s2 mostly starts out as a copy of s1, and then wanders off:
+    int shared = len1 ? (seed >> 40) % (len1 + 1) : 0;
+    memcpy(s2, s1, shared);
+    for (int i = shared; i < len2; ++i) {
+      seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+      s2[i] = ":::ab0"[(seed >> 33) % 6];
+    }
+    s2[len2 > shared ? len2 : shared] = 0;
+    if (_sign(KeyVal_strcmp(s1, s2)) != _sign(_reference_strcmp(s1, s2))
+        || _sign(KeyVal_strcmp(s2, s1)) != _sign(_reference_strcmp(s2, s1))) {
+      same = 0;
+    }
+  }
+  ok(same, "24a. word-at-a-time strcmp matches byte-at-a-time strcmp");
+
+  // 24b: strings that end right before an unreadable page:
+  long page = sysconf(_SC_PAGESIZE);
+  char *pages = mmap(0, 2 * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  mprotect(pages + page, page, PROT_NONE);
+  char *end = pages + page;
+  int right = 1;
+  for (int len = 1; len < 20; ++len) {
+    char *s = end - len;
+    memset(s, 'k', len - 1);
+    s[len - 1] = 0;
+    if (KeyVal_strcmp(s, s) != 0) right = 0;
+    if (KeyVal_strcmp(s, "kkkkkkkkkkkkkkkkkkkkkkkk") >= 0) right = 0;
+    if (KeyVal_strcmp("kkkkkkkkkkkkkkkkkkkkkkkk", s) <= 0) right = 0;
+  }
+  ok(right, "24b. strcmp doesn't read past the end of the last page");
+  munmap(pages, 2 * page);
+}
+
+
+// Returns the interpolation cache's value for 'key', if it has one.
+static const char *
+_cached(struct KeyVal *kv, const char *key) {
+  struct KeyValInterpCache *cache = kv->interp_cache;
+  for (unsigned long b = 0; b < cache->num_buckets; ++b) {
+    for (struct KeyValInterpNode *node = cache->buckets[b]; node; node = node->next) {
+      if (!strcmp(node->key, key)) return node->val;
+    }
+  }
+  return 0;
+}
+
+// Checks KeyVal_getValue(.., 1) against what it ought to be.
+static int
+_interps_to(struct KeyVal *kv, const char *key, const char *expected) {
+  char *v;
+  if (KeyVal_getValue(&v, kv, key, 1)) return 0;
+  int res = v && !strcmp(v, expected);
+  free(v);
+  return res;
+}
+
+// 25: the interpolation cache has to answer exactly like interpolating from
+// scratch, and only forget what it has to.
+static void test25() {
+  struct KeyVal *kv;
+  _check_err(KeyVal_new(&kv), "KeyVal_new");
+  _check_err(KeyVal_setInterpCache(kv, 1), "KeyVal_setInterpCache");
+  _check_err(KeyVal_setValue(kv, "base", "root"), "KeyVal_setValue");
+  _check_err(KeyVal_setValue(kv, "a", "${base}/a"), "KeyVal_setValue");
+  _check_err(KeyVal_setValue(kv, "b", "${a}/b"), "KeyVal_setValue");
+  _check_err(KeyVal_setValue(kv, "c", "${b}/${missing}"), "KeyVal_setValue");
+  _check_err(KeyVal_setValue(kv, "other", "${elsewhere}!"), "KeyVal_setValue");
+  _check_err(KeyVal_setValue(kv, "elsewhere", "there"), "KeyVal_setValue");
+
+  ok(_interps_to(kv, "b", "root/a/b") && _interps_to(kv, "c", "root/a/b/${missing}")
+      && _interps_to(kv, "other", "there!"), "25a. cached values are right");
+  ok(_cached(kv, "b") && _cached(kv, "c") && _cached(kv, "other"), "25b. and they're cached");
+  ok(_interps_to(kv, "b", "root/a/b"), "25c. cached values come back out");
+
+  _check_err(KeyVal_setValue(kv, "base", "R"), "KeyVal_setValue");
+  ok(!_cached(kv, "b") && !_cached(kv, "c") && _cached(kv, "other"),
+      "25d. setValue only throws out what used the key, at any depth");
+  ok(_interps_to(kv, "c", "R/a/b/${missing}"), "25e. and they're rebuilt");
+  _check_err(KeyVal_setValue(kv, "missing", "M"), "KeyVal_setValue");
+  ok(!_cached(kv, "c") && _interps_to(kv, "c", "R/a/b/M"), "25f. setting a missing key throws out what tried to use it");
+  _check_err(KeyVal_remove(kv, "a"), "KeyVal_remove");
+  ok(!_cached(kv, "c") && _cached(kv, "other"), "25g. remove throws out what used the key");
+  ok(_interps_to(kv, "b", "${a}/b"), "25h. and they're rebuilt");
+  _set_input("`elsewhere` = `loaded`\n");
+  _check_err(KeyVal_load(kv, IN), "KeyVal_load");
+  ok(!_cached(kv, "other") && _interps_to(kv, "other", "loaded!"), "25i. loading throws out what used the key");
+
+  _check_err(KeyVal_setValue(kv, "elsewhere", "F"), "KeyVal_setValue");
+  _check_err(KeyVal_freeze(kv), "KeyVal_freeze");
+  ok(_interps_to(kv, "other", "F!") && !_cached(kv, "other")
+      && _interps_to(kv, "b", "${a}/b") && _cached(kv, "b"),
+      "25j. frozen KeyVals use the cache, but don't fill it");
+  _check_err(KeyVal_thaw(kv), "KeyVal_thaw");
+  _check_err(KeyVal_delete(kv), "KeyVal_delete");
+
+  // 25k: lots of random changes to keys that use each other, with and
+  // without the cache:
+  struct KeyVal *plain;
+  struct KeyVal *cached;
+  _check_err(KeyVal_new(&plain), "KeyVal_new");
+  _check_err(KeyVal_new(&cached), "KeyVal_new");
+  _check_err(KeyVal_setInterpCache(cached, 1), "KeyVal_setInterpCache");
+  unsigned long long seed = 25;
+  int same = 1;
+  for (int step = 0; step < 20000 && same; ++step) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    char key[16];
+    char val[64];
+    sprintf(key, "k%d", (int)((seed >> 33) % 20));
+    int op = (seed >> 40) % 10;
+    if (op == 0) {
+      _check_err(KeyVal_remove(plain, key), "KeyVal_remove");
+      _check_err(KeyVal_remove(cached, key), "KeyVal_remove");
+    }
+    else if (op < 4) {
+      sprintf(val, "${k%d}.${k%d}", (int)((seed >> 45) % 20), (int)((seed >> 50) % 20));
+      _check_err(KeyVal_setValue(plain, key, val), "KeyVal_setValue");
+      _check_err(KeyVal_setValue(cached, key, val), "KeyVal_setValue");
+    }
+    else if (op < 6) {
+      sprintf(val, "v%d", step);
+      _check_err(KeyVal_setValue(plain, key, val), "KeyVal_setValue");
+      _check_err(KeyVal_setValue(cached, key, val), "KeyVal_setValue");
+    }
+    else {
+      char *v1;
+      char *v2;
+      unsigned char r1 = KeyVal_getValue(&v1, plain, key, 1);
+      unsigned char r2 = KeyVal_getValue(&v2, cached, key, 1);
+      if (r1 != r2) same = 0;
+      if (!r1 && !r2 && (!v1 != !v2 || (v1 && strcmp(v1, v2)))) same = 0;
+      if (!r1) free(v1);
+      if (!r2) free(v2);
+    }
+  }
+  ok(same, "25k. cached values always match uncached ones");
+  _check_err(KeyVal_setInterpCache(cached, 0), "KeyVal_setInterpCache");
+  _check_err(KeyVal_delete(plain), "KeyVal_delete");
+  _check_err(KeyVal_delete(cached), "KeyVal_delete");
+}
+
+// 26: the one-pass interpolator: unknown and empty names stay put without
+// stopping the rest, and there's no limit on how long the result can be.
+static void test26() {
+  struct KeyVal *kv;
+  _check_err(KeyVal_new(&kv), "KeyVal_new");
+  _check_err(KeyVal_setValue(kv, "k1", "2"), "KeyVal_setValue");
+  _check_err(KeyVal_setValue(kv, "blank", ""), "KeyVal_setValue");
+  _check_err(KeyVal_setValue(kv, "a", "${nope}-${k1}"), "KeyVal_setValue");
+  _check_err(KeyVal_setValue(kv, "b", "[${blank}]${}${k1}}"), "KeyVal_setValue");
+  ok(_interps_to(kv, "a", "${nope}-2"), "26a. unknown variables stay, and the rest still interpolates");
+  ok(_interps_to(kv, "b", "[]${}2}"), "26b. empty values and names are fine");
+
+  // lots of unclosed "${"s, then a variable:
+  char deep[200] = "";
+  for (int i = 0; i < 40; ++i) strcat(deep, "${");
+  strcat(deep, "${k1}");
+  _check_err(KeyVal_setValue(kv, "deep", deep), "KeyVal_setValue");
+  char expected[200] = "";
+  for (int i = 0; i < 40; ++i) strcat(expected, "${");
+  strcat(expected, "2");
+  ok(_interps_to(kv, "deep", expected), "26c. deeply nested opens");
+
+  // a result much longer than any one value:
+  char big[1001];
+  memset(big, 'x', 1000);
+  big[1000] = 0;
+  _check_err(KeyVal_setValue(kv, "big", big), "KeyVal_setValue");
+  _check_err(KeyVal_setValue(kv, "big4", "${big}${big}-${big}${big}"), "KeyVal_setValue");
+  char *value;
+  _check_err(KeyVal_getValue(&value, kv, "big4", 1), "KeyVal_getValue");
+  ok(strlen(value) == 4001 && value[2000] == '-' && value[4000] == 'x', "26d. results can be longer than KEYVAL_MAX_STR_LEN");
+  free(value);
+
+  char many[1001] = "";
+  for (int i = 0; i < 150; ++i) strcat(many, "${k1},");
+  _check_err(KeyVal_setValue(kv, "many", many), "KeyVal_setValue");
+  _check_err(KeyVal_getValue(&value, kv, "many", 1), "KeyVal_getValue");
+  int all_there = strlen(value) == 300;
+  for (int i = 0; i < 150 && all_there; ++i) all_there = !strncmp(value + 2 * i, "2,", 2);
+  ok(all_there, "26e. lots of variables");
+  free(value);
+
+  _check_err(KeyVal_setValue(kv, "loop", "x${loop}"), "KeyVal_setValue");
+  ok(KeyVal_getValue(&value, kv, "loop", 1) == 2, "26f. recursion still detected");
+  free(value);
+
+  _check_err(KeyVal_delete(kv), "KeyVal_delete");
+}
+
+
+// 27: peekValue and copyValue have to agree with getValue, without copying.
+static void test27() {
+  struct KeyVal *kv;
+  _check_err(KeyVal_new(&kv), "KeyVal_new");
+  _check_err(KeyVal_setValue(kv, "k1", "2"), "KeyVal_setValue");
+  _check_err(KeyVal_setValue(kv, "k2", "a${k1}b"), "KeyVal_setValue");
+  _check_err(KeyVal_setValue(kv, "k3", "${k2}${k2}${k2}${k2}"), "KeyVal_setValue");
+  _check_err(KeyVal_setValue(kv, "loop", "${loop}"), "KeyVal_setValue");
+
+  const char *value;
+  unsigned long len;
+  _check_err(KeyVal_peekValue(&value, &len, kv, "k2", 0), "KeyVal_peekValue");
+  ok(value && !strcmp(value, "a${k1}b") && len == 7, "27a. peekValue without interpolation");
+  _check_err(KeyVal_peekValue(&value, &len, kv, "k2", 1), "KeyVal_peekValue");
+  ok(value && !strcmp(value, "a2b") && len == 3, "27b. peekValue with interpolation");
+  _check_err(KeyVal_peekValue(&value, &len, kv, "nope", 1), "KeyVal_peekValue");
+  ok(!value && !len, "27c. peekValue of a missing key");
+  ok(KeyVal_peekValue(&value, &len, kv, "loop", 1) == 2 && !value, "27d. peekValue of recursive variables");
+
+  _check_err(KeyVal_setInterpCache(kv, 1), "KeyVal_setInterpCache");
+  const char *value2;
+  _check_err(KeyVal_peekValue(&value, &len, kv, "k3", 1), "KeyVal_peekValue");
+  _check_err(KeyVal_peekValue(&value2, &len, kv, "k2", 1), "KeyVal_peekValue");
+  ok(!strcmp(value, "a2ba2ba2ba2b") && !strcmp(value2, "a2b") && len == 3,
+      "27e. peekValue out of the interpolation cache");
+  _check_err(KeyVal_peekValue(&value2, &len, kv, "k3", 1), "KeyVal_peekValue");
+  ok(value == value2, "27f. and it's the same string every time");
+
+  char buf[16];
+  unsigned long size;
+  ok(KeyVal_copyValue(&size, buf, sizeof(buf), kv, "k3", 1) == 0
+      && size == 13 && !strcmp(buf, "a2ba2ba2ba2b"), "27g. copyValue with interpolation");
+  ok(KeyVal_copyValue(&size, buf, sizeof(buf), kv, "k2", 0) == 0
+      && size == 8 && !strcmp(buf, "a${k1}b"), "27h. copyValue without interpolation");
+  ok(KeyVal_copyValue(&size, buf, 12, kv, "k3", 1) == 3 && size == 13, "27i. copyValue says how big the buffer has to be");
+  ok(KeyVal_copyValue(&size, 0, 0, kv, "k1", 1) == 3 && size == 2, "27j. even with no buffer");
+  ok(KeyVal_copyValue(&size, buf, sizeof(buf), kv, "nope", 1) == 0 && size == 0, "27k. copyValue of a missing key");
+
+  // without the cache, interpolation goes straight into the buffer:
+  _check_err(KeyVal_setInterpCache(kv, 0), "KeyVal_setInterpCache");
+  ok(KeyVal_copyValue(&size, buf, 13, kv, "k3", 1) == 0 && size == 13
+      && !strcmp(buf, "a2ba2ba2ba2b"), "27l. uncached copyValue that just fits");
+  ok(KeyVal_copyValue(&size, buf, 12, kv, "k3", 1) == 3 && size == 13, "27m. uncached copyValue that doesn't");
+  ok(KeyVal_copyValue(&size, buf, sizeof(buf), kv, "loop", 1) == 2, "27n. copyValue of recursive variables");
+
+  _check_err(KeyVal_delete(kv), "KeyVal_delete");
+}
+
+
+// 28: getValues has to answer exactly like getValue, key by key, whatever
+// order the keys come in.
+static void test28() {
+  struct KeyVal *kv;
+  _check_err(KeyVal_new(&kv), "KeyVal_new");
+  char key[64];
+  char val[64];
+  for (int i = 0; i < 500; ++i) {
+    sprintf(key, "svc::%d::host", i * 2);  // (only the even ones)
+    sprintf(val, "h%d.${domain}", i * 2);
+    _check_err(KeyVal_setValue(kv, key, val), "KeyVal_setValue");
+  }
+  _check_err(KeyVal_setValue(kv, "domain", "example.com"), "KeyVal_setValue");
+  _check_err(KeyVal_setValue(kv, "loop", "${loop}"), "KeyVal_setValue");
+
+  // a mix of present and missing keys, in random order, some twice:
+  enum { N = 300 };
+  char *keys[N];
+  unsigned long long seed = 28;
+  for (int i = 0; i < N; ++i) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    int which = (seed >> 33) % 1000;
+    if (i % 50 == 0) sprintf(key, "zzz::%d", which);  // off the end
+    else if (i % 50 == 1) sprintf(key, "aaa");  // before everything
+    else sprintf(key, "svc::%d::host", which);
+    keys[i] = strdup(key);
+  }
+  for (int pass = 0; pass < 2; ++pass) {
+    if (pass) _check_err(KeyVal_setHashIndex(kv, 1), "KeyVal_setHashIndex");
+    for (int interp = 0; interp < 2; ++interp) {
+      char *values[N];
+      _check_err(KeyVal_getValues(values, kv, (const char **)keys, N, interp), "KeyVal_getValues");
+      int same = 1;
+      for (int i = 0; i < N; ++i) {
+        char *expected;
+        _check_err(KeyVal_getValue(&expected, kv, keys[i], interp), "KeyVal_getValue");
+        if (expected ? !values[i] || strcmp(expected, values[i]) : values[i] != 0) same = 0;
+        free(expected);
+        free(values[i]);
+      }
+      char desc[80];
+      sprintf(desc, "28%c. getValues matches getValue (%s, %s)", 'a' + pass * 2 + interp,
+          pass ? "hash index" : "search", interp ? "interpolated" : "raw");
+      ok(same, desc);
+    }
+  }
+  for (int i = 0; i < N; ++i) free(keys[i]);
+
+  const char *some[] = {"domain", "loop", "svc::2::host"};
+  char *values[3];
+  ok(KeyVal_getValues(values, kv, some, 3, 1) == 2 && !values[0] && !values[1] && !values[2],
+      "28e. recursive variables throw everything out");
+  ok(KeyVal_getValues(values, kv, some, 0, 1) == 0, "28f. no keys at all");
+
+  _check_err(KeyVal_delete(kv), "KeyVal_delete");
+}
+
+
+// 29: setValues has to end up exactly where the same setValues one at a time
+// would.
+static void test29() {
+  struct KeyVal *kv1, *kv2;
+  _check_err(KeyVal_new(&kv1), "KeyVal_new");
+  _check_err(KeyVal_new(&kv2), "KeyVal_new");
+  _check_err(KeyVal_setTrieIndex(kv2, 1), "KeyVal_setTrieIndex");
+  _check_err(KeyVal_setHashIndex(kv2, 1), "KeyVal_setHashIndex");
+
+  // some keys already there, then a shuffled batch with repeats:
+  char key[64];
+  char val[64];
+  for (int i = 0; i < 100; ++i) {
+    sprintf(key, "a::%03d", i * 3);
+    sprintf(val, "old %d", i);
+    _check_err(KeyVal_setValue(kv1, key, val), "KeyVal_setValue");
+    _check_err(KeyVal_setValue(kv2, key, val), "KeyVal_setValue");
+  }
+  enum { N = 1000 };
+  char *keys[N], *vals[N];
+  unsigned long long seed = 29;
+  for (int i = 0; i < N; ++i) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    sprintf(key, "a::%03d", (int)((seed >> 33) % 400));
+    sprintf(val, "new %d", i);
+    keys[i] = strdup(key);
+    vals[i] = strdup(val);
+    _check_err(KeyVal_setValue(kv1, keys[i], vals[i]), "KeyVal_setValue");
+  }
+  _check_err(KeyVal_setValues(kv2, (const char **)keys, (const char **)vals, N), "KeyVal_setValues");
+  ok(_same_contents(kv1, kv2), "29a. setValues matches setValue one at a time");
+
+  // a small batch into a big KeyVal goes a different way:
+  for (int i = 0; i < 40; ++i) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    sprintf(key, "a::%03d", (int)((seed >> 33) % 450));
+    sprintf(val, "newer %d", i);
+    free(keys[i]);
+    free(vals[i]);
+    keys[i] = strdup(key);
+    vals[i] = strdup(val);
+    _check_err(KeyVal_setValue(kv1, keys[i], vals[i]), "KeyVal_setValue");
+  }
+  _check_err(KeyVal_setValues(kv2, (const char **)keys, (const char **)vals, 40), "KeyVal_setValues");
+  ok(_same_contents(kv1, kv2), "29b. small setValues matches setValue one at a time");
+  unsigned long num_children = 0;
+  char **children;
+  _check_err(KeyVal_getKeys(&children, kv2, "a"), "KeyVal_getKeys");
+  while (children[num_children]) free(children[num_children++]);
+  free(children);
+  unsigned long size;
+  _check_err(KeyVal_size(&size, kv2), "KeyVal_size");
+  ok(num_children == size, "29c. the trie has every new key");
+  for (int i = 0; i < N; ++i) {
+    free(keys[i]);
+    free(vals[i]);
+  }
+
+  // bad arguments set nothing:
+  const char *some_keys[] = {"b::1", "b::2"};
+  const char *some_vals[] = {"1", 0};
+  ok(KeyVal_setValues(kv2, some_keys, some_vals, 2) == 1, "29d. setValues refuses a null value");
+  unsigned char has;
+  _check_err(KeyVal_hasValue(&has, kv2, "b::1"), "KeyVal_hasValue");
+  ok(!has, "29e. and sets nothing");
+
+  // cached interpolations that used any of them go away:
+  _check_err(KeyVal_setInterpCache(kv2, 1), "KeyVal_setInterpCache");
+  _check_err(KeyVal_setValue(kv2, "c", "${b::1}${b::2}"), "KeyVal_setValue");
+  ok(_interps_to(kv2, "c", "${b::1}${b::2}"), "29f. interpolated before");
+  some_vals[1] = "2";
+  _check_err(KeyVal_setValues(kv2, some_keys, some_vals, 2), "KeyVal_setValues");
+  ok(_interps_to(kv2, "c", "12"), "29g. and after");
+
+  ok(KeyVal_freeze(kv2) == 0 && KeyVal_setValues(kv2, some_keys, some_vals, 2) == 1,
+      "29h. frozen KeyVal refuses setValues");
+
+  // something already waiting on the unsorted tail is older than the batch:
+  _check_err(KeyVal_setValue(kv1, "z", "1"), "KeyVal_setValue");
+  _check_err(KeyVal_setValue(kv1, "y", "1"), "KeyVal_setValue");
+  some_keys[0] = "y";
+  _check_err(KeyVal_setValues(kv1, some_keys, some_vals, 1), "KeyVal_setValues");
+  char *value;
+  _check_err(KeyVal_getValue(&value, kv1, "y", 0), "KeyVal_getValue");
+  ok(value && !strcmp(value, "1"), "29i. setValues wins over earlier setValue");
+  free(value);
+
+  _check_err(KeyVal_delete(kv1), "KeyVal_delete");
+  _check_err(KeyVal_delete(kv2), "KeyVal_delete");
+}
+
+
+// Walks a cursor to the end, writing the keys into 'buf' separated by
+// spaces.
+static void
+_walk(char *buf, struct KeyValCursor *cur) {
+  buf[0] = 0;
+  const char *key;
+  while (!KeyVal_cursorKey(&key, cur) && key) {
+    if (buf[0]) strcat(buf, " ");
+    strcat(buf, key);
+    _check_err(KeyVal_cursorNext(cur), "KeyVal_cursorNext");
+  }
+}
+
+// 30: cursors have to walk exactly the right keys.
+static void test30() {
+  struct KeyVal *kv;
+  _check_err(KeyVal_new(&kv), "KeyVal_new");
+  const char *keys[] = {"b", "a::c", "ab", "a", "a::", "a::b::c", "a::b", "c::d"};
+  for (int i = 0; i < 8; ++i) {
+    _check_err(KeyVal_setValue(kv, keys[i], keys[i]), "KeyVal_setValue");
+  }
+  _check_err(KeyVal_setValue(kv, "c::d", "${a::b}!"), "KeyVal_setValue");
+
+  struct KeyValCursor cur;
+  char buf[256];
+  _check_err(KeyVal_cursorSubtree(&cur, kv, "a"), "KeyVal_cursorSubtree");
+  _walk(buf, &cur);
+  ok(!strcmp(buf, "a::b a::b::c a::c"), "30a. cursorSubtree walks just the subtree");
+  _check_err(KeyVal_cursorSubtree(&cur, kv, ""), "KeyVal_cursorSubtree");
+  _walk(buf, &cur);
+  ok(!strcmp(buf, "a a:: a::b a::b::c a::c ab b c::d"), "30b. cursorSubtree of \"\" walks everything");
+  _check_err(KeyVal_cursorSubtree(&cur, kv, "b"), "KeyVal_cursorSubtree");
+  _walk(buf, &cur);
+  ok(!buf[0], "30c. cursorSubtree of a key with no subkeys walks nothing");
+  _check_err(KeyVal_cursorSeek(&cur, kv, "a::b"), "KeyVal_cursorSeek");
+  _walk(buf, &cur);
+  ok(!strcmp(buf, "a::b a::b::c a::c ab b c::d"), "30d. cursorSeek starts at the key");
+  _check_err(KeyVal_cursorSeekAfter(&cur, kv, "a::b"), "KeyVal_cursorSeekAfter");
+  _walk(buf, &cur);
+  ok(!strcmp(buf, "a::b::c a::c ab b c::d"), "30e. cursorSeekAfter starts after it");
+  _check_err(KeyVal_cursorSeekAfter(&cur, kv, "a::bb"), "KeyVal_cursorSeekAfter");
+  _walk(buf, &cur);
+  ok(!strcmp(buf, "a::c ab b c::d"), "30f. and doesn't need it to exist");
+  _check_err(KeyVal_cursorSeek(&cur, kv, "zzz"), "KeyVal_cursorSeek");
+  _walk(buf, &cur);
+  ok(!buf[0], "30g. cursorSeek past the end walks nothing");
+
+  const char *value;
+  unsigned long len;
+  _check_err(KeyVal_cursorSubtree(&cur, kv, "c"), "KeyVal_cursorSubtree");
+  _check_err(KeyVal_cursorValue(&value, &len, &cur, 1), "KeyVal_cursorValue");
+  ok(value && !strcmp(value, "a::b!") && len == 5, "30h. cursorValue interpolates");
+  _check_err(KeyVal_cursorValue(&value, &len, &cur, 0), "KeyVal_cursorValue");
+  ok(value && !strcmp(value, "${a::b}!"), "30i. or not");
+  _check_err(KeyVal_cursorNext(&cur), "KeyVal_cursorNext");
+  _check_err(KeyVal_cursorNext(&cur), "KeyVal_cursorNext");
+  _check_err(KeyVal_cursorValue(&value, &len, &cur, 1), "KeyVal_cursorValue");
+  ok(!value && !len, "30j. no value at the end");
+  _check_err(KeyVal_delete(kv), "KeyVal_delete");
+
+  // lots of random subtrees, against counting by hand:
+  _check_err(KeyVal_new(&kv), "KeyVal_new");
+  unsigned long long seed = 30;
+  char key[64];
+  for (int i = 0; i < 2000; ++i) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    sprintf(key, "%d::%d::%d", (int)(seed >> 33) % 10, (int)(seed >> 40) % 10, (int)(seed >> 50) % 30);
+    _check_err(KeyVal_setValue(kv, key, "x"), "KeyVal_setValue");
+  }
+  char **all_keys;
+  _check_err(KeyVal_getAllKeys(&all_keys, kv), "KeyVal_getAllKeys");
+  int all_right = 1;
+  for (int i = 0; i < 110 && all_right; ++i) {
+    char path[16];
+    if (i < 10) sprintf(path, "%d", i);
+    else sprintf(path, "%d::%d", (i - 10) / 10, i % 10);
+    char prefix[20];
+    sprintf(prefix, "%s::", path);
+    unsigned long expected = 0;
+    for (char **k = all_keys; *k; ++k) expected += !strncmp(*k, prefix, strlen(prefix));
+    unsigned long walked = 0;
+    const char *k;
+    _check_err(KeyVal_cursorSubtree(&cur, kv, path), "KeyVal_cursorSubtree");
+    while (!KeyVal_cursorKey(&k, &cur) && k) {
+      if (strncmp(k, prefix, strlen(prefix))) all_right = 0;
+      ++walked;
+      _check_err(KeyVal_cursorNext(&cur), "KeyVal_cursorNext");
+    }
+    if (walked != expected) all_right = 0;
+  }
+  ok(all_right, "30k. cursorSubtree matches counting by hand");
+  for (char **k = all_keys; *k; ++k) free(*k);
+  free(all_keys);
+  _check_err(KeyVal_delete(kv), "KeyVal_delete");
+}
+
+
+// Counts the leftover temporary files from saving OUT.
+static int
+_num_temp_files() {
+  DIR *dir = opendir("/tmp");
+  if (!dir) return -1;
+  int res = 0;
+  struct dirent *ent;
+  while ((ent = readdir(dir))) {
+    res += !strncmp(ent->d_name, "keyval.test.out", 15) && strstr(ent->d_name, ".tmp.");
+  }
+  closedir(dir);
+  return res;
+}
+
+// 31: saving goes through a big buffer and a temporary file, and has to come
+// back in exactly as it went out.
+static void test31() {
+  struct KeyVal *kv1, *kv2;
+  _check_err(KeyVal_new(&kv1), "KeyVal_new");
+  _check_err(KeyVal_new(&kv2), "KeyVal_new");
+
+  // enough to fill the buffer several times, with escapes everywhere
+  // (including right at the ends of values):
+  char key[64];
+  // (values are 900 characters, so they stay under the limit escaped)
+  char val[901];
+  for (int i = 0; i < 3000; ++i) {
+    sprintf(key, "k::%d::`quoted\\`", i);
+    for (int j = 0; j < 900; ++j) {
+      val[j] = ((i + j) % 37 == 0) ? '`' : ((i + j) % 41 == 0) ? '\\' : 'a' + (i + j) % 26;
+    }
+    val[(i % 3) ? 900 : 899] = 0;
+    if (i % 3 == 1) val[899] = '\\';
+    _check_err(KeyVal_setValue(kv1, key, val), "KeyVal_setValue");
+  }
+  _check_err(KeyVal_save(kv1, OUT, 0, 1), "KeyVal_save");
+  _check_err(KeyVal_load(kv2, OUT), "KeyVal_load");
+  ok(_same_contents(kv1, kv2), "31a. saved and loaded back the same");
+  ok(_num_temp_files() == 0, "31b. no temporary files left behind");
+
+  // interpolated values can be longer than any one value:
+  _check_err(KeyVal_setValue(kv1, "big", "${k::1::`quoted\\`}${k::2::`quoted\\`}"), "KeyVal_setValue");
+  _check_err(KeyVal_save(kv1, OUT, 1, 0), "KeyVal_save");
+  struct stat st;
+  ok(stat(OUT, &st) == 0 && st.st_size > 3000 * 900, "31c. saved interpolated values");
+
+  // a failed save leaves nothing behind, and the old file alone:
+  char dir_path[64];
+  sprintf(dir_path, "%s.dir", OUT);
+  mkdir(dir_path, 0777);
+  char bad_path[80];
+  sprintf(bad_path, "%s/nope/x.kv", dir_path);
+  ok(KeyVal_save(kv1, bad_path, 0, 0) == 2, "31d. saving somewhere impossible fails");
+  ok(KeyVal_save(kv1, dir_path, 0, 0) == 2, "31e. saving over a directory fails");
+  rmdir(dir_path);
+  _check_err(KeyVal_setValue(kv1, "loop", "${loop}"), "KeyVal_setValue");
+  ok(KeyVal_save(kv1, OUT, 1, 0) == 1 && stat(OUT, &st) == 0 && st.st_size > 3000 * 900,
+      "31f. a save that fails partway leaves the old file");
+  ok(_num_temp_files() == 0, "31g. no temporary files left behind");
+
+  // the file being replaced keeps its permissions, and symlinks stay links:
+  _check_err(KeyVal_remove(kv1, "loop"), "KeyVal_remove");
+  chmod(OUT, 0600);
+  _check_err(KeyVal_save(kv1, OUT, 0, 0), "KeyVal_save");
+  ok(stat(OUT, &st) == 0 && (st.st_mode & 07777) == 0600, "31h. saving keeps the permissions");
+  char link_path[64];
+  sprintf(link_path, "%s.link", OUT);
+  unlink(link_path);
+  ok(symlink(OUT, link_path) == 0, "31i. made a symlink");
+  _check_err(KeyVal_setValue(kv1, "linked", "yes"), "KeyVal_setValue");
+  _check_err(KeyVal_save(kv1, link_path, 0, 0), "KeyVal_save");
+  ok(lstat(link_path, &st) == 0 && S_ISLNK(st.st_mode), "31j. saving through a symlink keeps the link");
+  _check_err(KeyVal_delete(kv2), "KeyVal_delete");
+  _check_err(KeyVal_new(&kv2), "KeyVal_new");
+  _check_err(KeyVal_load(kv2, OUT), "KeyVal_load");
+  ok(_same_contents(kv1, kv2), "31k. saving through a symlink replaces what it points to");
+  ok(stat(OUT, &st) == 0 && (st.st_mode & 07777) == 0600, "31l. ...and keeps its permissions");
+  ok(_num_temp_files() == 0, "31m. no temporary files left behind");
+  unlink(link_path);
+
+  _check_err(KeyVal_delete(kv1), "KeyVal_delete");
+  _check_err(KeyVal_delete(kv2), "KeyVal_delete");
+}
+
+
+// Reads a whole file into a new buffer (or returns 0), for comparing files.
+static char *
+_slurp(const char *path, long *len) {
+  FILE *fh = fopen(path, "r");
+  if (!fh) return 0;
+  fseek(fh, 0, SEEK_END);
+  *len = ftell(fh);
+  rewind(fh);
+  char *buf = malloc(*len + 1);
+  if (buf && fread(buf, 1, *len, fh) != (size_t)*len) {
+    free(buf);
+    buf = 0;
+  }
+  fclose(fh);
+  return buf;
+}
+
+// 32: saving on several threads.
+static void test32() {
+  // enough keys for several rounds of ranges, with escapes, long keys, and
+  // variables all over:
+  struct KeyVal *kv;
+  _check_err(KeyVal_new(&kv), "KeyVal_new");
+  char key[128];
+  char val[128];
+  unsigned long long seed = 32;
+  for (int i = 0; i < 100000; ++i) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    int len = (seed >> 33) % 40;
+    sprintf(key, "k::%d::`%.*s`", i, len, "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx");
+    if (i % 7 == 3) {
+      sprintf(val, "see ${k::%d::``} and \\`%d`", i % 5 == 0 ? 10 : 0, i);
+    } else {
+      sprintf(val, "value %d `with` quotes\\", i);
+    }
+    _check_err(KeyVal_setValue(kv, key, val), "KeyVal_setValue");
+  }
+  _check_err(KeyVal_setValue(kv, "k::0::``", "zero"), "KeyVal_setValue");
+  _check_err(KeyVal_setValue(kv, "k::10::``", "ten"), "KeyVal_setValue");
+
+  const char *par_out = "/tmp/keyval.test.out2";
+  int same = 1;
+  for (int interp = 0; interp < 2; ++interp) {
+    for (int align = 0; align < 2; ++align) {
+      long len1 = -1, len2 = -2;
+      _check_err(KeyVal_save(kv, OUT, interp, align), "KeyVal_save");
+      char *serial = _slurp(OUT, &len1);
+      for (unsigned int threads = 0; threads <= 8; threads = threads ? threads * 2 : 1) {
+        _check_err(KeyVal_saveParallel(kv, par_out, interp, align, threads), "KeyVal_saveParallel");
+        char *parallel = _slurp(par_out, &len2);
+        if (!serial || !parallel || len1 != len2 || memcmp(serial, parallel, len1)) same = 0;
+        free(parallel);
+      }
+      free(serial);
+    }
+  }
+  ok(same, "32a. saveParallel writes exactly what save does");
+  ok(_num_temp_files() == 0, "32b. no temporary files left behind");
+
+  // problems partway through, in any range, leave the old file alone:
+  struct stat st1, st2;
+  stat(par_out, &st1);
+  _check_err(KeyVal_setValue(kv, "k::99999::``", "${loop}"), "KeyVal_setValue");
+  _check_err(KeyVal_setValue(kv, "loop", "${loop}"), "KeyVal_setValue");
+  ok(KeyVal_saveParallel(kv, par_out, 1, 0, 4) == 1, "32c. interpolation problems are reported");
+  ok(stat(par_out, &st2) == 0 && st1.st_size == st2.st_size, "32d. and leave the old file");
+  ok(KeyVal_saveParallel(kv, "/tmp/keyval.test.nonexistent/x.kv", 0, 0, 4) == 2,
+      "32e. write problems are reported");
+  ok(_num_temp_files() == 0, "32f. no temporary files left behind");
+  ok(KeyVal_saveParallel(0, par_out, 0, 0, 4) == 1, "32g. null kv is rejected");
+  ok(KeyVal_saveParallel(kv, 0, 0, 0, 4) == 1, "32h. null filepath is rejected");
+  unlink(par_out);
+
+  _check_err(KeyVal_delete(kv), "KeyVal_delete");
+}
+
+
+// 33: journaling.
+static void test33() {
+  const char *other_out = "/tmp/keyval.test.out2";
+  struct KeyVal *kv, *kv2;
+  struct stat st1, st2;
+  long len1, len2;
+  _check_err(KeyVal_new(&kv), "KeyVal_new");
+  char key[64];
+  for (int i = 0; i < 1000; ++i) {
+    sprintf(key, "k::%d", i);
+    _check_err(KeyVal_setValue(kv, key, "some `value`"), "KeyVal_setValue");
+  }
+
+  // turning it on writes everything out, and changes go on the end:
+  ok(KeyVal_setJournal(kv, OUT, 0) == 0, "33a. journaling turns on");
+  _check_err(KeyVal_new(&kv2), "KeyVal_new");
+  _check_err(KeyVal_load(kv2, OUT), "KeyVal_load");
+  ok(_same_contents(kv, kv2), "33b. the journal starts out with everything");
+  _check_err(KeyVal_delete(kv2), "KeyVal_delete");
+  stat(OUT, &st1);
+  _check_err(KeyVal_setValue(kv, "k::5", "new `value`\\"), "KeyVal_setValue");
+  _check_err(KeyVal_setValue(kv, "zzz", "${k::5}"), "KeyVal_setValue");
+  _check_err(KeyVal_remove(kv, "k::7"), "KeyVal_remove");
+  _check_err(KeyVal_remove(kv, "not there"), "KeyVal_remove");
+  const char *keys[] = {"k::8", "aaa", "k::8"};
+  const char *vals[] = {"first", "second", "third"};
+  _check_err(KeyVal_setValues(kv, keys, vals, 3), "KeyVal_setValues");
+  stat(OUT, &st2);
+  ok(st2.st_size - st1.st_size < 200, "33c. changes only append a little");
+  _check_err(KeyVal_new(&kv2), "KeyVal_new");
+  _check_err(KeyVal_load(kv2, OUT), "KeyVal_load");
+  ok(_same_contents(kv, kv2), "33d. and load back the same");
+  _check_err(KeyVal_delete(kv2), "KeyVal_delete");
+
+  // compacting rewrites it exactly as save would:
+  ok(KeyVal_compact(kv) == 0, "33e. compacting works");
+  _check_err(KeyVal_save(kv, other_out, 0, 0), "KeyVal_save");
+  char *journal = _slurp(OUT, &len1);
+  char *saved = _slurp(other_out, &len2);
+  ok(journal && saved && len1 == len2 && !memcmp(journal, saved, len1),
+      "33f. compacting writes what save does");
+  free(journal);
+  free(saved);
+  _check_err(KeyVal_setValue(kv, "after", "compacting"), "KeyVal_setValue");
+  _check_err(KeyVal_new(&kv2), "KeyVal_new");
+  _check_err(KeyVal_load(kv2, OUT), "KeyVal_load");
+  ok(_same_contents(kv, kv2), "33g. and appending goes on afterwards");
+  _check_err(KeyVal_delete(kv2), "KeyVal_delete");
+
+  // automatic compaction:
+  _check_err(KeyVal_setJournal(kv, OUT, 10), "KeyVal_setJournal");
+  for (int i = 0; i < 10; ++i) {
+    sprintf(key, "k::%d", i * 3);
+    _check_err(KeyVal_setValue(kv, key, "changed"), "KeyVal_setValue");
+  }
+  _check_err(KeyVal_save(kv, other_out, 0, 0), "KeyVal_save");
+  journal = _slurp(OUT, &len1);
+  saved = _slurp(other_out, &len2);
+  ok(journal && saved && len1 == len2 && !memcmp(journal, saved, len1),
+      "33h. the tenth change compacts");
+  free(journal);
+  free(saved);
+  ok(_num_temp_files() == 0, "33i. no temporary files left behind");
+  ok(fstat(kv->journal->fd, &st1) == 0 && stat(OUT, &st2) == 0 && st1.st_ino == st2.st_ino
+      && (fcntl(kv->journal->fd, F_GETFL) & O_APPEND),
+      "33s. and appends go to the compacted file itself");
+
+  // a failed automatic compaction doesn't fail the change that set it off
+  // (here, because the journal's directory disappears out from under it):
+  char dir_path[64];
+  sprintf(dir_path, "%s.dir", OUT);
+  char dir_journal[80];
+  sprintf(dir_journal, "%s/journal.kv", dir_path);
+  mkdir(dir_path, 0777);
+  _check_err(KeyVal_setJournal(kv, dir_journal, 3), "KeyVal_setJournal");
+  unlink(dir_journal);
+  rmdir(dir_path);
+  int all_ok = 1;
+  for (int i = 0; i < 5; ++i) {
+    sprintf(key, "lost::%d", i);
+    if (KeyVal_setValue(kv, key, "x")) all_ok = 0;
+  }
+  ok(all_ok, "33p. changes succeed even when compacting fails");
+  mkdir(dir_path, 0777);
+  _check_err(KeyVal_setValue(kv, "found", "x"), "KeyVal_setValue");
+  ok(access(dir_journal, F_OK) == 0, "33q. compaction is tried again later");
+  _check_err(KeyVal_new(&kv2), "KeyVal_new");
+  _check_err(KeyVal_load(kv2, dir_journal), "KeyVal_load");
+  ok(_same_contents(kv, kv2), "33r. and then has everything");
+  _check_err(KeyVal_delete(kv2), "KeyVal_delete");
+  _check_err(KeyVal_setJournal(kv, OUT, 0), "KeyVal_setJournal");
+  unlink(dir_journal);
+  rmdir(dir_path);
+
+  // turning it off:
+  _check_err(KeyVal_setJournal(kv, 0, 0), "KeyVal_setJournal");
+  stat(OUT, &st1);
+  _check_err(KeyVal_setValue(kv, "not", "journaled"), "KeyVal_setValue");
+  stat(OUT, &st2);
+  ok(st1.st_size == st2.st_size, "33j. changes stop going to the file");
+
+  // error conditions:
+  ok(KeyVal_compact(kv) == 1, "33k. compacting needs journaling");
+  ok(KeyVal_setJournal(kv, "/tmp/keyval.test.nonexistent/x.kv", 0) == 2,
+      "33l. unwritable journals are reported");
+  ok(KeyVal_compact(kv) == 1, "33m. and leave journaling off");
+  ok(KeyVal_setJournal(0, OUT, 0) == 1, "33n. null kv is rejected");
+  _check_err(KeyVal_freeze(kv), "KeyVal_freeze");
+  ok(KeyVal_setJournal(kv, OUT, 0) == 1, "33o. frozen KeyVals can't journal");
+  _check_err(KeyVal_thaw(kv), "KeyVal_thaw");
+  unlink(other_out);
+
+  _check_err(KeyVal_delete(kv), "KeyVal_delete");
+}
+
+
+// Writes 'contents' to 'path' the way a config deployment would: to a new
+// file, renamed over the old one.
+static void
+_replace_file(const char *path, const char *contents) {
+  char tmp_path[128];
+  sprintf(tmp_path, "%s.new", path);
+  FILE *fh = fopen(tmp_path, "w");
+  fprintf(fh, "%s", contents);
+  fclose(fh);
+  rename(tmp_path, path);
+}
+
+// 34: layered files, and refreshing them.
+static void test34() {
+  const char *base = "/tmp/keyval.test.layer1";
+  const char *site = "/tmp/keyval.test.layer2";
+  const char *paths[] = {base, site};
+  _replace_file(base,
+      "`a` = `base a`\n"
+      "`b` = `base b`\n"
+      "`c` = `base c`\n"
+      "`d` = `base d`\n"
+      "`e` = `${a} and ${d}`\n");
+  _replace_file(site,
+      "`b` = `site b`\n"
+      "`c` remove\n"
+      "`f` = `site f`\n"
+      "`f` = `site f, again`\n");
+
+  struct KeyVal *kv, *expected;
+  _check_err(KeyVal_new(&kv), "KeyVal_new");
+  _check_err(KeyVal_setInterpCache(kv, 1), "KeyVal_setInterpCache");
+  ok(KeyVal_loadLayer(kv, base) == 0 && KeyVal_loadLayer(kv, site) == 0,
+      "34a. layers load");
+  _check_err(KeyVal_new(&expected), "KeyVal_new");
+  _check_err(KeyVal_loadMany(expected, paths, 2, 1), "KeyVal_loadMany");
+  ok(_same_contents(kv, expected), "34b. just like loading them in order");
+  _check_err(KeyVal_delete(expected), "KeyVal_delete");
+  ok(_interps_to(kv, "e", "base a and base d"), "34c. (and interpolates)");
+
+  // nothing changed, nothing reloaded:
+  unsigned long num_reloaded = 99;
+  ok(KeyVal_refresh(&num_reloaded, kv) == 0 && num_reloaded == 0, "34d. unchanged files aren't reloaded");
+
+  // change the bottom layer: overridden keys stay overridden, and dependent
+  // values are recomputed:
+  _replace_file(base,
+      "`a` = `new base a`\n"
+      "`b` = `new base b`\n"
+      "`c` = `base c`\n"
+      "`e` = `${a} and ${d}`\n"
+      "`g` = `base g`\n");
+  ok(KeyVal_refresh(&num_reloaded, kv) == 0 && num_reloaded == 1, "34e. one changed file is reloaded");
+  _check_err(KeyVal_new(&expected), "KeyVal_new");
+  _check_err(KeyVal_loadMany(expected, paths, 2, 1), "KeyVal_loadMany");
+  ok(_same_contents(kv, expected), "34f. with the same result as loading everything again");
+  _check_err(KeyVal_delete(expected), "KeyVal_delete");
+  ok(_interps_to(kv, "e", "new base a and ${d}"), "34g. and the interpolation cache knows");
+
+  // change the top layer, so that it stops overriding things:
+  _replace_file(site,
+      "`c` = `site c`\n"
+      "`a` remove\n");
+  ok(KeyVal_refresh(&num_reloaded, kv) == 0 && num_reloaded == 1, "34h. the other one is reloaded");
+  _check_err(KeyVal_new(&expected), "KeyVal_new");
+  _check_err(KeyVal_loadMany(expected, paths, 2, 1), "KeyVal_loadMany");
+  ok(_same_contents(kv, expected), "34i. with the same result as loading everything again");
+  _check_err(KeyVal_delete(expected), "KeyVal_delete");
+
+  // broken or missing files leave things as they were:
+  _replace_file(site, "`c` = oops\n");
+  ok(KeyVal_refresh(&num_reloaded, kv) == 1 && num_reloaded == 0, "34j. parsing problems are reported");
+  ok(_interps_to(kv, "c", "site c"), "34k. and the old contents stay");
+  unlink(site);
+  ok(KeyVal_refresh(&num_reloaded, kv) == 2, "34l. missing files are reported");
+  _replace_file(site, "`c` = `fixed`\n");
+  ok(KeyVal_refresh(&num_reloaded, kv) == 0 && num_reloaded == 1 && _interps_to(kv, "c", "fixed"),
+      "34m. and picked up again once they're back");
+
+  // rewriting in place, at the same size, right away (within the same
+  // second), and even putting the modification time back, is still noticed:
+  struct stat st;
+  FILE *fh = fopen(site, "r+");
+  fprintf(fh, "`c` = `fixit`\n");
+  fclose(fh);
+  ok(KeyVal_refresh(&num_reloaded, kv) == 0 && num_reloaded == 1 && _interps_to(kv, "c", "fixit"),
+      "34r. same-size rewrites in place are noticed");
+  stat(site, &st);
+  fh = fopen(site, "r+");
+  fprintf(fh, "`c` = `fixup`\n");
+  fclose(fh);
+  struct timespec times[2] = {st.st_atim, st.st_mtim};
+  utimensat(AT_FDCWD, site, times, 0);
+  ok(KeyVal_refresh(&num_reloaded, kv) == 0 && num_reloaded == 1 && _interps_to(kv, "c", "fixup"),
+      "34s. even with the modification time put back");
+
+  // error conditions:
+  ok(KeyVal_loadLayer(kv, "/tmp/keyval.test.nonexistent") == 2, "34n. missing layers are reported");
+  ok(KeyVal_refresh(0, kv) == 1, "34o. null res is rejected");
+  ok(KeyVal_refresh(&num_reloaded, 0) == 1, "34p. null kv is rejected");
+  _check_err(KeyVal_freeze(kv), "KeyVal_freeze");
+  ok(KeyVal_refresh(&num_reloaded, kv) == 1, "34q. frozen KeyVals can't refresh");
+  _check_err(KeyVal_thaw(kv), "KeyVal_thaw");
+
+  unlink(base);
+  unlink(site);
+  _check_err(KeyVal_delete(kv), "KeyVal_delete");
+}
+
+
+// 35: statistics.
+static void test35() {
+  struct KeyVal *kv;
+  struct KeyValStats stats;
+  _check_err(KeyVal_new(&kv), "KeyVal_new");
+  ok(KeyVal_stats(&stats, kv) == 0 && stats.num_keys == 0 && stats.used_size == 0
+      && stats.key_bytes == 0 && stats.max_depth == 0 && stats.max_fanout == 0,
+      "35a. an empty KeyVal has nothing in it");
+
+  // (out of order, with a repeat, so that some of it is on the tail)
+  const char *keys[] = {"m", "a::c::d", "a", "x::y::z::w", "a::b", "a::c", "b", "a::b", "a:::q"};
+  unsigned long key_bytes = 0;
+  for (int i = 0; i < 9; ++i) {
+    _check_err(KeyVal_setValue(kv, keys[i], "1234"), "KeyVal_setValue");
+    if (i != 7) key_bytes += strlen(keys[i]) + 1;
+  }
+  _check_err(KeyVal_stats(&stats, kv), "KeyVal_stats");
+  ok(stats.unsorted > 0 && stats.used_size == 9, "35b. the unsorted tail is counted");
+  ok(stats.num_keys == 8, "35c. repeats aren't keys");
+  ok(stats.key_bytes == key_bytes && stats.val_bytes == 8 * 5, "35d. string bytes");
+  ok(stats.array_bytes >= stats.max_size * sizeof(struct KeyValElement)
+      && stats.overhead_bytes >= 16 * 8, "35e. array and overhead bytes");
+  // ("a:::q" is "a" then ":q", so "a" has "b", "c", and ":q" under it, and
+  // the root has "a", "b", "m", and "x")
+  ok(stats.max_depth == 4 && stats.max_fanout == 4, "35f. depth and fan-out");
+  _check_err(KeyVal_stats(&stats, kv), "KeyVal_stats");
+  ok(stats.unsorted == 0 && stats.used_size == 8, "35g. and it's sorted afterwards");
+
+  // fan-out deeper down:
+  char key[32];
+  for (int i = 0; i < 10; ++i) {
+    sprintf(key, "x::y::%d", i);
+    _check_err(KeyVal_setValue(kv, key, ""), "KeyVal_setValue");
+  }
+  _check_err(KeyVal_stats(&stats, kv), "KeyVal_stats");
+  ok(stats.max_fanout == 11, "35h. fan-out below the root");
+
+  // indexes count, as extras:
+  unsigned long extra_bytes = stats.extra_bytes;
+  _check_err(KeyVal_setHashIndex(kv, 1), "KeyVal_setHashIndex");
+  _check_err(KeyVal_setTrieIndex(kv, 1), "KeyVal_setTrieIndex");
+  _check_err(KeyVal_stats(&stats, kv), "KeyVal_stats");
+  ok(stats.extra_bytes > extra_bytes, "35i. indexes are counted");
+  _check_err(KeyVal_delete(kv), "KeyVal_delete");
+
+  // arenas have their own overhead:
+  _check_err(KeyVal_newWithArena(&kv), "KeyVal_newWithArena");
+  _check_err(KeyVal_setValue(kv, "k", "v"), "KeyVal_setValue");
+  _check_err(KeyVal_stats(&stats, kv), "KeyVal_stats");
+  ok(stats.num_keys == 1 && stats.overhead_bytes >= 4096 - 4, "35j. arena overhead");
+
+  ok(KeyVal_stats(0, kv) == 1, "35k. null res is rejected");
+  ok(KeyVal_stats(&stats, 0) == 1, "35l. null kv is rejected");
+  _check_err(KeyVal_delete(kv), "KeyVal_delete");
+}
+
+
+// Failing allocations on purpose: the countdown hits zero on the allocation
+// that fails, and goes back to -1 (never fail) after that.  (Only where
+// malloc can be swapped out underneath the library.)
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__)
+#define TEST_OOM 1
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t num, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+static long _allocs_until_failure = -1;
+
+static int
+_alloc_fails() {
+  if (_allocs_until_failure < 0 || _allocs_until_failure-- > 0) return 0;
+  errno = ENOMEM;
+  return 1;
+}
+
+void *malloc(size_t size) {
+  return _alloc_fails() ? 0 : __libc_malloc(size);
+}
+
+void *calloc(size_t num, size_t size) {
+  return _alloc_fails() ? 0 : __libc_calloc(num, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  return _alloc_fails() ? 0 : __libc_realloc(ptr, size);
+}
+#endif
+
+// 36: running out of memory while keeping the optional indexes up to date
+// costs the indexes, but never the change itself.
+static void test36() {
+#ifdef TEST_OOM
+  // setting a key on the end of the sorted part, failing each allocation in
+  // turn:
+  int all_right = 1;
+  int trie_dropped = 0;
+  for (long n = 0; n < 20; ++n) {
+    struct KeyVal *kv;
+    _check_err(KeyVal_new(&kv), "KeyVal_new");
+    _check_err(KeyVal_setHashIndex(kv, 1), "KeyVal_setHashIndex");
+    _check_err(KeyVal_setTrieIndex(kv, 1), "KeyVal_setTrieIndex");
+    _check_err(KeyVal_setValue(kv, "a::b", "1"), "KeyVal_setValue");
+    _allocs_until_failure = n;
+    unsigned char res = KeyVal_setValue(kv, "b::c::d", "2");
+    _allocs_until_failure = -1;
+    unsigned char has;
+    _check_err(KeyVal_hasValue(&has, kv, "b::c::d"), "KeyVal_hasValue");
+    if (res != !has) all_right = 0;
+    if (!res && !kv->trie) trie_dropped = 1;
+    _check_err(KeyVal_delete(kv), "KeyVal_delete");
+  }
+  ok(all_right, "36a. setValue fails exactly when the value isn't set");
+  ok(trie_dropped, "36b. (including when the trie had to be dropped)");
+
+  // sorting the unsorted tail into the sorted part, the same way:
+  struct KeyVal *expected;
+  _check_err(KeyVal_new(&expected), "KeyVal_new");
+  const char *keys[] = {"k::0", "k::1", "k::2", "k::3", "k::4",
+      "m::x::y", "j::5", "k::3", "a", "k::1::z", 0};  // (k::3 collides in the merge)
+  all_right = 1;
+  trie_dropped = 0;
+  int hash_dropped = 0;
+  for (long n = 0; n < 40; ++n) {
+    struct KeyVal *kv;
+    _check_err(KeyVal_new(&kv), "KeyVal_new");
+    _check_err(KeyVal_setHashIndex(kv, 1), "KeyVal_setHashIndex");
+    _check_err(KeyVal_setTrieIndex(kv, 1), "KeyVal_setTrieIndex");
+    for (int k = 0; keys[k]; ++k) {
+      char val[16];
+      sprintf(val, "%d", k);
+      _check_err(KeyVal_setValue(kv, keys[k], val), "KeyVal_setValue");
+      if (n == 0) _check_err(KeyVal_setValue(expected, keys[k], val), "KeyVal_setValue");
+    }
+    unsigned long size;
+    _allocs_until_failure = n;
+    unsigned char res = KeyVal_size(&size, kv);
+    _allocs_until_failure = -1;
+    if (!res && !kv->trie) trie_dropped = 1;
+    if (!res && !kv->hash_index) hash_dropped = 1;
+    // (whether or not it worked, the array has to be in a sane state, before
+    // anything sorts it again: no empty slots, and no key in two of them)
+    for (unsigned long i = 0; i < kv->used_size; ++i) {
+      if (!kv->data[i].key) all_right = 0;
+      for (unsigned long j = 0; j < i; ++j) {
+        if (kv->data[i].key == kv->data[j].key) all_right = 0;
+      }
+    }
+    for (unsigned long i = 1; all_right && i < kv->last_sorted; ++i) {
+      if (KeyVal_strcmp(kv->data[i - 1].key, kv->data[i].key) >= 0) all_right = 0;
+    }
+    if (!all_right) {
+      _check_err(KeyVal_delete(kv), "KeyVal_delete");
+      break;
+    }
+    if (!_same_contents(kv, expected)) all_right = 0;
+    _check_err(KeyVal_delete(kv), "KeyVal_delete");
+  }
+  ok(all_right, "36c. sorting never loses or repeats anything");
+  ok(trie_dropped && hash_dropped, "36d. (including when the indexes had to be dropped)");
+  _check_err(KeyVal_delete(expected), "KeyVal_delete");
+#endif
+}
+
+
 int main(int argc, char **argv) {
 
   // turn on super-secret hidden variable that suppresses all error messages,
@@ -788,6 +2904,32 @@ int main(int argc, char **argv) {
   test8();  // test 8: interpolated variables
   test9();  // test 9: saving's align and interp switches
   test10();  // test 10: custom KeyVal_strcmp function
+  test11();  // test 11: sorting the unsorted tail
+  test12();  // test 12: mapped vs. unmappable input files
+  test13();  // test 13: zero-copy loading
+  test14();  // test 14: arena allocation
+  test15();  // test 15: cached key prefixes and lengths
+  test16();  // test 16: hash index
+  test17();  // test 17: trie index
+  test18();  // test 18: concurrent loads
+  test19();  // test 19: frozen KeyVals
+  test20();  // test 20: binary images
+  test21();  // test 21: loading several files at once
+  test22();  // test 22: loading one file in parallel chunks
+  test23();  // test 23: scanning quoted strings
+  test24();  // test 24: word-at-a-time KeyVal_strcmp
+  test25();  // test 25: interpolation cache
+  test26();  // test 26: one-pass interpolation
+  test27();  // test 27: peekValue and copyValue
+  test28();  // test 28: getValues
+  test29();  // test 29: setValues
+  test30();  // test 30: cursors
+  test31();  // test 31: buffered save
+  test32();  // test 32: parallel save
+  test33();  // test 33: journaling
+  test34();  // test 34: layered files and refreshing
+  test35();  // test 35: statistics
+  test36();  // test 36: running out of memory in the indexes
 
   // there's a good meta-test to add here, which is to run 'test' itself through
   // valgrind to make sure there are no memory leaks.
@@ -7,7 +7,7 @@ use strict;
 use warnings;
 
 use File::Temp;
-use Test::Simple tests => 30;
+use Test::Simple tests => 32;
 
 use lib qw(perl);
 use KeyVal;
@@ -46,6 +46,12 @@ ok($o->getValue("key") eq "val", "KeyVal::getValue(key) == val");
 $o->setValue("foo::bar", "bas");
 ok(1, "KeyVal::setValue(foo::bar, bas)");
 ok($o->size() == 2, "KeyVal::size == 2");
+
+# stats:
+my $stats = $o->stats();
+ok($stats->{num_keys} == 2, "KeyVal::stats num_keys == 2");
+ok($stats->{max_depth} == 2 && $stats->{max_fanout} == 2, "KeyVal::stats max_depth, max_fanout == 2");
+
 ok($o->exists("foo") == 1, "KeyVal::exists(foo) == 1");
 ok($o->hasValue("foo") == 0, "KeyVal::hasValue(foo) == 0");
 ok($o->hasKeys("foo") == 1, "KeyVal::hasKeys(foo) == 1");
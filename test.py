@@ -60,6 +60,12 @@ ok(o.getValue("key") == "val", "KeyVal::getValue(key) == val")
 o.setValue("foo::bar", "bas")
 ok(1, "KeyVal::setValue(foo::bar, bas)")
 ok(o.size() == 2, "KeyVal::size == 2")
+
+# stats:
+stats = o.stats()
+ok(stats["num_keys"] == 2, "KeyVal::stats num_keys == 2")
+ok(stats["max_depth"] == 2 and stats["max_fanout"] == 2, "KeyVal::stats max_depth, max_fanout == 2")
+
 ok(o.exists("foo") == True, "KeyVal::exists(foo) == 1")
 ok(o.hasValue("foo") == False, "KeyVal::hasValue(foo) == 0")
 ok(o.hasKeys("foo") == True, "KeyVal::hasKeys(foo) == 1")
@@ -57,6 +57,12 @@ ok [expr { [KeyVal::getValue $o "key"] == "val"}] "KeyVal::getValue(key) == val"
 KeyVal::setValue $o "foo::bar" "bas"
 ok 1 "KeyVal::setValue(foo::bar, bas)"
 ok [expr { [KeyVal::size $o] == 2}] "KeyVal::size == 2"
+
+# stats:
+set stats [KeyVal::stats $o]
+ok [expr { [dict get $stats num_keys] == 2}] "KeyVal::stats num_keys == 2"
+ok [expr { [dict get $stats max_depth] == 2 && [dict get $stats max_fanout] == 2}] "KeyVal::stats max_depth, max_fanout == 2"
+
 ok [expr { [KeyVal::exists $o "foo"] == 1}] "KeyVal::exists(foo) == 1"
 ok [expr { [KeyVal::hasValue $o "foo"] == 0}] "KeyVal::hasValue(foo) == 0"
 ok [expr { [KeyVal::hasKeys $o "foo"] == 1}] "KeyVal::hasKeys(foo) == 1"